@@ -0,0 +1,541 @@
+// For `clock_gettime`.
+#define _POSIX_C_SOURCE 200809L
+
+#include <chan/bitvector.h>
+#include <chan/bloom.h>
+#include <chan/heap.h>
+#include <chan/list.h>
+#include <chan/map.h>
+#include <chan/parallel.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Rough timings of the containers. Usage: chan_bench [n] [n_large] [n_push]
+
+static double
+seconds_since(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// Wall clock time in seconds, for the multithreaded benchmarks.
+static double
+wall_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+// Deterministic pseudo-random numbers (xorshift), same across runs.
+static unsigned long long
+next_random(unsigned long long *state)
+{
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static bool less_u64(void *a, void *b) { return *(unsigned long long*)a < *(unsigned long long*)b; }
+static bool less_equal_u64(void *a, void *b) { return *(unsigned long long*)a <= *(unsigned long long*)b; }
+static size_t hasher_u64(void *a) { return (size_t)*(unsigned long long*)a; }
+
+// Pushes `n` random values and pops them all.
+static void
+bench_heap(size_t n, size_t arity)
+{
+    struct chan_heap *h = chan_heap_new_arity(sizeof(unsigned long long), less_u64, arity);
+    unsigned long long state = 88172645463325252ULL;
+    clock_t start = clock();
+    for (size_t i = 0; i < n; ++i) {
+        unsigned long long value = next_random(&state);
+        chan_heap_push(h, &value);
+    }
+    const double push_time = seconds_since(start);
+    start = clock();
+    unsigned long long prev = 0, value;
+    for (size_t i = 0; i < n; ++i) {
+        chan_heap_pop(h, &value);
+        // Checked also in Release builds, where the benchmark is run.
+        if (value < prev) {
+            fprintf(stderr, "heap popped %llu after %llu\n", value, prev);
+            abort();
+        }
+        prev = value;
+    }
+    const double pop_time = seconds_since(start);
+    printf("heap arity %zu: push %.1f ns/op, pop %.1f ns/op\n",
+        arity, 1e9 * push_time / n, 1e9 * pop_time / n);
+    chan_heap_free(h);
+}
+
+// Looks up `n` keys of which `miss_percent` percent are absent from a map of
+// `n_keys` random keys, with and without a Bloom filter.
+static void
+bench_map_miss(bool bst, size_t n_keys, size_t n, unsigned miss_percent)
+{
+    struct chan_map *map = bst
+        ? chan_bst_map_new(sizeof(unsigned long long), sizeof(unsigned long long), less_equal_u64)
+        : chan_hash_map_new(sizeof(unsigned long long), sizeof(unsigned long long), hasher_u64);
+    unsigned long long *keys = malloc(n_keys * sizeof(*keys));
+    unsigned long long state = 88172645463325252ULL;
+    // Absent keys have bit 40 set. It is above the bits that pick the hash
+    // bucket and mixes the absent keys among the present ones in order.
+    for (size_t i = 0; i < n_keys; ++i) {
+        keys[i] = next_random(&state) & ~(1ULL << 40);
+        chan_map_insert(map, &keys[i], &keys[i]);
+    }
+    for (int with_bloom = 0; with_bloom < 2; ++with_bloom) {
+        if (with_bloom) {
+            chan_map_set_bloom(map, chan_bloom_new(sizeof(unsigned long long), hasher_u64, n_keys, 10));
+        }
+        unsigned long long lookup_state = 2463534242ULL;
+        size_t found = 0;
+        clock_t start = clock();
+        for (size_t i = 0; i < n; ++i) {
+            const unsigned long long r = next_random(&lookup_state);
+            unsigned long long key = r % 100 < miss_percent ? r | (1ULL << 40) : keys[r % n_keys];
+            found += chan_map_at(map, &key) != NULL;
+        }
+        const double time = seconds_since(start);
+        printf("%s map, %zu keys, %u%% misses%s: %.1f ns/lookup (%zu found)\n",
+            bst ? "bst" : "hash", n_keys, miss_percent, with_bloom ? ", bloom" : "",
+            1e9 * time / n, found);
+    }
+    free(keys);
+    chan_map_free(map);
+}
+
+// Resets the peak resident memory of the process, Linux only.
+static void
+reset_peak_rss()
+{
+    FILE *f = fopen("/proc/self/clear_refs", "w");
+    if (!f) return;
+    fputs("5", f);
+    fclose(f);
+}
+
+// Peak resident memory of the process in MiB, or -1 if unknown.
+static double
+peak_rss_mib()
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return -1;
+    char line[256];
+    double kib = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmHWM:", 6) == 0) kib = atof(line + 6);
+    }
+    fclose(f);
+    return kib / 1024;
+}
+
+// Pushes `n` values to a vector list whose array is page mapped once it
+// reaches `mmap_threshold` bytes.
+static void
+bench_push(size_t n, size_t mmap_threshold)
+{
+    reset_peak_rss();
+    struct chan_list *list = chan_vector_list_new(sizeof(unsigned long long));
+    struct chan_growth growth = { mmap_threshold, 0, 0 };
+    chan_list_set_growth(list, growth);
+    clock_t start = clock();
+    for (unsigned long long i = 0; i < n; ++i) chan_list_push(list, &i);
+    const double time = seconds_since(start);
+    printf("vector push %zu, mmap %s: %.2f ns/op, peak rss %.0f MiB\n",
+        n, mmap_threshold == SIZE_MAX ? "off" : "on", 1e9 * time / n, peak_rss_mib());
+    chan_list_free(list);
+}
+
+// Runs `bench_push()` with and without mappings from `n` values up to
+// `n_max` by factors of ten, skipping the sizes whose array and a copy of it
+// would not fit in the physical memory.
+static void
+bench_push_sizes(size_t n, size_t n_max)
+{
+    const double memory = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    for (; n <= n_max; n *= 10) {
+        if (2.0 * n * sizeof(unsigned long long) > memory) {
+            printf("vector push %zu: skipped, needs more memory\n", n);
+            continue;
+        }
+        bench_push(n, SIZE_MAX);
+        bench_push(n, 0);
+    }
+}
+
+// Pushes `n` values to a chunked list, which never copies them, and sums
+// them chunk by chunk.
+static void
+bench_push_chunked(size_t n)
+{
+    reset_peak_rss();
+    struct chan_list *list = chan_chunked_list_new(sizeof(unsigned long long), 0);
+    clock_t start = clock();
+    for (unsigned long long i = 0; i < n; ++i) chan_list_push(list, &i);
+    const double push_time = seconds_since(start);
+    const double rss = peak_rss_mib();
+    start = clock();
+    unsigned long long sum = 0;
+    struct chan_list_iter iter = chan_list_iter_new(list);
+    struct chan_list_iter_block *block;
+    while ((block = chan_list_iter_next_block(list, &iter))) {
+        const unsigned long long *values = block->values;
+        for (size_t i = 0; i < block->size; ++i) sum += values[i];
+    }
+    const double sum_time = seconds_since(start);
+    printf("chunked push %zu: %.2f ns/op, peak rss %.0f MiB, block sum %.2f ns/value (%llu)\n",
+        n, 1e9 * push_time / n, rss, 1e9 * sum_time / n, sum);
+    chan_list_free(list);
+}
+
+// Memory and scan speed of `n` flags as bytes in a vector list and as bits.
+static void
+bench_bitvector(size_t n)
+{
+    struct chan_list *bytes = chan_vector_list_new(sizeof(bool));
+    struct chan_list *bits = chan_bitvector_new(1);
+    struct chan_list *other = chan_bitvector_new(1);
+    unsigned long long state = 1;
+    for (size_t i = 0; i < n; ++i) {
+        bool flag = next_random(&state) % 3 == 0;
+        chan_list_push(bytes, &flag);
+        chan_bitvector_push(bits, flag);
+        chan_bitvector_push(other, next_random(&state) % 2);
+    }
+    clock_t start = clock();
+    size_t n_data;
+    const bool *data = chan_list_data(bytes, &n_data);
+    size_t count_bytes = 0;
+    for (size_t i = 0; i < n_data; ++i) count_bytes += data[i];
+    const double bytes_time = seconds_since(start);
+    start = clock();
+    const size_t count_bits = chan_bitvector_count(bits);
+    const double bits_time = seconds_since(start);
+    start = clock();
+    chan_bitvector_and(bits, other);
+    const double and_time = seconds_since(start);
+    // Builds the rank directory.
+    size_t sum = chan_bitvector_select(bits, 0);
+    start = clock();
+    for (size_t k = 0; k < 1000000; ++k) sum += chan_bitvector_select(bits, (k * 7919) % (count_bits / 4));
+    const double select_time = seconds_since(start);
+    printf("flags %zu: bytes %.1f MiB, count %.3f ns/flag; bits %.1f MiB, count %.3f ns/flag (%s), and %.3f ns/flag, select %.1f ns (%zu)\n",
+        n, chan_list_memory_usage(bytes).used / 1048576.0, 1e9 * bytes_time / n,
+        chan_list_memory_usage(bits).used / 1048576.0, 1e9 * bits_time / n,
+        count_bytes == count_bits ? "same" : "differs", 1e9 * and_time / n, 1e9 * select_time / 1000000, sum);
+    chan_list_free(other);
+    chan_list_free(bits);
+    chan_list_free(bytes);
+}
+
+// Memory, scan and search of `n` sorted timestamps in a vector list and in
+// a delta list.
+static void
+bench_delta_list(size_t n, size_t n_queries)
+{
+    struct chan_list *vector = chan_vector_list_new(sizeof(unsigned long long));
+    struct chan_list *delta = chan_delta_list_new();
+    unsigned long long state = 1;
+    unsigned long long value = 1700000000000ULL;
+    for (size_t i = 0; i < n; ++i) {
+        // Milliseconds between events, with rare pauses.
+        value += next_random(&state) % 1000 == 0 ? next_random(&state) % 100000000 : next_random(&state) % 64;
+        chan_list_push(vector, &value);
+        chan_list_push(delta, &value);
+    }
+    size_t n_data;
+    const unsigned long long *data = chan_list_data(vector, &n_data);
+    clock_t start = clock();
+    unsigned long long vector_sum = 0;
+    for (size_t i = 0; i < n_data; ++i) vector_sum += data[i];
+    const double vector_scan = seconds_since(start);
+    start = clock();
+    unsigned long long delta_sum = 0;
+    struct chan_list_iter iter = chan_list_iter_new(delta);
+    struct chan_list_iter_block *block;
+    while ((block = chan_list_iter_next_block(delta, &iter))) {
+        const uint64_t *values = block->values;
+        for (size_t i = 0; i < block->size; ++i) delta_sum += values[i];
+    }
+    const double delta_scan = seconds_since(start);
+
+    unsigned long long *queries = malloc(n_queries * sizeof(*queries));
+    for (size_t i = 0; i < n_queries; ++i) queries[i] = data[0] + next_random(&state) % (value - data[0]);
+    start = clock();
+    size_t vector_found = 0;
+    for (size_t i = 0; i < n_queries; ++i) {
+        vector_found += chan_list_lower_bound(vector, sizeof(unsigned long long), &queries[i], less_u64);
+    }
+    const double vector_search = seconds_since(start);
+    start = clock();
+    size_t delta_found = 0;
+    for (size_t i = 0; i < n_queries; ++i) delta_found += chan_delta_list_lower_bound(delta, queries[i]);
+    const double delta_search = seconds_since(start);
+
+    printf("sorted %zu: vector %.1f MiB, scan %.2f ns/value, lower bound %.0f ns; "
+        "delta %.1f MiB, scan %.2f ns/value, lower bound %.0f ns (%s)\n",
+        n, chan_list_memory_usage(vector).used / 1048576.0, 1e9 * vector_scan / n, 1e9 * vector_search / n_queries,
+        chan_list_memory_usage(delta).used / 1048576.0, 1e9 * delta_scan / n, 1e9 * delta_search / n_queries,
+        vector_sum == delta_sum && vector_found == delta_found ? "same" : "differs");
+    free(queries);
+    chan_list_free(delta);
+    chan_list_free(vector);
+}
+
+static void
+sum_u64(void *ctx, void *acc, const void *values, size_t n)
+{
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += ((const unsigned long long*)values)[i];
+    *(unsigned long long*)acc += sum;
+}
+
+static void
+add_u64(void *ctx, void *acc, const void *other)
+{
+    *(unsigned long long*)acc += *(const unsigned long long*)other;
+}
+
+// Sums a vector of `n` values with 1, 2, 4, ... threads up to one per core.
+static void
+bench_parallel_sum(size_t n)
+{
+    struct chan_list *list = chan_vector_list_new(sizeof(unsigned long long));
+    for (unsigned long long i = 0; i < n; ++i) chan_list_push(list, &i);
+    struct chan_pool *all = chan_pool_new(0);
+    const size_t max_threads = chan_pool_size(all);
+    chan_pool_free(all);
+    double single_time = 0;
+    for (size_t n_threads = 1;; n_threads = 2 * n_threads < max_threads ? 2 * n_threads : max_threads) {
+        struct chan_pool *pool = chan_pool_new(n_threads);
+        const int repeats = 10;
+        unsigned long long total = 0;
+        const double start = wall_seconds();
+        for (int r = 0; r < repeats; ++r) {
+            // The chunks start from the initial value, so it is the identity.
+            unsigned long long sum = 0;
+            chan_list_parallel_reduce(list, sizeof(sum), &sum, sizeof(sum), sum_u64, add_u64, NULL, pool);
+            total += sum;
+        }
+        const double time = (wall_seconds() - start) / repeats;
+        if (n_threads == 1) single_time = time;
+        const unsigned long long expected = repeats * (n * (unsigned long long)(n - 1) / 2);
+        // Checked also in Release builds, where the benchmark is run.
+        if (total != expected) {
+            fprintf(stderr, "parallel sum %llu, expected %llu\n", total, expected);
+            abort();
+        }
+        printf("parallel sum %zu, %zu threads: %.2f GB/s, speedup %.1f\n",
+            n, n_threads, 1e-9 * n * sizeof(unsigned long long) / time, single_time / time);
+        chan_pool_free(pool);
+        if (n_threads == max_threads) break;
+    }
+    chan_list_free(list);
+}
+
+// Times `n` random lookups of present keys.
+static double
+lookup_ns(const struct chan_map *map, const unsigned long long *keys, size_t n_keys, size_t n)
+{
+    unsigned long long state = 2463534242ULL;
+    size_t found = 0;
+    clock_t start = clock();
+    for (size_t i = 0; i < n; ++i) {
+        found += chan_map_at(map, (void*)&keys[next_random(&state) % n_keys]) != NULL;
+    }
+    const double time = seconds_since(start);
+    if (found != n) {
+        fprintf(stderr, "found %zu of %zu keys\n", found, n);
+        abort();
+    }
+    return 1e9 * time / n;
+}
+
+// Memory and lookup time of a hash map of `n_keys` random keys and of its
+// frozen copy.
+static void
+bench_freeze(size_t n_keys, size_t n)
+{
+    struct chan_map *map = chan_hash_map_new(sizeof(unsigned long long), sizeof(unsigned long long), hasher_u64);
+    unsigned long long *keys = malloc(n_keys * sizeof(*keys));
+    unsigned long long state = 88172645463325252ULL;
+    for (size_t i = 0; i < n_keys; ++i) {
+        keys[i] = next_random(&state);
+        chan_map_insert(map, &keys[i], &keys[i]);
+    }
+    chan_map_shrink_to_fit(map);
+    clock_t start = clock();
+    struct chan_map *frozen = chan_hash_map_freeze(map);
+    const double freeze_time = seconds_since(start);
+    if (!frozen) {
+        fprintf(stderr, "freezing %zu keys failed\n", n_keys);
+        abort();
+    }
+    const struct chan_map *maps[] = { map, frozen };
+    for (int i = 0; i < 2; ++i) {
+        printf("%s map, %zu keys: %.1f bytes/key, %.1f ns/lookup\n",
+            i ? "frozen" : "hash", n_keys, (double)chan_map_memory_usage(maps[i]).allocated / n_keys,
+            lookup_ns(maps[i], keys, n_keys, n));
+    }
+    printf("freeze %zu keys: %.0f ns/key\n", n_keys, 1e9 * freeze_time / n_keys);
+    free(keys);
+    chan_map_free(frozen);
+    chan_map_free(map);
+}
+
+// Inserts `n_keys` random 8-byte big-endian keys to an ART, BST or hash map
+// and looks up `n` of them.
+static void
+bench_ordered(const char *kind, size_t n_keys, size_t n)
+{
+    struct chan_map *map = kind[0] == 'a' ? chan_art_map_new(sizeof(unsigned long long), sizeof(unsigned long long))
+        : kind[0] == 'b' ? chan_bst_map_new(sizeof(unsigned long long), sizeof(unsigned long long), less_equal_u64)
+        : chan_hash_map_new(sizeof(unsigned long long), sizeof(unsigned long long), hasher_u64);
+    unsigned long long *keys = malloc(n_keys * sizeof(*keys));
+    unsigned long long state = 88172645463325252ULL;
+    for (size_t i = 0; i < n_keys; ++i) {
+        const unsigned long long x = next_random(&state);
+        unsigned char *key = (unsigned char*)&keys[i];
+        for (int j = 0; j < 8; ++j) key[j] = x >> (56 - 8 * j);
+    }
+    clock_t start = clock();
+    for (size_t i = 0; i < n_keys; ++i) chan_map_insert(map, &keys[i], &keys[i]);
+    const double insert_time = seconds_since(start);
+    const double lookup_time = lookup_ns(map, keys, n_keys, n);
+    printf("%s map, %zu keys: insert %.1f ns/op, %.1f ns/lookup, %.1f bytes/key\n",
+        kind, n_keys, 1e9 * insert_time / n_keys, lookup_time,
+        (double)chan_map_memory_usage(map).allocated / n_keys);
+    free(keys);
+    chan_map_free(map);
+}
+
+// Runs `bench_ordered()` for the ART, BST and hash maps from 1M keys up to
+// `n_max` keys by factors of ten, skipping the sizes whose maps would not fit
+// in the physical memory at about 48 bytes per key.
+static void
+bench_ordered_sizes(size_t n_max, size_t n)
+{
+    const double memory = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    for (size_t n_keys = 1000000; n_keys <= n_max; n_keys *= 10) {
+        if (48.0 * n_keys > memory) {
+            printf("ordered maps, %zu keys: skipped, needs more memory\n", n_keys);
+            continue;
+        }
+        bench_ordered("bst", n_keys, n);
+        bench_ordered("art", n_keys, n);
+        bench_ordered("hash", n_keys, n);
+    }
+}
+
+// Hit and miss lookups in hash maps with the keys stored only in the dense
+// array, or also inline in the buckets.
+static void
+bench_hash_inline_keys(size_t n_keys, size_t n)
+{
+    unsigned long long *keys = malloc(n_keys * sizeof(*keys));
+    unsigned long long state = 88172645463325252ULL;
+    for (size_t i = 0; i < n_keys; ++i) keys[i] = next_random(&state);
+    for (int inline_keys = 0; inline_keys < 2; ++inline_keys) {
+        struct chan_map *map = inline_keys
+            ? chan_hash_map_new_inline_keys(sizeof(unsigned long long), sizeof(unsigned long long), hasher_u64)
+            : chan_hash_map_new(sizeof(unsigned long long), sizeof(unsigned long long), hasher_u64);
+        for (size_t i = 0; i < n_keys; ++i) chan_map_insert(map, &keys[i], &keys[i]);
+        for (int miss = 0; miss < 2; ++miss) {
+            unsigned long long lookup_state = 2463534242ULL;
+            size_t found = 0;
+            clock_t start = clock();
+            for (size_t i = 0; i < n; ++i) {
+                const unsigned long long r = next_random(&lookup_state);
+                // Random keys not inserted are misses, barring a collision.
+                unsigned long long key = miss ? r : keys[r % n_keys];
+                found += chan_map_at(map, &key) != NULL;
+            }
+            const double time = seconds_since(start);
+            printf("hash map%s, %zu keys, %s: %.1f ns/lookup (%zu found), %.1f bytes/key\n",
+                inline_keys ? " with inline keys" : "", n_keys, miss ? "misses" : "hits",
+                1e9 * time / n, found, (double)chan_map_memory_usage(map).allocated / n_keys);
+        }
+        chan_map_free(map);
+    }
+    free(keys);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    const unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts `n` random values with `qsort()`, `chan_list_sort()` and
+// `chan_list_radix_sort()`.
+static void
+bench_sort(size_t n)
+{
+    struct chan_list *list = chan_vector_list_new(sizeof(unsigned long long));
+    unsigned long long state = 88172645463325252ULL;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned long long value = next_random(&state);
+        chan_list_push(list, &value);
+    }
+    const char *names[] = { "qsort", "introsort", "radix sort" };
+    for (int method = 0; method < 3; ++method) {
+        struct chan_list *copy = chan_list_clone(list);
+        // Unshare before timing.
+        size_t m;
+        chan_list_writable_data(copy, &m);
+        clock_t start = clock();
+        if (method == 0) qsort(chan_list_writable_data(copy, &m), n, sizeof(unsigned long long), compare_u64);
+        else if (method == 1) chan_list_sort(copy, sizeof(unsigned long long), less_u64);
+        else chan_list_radix_sort(copy, sizeof(unsigned long long), 0, CHAN_RADIX_U64);
+        const double time = seconds_since(start);
+        const unsigned long long *data = chan_list_data(copy, &m);
+        for (size_t i = 1; i < m; ++i) {
+            if (data[i - 1] > data[i]) {
+                fprintf(stderr, "%s left %llu before %llu\n", names[method], data[i - 1], data[i]);
+                abort();
+            }
+        }
+        printf("%s %zu u64: %.1f ns/value\n", names[method], n, 1e9 * time / n);
+        chan_list_free(copy);
+    }
+    chan_list_free(list);
+}
+
+int
+main(int argc, char **argv)
+{
+    const size_t n = argc > 1 ? (size_t)atoll(argv[1]) : 1000000;
+    const size_t n_large = argc > 2 ? (size_t)atoll(argv[2]) : 10000000;
+    const size_t n_push = argc > 3 ? (size_t)atoll(argv[3]) : 1000000000;
+    printf("n = %zu\n", n);
+    bench_heap(n, 2);
+    bench_heap(n, 4);
+    bench_heap(n, 8);
+    bench_map_miss(false, 1000000, n, 90);
+    bench_map_miss(false, 1000000, n, 99);
+    bench_map_miss(true, 1000000, n, 90);
+    bench_map_miss(true, 1000000, n, 99);
+    // The array of 8-byte values outgrows the default threshold of 64 MiB.
+    bench_push_sizes(n_large, n_push);
+    bench_push_chunked(n_large);
+    bench_parallel_sum(n_large);
+    bench_freeze(n_large, n);
+    // The ART map orders the keys by their bytes, the BST by `less`.
+    bench_ordered_sizes(10 * n_large, n);
+    bench_hash_inline_keys(n_large, n);
+    bench_sort(n_large);
+    bench_bitvector(n_large);
+    bench_delta_list(n_large, n);
+    return 0;
+}
@@ -0,0 +1,568 @@
+#include "bitvector.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define BITVECTOR_X86
+#endif
+
+// Words per entry of the rank directory.
+#define RANK_BLOCK_WORDS 8
+
+// Values decoded at a time by the block iterator.
+#define BLOCK_VALUES 64
+
+struct chan_bitvector {
+    struct chan_list list;
+    unsigned bits;
+    size_t size;
+    // Capacity in words. The bits past the last value are kept zero, so that
+    // the word operations and counts need not mask the last word.
+    size_t capacity;
+    uint64_t *words;
+    // `rank[b]` is the number of ones in the words before block `b` of
+    // `RANK_BLOCK_WORDS` words, with the total count as the last entry.
+    size_t *rank;
+    size_t n_rank;
+    bool rank_valid;
+    // Decoded values behind the pointers of the list API.
+    uint16_t at_value;
+    union {
+        uint8_t u8[BLOCK_VALUES];
+        uint16_t u16[BLOCK_VALUES];
+    } block;
+};
+
+static inline size_t
+words_for(const struct chan_bitvector *v, size_t n)
+{
+    return (n * v->bits + 63) / 64;
+}
+
+static inline uint64_t
+value_mask(const struct chan_bitvector *v)
+{
+    return ((uint64_t)1 << v->bits) - 1;
+}
+
+static inline unsigned
+get(const struct chan_bitvector *v, size_t i)
+{
+    const size_t pos = i * v->bits;
+    const size_t w = pos >> 6;
+    const unsigned off = pos & 63;
+    uint64_t x = v->words[w] >> off;
+    if (off + v->bits > 64) x |= v->words[w + 1] << (64 - off);
+    return (unsigned)(x & value_mask(v));
+}
+
+static inline void
+set(struct chan_bitvector *v, size_t i, uint64_t value)
+{
+    const size_t pos = i * v->bits;
+    const size_t w = pos >> 6;
+    const unsigned off = pos & 63;
+    const uint64_t mask = value_mask(v);
+    v->words[w] = (v->words[w] & ~(mask << off)) | (value << off);
+    if (off + v->bits > 64) {
+        v->words[w + 1] = (v->words[w + 1] & ~(mask >> (64 - off))) | (value >> (64 - off));
+    }
+}
+
+// Value of the list API, see `chan_bitvector_new()`.
+static inline unsigned
+load_value(const struct chan_bitvector *v, const void *value)
+{
+    if (!value) return 0;
+    if (v->bits <= 8) return *(const uint8_t*)value;
+    uint16_t x;
+    memcpy(&x, value, sizeof(x));
+    return x;
+}
+
+// Copies the words holding values `[from, to)` if they are shared with a
+// clone, and drops the rank directory. Called before writing to them.
+static inline void
+make_unique(struct chan_list *list, size_t from, size_t to)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    if (chan_cow_is_chunked(v->words)) {
+        // Chunks past the words in use are mapped fresh, so they stay zero.
+        const size_t used = words_for(v, v->size);
+        v->words = CHAN_COW_UNSHARE_RANGE(list, v->words, used * sizeof(uint64_t), v->capacity * sizeof(uint64_t),
+            (from * v->bits >> 6) * sizeof(uint64_t), words_for(v, to) * sizeof(uint64_t));
+    }
+    else if (chan_cow_is_shared(v->words)) {
+        // Only the words in use are copied, the spare ones must be zeroed.
+        const size_t used = words_for(v, v->size);
+        v->words = CHAN_COW_UNSHARE(list, v->words, used * sizeof(uint64_t), v->capacity * sizeof(uint64_t));
+        memset(v->words + used, 0, (v->capacity - used) * sizeof(uint64_t));
+    }
+    v->rank_valid = false;
+}
+
+// Grows the words to hold `n` values. The new words are zero.
+static void
+reserve(struct chan_list *list, size_t n)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    const size_t needed = words_for(v, n);
+    if (needed <= v->capacity) return;
+    size_t capacity = chan_growth_next_capacity(&list->growth, v->capacity);
+    if (capacity < needed) capacity = needed;
+    v->words = CHAN_COW_REALLOC(list, v->words, v->capacity * sizeof(uint64_t), capacity * sizeof(uint64_t));
+    assert(v->words);
+    v->words = CHAN_COW_UNSHARE_RANGE(list, v->words, v->capacity * sizeof(uint64_t), capacity * sizeof(uint64_t),
+        v->capacity * sizeof(uint64_t), capacity * sizeof(uint64_t));
+    memset(v->words + v->capacity, 0, (capacity - v->capacity) * sizeof(uint64_t));
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->capacity = capacity;
+}
+
+// Zeroes the values from `n` to the end and makes `n` the size.
+static void
+truncate_to(struct chan_bitvector *v, size_t n)
+{
+    assert(n <= v->size);
+    if (n == v->size) return;
+    const size_t pos = n * v->bits;
+    const size_t w = pos >> 6;
+    if (pos & 63) v->words[w] &= ((uint64_t)1 << (pos & 63)) - 1;
+    const size_t first_zero = (pos + 63) >> 6;
+    const size_t end = words_for(v, v->size);
+    if (end > first_zero) memset(v->words + first_zero, 0, (end - first_zero) * sizeof(uint64_t));
+    v->size = n;
+}
+
+static void
+chan_bitvector_free(struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    assert(v);
+    chan_cow_free(v->words);
+    free(v->rank);
+    free(v);
+}
+
+static struct chan_list*
+chan_bitvector_clone(const struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    struct chan_bitvector *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->list.stats, 0, sizeof(clone->list.stats));
+#endif
+    clone->words = chan_cow_share(v->words);
+    clone->rank = NULL;
+    clone->n_rank = 0;
+    clone->rank_valid = false;
+    return &clone->list;
+}
+
+static void
+chan_bitvector_clear(struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    make_unique(list, 0, v->size);
+    truncate_to(v, 0);
+}
+
+static size_t
+chan_bitvector_size(const struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    return v->size;
+}
+
+static void*
+chan_bitvector_at(const struct chan_list *list, size_t i)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    assert(i < v->size);
+    const unsigned x = get(v, i);
+    if (v->bits <= 8) *(uint8_t*)&v->at_value = (uint8_t)x;
+    else v->at_value = (uint16_t)x;
+    return &v->at_value;
+}
+
+static void
+chan_bitvector_list_push(struct chan_list *list, void *value)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    chan_bitvector_push(list, load_value(v, value));
+}
+
+static void
+chan_bitvector_pop(struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    assert(v->size > 0);
+    make_unique(list, v->size - 1, v->size);
+    truncate_to(v, v->size - 1);
+}
+
+static void
+chan_bitvector_insert(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    assert(n <= v->size);
+    const unsigned x = load_value(v, value);
+    assert((x & ~value_mask(v)) == 0);
+    reserve(list, v->size + 1);
+    make_unique(list, n, v->size + 1);
+    v->size++;
+    for (size_t i = v->size - 1; i > n; --i) set(v, i, get(v, i - 1));
+    set(v, n, x);
+}
+
+static void
+chan_bitvector_remove(struct chan_list *list, size_t n)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    assert(n < v->size);
+    make_unique(list, n, v->size);
+    for (size_t i = n; i + 1 < v->size; ++i) set(v, i, get(v, i + 1));
+    truncate_to(v, v->size - 1);
+}
+
+// Value NULL grows the list with zeros.
+static void
+chan_bitvector_resize(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    const unsigned x = load_value(v, value);
+    assert((x & ~value_mask(v)) == 0);
+    reserve(list, n);
+    if (n <= v->size) {
+        make_unique(list, n, v->size);
+        truncate_to(v, n);
+        return;
+    }
+    make_unique(list, v->size, n);
+    const size_t n0 = v->size;
+    v->size = n;
+    if (x) for (size_t i = n0; i < n; ++i) set(v, i, x);
+}
+
+static struct chan_list_iter
+chan_bitvector_iter_new(const struct chan_list *list)
+{
+    struct chan_list_iter list_iter;
+    list_iter.ind = 0;
+    return list_iter;
+}
+
+static struct chan_list_iter_item*
+chan_bitvector_iter_next(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    if (list_iter->ind >= v->size) return NULL;
+    list_iter->list_iter_item.value = chan_bitvector_at(list, list_iter->ind);
+    list_iter->ind++;
+    return &list_iter->list_iter_item;
+}
+
+// Decodes the next `BLOCK_VALUES` values at most.
+static struct chan_list_iter_block*
+chan_bitvector_iter_next_block(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    if (list_iter->ind >= v->size) return NULL;
+    const size_t n = v->size - list_iter->ind < BLOCK_VALUES ? v->size - list_iter->ind : BLOCK_VALUES;
+    if (v->bits <= 8) {
+        for (size_t i = 0; i < n; ++i) v->block.u8[i] = (uint8_t)get(v, list_iter->ind + i);
+    }
+    else {
+        for (size_t i = 0; i < n; ++i) v->block.u16[i] = (uint16_t)get(v, list_iter->ind + i);
+    }
+    list_iter->list_iter_block.values = &v->block;
+    list_iter->list_iter_block.size = n;
+    list_iter->ind += n;
+    return &list_iter->list_iter_block;
+}
+
+static struct chan_memory_usage
+chan_bitvector_memory_usage(const struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * sizeof(uint64_t) + v->n_rank * sizeof(size_t);
+    usage.used = sizeof(*v) + words_for(v, v->size) * sizeof(uint64_t) + v->n_rank * sizeof(size_t);
+    return usage;
+}
+
+static void
+chan_bitvector_shrink_to_fit(struct chan_list *list)
+{
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    const size_t n_words = words_for(v, v->size);
+    if (v->capacity == n_words) return;
+    if (n_words == 0) {
+        chan_cow_free(v->words);
+        v->words = NULL;
+    }
+    else {
+        v->words = CHAN_COW_REALLOC(list, v->words, v->capacity * sizeof(uint64_t), n_words * sizeof(uint64_t));
+        assert(v->words);
+    }
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->capacity = n_words;
+}
+
+static void
+chan_bitvector_debug_print(
+    const struct chan_list *list,
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_bitvector *v = (struct chan_bitvector*)list;
+    const int bufSize = 256;
+    char buf[bufSize];
+    printf("size %zu, bits %u, capacity %zu words [", v->size, v->bits, v->capacity);
+    for (size_t i = 0; i < v->size; ++i) {
+        if (i > 0) printf(", ");
+        print_value(buf, bufSize, chan_bitvector_at(list, i));
+        printf("%s", buf);
+    }
+    printf("]\n");
+}
+
+static inline struct chan_bitvector*
+as_bitvector(const struct chan_list *list)
+{
+    assert(list->vtable->free == chan_bitvector_free && "not a bitvector");
+    return (struct chan_bitvector*)list;
+}
+
+unsigned
+chan_bitvector_bits(const struct chan_list *s)
+{
+    return as_bitvector(s)->bits;
+}
+
+unsigned
+chan_bitvector_get(const struct chan_list *s, size_t i)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    assert(i < v->size);
+    return get(v, i);
+}
+
+void
+chan_bitvector_set(struct chan_list *s, size_t i, unsigned value)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    assert(i < v->size);
+    assert((value & ~value_mask(v)) == 0);
+    make_unique(s, i, i + 1);
+    set(v, i, value);
+}
+
+void
+chan_bitvector_push(struct chan_list *s, unsigned value)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    assert((value & ~value_mask(v)) == 0);
+    reserve(s, v->size + 1);
+    make_unique(s, v->size, v->size + 1);
+    set(v, v->size, value);
+    v->size++;
+}
+
+const uint64_t*
+chan_bitvector_words(const struct chan_list *s, size_t *n_words)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    *n_words = words_for(v, v->size);
+    return v->words;
+}
+
+// The loops that count ones, defined once as is and, on x86, once more for
+// the `popcnt` instruction, which `-O2` alone does not assume. Without it the
+// compiler calls a bit-twiddling routine. `rank_words` counts the ones below
+// bit `i` from word `w`, and `select_words` finds the bit of the `k`th one
+// from word `w`, which must exist.
+#define POPCOUNT_FUNCTIONS(suffix, attribute) \
+    attribute static size_t \
+    count_words##suffix(const uint64_t *words, size_t n) \
+    { \
+        size_t count = 0; \
+        for (size_t i = 0; i < n; ++i) count += (size_t)__builtin_popcountll(words[i]); \
+        return count; \
+    } \
+    \
+    attribute static void \
+    build_rank##suffix(size_t *rank, const uint64_t *words, size_t n_words) \
+    { \
+        size_t count = 0; \
+        for (size_t b = 0; b * RANK_BLOCK_WORDS < n_words; ++b) { \
+            rank[b] = count; \
+            const size_t end = (b + 1) * RANK_BLOCK_WORDS < n_words ? (b + 1) * RANK_BLOCK_WORDS : n_words; \
+            count += count_words##suffix(words + b * RANK_BLOCK_WORDS, end - b * RANK_BLOCK_WORDS); \
+        } \
+        rank[(n_words + RANK_BLOCK_WORDS - 1) / RANK_BLOCK_WORDS] = count; \
+    } \
+    \
+    attribute static size_t \
+    rank_words##suffix(const uint64_t *words, size_t w, size_t i) \
+    { \
+        size_t count = count_words##suffix(words + w, (i >> 6) - w); \
+        if (i & 63) count += (size_t)__builtin_popcountll(words[i >> 6] & (((uint64_t)1 << (i & 63)) - 1)); \
+        return count; \
+    } \
+    \
+    attribute static size_t \
+    select_words##suffix(const uint64_t *words, size_t w, size_t k) \
+    { \
+        for (;; ++w) { \
+            const size_t ones = (size_t)__builtin_popcountll(words[w]); \
+            if (k < ones) break; \
+            k -= ones; \
+        } \
+        uint64_t word = words[w]; \
+        for (; k > 0; --k) word &= word - 1; \
+        return (w << 6) + (size_t)__builtin_ctzll(word); \
+    }
+
+POPCOUNT_FUNCTIONS(, )
+
+#ifdef BITVECTOR_X86
+POPCOUNT_FUNCTIONS(_popcnt, __attribute__((target("popcnt"))))
+#define HAS_POPCNT() __builtin_cpu_supports("popcnt")
+#else
+#define HAS_POPCNT() false
+#define count_words_popcnt count_words
+#define build_rank_popcnt build_rank
+#define rank_words_popcnt rank_words
+#define select_words_popcnt select_words
+#endif
+
+size_t
+chan_bitvector_count(const struct chan_list *s)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    const size_t n_words = words_for(v, v->size);
+    if (HAS_POPCNT()) return count_words_popcnt(v->words, n_words);
+    return count_words(v->words, n_words);
+}
+
+static void
+ensure_rank(struct chan_bitvector *v)
+{
+    assert(v->bits == 1 && "rank and select need 1 bit per value");
+    if (v->rank_valid) return;
+    const size_t n_words = words_for(v, v->size);
+    const size_t n_rank = (n_words + RANK_BLOCK_WORDS - 1) / RANK_BLOCK_WORDS + 1;
+    if (n_rank != v->n_rank) {
+        v->rank = CHAN_REALLOC(&v->list, v->rank, v->n_rank * sizeof(size_t), n_rank * sizeof(size_t));
+        assert(v->rank);
+        v->n_rank = n_rank;
+    }
+    if (HAS_POPCNT()) build_rank_popcnt(v->rank, v->words, n_words);
+    else build_rank(v->rank, v->words, n_words);
+    v->rank_valid = true;
+}
+
+size_t
+chan_bitvector_rank(struct chan_list *s, size_t i)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    assert(i <= v->size);
+    ensure_rank(v);
+    const size_t b = (i >> 6) / RANK_BLOCK_WORDS;
+    const size_t w = b * RANK_BLOCK_WORDS;
+    if (HAS_POPCNT()) return v->rank[b] + rank_words_popcnt(v->words, w, i);
+    return v->rank[b] + rank_words(v->words, w, i);
+}
+
+size_t
+chan_bitvector_select(struct chan_list *s, size_t k)
+{
+    struct chan_bitvector *v = as_bitvector(s);
+    ensure_rank(v);
+    if (k >= v->rank[v->n_rank - 1]) return v->size;
+    // Last block with fewer than `k + 1` ones before it.
+    size_t lo = 0;
+    size_t hi = v->n_rank - 1;
+    while (hi - lo > 1) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (v->rank[mid] <= k) lo = mid;
+        else hi = mid;
+    }
+    k -= v->rank[lo];
+    if (HAS_POPCNT()) return select_words_popcnt(v->words, lo * RANK_BLOCK_WORDS, k);
+    return select_words(v->words, lo * RANK_BLOCK_WORDS, k);
+}
+
+// Plain loops over the words, which the compiler vectorizes.
+#define WORD_OP(dst, src, op) \
+    do { \
+        struct chan_bitvector *d_ = as_bitvector(dst); \
+        const struct chan_bitvector *s_ = as_bitvector(src); \
+        assert(d_->bits == s_->bits && d_->size == s_->size); \
+        make_unique(dst, 0, d_->size); \
+        uint64_t *a_ = d_->words; \
+        const uint64_t *b_ = s_->words; \
+        const size_t n_ = words_for(d_, d_->size); \
+        for (size_t i_ = 0; i_ < n_; ++i_) a_[i_] op b_[i_]; \
+    } while (0)
+
+void
+chan_bitvector_and(struct chan_list *dst, const struct chan_list *src)
+{
+    WORD_OP(dst, src, &=);
+}
+
+void
+chan_bitvector_or(struct chan_list *dst, const struct chan_list *src)
+{
+    WORD_OP(dst, src, |=);
+}
+
+void
+chan_bitvector_xor(struct chan_list *dst, const struct chan_list *src)
+{
+    WORD_OP(dst, src, ^=);
+}
+
+struct chan_list*
+chan_bitvector_new(unsigned bits_per_value)
+{
+    static const struct chan_list_vtable vtable = {
+        chan_bitvector_free,
+        chan_bitvector_clone,
+        chan_bitvector_clear,
+        chan_bitvector_size,
+        chan_bitvector_insert,
+        chan_bitvector_list_push,
+        chan_bitvector_pop,
+        chan_bitvector_at,
+        chan_bitvector_remove,
+        chan_bitvector_resize,
+        chan_bitvector_iter_new,
+        chan_bitvector_iter_next,
+        chan_bitvector_iter_next_block,
+        NULL,
+        NULL,
+        chan_bitvector_memory_usage,
+        chan_bitvector_shrink_to_fit,
+        chan_bitvector_debug_print,
+    };
+    static struct chan_list list = { &vtable };
+    assert(bits_per_value >= 1 && bits_per_value <= 16);
+    struct chan_bitvector *bitvector = malloc(sizeof(*bitvector));
+    memcpy(&bitvector->list, &list, sizeof(list));
+
+    bitvector->bits = bits_per_value;
+    bitvector->size = 0;
+    bitvector->capacity = 0;
+    bitvector->words = NULL;
+    bitvector->rank = NULL;
+    bitvector->n_rank = 0;
+    bitvector->rank_valid = false;
+
+    return &bitvector->list;
+}
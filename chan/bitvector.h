@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "list.h"
+
+// List of unsigned integers of 1 to 16 bits each, packed back to back into
+// 64-bit words. A value may straddle two words, so any width is dense.
+//
+// Through the list API (`chan_list_at()`, `chan_list_push()` and so on) the
+// values are `uint8_t` (or `bool`) for up to 8 bits per value and `uint16_t`
+// otherwise. The pointers returned by `chan_list_at()` and the iterators
+// point to decoded copies: the one from `chan_list_at()` and the item
+// iterator is valid until the next such call on the list, the one from the
+// block iterator (up to 64 values) until the next block. Writing through
+// them does not change the list, use `chan_bitvector_set()`.
+struct chan_list *chan_bitvector_new(unsigned bits_per_value);
+
+unsigned chan_bitvector_bits(const struct chan_list *s);
+unsigned chan_bitvector_get(const struct chan_list *s, size_t i);
+void chan_bitvector_set(struct chan_list *s, size_t i, unsigned value);
+void chan_bitvector_push(struct chan_list *s, unsigned value);
+
+// The words holding the values, `*n_words` of them. The bits past the last
+// value are zero. Valid until the list is modified.
+const uint64_t *chan_bitvector_words(const struct chan_list *s, size_t *n_words);
+
+// Number of set bits, which for 1 bit per value is the number of ones.
+size_t chan_bitvector_count(const struct chan_list *s);
+
+// For 1 bit per value: the number of ones before position `i`, and the
+// position of the one with rank `k` (counting from zero), or the size of the
+// list if there are at most `k` ones. Both are `O(1)` apart from a short
+// binary search in select, using a directory of counts per 512 bits that is
+// rebuilt by the first call after the list was modified.
+size_t chan_bitvector_rank(struct chan_list *s, size_t i);
+size_t chan_bitvector_select(struct chan_list *s, size_t k);
+
+// Word by word `dst = dst op src` for lists of the same size and width.
+void chan_bitvector_and(struct chan_list *dst, const struct chan_list *src);
+void chan_bitvector_or(struct chan_list *dst, const struct chan_list *src);
+void chan_bitvector_xor(struct chan_list *dst, const struct chan_list *src);
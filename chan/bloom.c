@@ -0,0 +1,213 @@
+#include "bloom.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+// One block is a cache line.
+#define BLOCK_BYTES 64
+#define BLOCK_WORDS (BLOCK_BYTES / sizeof(uint64_t))
+#define BLOCK_BITS (8 * BLOCK_BYTES)
+// Number of hash bits that pick a bit in a block.
+#define BIT_IND_BITS 9
+
+#define MAX_HASHES 16
+
+struct chan_bloom {
+    size_t key_size;
+    size_t bits_per_item;
+    // Number of bits set per key.
+    size_t n_hashes;
+    size_t n_items;
+    size_t n_blocks;
+    // `blocks` is `allocation` aligned to a cache line. The allocation is a
+    // copy-on-write buffer shared with clones.
+    void *allocation;
+    uint64_t *blocks;
+    size_t (*hasher)(void*);
+};
+
+// Finalizer of splitmix64. User hashers may be as weak as the identity, and
+// the filter needs all output bits to be well mixed.
+static inline uint64_t
+mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// FNV-1a over the key bytes.
+static uint64_t
+hash_bytes(const void *key, size_t key_size)
+{
+    const unsigned char *p = key;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < key_size; ++i) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static inline uint64_t
+hash_key(const struct chan_bloom *b, void *key)
+{
+    return mix(b->hasher ? (uint64_t)b->hasher(key) : hash_bytes(key, b->key_size));
+}
+
+// The upper half of the hash picks the block.
+static inline uint64_t*
+block_of(const struct chan_bloom *b, uint64_t hash)
+{
+    const size_t ind = (size_t)(((hash >> 32) * (uint64_t)b->n_blocks) >> 32);
+    return b->blocks + ind * BLOCK_WORDS;
+}
+
+// Sets the bits of the key if `set`, otherwise returns whether they all are
+// set. The bit indices come from a second mix of the hash, nine bits each.
+static inline bool
+visit_bits(const struct chan_bloom *b, uint64_t *block, uint64_t hash, bool set)
+{
+    uint64_t bits = mix(hash ^ 0x9e3779b97f4a7c15ULL);
+    size_t left = 64 / BIT_IND_BITS;
+    for (size_t i = 0; i < b->n_hashes; ++i) {
+        if (left == 0) {
+            bits = mix(bits);
+            left = 64 / BIT_IND_BITS;
+        }
+        const size_t word = (bits & (BLOCK_BITS - 1)) / 64;
+        const uint64_t bit = (uint64_t)1 << (bits & 63);
+        if (set) block[word] |= bit;
+        else if (!(block[word] & bit)) return false;
+        bits >>= BIT_IND_BITS;
+        left--;
+    }
+    return true;
+}
+
+static inline size_t
+allocation_size(const struct chan_bloom *b)
+{
+    return b->n_blocks * BLOCK_BYTES + BLOCK_BYTES - 1;
+}
+
+static uint64_t*
+align_blocks(void *allocation)
+{
+    const uintptr_t p = (uintptr_t)allocation;
+    return (uint64_t*)((p + BLOCK_BYTES - 1) & ~(uintptr_t)(BLOCK_BYTES - 1));
+}
+
+static void
+set_size(struct chan_bloom *b, size_t n_items)
+{
+    chan_cow_free(b->allocation);
+    const size_t bits = n_items * b->bits_per_item;
+    b->n_items = n_items;
+    b->n_blocks = bits < BLOCK_BITS ? 1 : (bits + BLOCK_BITS - 1) / BLOCK_BITS;
+    assert(b->n_blocks <= UINT32_MAX);
+    b->allocation = chan_cow_new(SIZE_MAX, SIZE_MAX, allocation_size(b));
+    b->blocks = align_blocks(b->allocation);
+    memset(b->blocks, 0, b->n_blocks * BLOCK_BYTES);
+}
+
+// Copies the blocks if they are shared with a clone. The copy may be aligned
+// differently within its allocation.
+static void
+make_unique(struct chan_bloom *b)
+{
+    if (!chan_cow_is_shared(b->allocation)) return;
+    void *allocation = chan_cow_new(SIZE_MAX, SIZE_MAX, allocation_size(b));
+    uint64_t *blocks = align_blocks(allocation);
+    memcpy(blocks, b->blocks, b->n_blocks * BLOCK_BYTES);
+    chan_cow_free(b->allocation);
+    b->allocation = allocation;
+    b->blocks = blocks;
+}
+
+void
+chan_bloom_free(struct chan_bloom *b)
+{
+    assert(b);
+    chan_cow_free(b->allocation);
+    free(b);
+}
+
+struct chan_bloom*
+chan_bloom_clone(const struct chan_bloom *b)
+{
+    struct chan_bloom *clone = malloc(sizeof(*clone));
+    memcpy(clone, b, sizeof(*clone));
+    clone->allocation = chan_cow_share(b->allocation);
+    return clone;
+}
+
+void
+chan_bloom_clear(struct chan_bloom *b)
+{
+    // Fresh blocks are zeroed anyway, so there is no need to copy shared ones.
+    if (chan_cow_is_shared(b->allocation)) set_size(b, b->n_items);
+    else memset(b->blocks, 0, b->n_blocks * BLOCK_BYTES);
+}
+
+void
+chan_bloom_resize(struct chan_bloom *b, size_t n_items)
+{
+    set_size(b, n_items);
+}
+
+size_t
+chan_bloom_capacity(const struct chan_bloom *b)
+{
+    return b->n_items;
+}
+
+void
+chan_bloom_add(struct chan_bloom *b, void *key)
+{
+    make_unique(b);
+    const uint64_t hash = hash_key(b, key);
+    visit_bits(b, block_of(b, hash), hash, true);
+}
+
+bool
+chan_bloom_may_contain(const struct chan_bloom *b, void *key)
+{
+    const uint64_t hash = hash_key(b, key);
+    return visit_bits(b, block_of(b, hash), hash, false);
+}
+
+struct chan_memory_usage
+chan_bloom_memory_usage(const struct chan_bloom *b)
+{
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*b) + b->n_blocks * BLOCK_BYTES + BLOCK_BYTES - 1;
+    usage.used = usage.allocated;
+    return usage;
+}
+
+struct chan_bloom*
+chan_bloom_new(
+    size_t key_size,
+    size_t (*hasher)(void*),
+    size_t n_items,
+    size_t bits_per_item
+) {
+    assert(bits_per_item > 0);
+    struct chan_bloom *b = malloc(sizeof(*b));
+    b->key_size = key_size;
+    b->bits_per_item = bits_per_item;
+    // The optimal number of bits set per key is `bits_per_item * ln 2`.
+    b->n_hashes = (bits_per_item * 69 + 50) / 100;
+    if (b->n_hashes < 1) b->n_hashes = 1;
+    if (b->n_hashes > MAX_HASHES) b->n_hashes = MAX_HASHES;
+    b->allocation = NULL;
+    b->hasher = hasher;
+    set_size(b, n_items);
+    return b;
+}
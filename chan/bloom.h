@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+// Blocked Bloom filter over fixed-size keys. All the bits of a key fall in
+// one 64-byte block, so a query reads a single cache line. Answers either
+// "definitely absent" or "maybe present".
+struct chan_bloom;
+
+// Sized for `n_items` keys at `bits_per_item` bits each; 10 bits per item
+// gives about 1% false positives. If `hasher` is NULL, the `key_size` bytes
+// of the key are hashed.
+struct chan_bloom *chan_bloom_new(
+    size_t key_size,
+    size_t (*hasher)(void*),
+    size_t n_items,
+    size_t bits_per_item
+);
+
+void chan_bloom_free(struct chan_bloom *b);
+// Copy-on-write copy, see `chan_map_clone()`.
+struct chan_bloom *chan_bloom_clone(const struct chan_bloom *b);
+// Forgets all keys.
+void chan_bloom_clear(struct chan_bloom *b);
+// Forgets all keys and resizes the filter for `n_items` keys.
+void chan_bloom_resize(struct chan_bloom *b, size_t n_items);
+// Number of keys the filter was sized for. Adding more keys works but raises
+// the false positive rate.
+size_t chan_bloom_capacity(const struct chan_bloom *b);
+void chan_bloom_add(struct chan_bloom *b, void *key);
+// Returns false if `key` has certainly not been added.
+bool chan_bloom_may_contain(const struct chan_bloom *b, void *key);
+struct chan_memory_usage chan_bloom_memory_usage(const struct chan_bloom *b);
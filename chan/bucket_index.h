@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bucket arrays of the hash maps. A bucket holds the index of a key in the
+// dense key array, stored in the narrowest unsigned type that fits the
+// number of buckets, and the width is switched when the array is resized.
+// The maximum value of each type marks an empty bucket, so an array of empty
+// buckets is all one bits. The load factor keeps key indices below the number
+// of buckets minus one, so for example 256 buckets fit in one byte each.
+
+// Returned by `chan_bucket_get()` for an empty bucket.
+#define CHAN_BUCKET_EMPTY SIZE_MAX
+
+// Bytes per bucket in an array of `n_buckets` buckets.
+static inline size_t
+chan_bucket_width(size_t n_buckets)
+{
+    if (n_buckets - 1 <= UINT8_MAX) return sizeof(uint8_t);
+    if (n_buckets - 1 <= UINT16_MAX) return sizeof(uint16_t);
+    if (n_buckets - 1 <= UINT32_MAX) return sizeof(uint32_t);
+    return sizeof(uint64_t);
+}
+
+static inline void
+chan_bucket_fill_empty(void *buckets, size_t width, size_t n_buckets)
+{
+    memset(buckets, 0xff, width * n_buckets);
+}
+
+static inline size_t
+chan_bucket_get(const void *buckets, size_t width, size_t i)
+{
+    switch (width) {
+    case sizeof(uint8_t): {
+        const uint8_t k = ((const uint8_t*)buckets)[i];
+        return k == UINT8_MAX ? CHAN_BUCKET_EMPTY : k;
+    }
+    case sizeof(uint16_t): {
+        const uint16_t k = ((const uint16_t*)buckets)[i];
+        return k == UINT16_MAX ? CHAN_BUCKET_EMPTY : k;
+    }
+    case sizeof(uint32_t): {
+        const uint32_t k = ((const uint32_t*)buckets)[i];
+        return k == UINT32_MAX ? CHAN_BUCKET_EMPTY : k;
+    }
+    default: {
+        const uint64_t k = ((const uint64_t*)buckets)[i];
+        return k == UINT64_MAX ? CHAN_BUCKET_EMPTY : (size_t)k;
+    }
+    }
+}
+
+// Sets bucket `i` to `key_ind`, which may be `CHAN_BUCKET_EMPTY`.
+static inline void
+chan_bucket_set(void *buckets, size_t width, size_t i, size_t key_ind)
+{
+    switch (width) {
+    case sizeof(uint8_t): ((uint8_t*)buckets)[i] = (uint8_t)key_ind; break;
+    case sizeof(uint16_t): ((uint16_t*)buckets)[i] = (uint16_t)key_ind; break;
+    case sizeof(uint32_t): ((uint32_t*)buckets)[i] = (uint32_t)key_ind; break;
+    default: ((uint64_t*)buckets)[i] = (uint64_t)key_ind; break;
+    }
+}
+
+// Defines functions `name_8`, `name_16`, `name_32` and `name_64` with the
+// macro `DEFINE(name, type)`, whose body reads the buckets as `type`. Used
+// for the probe loops, so that they load the buckets without a switch.
+#define CHAN_BUCKET_SPECIALIZE(DEFINE, name) \
+    DEFINE(name##_8, uint8_t) \
+    DEFINE(name##_16, uint16_t) \
+    DEFINE(name##_32, uint32_t) \
+    DEFINE(name##_64, uint64_t)
+
+// Calls the function defined above that matches `width`.
+#define CHAN_BUCKET_DISPATCH(name, width, ...) \
+    ((width) == sizeof(uint8_t) ? name##_8(__VA_ARGS__) : \
+    (width) == sizeof(uint16_t) ? name##_16(__VA_ARGS__) : \
+    (width) == sizeof(uint32_t) ? name##_32(__VA_ARGS__) : \
+    name##_64(__VA_ARGS__))
@@ -0,0 +1,613 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// For `memfd_create` and `fallocate`.
+#define _GNU_SOURCE
+#endif
+
+#include "cow.h"
+
+#ifdef CHAN_COW_CHUNKED
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The chunks of all chunked buffers live in one memory file. A buffer is
+// a private page that ends with its header, followed by shared mappings of
+// its chunks, and a clone maps the same chunks after a page of its own.
+// Writing to a chunk that another buffer also maps first copies it to a free
+// chunk of the file and maps that one in its place, so the data stays
+// contiguous and only the written chunks are copied.
+//
+// Each run of chunks at consecutive file offsets is a mapping in the kernel,
+// which limits the number of mappings per process (`vm.max_map_count`).
+// Once the buffers use half of that, a buffer fragmented into more than one
+// run per 8 chunks is copied to one run of new chunks instead of splitting
+// another run.
+//
+// If the file can not be created or grown, or a mapping fails, new and
+// resized buffers and clones fall back to ordinary buffers. Only copying a
+// chunk in place can not fall back, as pointers into the buffer must stay
+// valid, and aborts if not even the whole buffer can be copied.
+//
+// The file and the reference counts of its chunks are guarded by the lock.
+// The `struct chan_cow_chunked` of a buffer is only touched by its owner.
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    // Set if the file could not be created, which is not retried.
+    bool unavailable;
+    size_t page;
+    // Chunks in the file, and the number of buffers mapping each of them.
+    size_t n_chunks;
+    uint32_t *refs;
+    // Chunks no buffer maps, their pages given back to the system.
+    uint32_t *free_chunks;
+    size_t n_free;
+    size_t free_capacity;
+    // Kernel mappings of all the buffers, and the most to use.
+    size_t runs;
+    size_t max_runs;
+} store = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+// Returned by the allocations of chunks when the file can not grow.
+#define NO_CHUNK UINT32_MAX
+
+#define BIT_WORD(k) ((k) / 64)
+#define BIT_MASK(k) ((uint64_t)1 << ((k) % 64))
+
+static size_t
+chunks_for(size_t bytes)
+{
+    return (bytes + CHAN_COW_CHUNK - 1) / CHAN_COW_CHUNK;
+}
+
+static size_t
+min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+// Called with the lock held.
+static bool
+store_open(void)
+{
+    if (store.fd >= 0) return true;
+    if (store.unavailable) return false;
+    store.page = (size_t)sysconf(_SC_PAGESIZE);
+    store.fd = CHAN_COW_CHUNK % store.page == 0 ? memfd_create("chan_cow", MFD_CLOEXEC) : -1;
+    if (store.fd < 0) {
+        store.unavailable = true;
+        return false;
+    }
+    unsigned long max_map_count = 65530;
+    FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+    if (f) {
+        if (fscanf(f, "%lu", &max_map_count) != 1) max_map_count = 65530;
+        fclose(f);
+    }
+    store.max_runs = max_map_count / 2;
+    return true;
+}
+
+// Appends `n` zeroed chunks to the file, returning the first, or `NO_CHUNK`
+// if the file can not grow. Called with the lock held.
+static uint32_t
+grow_file(size_t n)
+{
+    const size_t first = store.n_chunks;
+    if (first + n >= NO_CHUNK) return NO_CHUNK;
+    if (ftruncate(store.fd, (off_t)((first + n) * CHAN_COW_CHUNK)) != 0) return NO_CHUNK;
+    store.refs = realloc(store.refs, (first + n) * sizeof(*store.refs));
+    assert(store.refs);
+    memset(store.refs + first, 0, n * sizeof(*store.refs));
+    store.n_chunks = first + n;
+    return (uint32_t)first;
+}
+
+static void
+push_free(uint32_t f)
+{
+    if (store.n_free == store.free_capacity) {
+        store.free_capacity = store.free_capacity ? 2 * store.free_capacity : 64;
+        store.free_chunks = realloc(store.free_chunks, store.free_capacity * sizeof(*store.free_chunks));
+        assert(store.free_chunks);
+    }
+    store.free_chunks[store.n_free++] = f;
+}
+
+// A zeroed chunk referenced once, or `NO_CHUNK`. Chunks are appended to the
+// file in batches, lowest first, so that chunks copied one after another
+// tend to be consecutive. Called with the lock held.
+static uint32_t
+alloc_chunk(void)
+{
+    if (store.n_free == 0) {
+        const size_t batch = store.n_chunks / 8 > 16 ? store.n_chunks / 8 : 16;
+        const uint32_t first = grow_file(batch);
+        if (first == NO_CHUNK) return NO_CHUNK;
+        for (size_t i = batch; i-- > 0;) push_free(first + (uint32_t)i);
+    }
+    const uint32_t f = store.free_chunks[--store.n_free];
+    store.refs[f] = 1;
+    return f;
+}
+
+// `n` consecutive zeroed chunks referenced once, or `NO_CHUNK`. Called with
+// the lock held.
+static uint32_t
+alloc_run(size_t n)
+{
+    const uint32_t first = grow_file(n);
+    if (first == NO_CHUNK) return NO_CHUNK;
+    for (size_t i = 0; i < n; ++i) store.refs[first + i] = 1;
+    return first;
+}
+
+// Gives the pages of chunks `[first, first + n)` back and makes the chunks
+// free. Chunks whose pages can not be dropped are not reused, as a new chunk
+// must read as zeros.
+static void
+free_run(size_t first, size_t n)
+{
+    if (n == 0) return;
+    if (fallocate(store.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            (off_t)(first * CHAN_COW_CHUNK), (off_t)(n * CHAN_COW_CHUNK)) != 0) {
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) push_free((uint32_t)(first + i));
+}
+
+// Drops a reference to each of the chunks and frees those no buffer maps
+// anymore. Called with the lock held.
+static void
+drop_chunks(const uint32_t *chunks, size_t n)
+{
+    size_t hole = 0, hole_size = 0;
+    for (size_t k = 0; k < n; ++k) {
+        const uint32_t f = chunks[k];
+        assert(store.refs[f] > 0);
+        if (--store.refs[f] > 0) continue;
+        if (hole_size > 0 && hole + hole_size == f) {
+            hole_size++;
+            continue;
+        }
+        free_run(hole, hole_size);
+        hole = f;
+        hole_size = 1;
+    }
+    free_run(hole, hole_size);
+}
+
+// Same for the run of `n` chunks from `first`, referenced once.
+static void
+drop_run(uint32_t first, size_t n)
+{
+    for (size_t k = 0; k < n; ++k) store.refs[first + k] = 0;
+    free_run(first, n);
+}
+
+static size_t
+count_runs(const uint32_t *chunks, size_t n)
+{
+    size_t runs = n > 0;
+    for (size_t k = 1; k < n; ++k) runs += chunks[k] != chunks[k - 1] + 1;
+    return runs;
+}
+
+// Runs that end next to chunk `k`.
+static size_t
+breaks_around(const struct chan_cow_chunked *m, size_t k)
+{
+    size_t breaks = 0;
+    if (k > 0 && m->chunks[k] != m->chunks[k - 1] + 1) breaks++;
+    if (k + 1 < m->n_chunks && m->chunks[k + 1] != m->chunks[k] + 1) breaks++;
+    return breaks;
+}
+
+// Copies `bytes` bytes to the start of chunk `f`. False if the file can not
+// be written, eg for lack of memory.
+static bool
+write_chunk(uint32_t f, const char *src, size_t bytes)
+{
+    off_t offset = (off_t)f * CHAN_COW_CHUNK;
+    while (bytes > 0) {
+        const ssize_t n = pwrite(store.fd, src, bytes, offset);
+        if (n <= 0) return false;
+        src += n;
+        bytes -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+// Copies the first `bytes` bytes of the chunks of `m` from the file, which
+// holds them also where they are not mapped.
+static void
+read_chunks(const struct chan_cow_chunked *m, char *dst, size_t bytes)
+{
+    for (size_t k = 0; k * CHAN_COW_CHUNK < bytes; ++k) {
+        size_t left = min_size(CHAN_COW_CHUNK, bytes - k * CHAN_COW_CHUNK);
+        off_t offset = (off_t)m->chunks[k] * CHAN_COW_CHUNK;
+        char *p = dst + k * CHAN_COW_CHUNK;
+        while (left > 0) {
+            const ssize_t n = pread(store.fd, p, left, offset);
+            if (n <= 0) {
+                fprintf(stderr, "chan: can not read a chunk of a copy-on-write buffer\n");
+                abort();
+            }
+            p += n;
+            left -= (size_t)n;
+            offset += n;
+        }
+    }
+}
+
+// Maps chunks `[first, first + n)` of `m` in place, a run at a time. Fails
+// only at the mapping limit of the process or for lack of memory.
+static bool
+map_chunks(char *data, const struct chan_cow_chunked *m, size_t first, size_t n)
+{
+    size_t k = first;
+    while (k < first + n) {
+        size_t end = k + 1;
+        while (end < first + n && m->chunks[end] == m->chunks[end - 1] + 1) end++;
+        void *p = mmap(data + k * CHAN_COW_CHUNK, (end - k) * CHAN_COW_CHUNK, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, store.fd, (off_t)m->chunks[k] * CHAN_COW_CHUNK);
+        if (p == MAP_FAILED) return false;
+        k = end;
+    }
+    return true;
+}
+
+static struct chan_cow_chunked*
+descriptor_new(size_t n_chunks)
+{
+    struct chan_cow_chunked *m = malloc(sizeof(*m));
+    assert(m);
+    m->n_chunks = n_chunks;
+    m->chunks = malloc((n_chunks > 0 ? n_chunks : 1) * sizeof(*m->chunks));
+    m->exclusive = calloc(BIT_WORD(n_chunks) + 1, sizeof(*m->exclusive));
+    assert(m->chunks && m->exclusive);
+    m->n_shared = n_chunks;
+    m->runs = 0;
+    return m;
+}
+
+static void
+descriptor_free(struct chan_cow_chunked *m)
+{
+    free(m->chunks);
+    free(m->exclusive);
+    free(m);
+}
+
+static void
+descriptor_resize(struct chan_cow_chunked *m, size_t n_chunks)
+{
+    m->chunks = realloc(m->chunks, (n_chunks > 0 ? n_chunks : 1) * sizeof(*m->chunks));
+    m->exclusive = realloc(m->exclusive, (BIT_WORD(n_chunks) + 1) * sizeof(*m->exclusive));
+    assert(m->chunks && m->exclusive);
+    const size_t old_words = BIT_WORD(m->n_chunks) + 1;
+    if (BIT_WORD(n_chunks) + 1 > old_words) {
+        memset(m->exclusive + old_words, 0, (BIT_WORD(n_chunks) + 1 - old_words) * sizeof(*m->exclusive));
+    }
+}
+
+static void
+set_exclusive(struct chan_cow_chunked *m, size_t k)
+{
+    if (m->exclusive[BIT_WORD(k)] & BIT_MASK(k)) return;
+    m->exclusive[BIT_WORD(k)] |= BIT_MASK(k);
+    m->n_shared--;
+}
+
+static void
+set_all_exclusive(struct chan_cow_chunked *m)
+{
+    for (size_t k = 0; k < m->n_chunks; ++k) m->exclusive[BIT_WORD(k)] |= BIT_MASK(k);
+    m->n_shared = 0;
+}
+
+static size_t
+mapping_bytes(const struct chan_cow_chunked *m)
+{
+    return store.page + m->n_chunks * CHAN_COW_CHUNK;
+}
+
+static void
+set_header(char *data, struct chan_cow_chunked *m)
+{
+    CHAN_COW_CHUNKED_OF(data) = m;
+    *CHAN_COW_REFS(data) = 1;
+    *CHAN_COW_MAPPED(data) = mapping_bytes(m) | CHAN_COW_CHUNKED_FLAG;
+}
+
+// Maps the chunks of `m` after a new private page, returning the buffer, or
+// NULL if the mappings fail.
+static char*
+map_buffer(struct chan_cow_chunked *m)
+{
+    char *base = mmap(NULL, mapping_bytes(m), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    char *data = base + store.page;
+    if (!map_chunks(data, m, 0, m->n_chunks)) {
+        munmap(base, mapping_bytes(m));
+        return NULL;
+    }
+    set_header(data, m);
+    return data;
+}
+
+// An ordinary buffer of `bytes` bytes with the first `kept` bytes of the
+// chunks of `m`, which are then dropped along with the `mapped` bytes of the
+// mapping of buffer `ptr`, if any.
+static void*
+to_ordinary(struct chan_cow_chunked *m, void *ptr, size_t mapped, size_t kept, size_t bytes)
+{
+    void *buffer = chan_cow_new(SIZE_MAX, SIZE_MAX, bytes);
+    read_chunks(m, buffer, kept);
+    if (ptr) munmap((char*)ptr - store.page, mapped);
+    pthread_mutex_lock(&store.lock);
+    drop_chunks(m->chunks, m->n_chunks);
+    store.runs -= 1 + m->runs;
+    pthread_mutex_unlock(&store.lock);
+    descriptor_free(m);
+    return buffer;
+}
+
+// Copies the first `used_bytes` bytes of the buffer to one run of new chunks
+// and maps it in place of the old ones. False if there are no chunks or
+// mappings for it.
+static bool
+compact(struct chan_stats *stats, char *data, struct chan_cow_chunked *m, size_t used_bytes)
+{
+    const size_t n = m->n_chunks;
+    if (n == 0) return true;
+    pthread_mutex_lock(&store.lock);
+    const uint32_t first = alloc_run(n);
+    pthread_mutex_unlock(&store.lock);
+    if (first == NO_CHUNK) return false;
+    used_bytes = min_size(used_bytes, n * CHAN_COW_CHUNK);
+    bool written = true;
+    for (size_t k = 0; written && k * CHAN_COW_CHUNK < used_bytes; ++k) {
+        written = write_chunk(first + (uint32_t)k, data + k * CHAN_COW_CHUNK,
+            min_size(CHAN_COW_CHUNK, used_bytes - k * CHAN_COW_CHUNK));
+    }
+    void *p = written
+        ? mmap(data, n * CHAN_COW_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            store.fd, (off_t)first * CHAN_COW_CHUNK)
+        : MAP_FAILED;
+    pthread_mutex_lock(&store.lock);
+    if (p == MAP_FAILED) {
+        drop_run(first, n);
+        pthread_mutex_unlock(&store.lock);
+        return false;
+    }
+    drop_chunks(m->chunks, n);
+    store.runs -= m->runs - 1;
+    pthread_mutex_unlock(&store.lock);
+    for (size_t k = 0; k < n; ++k) m->chunks[k] = first + (uint32_t)k;
+    m->runs = 1;
+    set_all_exclusive(m);
+#ifdef CHAN_STATS
+    if (stats) stats->cow_bytes += used_bytes;
+#endif
+    (void)stats;
+    return true;
+}
+
+static void
+compact_or_abort(struct chan_stats *stats, char *data, struct chan_cow_chunked *m, size_t used_bytes)
+{
+    if (compact(stats, data, m, used_bytes)) return;
+    fprintf(stderr, "chan: out of memory or mappings copying a shared chunk\n");
+    abort();
+}
+
+// Makes chunk `k` of the buffer exclusive, copying what it holds of the first
+// `used_bytes` bytes if another buffer maps it.
+static void
+unshare_chunk(struct chan_stats *stats, char *data, struct chan_cow_chunked *m, size_t k, size_t used_bytes)
+{
+    pthread_mutex_lock(&store.lock);
+    const uint32_t f = m->chunks[k];
+    if (store.refs[f] == 1) {
+        pthread_mutex_unlock(&store.lock);
+        set_exclusive(m, k);
+        return;
+    }
+    if (store.runs + 2 > store.max_runs && m->runs > m->n_chunks / 8) {
+        pthread_mutex_unlock(&store.lock);
+        compact_or_abort(stats, data, m, used_bytes);
+        return;
+    }
+    const uint32_t g = alloc_chunk();
+    pthread_mutex_unlock(&store.lock);
+    if (g == NO_CHUNK) {
+        compact_or_abort(stats, data, m, used_bytes);
+        return;
+    }
+
+    const size_t start = k * CHAN_COW_CHUNK;
+    const size_t copied = used_bytes > start ? min_size(CHAN_COW_CHUNK, used_bytes - start) : 0;
+    void *p = write_chunk(g, data + start, copied)
+        ? mmap(data + start, CHAN_COW_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            store.fd, (off_t)g * CHAN_COW_CHUNK)
+        : MAP_FAILED;
+    if (p == MAP_FAILED) {
+        pthread_mutex_lock(&store.lock);
+        drop_chunks(&g, 1);
+        pthread_mutex_unlock(&store.lock);
+        compact_or_abort(stats, data, m, used_bytes);
+        return;
+    }
+
+    pthread_mutex_lock(&store.lock);
+    const size_t breaks = breaks_around(m, k);
+    m->chunks[k] = g;
+    m->runs = m->runs + breaks_around(m, k) - breaks;
+    store.runs = store.runs + breaks_around(m, k) - breaks;
+    drop_chunks(&f, 1);
+    pthread_mutex_unlock(&store.lock);
+    set_exclusive(m, k);
+#ifdef CHAN_STATS
+    if (stats) stats->cow_bytes += copied;
+#endif
+    (void)stats;
+}
+
+void*
+chan_cow_chunked_new(size_t bytes)
+{
+    const size_t n = chunks_for(bytes);
+    pthread_mutex_lock(&store.lock);
+    const uint32_t first = store_open() ? alloc_run(n) : NO_CHUNK;
+    if (first == NO_CHUNK) {
+        pthread_mutex_unlock(&store.lock);
+        return NULL;
+    }
+    struct chan_cow_chunked *m = descriptor_new(n);
+    for (size_t k = 0; k < n; ++k) m->chunks[k] = first + (uint32_t)k;
+    m->runs = n > 0;
+    store.runs += 1 + m->runs;
+    pthread_mutex_unlock(&store.lock);
+    set_all_exclusive(m);
+    char *data = map_buffer(m);
+    if (!data) {
+        pthread_mutex_lock(&store.lock);
+        drop_chunks(m->chunks, n);
+        store.runs -= 1 + m->runs;
+        pthread_mutex_unlock(&store.lock);
+        descriptor_free(m);
+    }
+    return data;
+}
+
+void*
+chan_cow_chunked_share(void *ptr)
+{
+    struct chan_cow_chunked *m = CHAN_COW_CHUNKED_OF(ptr);
+    // Sharing a fragmented buffer doubles its mappings.
+    pthread_mutex_lock(&store.lock);
+    const bool fragmented = m->runs > 1 && store.runs + 1 + m->runs > store.max_runs;
+    pthread_mutex_unlock(&store.lock);
+    if (fragmented) compact(NULL, ptr, m, m->n_chunks * CHAN_COW_CHUNK);
+    struct chan_cow_chunked *clone = descriptor_new(m->n_chunks);
+    memcpy(clone->chunks, m->chunks, m->n_chunks * sizeof(*m->chunks));
+    clone->runs = m->runs;
+    pthread_mutex_lock(&store.lock);
+    for (size_t k = 0; k < m->n_chunks; ++k) store.refs[m->chunks[k]]++;
+    store.runs += 1 + clone->runs;
+    pthread_mutex_unlock(&store.lock);
+    char *data = map_buffer(clone);
+    if (!data) {
+        // Out of mappings, the clone gets a copy of its own.
+        const size_t bytes = m->n_chunks * CHAN_COW_CHUNK;
+        return to_ordinary(clone, NULL, 0, bytes, bytes);
+    }
+    memset(m->exclusive, 0, (BIT_WORD(m->n_chunks) + 1) * sizeof(*m->exclusive));
+    m->n_shared = m->n_chunks;
+    return data;
+}
+
+void
+chan_cow_chunked_free(void *ptr)
+{
+    struct chan_cow_chunked *m = CHAN_COW_CHUNKED_OF(ptr);
+    munmap((char*)ptr - store.page, mapping_bytes(m));
+    pthread_mutex_lock(&store.lock);
+    drop_chunks(m->chunks, m->n_chunks);
+    store.runs -= 1 + m->runs;
+    pthread_mutex_unlock(&store.lock);
+    descriptor_free(m);
+}
+
+bool
+chan_cow_chunked_is_shared(void *ptr)
+{
+    struct chan_cow_chunked *m = CHAN_COW_CHUNKED_OF(ptr);
+    if (m->n_shared == 0) return false;
+    bool shared = false;
+    pthread_mutex_lock(&store.lock);
+    for (size_t k = 0; k < m->n_chunks; ++k) {
+        if (m->exclusive[BIT_WORD(k)] & BIT_MASK(k)) continue;
+        if (store.refs[m->chunks[k]] > 1) shared = true;
+        else set_exclusive(m, k);
+    }
+    pthread_mutex_unlock(&store.lock);
+    return shared;
+}
+
+void
+chan_cow_chunked_unshare(struct chan_stats *stats, void *ptr, size_t used_bytes, size_t from, size_t to)
+{
+    struct chan_cow_chunked *m = CHAN_COW_CHUNKED_OF(ptr);
+    const size_t end = min_size(chunks_for(to), m->n_chunks);
+    for (size_t k = from / CHAN_COW_CHUNK; k < end && m->n_shared > 0; ++k) {
+        if (m->exclusive[BIT_WORD(k)] & BIT_MASK(k)) continue;
+        unshare_chunk(stats, ptr, m, k, used_bytes);
+    }
+}
+
+// Chunks are never copied to resize the buffer: new ones are appended to the
+// file and the old ones mapped again before them, still shared if they were.
+// Without chunks or mappings for that, the buffer becomes an ordinary one.
+void*
+chan_cow_chunked_resize(void *ptr, size_t old_bytes, size_t new_bytes)
+{
+    struct chan_cow_chunked *m = CHAN_COW_CHUNKED_OF(ptr);
+    const size_t n0 = m->n_chunks;
+    const size_t n = chunks_for(new_bytes);
+    if (n == n0) return ptr;
+
+    const size_t old_mapping = mapping_bytes(m);
+    if (n < n0) {
+        munmap((char*)ptr + n * CHAN_COW_CHUNK, (n0 - n) * CHAN_COW_CHUNK);
+        pthread_mutex_lock(&store.lock);
+        drop_chunks(m->chunks + n, n0 - n);
+        const size_t runs = count_runs(m->chunks, n);
+        store.runs = store.runs + runs - m->runs;
+        m->runs = runs;
+        pthread_mutex_unlock(&store.lock);
+        for (size_t k = n; k < n0; ++k) {
+            if (!(m->exclusive[BIT_WORD(k)] & BIT_MASK(k))) m->n_shared--;
+            m->exclusive[BIT_WORD(k)] &= ~BIT_MASK(k);
+        }
+        descriptor_resize(m, n);
+        m->n_chunks = n;
+        set_header(ptr, m);
+        return ptr;
+    }
+
+    const size_t kept = min_size(old_bytes, new_bytes);
+    pthread_mutex_lock(&store.lock);
+    const uint32_t first = alloc_run(n - n0);
+    pthread_mutex_unlock(&store.lock);
+    if (first == NO_CHUNK) return to_ordinary(m, ptr, old_mapping, kept, new_bytes);
+    descriptor_resize(m, n);
+    pthread_mutex_lock(&store.lock);
+    for (size_t k = n0; k < n; ++k) m->chunks[k] = first + (uint32_t)(k - n0);
+    m->n_chunks = n;
+    const size_t runs = count_runs(m->chunks, n);
+    store.runs = store.runs + runs - m->runs;
+    m->runs = runs;
+    pthread_mutex_unlock(&store.lock);
+    for (size_t k = n0; k < n; ++k) m->exclusive[BIT_WORD(k)] |= BIT_MASK(k);
+
+    // All the data is in the file, so the old mapping can go before the new
+    // one is made, which keeps the mappings of the process within the limit.
+    char *base = mmap(NULL, mapping_bytes(m), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return to_ordinary(m, ptr, old_mapping, kept, new_bytes);
+    munmap((char*)ptr - store.page, old_mapping);
+    char *data = base + store.page;
+    if (!map_chunks(data, m, 0, n)) {
+        munmap(base, mapping_bytes(m));
+        return to_ordinary(m, NULL, 0, kept, new_bytes);
+    }
+    set_header(data, m);
+    return data;
+}
+
+#endif
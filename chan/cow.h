@@ -0,0 +1,283 @@
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "growth.h"
+#include "stats.h"
+
+// Copy-on-write buffers behind `chan_map_clone()` and `chan_list_clone()`.
+// A buffer starts with a header that counts the containers sharing it, and
+// a container copies a shared buffer before writing to it. The count is
+// updated atomically, so a clone may be read and freed on another thread
+// while the original keeps being modified.
+//
+// On Linux, buffers of at least `chan_growth.chunk_threshold` bytes, if it
+// is set, are instead built from `CHAN_COW_CHUNK` byte chunks of a memory
+// file, see `cow.c`. A clone maps the same chunks at another address, and
+// writing through `CHAN_COW_UNSHARE_RANGE()` copies only the shared chunks
+// in the range.
+
+// Header size, a multiple of the strictest alignment of the stored items.
+#define CHAN_COW_HEADER 16
+
+#define CHAN_COW_REFS(ptr) ((size_t*)((char*)(ptr) - CHAN_COW_HEADER))
+
+// Bytes of the page mapping that holds the header and the buffer, or zero if
+// they were allocated with `malloc`. See `chan_growth.mmap_threshold`. The
+// mapping of a chunked buffer has `CHAN_COW_CHUNKED_FLAG` set as well.
+#define CHAN_COW_MAPPED(ptr) (CHAN_COW_REFS(ptr) + 1)
+
+#define CHAN_COW_CHUNKED_FLAG ((size_t)1 << (8 * sizeof(size_t) - 1))
+
+#if defined(__linux__)
+#define CHAN_COW_CHUNKED
+#endif
+
+// Bytes per chunk of the chunked buffers.
+#define CHAN_COW_CHUNK ((size_t)64 << 10)
+
+#ifdef CHAN_COW_CHUNKED
+
+// Chunks of a chunked buffer. Only the owner of the buffer touches them,
+// the chunks themselves are counted in `cow.c`.
+struct chan_cow_chunked {
+    size_t n_chunks;
+    // Chunk of the memory file behind each chunk of the buffer.
+    uint32_t *chunks;
+    // Bit per chunk, set if no other buffer maps it so that it can be
+    // written in place.
+    uint64_t *exclusive;
+    // Chunks whose bit is not set.
+    size_t n_shared;
+    // Runs of chunks at consecutive file offsets, each a kernel mapping.
+    size_t runs;
+};
+
+// Kept in the page before the header of a chunked buffer.
+#define CHAN_COW_CHUNKED_OF(ptr) \
+    (*(struct chan_cow_chunked**)((char*)(ptr) - CHAN_COW_HEADER - sizeof(struct chan_cow_chunked*)))
+
+// NULL if the memory file or the mappings are not available. The others fall
+// back to ordinary buffers themselves.
+void *chan_cow_chunked_new(size_t bytes);
+void *chan_cow_chunked_share(void *ptr);
+void chan_cow_chunked_free(void *ptr);
+void *chan_cow_chunked_resize(void *ptr, size_t old_bytes, size_t new_bytes);
+bool chan_cow_chunked_is_shared(void *ptr);
+void chan_cow_chunked_unshare(struct chan_stats *stats, void *ptr, size_t used_bytes, size_t from, size_t to);
+
+#endif
+
+#ifdef CHAN_STATS
+#define CHAN_COW_STATS_OF(c) CHAN_STATS_OF(c)
+#else
+#define CHAN_COW_STATS_OF(c) ((struct chan_stats*)NULL)
+#endif
+
+// The containers are passed as pointers to `chan_map` or `chan_list`.
+#define CHAN_COW_THRESHOLDS(c) \
+    chan_growth_mmap_threshold(&(c)->growth), chan_growth_chunk_threshold(&(c)->growth)
+
+#define CHAN_COW_REALLOC(c, ptr, old_bytes, new_bytes) \
+    chan_cow_realloc(CHAN_COW_STATS_OF(c), CHAN_COW_THRESHOLDS(c), ptr, old_bytes, new_bytes)
+
+#define CHAN_COW_UNSHARE(c, ptr, used_bytes, bytes) \
+    chan_cow_unshare(CHAN_COW_STATS_OF(c), CHAN_COW_THRESHOLDS(c), ptr, used_bytes, bytes)
+
+#define CHAN_COW_UNSHARE_RANGE(c, ptr, used_bytes, bytes, from, to) \
+    chan_cow_unshare_range(CHAN_COW_STATS_OF(c), CHAN_COW_THRESHOLDS(c), ptr, used_bytes, bytes, from, to)
+
+static inline bool
+chan_cow_is_chunked(const void *ptr)
+{
+#ifdef CHAN_COW_CHUNKED
+    return ptr && (*CHAN_COW_MAPPED(ptr) & CHAN_COW_CHUNKED_FLAG);
+#else
+    (void)ptr;
+    return false;
+#endif
+}
+
+static inline bool
+chan_cow_is_shared(const void *ptr)
+{
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) return chan_cow_chunked_is_shared((void*)ptr);
+#endif
+    return ptr && __atomic_load_n(CHAN_COW_REFS(ptr), __ATOMIC_ACQUIRE) > 1;
+}
+
+// Adds a reference to the buffer. A chunked buffer is mapped again, or
+// copied if that fails, so the returned pointer is the one to give to the
+// new owner.
+static inline void*
+chan_cow_share(void *ptr)
+{
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) return chan_cow_chunked_share(ptr);
+#endif
+    if (ptr) __atomic_add_fetch(CHAN_COW_REFS(ptr), 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+// Drops a reference to the buffer, freeing it with the last one.
+static inline void
+chan_cow_free(void *ptr)
+{
+    if (!ptr) return;
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) {
+        chan_cow_chunked_free(ptr);
+        return;
+    }
+#endif
+    if (__atomic_sub_fetch(CHAN_COW_REFS(ptr), 1, __ATOMIC_ACQ_REL) == 0) {
+        const size_t mapped = *CHAN_COW_MAPPED(ptr);
+        if (mapped) chan_pages_free(CHAN_COW_REFS(ptr), mapped);
+        else free(CHAN_COW_REFS(ptr));
+    }
+}
+
+// New unshared buffer, chunked if it has at least `chunk_threshold` bytes,
+// else mapped if it has at least `mmap_threshold` bytes. Falls back to
+// `malloc` if the system has no memory file or mappings to give.
+static inline void*
+chan_cow_new(size_t mmap_threshold, size_t chunk_threshold, size_t bytes)
+{
+    const size_t total = CHAN_COW_HEADER + bytes;
+#ifdef CHAN_COW_CHUNKED
+    if (total >= chunk_threshold) {
+        void *buffer = chan_cow_chunked_new(bytes);
+        if (buffer) return buffer;
+    }
+#else
+    (void)chunk_threshold;
+#endif
+    size_t *header = total >= mmap_threshold ? chan_pages_new(total) : NULL;
+    if (header) {
+        header[1] = total;
+    }
+    else {
+        header = malloc(total);
+        assert(header);
+        header[1] = 0;
+    }
+    header[0] = 1;
+    return (char*)header + CHAN_COW_HEADER;
+}
+
+// Like `realloc`, but a shared buffer is left to its other owners and the
+// first `min(old_bytes, new_bytes)` bytes are copied to a new one, which is
+// unshared. A buffer that reaches `mmap_threshold` or `chunk_threshold` bytes
+// is copied to a page mapping or to chunks once, after which it is resized
+// by moving pages. A chunked buffer keeps sharing the chunks it had, so
+// writes must still go through `CHAN_COW_UNSHARE_RANGE()`. `stats` may be
+// NULL.
+static inline void*
+chan_cow_realloc(
+    struct chan_stats *stats,
+    size_t mmap_threshold,
+    size_t chunk_threshold,
+    void *ptr,
+    size_t old_bytes,
+    size_t new_bytes
+) {
+    const size_t kept = old_bytes < new_bytes ? old_bytes : new_bytes;
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) {
+#ifdef CHAN_STATS
+        if (stats) stats->reallocs++;
+#endif
+        return chan_cow_chunked_resize(ptr, old_bytes, new_bytes);
+    }
+#endif
+    const bool shared = chan_cow_is_shared(ptr);
+    const size_t total = CHAN_COW_HEADER + new_bytes;
+    if (ptr && !shared && total < chunk_threshold) {
+        if (old_bytes == new_bytes) return ptr;
+        const size_t mapped = *CHAN_COW_MAPPED(ptr);
+        char *header = NULL;
+        if (mapped) {
+            header = chan_pages_resize(CHAN_COW_REFS(ptr), mapped, total);
+            if (header) ((size_t*)header)[1] = total;
+        }
+        else if (total < mmap_threshold) {
+            header = realloc(CHAN_COW_REFS(ptr), total);
+            assert(header);
+        }
+        if (header) {
+#ifdef CHAN_STATS
+            // Remapped pages are not copied.
+            if (stats) {
+                stats->reallocs++;
+                if (!mapped && header + CHAN_COW_HEADER != ptr) stats->bytes_moved += kept;
+            }
+#endif
+            return header + CHAN_COW_HEADER;
+        }
+    }
+    void *buffer = chan_cow_new(mmap_threshold, chunk_threshold, new_bytes);
+    if (ptr) {
+        memcpy(buffer, ptr, kept);
+        chan_cow_free(ptr);
+    }
+#ifdef CHAN_STATS
+    if (stats) {
+        stats->reallocs++;
+        if (shared) stats->cow_bytes += kept;
+        else if (ptr) stats->bytes_moved += kept;
+    }
+#endif
+    (void)stats;
+    return buffer;
+}
+
+// Returns the buffer if it is not shared, otherwise a new buffer of `bytes`
+// bytes with a copy of the first `used_bytes` bytes.
+static inline void*
+chan_cow_unshare(
+    struct chan_stats *stats,
+    size_t mmap_threshold,
+    size_t chunk_threshold,
+    void *ptr,
+    size_t used_bytes,
+    size_t bytes
+) {
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) {
+        if (CHAN_COW_CHUNKED_OF(ptr)->n_shared > 0) chan_cow_chunked_unshare(stats, ptr, used_bytes, 0, bytes);
+        return ptr;
+    }
+#endif
+    if (!chan_cow_is_shared(ptr)) return ptr;
+    return chan_cow_realloc(stats, mmap_threshold, chunk_threshold, ptr, used_bytes, bytes);
+}
+
+// Like `chan_cow_unshare()` before writing to bytes `[from, to)` of the
+// buffer. A chunked buffer stays in place and only its shared chunks in
+// the range are copied, other buffers are unshared whole.
+static inline void*
+chan_cow_unshare_range(
+    struct chan_stats *stats,
+    size_t mmap_threshold,
+    size_t chunk_threshold,
+    void *ptr,
+    size_t used_bytes,
+    size_t bytes,
+    size_t from,
+    size_t to
+) {
+#ifdef CHAN_COW_CHUNKED
+    if (chan_cow_is_chunked(ptr)) {
+        if (CHAN_COW_CHUNKED_OF(ptr)->n_shared > 0) chan_cow_chunked_unshare(stats, ptr, used_bytes, from, to);
+        return ptr;
+    }
+#endif
+    (void)from;
+    (void)to;
+    return chan_cow_unshare(stats, mmap_threshold, chunk_threshold, ptr, used_bytes, bytes);
+}
@@ -0,0 +1,65 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// For `mremap`.
+#define _GNU_SOURCE
+#endif
+
+#include "growth.h"
+
+#include <string.h>
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static size_t
+round_to_pages(size_t bytes)
+{
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+void*
+chan_pages_new(size_t bytes)
+{
+    void *p = mmap(NULL, round_to_pages(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void*
+chan_pages_resize(void *ptr, size_t old_bytes, size_t new_bytes)
+{
+    old_bytes = round_to_pages(old_bytes);
+    new_bytes = round_to_pages(new_bytes);
+    if (old_bytes == new_bytes) return ptr;
+    void *p = mremap(ptr, old_bytes, new_bytes, MREMAP_MAYMOVE);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void
+chan_pages_free(void *ptr, size_t bytes)
+{
+    munmap(ptr, round_to_pages(bytes));
+}
+
+#else
+
+void*
+chan_pages_new(size_t bytes)
+{
+    return calloc(1, bytes);
+}
+
+void*
+chan_pages_resize(void *ptr, size_t old_bytes, size_t new_bytes)
+{
+    return realloc(ptr, new_bytes);
+}
+
+void
+chan_pages_free(void *ptr, size_t bytes)
+{
+    free(ptr);
+}
+
+#endif
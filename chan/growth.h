@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Default of `chan_growth.mmap_threshold`.
+#define CHAN_GROWTH_MMAP_THRESHOLD ((size_t)64 << 20)
+
+// How a container grows its arrays, see `chan_map_set_growth()` and
+// `chan_list_set_growth()`. The zero value selects the defaults.
+struct chan_growth {
+    // Arrays of at least this many bytes are allocated with `mmap` and
+    // resized with `mremap`, which moves pages instead of copying them and
+    // so never holds the old and new copies at once. Linux only, elsewhere
+    // they are allocated as usual. Zero selects `CHAN_GROWTH_MMAP_THRESHOLD`
+    // and `SIZE_MAX` turns this off.
+    size_t mmap_threshold;
+    // A full array grows to `factor_num / factor_den` times its size, at
+    // least by one item. Zero selects 3/2.
+    unsigned factor_num;
+    unsigned factor_den;
+    // Opt-in: arrays of at least this many bytes are mapped from 64 KiB
+    // chunks of a shared memory file instead, see `cow.h`. They too grow
+    // without copying, and a clone shares the chunks, of which a write
+    // copies only the ones it touches, so that large containers can be
+    // snapshotted often. The mappings are shared: a child process forked
+    // while they exist writes to the same memory as its parent, so do not
+    // use this with fork-based snapshots. Linux only, elsewhere and if the
+    // memory file is not available the arrays are allocated as above. Zero,
+    // the default, and `SIZE_MAX` turn this off.
+    size_t chunk_threshold;
+};
+
+static inline size_t
+chan_growth_mmap_threshold(const struct chan_growth *g)
+{
+    return g->mmap_threshold ? g->mmap_threshold : CHAN_GROWTH_MMAP_THRESHOLD;
+}
+
+static inline size_t
+chan_growth_chunk_threshold(const struct chan_growth *g)
+{
+    return g->chunk_threshold ? g->chunk_threshold : SIZE_MAX;
+}
+
+// Capacity to grow a full array of `size` items to.
+static inline size_t
+chan_growth_next_capacity(const struct chan_growth *g, size_t size)
+{
+    if (size < 4) return 4;
+    const size_t num = g->factor_num ? g->factor_num : 3;
+    const size_t den = g->factor_den ? g->factor_den : 2;
+    // Divide first for sizes where the product would overflow.
+    const size_t n = size <= SIZE_MAX / num ? size * num / den : size / den * num;
+    return n > size ? n : size + 1;
+}
+
+// Page allocations behind the large arrays, sizes in bytes. `chan_pages_new()`
+// returns zeroed memory. The first two return NULL if the system has no
+// memory or mappings left, leaving `ptr` as it was.
+void *chan_pages_new(size_t bytes);
+void *chan_pages_resize(void *ptr, size_t old_bytes, size_t new_bytes);
+void chan_pages_free(void *ptr, size_t bytes);
@@ -0,0 +1,302 @@
+#include "heap.h"
+
+#include <assert.h>
+#include <string.h>
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+static const size_t NOT_IN_HEAP = (size_t)-1;
+
+struct chan_heap {
+#ifdef CHAN_STATS
+    struct chan_stats stats;
+#endif
+    size_t value_size;
+    size_t arity;
+    size_t size;
+    size_t capacity;
+    struct chan_growth growth;
+    void *data;
+    // Position of each value in `data`, indexed by handle.
+    size_t *pos_of_handle;
+    // Handle of each value in `data`, indexed by position.
+    chan_heap_handle *handle_of_pos;
+    // Number of handles given out so far, and the popped ones for reuse.
+    size_t n_handles;
+    size_t n_free_handles;
+    chan_heap_handle *free_handles;
+    // Holds the value that is being sifted.
+    void *tmp;
+    bool (*less)(void*, void*);
+};
+
+// The values are moved a lot, so let the compiler turn the common sizes into
+// plain loads and stores instead of calls to a generic `memcpy`.
+static inline void
+copy_value(void *dst, const void *src, size_t value_size)
+{
+    switch (value_size) {
+        case 4: memcpy(dst, src, 4); break;
+        case 8: memcpy(dst, src, 8); break;
+        case 16: memcpy(dst, src, 16); break;
+        default: memcpy(dst, src, value_size); break;
+    }
+}
+
+static bool
+heap_less(const struct chan_heap *h, void *a, void *b)
+{
+    CHAN_STATS_ADD(h, comparisons, 1);
+    return h->less(a, b);
+}
+
+// Moves the value and its handle from position `src` to `dst`.
+static inline void
+move(struct chan_heap *h, size_t dst, size_t src)
+{
+    copy_value(AT(h->data, dst, h->value_size), AT(h->data, src, h->value_size), h->value_size);
+    const chan_heap_handle handle = h->handle_of_pos[src];
+    h->handle_of_pos[dst] = handle;
+    h->pos_of_handle[handle] = dst;
+}
+
+// Places the value in `tmp` with the given handle to position `pos`.
+static inline void
+place_tmp(struct chan_heap *h, size_t pos, chan_heap_handle handle)
+{
+    copy_value(AT(h->data, pos, h->value_size), h->tmp, h->value_size);
+    h->handle_of_pos[pos] = handle;
+    h->pos_of_handle[handle] = pos;
+}
+
+// The sifts move a "hole" through the tree instead of swapping, so each step
+// copies one value rather than three.
+static void
+sift_up(struct chan_heap *h, size_t pos)
+{
+    const chan_heap_handle handle = h->handle_of_pos[pos];
+    copy_value(h->tmp, AT(h->data, pos, h->value_size), h->value_size);
+    while (pos > 0) {
+        const size_t parent = (pos - 1) / h->arity;
+        if (!heap_less(h, h->tmp, AT(h->data, parent, h->value_size))) break;
+        move(h, pos, parent);
+        pos = parent;
+    }
+    place_tmp(h, pos, handle);
+}
+
+static void
+sift_down(struct chan_heap *h, size_t pos)
+{
+    const chan_heap_handle handle = h->handle_of_pos[pos];
+    copy_value(h->tmp, AT(h->data, pos, h->value_size), h->value_size);
+    for (;;) {
+        const size_t first = h->arity * pos + 1;
+        if (first >= h->size) break;
+        const size_t last = first + h->arity < h->size ? first + h->arity : h->size;
+        size_t min = first;
+        for (size_t c = first + 1; c < last; ++c) {
+            if (heap_less(h, AT(h->data, c, h->value_size), AT(h->data, min, h->value_size))) min = c;
+        }
+        if (!heap_less(h, AT(h->data, min, h->value_size), h->tmp)) break;
+        move(h, pos, min);
+        pos = min;
+    }
+    place_tmp(h, pos, handle);
+}
+
+// Reallocates all the arrays to hold exactly `n` values.
+static void
+set_capacity(struct chan_heap *h, size_t n)
+{
+    if (n == h->capacity) return;
+    assert(n >= h->size && n >= h->n_handles);
+    if (n == 0) {
+        free(h->data);
+        free(h->pos_of_handle);
+        free(h->handle_of_pos);
+        free(h->free_handles);
+        h->data = NULL;
+        h->pos_of_handle = NULL;
+        h->handle_of_pos = NULL;
+        h->free_handles = NULL;
+    }
+    else {
+        h->data = CHAN_REALLOC(h, h->data, h->capacity * h->value_size, n * h->value_size);
+        h->pos_of_handle = CHAN_REALLOC(h, h->pos_of_handle,
+            h->capacity * sizeof(*h->pos_of_handle), n * sizeof(*h->pos_of_handle));
+        h->handle_of_pos = CHAN_REALLOC(h, h->handle_of_pos,
+            h->capacity * sizeof(*h->handle_of_pos), n * sizeof(*h->handle_of_pos));
+        h->free_handles = CHAN_REALLOC(h, h->free_handles,
+            h->capacity * sizeof(*h->free_handles), n * sizeof(*h->free_handles));
+        assert(h->data && h->pos_of_handle && h->handle_of_pos && h->free_handles);
+    }
+    CHAN_STATS_ADD(h, resizes, 1);
+    h->capacity = n;
+}
+
+void
+chan_heap_free(struct chan_heap *h)
+{
+    assert(h);
+    if (h->data) free(h->data);
+    if (h->pos_of_handle) free(h->pos_of_handle);
+    if (h->handle_of_pos) free(h->handle_of_pos);
+    if (h->free_handles) free(h->free_handles);
+    free(h->tmp);
+    free(h);
+}
+
+void
+chan_heap_clear(struct chan_heap *h)
+{
+    h->size = 0;
+    h->n_handles = 0;
+    h->n_free_handles = 0;
+}
+
+size_t
+chan_heap_size(const struct chan_heap *h)
+{
+    return h->size;
+}
+
+chan_heap_handle
+chan_heap_push(struct chan_heap *h, void *value)
+{
+    if (h->size >= h->capacity) {
+        set_capacity(h, chan_growth_next_capacity(&h->growth, h->size));
+    }
+    // All handles are in use unless some have been freed, so a new handle
+    // always fits in the arrays.
+    const chan_heap_handle handle = h->n_free_handles > 0
+        ? h->free_handles[--h->n_free_handles]
+        : h->n_handles++;
+    const size_t pos = h->size++;
+    copy_value(AT(h->data, pos, h->value_size), value, h->value_size);
+    h->handle_of_pos[pos] = handle;
+    h->pos_of_handle[handle] = pos;
+    sift_up(h, pos);
+    return handle;
+}
+
+void*
+chan_heap_peek(const struct chan_heap *h)
+{
+    return h->size > 0 ? h->data : NULL;
+}
+
+void
+chan_heap_pop(struct chan_heap *h, void *value)
+{
+    assert(h->size > 0);
+    if (value) copy_value(value, h->data, h->value_size);
+    const chan_heap_handle handle = h->handle_of_pos[0];
+    h->pos_of_handle[handle] = NOT_IN_HEAP;
+    h->free_handles[h->n_free_handles++] = handle;
+    h->size--;
+    if (h->size > 0) {
+        move(h, 0, h->size);
+        sift_down(h, 0);
+    }
+}
+
+void
+chan_heap_heapify(struct chan_heap *h, void *values, size_t n)
+{
+    chan_heap_clear(h);
+    if (n > h->capacity) set_capacity(h, n);
+    if (n == 0) return;
+    memcpy(h->data, values, n * h->value_size);
+    for (size_t i = 0; i < n; ++i) {
+        h->handle_of_pos[i] = i;
+        h->pos_of_handle[i] = i;
+    }
+    h->size = n;
+    h->n_handles = n;
+    // Sift down every node that has children, starting from the last one.
+    if (n < 2) return;
+    for (size_t i = (n - 2) / h->arity + 1; i-- > 0;) sift_down(h, i);
+}
+
+void*
+chan_heap_get(const struct chan_heap *h, chan_heap_handle handle)
+{
+    assert(handle < h->n_handles && h->pos_of_handle[handle] != NOT_IN_HEAP);
+    return AT(h->data, h->pos_of_handle[handle], h->value_size);
+}
+
+void
+chan_heap_decrease_key(struct chan_heap *h, chan_heap_handle handle, void *value)
+{
+    void *old = chan_heap_get(h, handle);
+    assert(!h->less(old, value));
+    copy_value(old, value, h->value_size);
+    sift_up(h, h->pos_of_handle[handle]);
+}
+
+struct chan_memory_usage
+chan_heap_memory_usage(const struct chan_heap *h)
+{
+    const size_t item_size = h->value_size + sizeof(*h->pos_of_handle)
+        + sizeof(*h->handle_of_pos) + sizeof(*h->free_handles);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*h) + h->value_size + h->capacity * item_size;
+    usage.used = sizeof(*h) + h->value_size + h->size * item_size;
+    return usage;
+}
+
+void
+chan_heap_shrink_to_fit(struct chan_heap *h)
+{
+    // Live handles may be as large as the number of handles given out.
+    set_capacity(h, h->n_handles);
+}
+
+void
+chan_heap_set_growth(struct chan_heap *h, struct chan_growth growth)
+{
+    h->growth = growth;
+}
+
+struct chan_stats
+chan_heap_stats(const struct chan_heap *h)
+{
+#ifdef CHAN_STATS
+    return h->stats;
+#else
+    struct chan_stats stats = { 0 };
+    return stats;
+#endif
+}
+
+struct chan_heap*
+chan_heap_new_arity(size_t value_size, bool (*less)(void*, void*), size_t arity)
+{
+    assert(arity >= 2);
+    struct chan_heap *h = malloc(sizeof(*h));
+#ifdef CHAN_STATS
+    memset(&h->stats, 0, sizeof(h->stats));
+#endif
+    h->value_size = value_size;
+    h->arity = arity;
+    h->size = 0;
+    h->capacity = 0;
+    memset(&h->growth, 0, sizeof(h->growth));
+    h->data = NULL;
+    h->pos_of_handle = NULL;
+    h->handle_of_pos = NULL;
+    h->n_handles = 0;
+    h->n_free_handles = 0;
+    h->free_handles = NULL;
+    h->tmp = malloc(value_size);
+    h->less = less;
+    return h;
+}
+
+struct chan_heap*
+chan_heap_new(size_t value_size, bool (*less)(void*, void*))
+{
+    return chan_heap_new_arity(value_size, less, CHAN_HEAP_DEFAULT_ARITY);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "growth.h"
+#include "stats.h"
+
+// Priority queue that yields the smallest value first. Stored as an implicit
+// d-ary tree in one contiguous array.
+struct chan_heap;
+
+// Returned by `chan_heap_push` and valid until the value is popped. Handles
+// of popped values are reused.
+typedef size_t chan_heap_handle;
+
+// Default number of children per node. With 4 the children of a node are
+// adjacent and the tree is half as deep as a binary one.
+#define CHAN_HEAP_DEFAULT_ARITY 4
+
+// Function `less` returns true iff first argument is less than the second.
+struct chan_heap *chan_heap_new(size_t value_size, bool (*less)(void*, void*));
+struct chan_heap *chan_heap_new_arity(size_t value_size, bool (*less)(void*, void*), size_t arity);
+
+void chan_heap_free(struct chan_heap *h);
+void chan_heap_clear(struct chan_heap *h);
+size_t chan_heap_size(const struct chan_heap *h);
+chan_heap_handle chan_heap_push(struct chan_heap *h, void *value);
+// Returns pointer to the smallest value, or NULL if empty. The value must not
+// be modified through the pointer.
+void* chan_heap_peek(const struct chan_heap *h);
+// Removes the smallest value, copying it to `value` unless it is NULL.
+void chan_heap_pop(struct chan_heap *h, void *value);
+// Replaces the contents with the `n` values in O(n). The values get handles
+// 0, 1, ..., n - 1 in order.
+void chan_heap_heapify(struct chan_heap *h, void *values, size_t n);
+// Returns pointer to the value of a handle. Must not be modified through it.
+void* chan_heap_get(const struct chan_heap *h, chan_heap_handle handle);
+// Replaces the value of a handle with a value that is not greater.
+void chan_heap_decrease_key(struct chan_heap *h, chan_heap_handle handle, void *value);
+struct chan_memory_usage chan_heap_memory_usage(const struct chan_heap *h);
+void chan_heap_shrink_to_fit(struct chan_heap *h);
+// Sets the growth factor of the arrays, effective from their next resize.
+// The arrays are always allocated with `realloc`, so the mapping thresholds
+// do not apply.
+void chan_heap_set_growth(struct chan_heap *h, struct chan_growth growth);
+// Counters collected when built with `CHAN_STATS`, zeros otherwise.
+struct chan_stats chan_heap_stats(const struct chan_heap *h);
@@ -1,11 +1,19 @@
 #include "list.h"
 
+#include <assert.h>
+
 void
 chan_list_free(struct chan_list *s)
 {
     s->vtable->free(s);
 }
 
+struct chan_list*
+chan_list_clone(const struct chan_list *s)
+{
+    return s->vtable->clone(s);
+}
+
 void
 chan_list_clear(struct chan_list *s)
 {
@@ -66,6 +74,46 @@ chan_list_iter_next(const struct chan_list *s, struct chan_list_iter *iter)
     return s->vtable->iter_next(s, iter);
 }
 
+struct chan_list_iter_block*
+chan_list_iter_next_block(const struct chan_list *s, struct chan_list_iter *iter)
+{
+    return s->vtable->iter_next_block(s, iter);
+}
+
+void*
+chan_list_data(const struct chan_list *s, size_t *n)
+{
+    assert(s->vtable->data && "values are not contiguous");
+    *n = s->vtable->size(s);
+    return s->vtable->data(s);
+}
+
+void*
+chan_list_writable_data(struct chan_list *s, size_t *n)
+{
+    assert(s->vtable->writable_data && "values are not contiguous");
+    *n = s->vtable->size(s);
+    return s->vtable->writable_data(s);
+}
+
+struct chan_memory_usage
+chan_list_memory_usage(const struct chan_list *s)
+{
+    return s->vtable->memory_usage(s);
+}
+
+void
+chan_list_shrink_to_fit(struct chan_list *s)
+{
+    s->vtable->shrink_to_fit(s);
+}
+
+void
+chan_list_set_growth(struct chan_list *s, struct chan_growth growth)
+{
+    s->growth = growth;
+}
+
 void
 chan_list_debug_print(
     const struct chan_list *s,
@@ -73,3 +121,14 @@ chan_list_debug_print(
 ) {
     s->vtable->debug_print(s, print_value);
 }
+
+struct chan_stats
+chan_list_stats(const struct chan_list *s)
+{
+#ifdef CHAN_STATS
+    return s->stats;
+#else
+    struct chan_stats stats = { 0 };
+    return stats;
+#endif
+}
@@ -1,10 +1,18 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
+#include "growth.h"
+#include "stats.h"
+
 struct chan_list {
     const struct chan_list_vtable * const vtable;
+    struct chan_growth growth;
+#ifdef CHAN_STATS
+    struct chan_stats stats;
+#endif
 };
 
 // Value from the list iterator. Iterator is finished if value == NULL.
@@ -14,16 +22,26 @@ struct chan_list_iter_item {
     // in particular for linked list.
 };
 
+// Contiguous run of `size` values from the block iterator, in the same
+// order as the item iterator would yield them. Iterator is finished if the
+// returned pointer is NULL.
+struct chan_list_iter_block {
+    void *values;
+    size_t size;
+};
+
 // Iterator status.
 struct chan_list_iter {
     size_t ind;
     // Storing the yielded value here allows returning it as pointer and
     // making the API for iterating in a loop nicer.
     struct chan_list_iter_item list_iter_item;
+    struct chan_list_iter_block list_iter_block;
 };
 
 struct chan_list_vtable {
     void (*free)(struct chan_list*);
+    struct chan_list* (*clone)(const struct chan_list*);
     void (*clear)(struct chan_list*);
     size_t (*size)(const struct chan_list*);
     void (*insert)(struct chan_list*, size_t, void*);
@@ -34,6 +52,12 @@ struct chan_list_vtable {
     void (*resize)(struct chan_list*, size_t, void*);
     struct chan_list_iter (*iter_new)(const struct chan_list*);
     struct chan_list_iter_item* (*iter_next)(const struct chan_list*, struct chan_list_iter*);
+    struct chan_list_iter_block* (*iter_next_block)(const struct chan_list*, struct chan_list_iter*);
+    // NULL for lists whose values are not stored in one array.
+    void* (*data)(const struct chan_list*);
+    void* (*writable_data)(struct chan_list*);
+    struct chan_memory_usage (*memory_usage)(const struct chan_list*);
+    void (*shrink_to_fit)(struct chan_list*);
     void (*debug_print)(
         const struct chan_list*,
         int (*print_value)(char *dest, int n, void *a)
@@ -41,6 +65,13 @@ struct chan_list_vtable {
 };
 
 void chan_list_free(struct chan_list *s);
+// Returns an independent copy of the list in O(1). The copies share storage
+// until either one is modified, which first copies the storage it writes to:
+// the touched chunks of arrays past `chan_growth.chunk_threshold`, otherwise
+// the whole arrays.
+// While shared, values must not be written through pointers from
+// `chan_list_at()` or the iterators.
+struct chan_list *chan_list_clone(const struct chan_list *s);
 void chan_list_clear(struct chan_list *s);
 size_t chan_list_size(const struct chan_list *s);
 void chan_list_insert(struct chan_list *s, size_t ind, void *value);
@@ -51,11 +82,83 @@ void chan_list_remove(struct chan_list *s, size_t);
 void chan_list_resize(struct chan_list *s, size_t, void*);
 struct chan_list_iter chan_list_iter_new(const struct chan_list*);
 struct chan_list_iter_item* chan_list_iter_next(const struct chan_list*, struct chan_list_iter*);
+struct chan_list_iter_block* chan_list_iter_next_block(const struct chan_list*, struct chan_list_iter*);
+// The array of the `*n = chan_list_size(s)` values, for scans without a call
+// per item. Valid until the list is modified. Vector list only.
+void *chan_list_data(const struct chan_list *s, size_t *n);
+// Same array, first copying the values shared with clones so that they can be
+// written in place. Valid until the list is modified. Vector list only.
+void *chan_list_writable_data(struct chan_list *s, size_t *n);
 void chan_list_debug_print(
     const struct chan_list *s,
     int (*print_value)(char *dest, int n, void *a)
 );
+struct chan_memory_usage chan_list_memory_usage(const struct chan_list *s);
+// Releases unused capacity, eg after `chan_list_clear()`.
+void chan_list_shrink_to_fit(struct chan_list *s);
+// Sets how the arrays of the list grow, effective from their next resize.
+void chan_list_set_growth(struct chan_list *s, struct chan_growth growth);
+// Counters collected when built with `CHAN_STATS`, zeros otherwise.
+struct chan_stats chan_list_stats(const struct chan_list *s);
+
+// Sorting and searching of vector lists, in place. The public list type does
+// not know its value size, so the callers pass it, as with `qsort()`.
+// `less` returns true iff its first argument is less than the second, or
+// less than or equal: strict is faster when many values are equal.
+//
+// Introsort, not stable, O(n log n) in the worst case. Values of 4, 8 and 16
+// bytes are swapped without `memcpy` calls.
+void chan_list_sort(struct chan_list *s, size_t value_size, bool (*less)(void*, void*));
+
+enum chan_radix_key {
+    CHAN_RADIX_U32,
+    CHAN_RADIX_I32,
+    CHAN_RADIX_F32,
+    CHAN_RADIX_U64,
+    CHAN_RADIX_I64,
+    CHAN_RADIX_F64,
+};
+
+// Stable LSD radix sort of records by the native-endian integer or float key
+// at `key_offset`, one pass per key byte, skipping the bytes that are equal
+// in all keys. Floats are ordered with -0 before +0 and NaNs at the ends.
+// Needs a temporary copy of the values.
+void chan_list_radix_sort(struct chan_list *s, size_t value_size, size_t key_offset, enum chan_radix_key key);
+
+// Index of the first value of a sorted vector list that is not less than
+// `value`, or the size if there is none.
+size_t chan_list_lower_bound(const struct chan_list *s, size_t value_size, void *value, bool (*less)(void*, void*));
+
+// Removes the values equal byte for byte to the previous value, eg the
+// duplicates of a sorted list, and returns the new size.
+size_t chan_list_unique(struct chan_list *s, size_t value_size);
 
 struct chan_list *chan_vector_list_new(size_t value_size);
 
 struct chan_list *chan_linked_list_new(size_t value_size);
+
+// List of fixed-size chunks of `chunk_size` values (rounded up to a power of
+// two, or about 4 KiB if zero) found through a directory of chunk pointers.
+// Values never move when the list grows, so pointers from `chan_list_at()`
+// stay valid until the value is removed or moved by an insertion or removal
+// before it, and growing copies only the directory. `chan_list_at()` is two
+// loads. The block iterator yields the values chunk by chunk. Clones share
+// the chunks until either list writes to a chunk, which copies that chunk
+// only and so moves its values.
+struct chan_list *chan_chunked_list_new(size_t value_size, size_t chunk_size);
+
+// List of sorted `uint64_t` values, eg timestamps or document ids,
+// compressed in blocks of 128 as bit-packed differences of consecutive
+// values. Each block has the width that makes it smallest, with the few
+// larger differences stored separately, so dense runs take a few bits per
+// value. The values must be pushed in order, and inserting or removing
+// re-encodes the values after the position.
+//
+// `chan_list_at()` and the iterators decode one block at a time into a
+// buffer of the list, so their pointers are valid until they are called for
+// another block. The block iterator yields the blocks, which suits scans.
+struct chan_list *chan_delta_list_new(void);
+
+// Index of the first value not less than `value`, or the size if there is
+// none. Searches the first values of the blocks and decodes one block.
+size_t chan_delta_list_lower_bound(const struct chan_list *s, uint64_t value);
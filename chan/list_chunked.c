@@ -0,0 +1,298 @@
+#include "list.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Chunk size in bytes when the constructor is given zero values per chunk.
+#define DEFAULT_CHUNK_BYTES 4096
+
+struct chan_chunked_list {
+    struct chan_list list;
+    size_t value_size;
+    size_t size;
+    // Values per chunk is `1 << chunk_shift`.
+    unsigned chunk_shift;
+    // Number of allocated chunks, the first of them in use.
+    size_t n_chunks;
+    size_t chunks_capacity;
+    // Each chunk is a copy-on-write buffer shared with clones by itself.
+    void **chunks;
+};
+
+static inline size_t
+chunk_bytes(const struct chan_chunked_list *v)
+{
+    return v->value_size << v->chunk_shift;
+}
+
+static inline void*
+value_at(const struct chan_chunked_list *v, size_t i)
+{
+    return AT(v->chunks[i >> v->chunk_shift], i & (((size_t)1 << v->chunk_shift) - 1), v->value_size);
+}
+
+// Copies the chunks from the one of value `from` to the last one in use if
+// they are shared with a clone. Called before writing to them.
+static void
+make_unique(struct chan_list *list, size_t from)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    if (v->size == 0) return;
+    const size_t bytes = chunk_bytes(v);
+    for (size_t k = from >> v->chunk_shift; k <= (v->size - 1) >> v->chunk_shift; ++k) {
+        v->chunks[k] = CHAN_COW_UNSHARE(list, v->chunks[k], bytes, bytes);
+    }
+}
+
+// Makes room for `n` values by adding chunks. Only the directory of chunk
+// pointers is reallocated, the values stay where they are.
+static void
+reserve(struct chan_list *list, size_t n)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    while (n > v->n_chunks << v->chunk_shift) {
+        if (v->n_chunks == v->chunks_capacity) {
+            const size_t capacity = chan_growth_next_capacity(&list->growth, v->n_chunks);
+            v->chunks = CHAN_REALLOC(list, v->chunks,
+                v->chunks_capacity * sizeof(*v->chunks), capacity * sizeof(*v->chunks));
+            assert(v->chunks);
+            v->chunks_capacity = capacity;
+        }
+        v->chunks[v->n_chunks++] = CHAN_COW_REALLOC(list, NULL, 0, chunk_bytes(v));
+        CHAN_STATS_ADD(list, resizes, 1);
+    }
+}
+
+static void
+chan_chunked_list_free(struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    assert(v);
+    for (size_t k = 0; k < v->n_chunks; ++k) chan_cow_free(v->chunks[k]);
+    free(v->chunks);
+    free(v);
+}
+
+// Copies the directory and shares the chunks, so O(number of chunks).
+static struct chan_list*
+chan_chunked_list_clone(const struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    struct chan_chunked_list *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->list.stats, 0, sizeof(clone->list.stats));
+#endif
+    clone->chunks = v->n_chunks ? malloc(v->n_chunks * sizeof(*v->chunks)) : NULL;
+    clone->chunks_capacity = v->n_chunks;
+    for (size_t k = 0; k < v->n_chunks; ++k) clone->chunks[k] = chan_cow_share(v->chunks[k]);
+    return &clone->list;
+}
+
+static void
+chan_chunked_list_clear(struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    v->size = 0;
+}
+
+static size_t
+chan_chunked_list_size(const struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    return v->size;
+}
+
+static void*
+chan_chunked_list_at(const struct chan_list *list, size_t i)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    return value_at(v, i);
+}
+
+static void
+chan_chunked_list_push(struct chan_list *list, void *value)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    reserve(list, v->size + 1);
+    v->size++;
+    make_unique(list, v->size - 1);
+    memcpy(value_at(v, v->size - 1), value, v->value_size);
+}
+
+static void
+chan_chunked_list_pop(struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    assert(v->size > 0);
+    v->size--;
+}
+
+static void
+chan_chunked_list_insert(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    assert(n <= v->size);
+    reserve(list, v->size + 1);
+    v->size++;
+    make_unique(list, n);
+    for (size_t i = v->size - 1; i > n; --i) {
+        memcpy(value_at(v, i), value_at(v, i - 1), v->value_size);
+    }
+    memcpy(value_at(v, n), value, v->value_size);
+}
+
+static void
+chan_chunked_list_remove(struct chan_list *list, size_t n)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    assert(n < v->size);
+    make_unique(list, n);
+    v->size--;
+    for (size_t i = n; i < v->size; ++i) {
+        memcpy(value_at(v, i), value_at(v, i + 1), v->value_size);
+    }
+}
+
+static void
+chan_chunked_list_resize(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    const size_t n0 = v->size;
+    reserve(list, n);
+    v->size = n;
+    make_unique(list, n0);
+    for (size_t i = n0; i < n; ++i) {
+        memcpy(value_at(v, i), value, v->value_size);
+    }
+}
+
+static struct chan_list_iter
+chan_chunked_list_iter_new(const struct chan_list *list)
+{
+    struct chan_list_iter list_iter;
+    list_iter.ind = 0;
+    return list_iter;
+}
+
+static struct chan_list_iter_item*
+chan_chunked_list_iter_next(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    if (list_iter->ind >= v->size) return NULL;
+    list_iter->list_iter_item.value = value_at(v, list_iter->ind);
+    list_iter->ind++;
+    return &list_iter->list_iter_item;
+}
+
+// The rest of the chunk of the next value.
+static struct chan_list_iter_block*
+chan_chunked_list_iter_next_block(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    if (list_iter->ind >= v->size) return NULL;
+    const size_t chunk_end = ((list_iter->ind >> v->chunk_shift) + 1) << v->chunk_shift;
+    const size_t end = chunk_end < v->size ? chunk_end : v->size;
+    list_iter->list_iter_block.values = value_at(v, list_iter->ind);
+    list_iter->list_iter_block.size = end - list_iter->ind;
+    list_iter->ind = end;
+    return &list_iter->list_iter_block;
+}
+
+static struct chan_memory_usage
+chan_chunked_list_memory_usage(const struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    const size_t chunks_in_use = (v->size + ((size_t)1 << v->chunk_shift) - 1) >> v->chunk_shift;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->chunks_capacity * sizeof(*v->chunks) + v->n_chunks * chunk_bytes(v);
+    usage.used = sizeof(*v) + chunks_in_use * sizeof(*v->chunks) + v->size * v->value_size;
+    return usage;
+}
+
+// Frees the chunks past the last value. The last chunk in use keeps its
+// free slots, since values do not move.
+static void
+chan_chunked_list_shrink_to_fit(struct chan_list *list)
+{
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    const size_t chunks_in_use = (v->size + ((size_t)1 << v->chunk_shift) - 1) >> v->chunk_shift;
+    if (chunks_in_use == v->chunks_capacity) return;
+    for (size_t k = chunks_in_use; k < v->n_chunks; ++k) chan_cow_free(v->chunks[k]);
+    v->n_chunks = chunks_in_use;
+    if (v->n_chunks == 0) {
+        free(v->chunks);
+        v->chunks = NULL;
+    }
+    else {
+        v->chunks = CHAN_REALLOC(list, v->chunks,
+            v->chunks_capacity * sizeof(*v->chunks), v->n_chunks * sizeof(*v->chunks));
+        assert(v->chunks);
+    }
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->chunks_capacity = v->n_chunks;
+}
+
+static void
+chan_chunked_list_debug_print(
+    const struct chan_list *list,
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_chunked_list *v = (struct chan_chunked_list*)list;
+    const int bufSize = 256;
+    char buf[bufSize];
+    printf("size %zu, chunks %zu of %zu values [", v->size, v->n_chunks, (size_t)1 << v->chunk_shift);
+    for (size_t i = 0; i < v->size; ++i) {
+        if (i > 0) printf(i & (((size_t)1 << v->chunk_shift) - 1) ? ", " : " | ");
+        print_value(buf, bufSize, value_at(v, i));
+        printf("%s", buf);
+    }
+    printf("]\n");
+}
+
+struct chan_list*
+chan_chunked_list_new(size_t value_size, size_t chunk_size)
+{
+    static const struct chan_list_vtable vtable = {
+        chan_chunked_list_free,
+        chan_chunked_list_clone,
+        chan_chunked_list_clear,
+        chan_chunked_list_size,
+        chan_chunked_list_insert,
+        chan_chunked_list_push,
+        chan_chunked_list_pop,
+        chan_chunked_list_at,
+        chan_chunked_list_remove,
+        chan_chunked_list_resize,
+        chan_chunked_list_iter_new,
+        chan_chunked_list_iter_next,
+        chan_chunked_list_iter_next_block,
+        NULL,
+        NULL,
+        chan_chunked_list_memory_usage,
+        chan_chunked_list_shrink_to_fit,
+        chan_chunked_list_debug_print,
+    };
+    static struct chan_list list = { &vtable };
+    assert(value_size > 0);
+    struct chan_chunked_list *chunked_list = malloc(sizeof(*chunked_list));
+    memcpy(&chunked_list->list, &list, sizeof(list));
+
+    if (chunk_size == 0) chunk_size = DEFAULT_CHUNK_BYTES / value_size;
+    unsigned chunk_shift = 0;
+    while (((size_t)1 << chunk_shift) < chunk_size) chunk_shift++;
+
+    chunked_list->value_size = value_size;
+    chunked_list->size = 0;
+    chunked_list->chunk_shift = chunk_shift;
+    chunked_list->n_chunks = 0;
+    chunked_list->chunks_capacity = 0;
+    chunked_list->chunks = NULL;
+
+    return &chunked_list->list;
+}
@@ -0,0 +1,605 @@
+#include "list.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define DELTA_X86
+#include <immintrin.h>
+#endif
+
+// Values per compressed block.
+#define BLOCK 128
+
+// Widest packed delta. Wider deltas are stored as exceptions.
+#define MAX_BITS 32
+
+// A block of `BLOCK` values is stored as the differences of consecutive
+// values, the first one being zero, in the 32-bit words of `packed` from
+// `offset` on:
+//
+// * `4 * bits` words of the low `bits` bits of each delta. Delta `i` is in
+//   lane `i % 4`, and lane `l` takes words `l`, `l + 4`, `l + 8` and so on,
+//   so one 128-bit load reads the same position of all four lanes.
+// * The positions of the `n_exceptions` deltas that do not fit in `bits`
+//   bits, four bytes per word.
+// * The rest of their bits, `delta >> bits`, two words each.
+//
+// The width is chosen per block to minimize its size (PFOR), so a few large
+// gaps do not widen the whole block.
+struct block_meta {
+    uint32_t offset;
+    uint8_t bits;
+    uint8_t n_exceptions;
+};
+
+struct chan_delta_list {
+    struct chan_list list;
+    size_t n_blocks;
+    size_t blocks_capacity;
+    // First value of each block, searched before decoding any block.
+    uint64_t *firsts;
+    struct block_meta *meta;
+    size_t packed_size;
+    size_t packed_capacity;
+    uint32_t *packed;
+    // The values after the last full block, not compressed.
+    size_t tail_size;
+    uint64_t tail[BLOCK];
+    // The last decoded block, behind the pointers of `chan_list_at()` and
+    // the iterators. Block `SIZE_MAX` if none.
+    size_t cached_block;
+    uint64_t cache[BLOCK];
+};
+
+static inline size_t
+size_of(const struct chan_delta_list *v)
+{
+    return v->n_blocks * BLOCK + v->tail_size;
+}
+
+static inline uint32_t
+low_mask(unsigned bits)
+{
+    return bits == 32 ? UINT32_MAX : ((uint32_t)1 << bits) - 1;
+}
+
+static inline unsigned
+bit_length(uint64_t x)
+{
+    return x ? 64 - (unsigned)__builtin_clzll(x) : 0;
+}
+
+// Copies the part of the arrays that is shared with a clone before a block
+// of `words` packed words is appended, the only write to them.
+static void
+make_unique(struct chan_list *list, size_t words)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const size_t b = v->n_blocks;
+    v->firsts = CHAN_COW_UNSHARE_RANGE(list, v->firsts, b * sizeof(*v->firsts),
+        v->blocks_capacity * sizeof(*v->firsts), b * sizeof(*v->firsts), (b + 1) * sizeof(*v->firsts));
+    v->meta = CHAN_COW_UNSHARE_RANGE(list, v->meta, b * sizeof(*v->meta),
+        v->blocks_capacity * sizeof(*v->meta), b * sizeof(*v->meta), (b + 1) * sizeof(*v->meta));
+    v->packed = CHAN_COW_UNSHARE_RANGE(list, v->packed, v->packed_size * sizeof(*v->packed),
+        v->packed_capacity * sizeof(*v->packed), v->packed_size * sizeof(*v->packed),
+        (v->packed_size + words) * sizeof(*v->packed));
+}
+
+// Width of the packed deltas that makes the block smallest, given the
+// number of deltas of each bit length.
+static unsigned
+best_bits(const unsigned *length_counts)
+{
+    unsigned best = MAX_BITS;
+    size_t best_words = SIZE_MAX;
+    unsigned n_exceptions = 0;
+    for (unsigned len = MAX_BITS + 1; len <= 64; ++len) n_exceptions += length_counts[len];
+    for (unsigned bits = MAX_BITS + 1; bits-- > 0;) {
+        const size_t words = 4 * bits + (n_exceptions + 3) / 4 + 2 * n_exceptions;
+        if (words <= best_words) {
+            best = bits;
+            best_words = words;
+        }
+        n_exceptions += length_counts[bits];
+    }
+    return best;
+}
+
+// Compresses the full tail into a new block.
+static void
+append_block(struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    assert(v->tail_size == BLOCK);
+    uint64_t deltas[BLOCK];
+    unsigned length_counts[65] = { 0 };
+    deltas[0] = 0;
+    length_counts[0]++;
+    for (size_t i = 1; i < BLOCK; ++i) {
+        deltas[i] = v->tail[i] - v->tail[i - 1];
+        length_counts[bit_length(deltas[i])]++;
+    }
+    const unsigned bits = best_bits(length_counts);
+    unsigned n_exceptions = 0;
+    for (unsigned len = bits + 1; len <= 64; ++len) n_exceptions += length_counts[len];
+    const size_t words = 4 * bits + (n_exceptions + 3) / 4 + 2 * n_exceptions;
+
+    if (v->n_blocks == v->blocks_capacity) {
+        const size_t capacity = chan_growth_next_capacity(&list->growth, v->n_blocks);
+        v->firsts = CHAN_COW_REALLOC(list, v->firsts,
+            v->blocks_capacity * sizeof(*v->firsts), capacity * sizeof(*v->firsts));
+        v->meta = CHAN_COW_REALLOC(list, v->meta,
+            v->blocks_capacity * sizeof(*v->meta), capacity * sizeof(*v->meta));
+        assert(v->firsts && v->meta);
+        v->blocks_capacity = capacity;
+        CHAN_STATS_ADD(list, resizes, 1);
+    }
+    if (v->packed_size + words > v->packed_capacity) {
+        size_t capacity = chan_growth_next_capacity(&list->growth, v->packed_capacity);
+        if (capacity < v->packed_size + words) capacity = v->packed_size + words;
+        v->packed = CHAN_COW_REALLOC(list, v->packed,
+            v->packed_capacity * sizeof(*v->packed), capacity * sizeof(*v->packed));
+        assert(v->packed);
+        v->packed_capacity = capacity;
+        CHAN_STATS_ADD(list, resizes, 1);
+    }
+    assert(v->packed_size <= UINT32_MAX && "compressed list too large");
+    make_unique(list, words);
+
+    uint32_t *out = v->packed + v->packed_size;
+    memset(out, 0, words * sizeof(*out));
+    const uint32_t mask = low_mask(bits);
+    uint8_t *positions = (uint8_t*)(out + 4 * bits);
+    uint32_t *highs = out + 4 * bits + (n_exceptions + 3) / 4;
+    unsigned e = 0;
+    for (size_t i = 0; i < BLOCK; ++i) {
+        const uint32_t low = (uint32_t)deltas[i] & mask;
+        const size_t pos = (i / 4) * bits;
+        const size_t w = 4 * (pos / 32) + i % 4;
+        const unsigned off = pos % 32;
+        out[w] |= low << off;
+        if (off + bits > 32) out[w + 4] |= low >> (32 - off);
+        if (bit_length(deltas[i]) > bits) {
+            const uint64_t high = deltas[i] >> bits;
+            positions[e] = (uint8_t)i;
+            highs[2 * e] = (uint32_t)high;
+            highs[2 * e + 1] = (uint32_t)(high >> 32);
+            e++;
+        }
+    }
+
+    v->firsts[v->n_blocks] = v->tail[0];
+    v->meta[v->n_blocks].offset = (uint32_t)v->packed_size;
+    v->meta[v->n_blocks].bits = (uint8_t)bits;
+    v->meta[v->n_blocks].n_exceptions = (uint8_t)n_exceptions;
+    v->n_blocks++;
+    v->packed_size += words;
+    // The tail is the decoded block.
+    memcpy(v->cache, v->tail, sizeof(v->cache));
+    v->cached_block = v->n_blocks - 1;
+    v->tail_size = 0;
+}
+
+// Unpacks the low `bits` bits of the deltas of a block into `lows`, in
+// order. The four lanes are unpacked at once with SSE2. Inlined with
+// constant `bits`, for which the shifts and loads are known.
+#ifdef DELTA_X86
+static inline void
+unpack_lanes(const uint32_t *in, unsigned bits, uint32_t *lows)
+{
+    const __m128i mask = _mm_set1_epi32((int)low_mask(bits));
+#pragma GCC unroll 32
+    for (size_t j = 0; j < BLOCK / 4; ++j) {
+        const size_t pos = j * bits;
+        const unsigned off = pos % 32;
+        const __m128i *p = (const __m128i*)(in + 4 * (pos / 32));
+        __m128i x = _mm_srli_epi32(_mm_loadu_si128(p), off);
+        if (off + bits > 32) x = _mm_or_si128(x, _mm_slli_epi32(_mm_loadu_si128(p + 1), 32 - off));
+        _mm_storeu_si128((__m128i*)(lows + 4 * j), _mm_and_si128(x, mask));
+    }
+}
+#else
+static inline void
+unpack_lanes(const uint32_t *in, unsigned bits, uint32_t *lows)
+{
+    const uint32_t mask = low_mask(bits);
+    for (size_t j = 0; j < BLOCK / 4; ++j) {
+        const size_t pos = j * bits;
+        const unsigned off = pos % 32;
+        const uint32_t *p = in + 4 * (pos / 32);
+        for (size_t lane = 0; lane < 4; ++lane) {
+            uint32_t x = p[lane] >> off;
+            if (off + bits > 32) x |= p[lane + 4] << (32 - off);
+            lows[4 * j + lane] = x & mask;
+        }
+    }
+}
+#endif
+
+#define UNPACK_CASE(bits) case bits: unpack_lanes(in, bits, lows); return;
+
+static void
+unpack(const uint32_t *in, unsigned bits, uint32_t *lows)
+{
+    switch (bits) {
+    UNPACK_CASE(1) UNPACK_CASE(2) UNPACK_CASE(3) UNPACK_CASE(4)
+    UNPACK_CASE(5) UNPACK_CASE(6) UNPACK_CASE(7) UNPACK_CASE(8)
+    UNPACK_CASE(9) UNPACK_CASE(10) UNPACK_CASE(11) UNPACK_CASE(12)
+    UNPACK_CASE(13) UNPACK_CASE(14) UNPACK_CASE(15) UNPACK_CASE(16)
+    UNPACK_CASE(17) UNPACK_CASE(18) UNPACK_CASE(19) UNPACK_CASE(20)
+    UNPACK_CASE(21) UNPACK_CASE(22) UNPACK_CASE(23) UNPACK_CASE(24)
+    UNPACK_CASE(25) UNPACK_CASE(26) UNPACK_CASE(27) UNPACK_CASE(28)
+    UNPACK_CASE(29) UNPACK_CASE(30) UNPACK_CASE(31) UNPACK_CASE(32)
+    }
+    memset(lows, 0, BLOCK * sizeof(*lows));
+}
+
+// `values[i]` = `first` + the sum of `lows[0..i]`. With SSE2, four values
+// per step: prefix sums of the two pairs, then of the four, plus the carry
+// from the previous steps.
+#ifdef DELTA_X86
+static void
+prefix_sum(const uint32_t *lows, uint64_t first, uint64_t *values)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i carry = _mm_set1_epi64x((long long)first);
+    for (size_t i = 0; i < BLOCK; i += 4) {
+        const __m128i d = _mm_loadu_si128((const __m128i*)(lows + i));
+        __m128i a = _mm_unpacklo_epi32(d, zero);
+        __m128i b = _mm_unpackhi_epi32(d, zero);
+        a = _mm_add_epi64(a, _mm_slli_si128(a, 8));
+        b = _mm_add_epi64(b, _mm_slli_si128(b, 8));
+        b = _mm_add_epi64(b, _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 2, 3, 2)));
+        // The sum of the four, so that the carry waits for one addition
+        // per step only.
+        const __m128i sum = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 2, 3, 2));
+        _mm_storeu_si128((__m128i*)(values + i), _mm_add_epi64(a, carry));
+        _mm_storeu_si128((__m128i*)(values + i + 2), _mm_add_epi64(b, carry));
+        carry = _mm_add_epi64(carry, sum);
+    }
+}
+#else
+static void
+prefix_sum(const uint32_t *lows, uint64_t first, uint64_t *values)
+{
+    uint64_t value = first;
+    for (size_t i = 0; i < BLOCK; ++i) values[i] = value += lows[i];
+}
+#endif
+
+// Decodes block `b`: the prefix sums of the low bits of its deltas, and then
+// the high bits of the exceptions added to the values from theirs on.
+static void
+decode_block(const struct chan_delta_list *v, size_t b, uint64_t *values)
+{
+    const struct block_meta meta = v->meta[b];
+    const uint32_t *in = v->packed + meta.offset;
+    uint32_t lows[BLOCK];
+    unpack(in, meta.bits, lows);
+    prefix_sum(lows, v->firsts[b], values);
+    const uint8_t *positions = (const uint8_t*)(in + 4 * meta.bits);
+    const uint32_t *highs = in + 4 * meta.bits + (meta.n_exceptions + 3) / 4;
+    for (unsigned e = 0; e < meta.n_exceptions; ++e) {
+        const uint64_t high = (highs[2 * e] | (uint64_t)highs[2 * e + 1] << 32) << meta.bits;
+        for (size_t i = positions[e]; i < BLOCK; ++i) values[i] += high;
+    }
+}
+
+// The values of block `b`, decoded into the cache unless they are there.
+static const uint64_t*
+cached(const struct chan_delta_list *v, size_t b)
+{
+    struct chan_delta_list *w = (struct chan_delta_list*)v;
+    if (w->cached_block != b) {
+        decode_block(w, b, w->cache);
+        w->cached_block = b;
+    }
+    return w->cache;
+}
+
+static const uint64_t*
+value_at(const struct chan_delta_list *v, size_t i)
+{
+    const size_t b = i / BLOCK;
+    if (b == v->n_blocks) return &v->tail[i % BLOCK];
+    return &cached(v, b)[i % BLOCK];
+}
+
+static void
+chan_delta_list_free(struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    assert(v);
+    chan_cow_free(v->firsts);
+    chan_cow_free(v->meta);
+    chan_cow_free(v->packed);
+    free(v);
+}
+
+static struct chan_list*
+chan_delta_list_clone(const struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    struct chan_delta_list *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->list.stats, 0, sizeof(clone->list.stats));
+#endif
+    clone->firsts = chan_cow_share(v->firsts);
+    clone->meta = chan_cow_share(v->meta);
+    clone->packed = chan_cow_share(v->packed);
+    return &clone->list;
+}
+
+// Drops the values from `n` on. The block of value `n` becomes the tail.
+static void
+truncate_to(struct chan_delta_list *v, size_t n)
+{
+    assert(n <= size_of(v));
+    const size_t b = n / BLOCK;
+    if (b < v->n_blocks) {
+        decode_block(v, b, v->tail);
+        v->n_blocks = b;
+        v->packed_size = v->meta[b].offset;
+        v->cached_block = SIZE_MAX;
+    }
+    v->tail_size = n - v->n_blocks * BLOCK;
+}
+
+static void
+chan_delta_list_clear(struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    truncate_to(v, 0);
+}
+
+static size_t
+chan_delta_list_size(const struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    return size_of(v);
+}
+
+static void*
+chan_delta_list_at(const struct chan_list *list, size_t i)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    assert(i < size_of(v));
+    return (void*)value_at(v, i);
+}
+
+static void
+chan_delta_list_push(struct chan_list *list, void *value)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    uint64_t x;
+    memcpy(&x, value, sizeof(x));
+    const size_t n = size_of(v);
+    assert((n == 0 || *value_at(v, n - 1) <= x) && "values must be pushed in order");
+    (void)n;
+    v->tail[v->tail_size++] = x;
+    if (v->tail_size == BLOCK) append_block(list);
+}
+
+static void
+chan_delta_list_pop(struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    assert(size_of(v) > 0);
+    truncate_to(v, size_of(v) - 1);
+}
+
+// Re-encodes the values after the changed one.
+static void
+chan_delta_list_insert(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const size_t size = size_of(v);
+    assert(n <= size);
+    const size_t n_after = size - n;
+    uint64_t *after = malloc((n_after + 1) * sizeof(*after));
+    for (size_t i = 0; i < n_after; ++i) after[i] = *value_at(v, n + i);
+    truncate_to(v, n);
+    chan_delta_list_push(list, value);
+    for (size_t i = 0; i < n_after; ++i) chan_delta_list_push(list, &after[i]);
+    free(after);
+}
+
+static void
+chan_delta_list_remove(struct chan_list *list, size_t n)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const size_t size = size_of(v);
+    assert(n < size);
+    const size_t n_after = size - n - 1;
+    uint64_t *after = malloc((n_after + 1) * sizeof(*after));
+    for (size_t i = 0; i < n_after; ++i) after[i] = *value_at(v, n + 1 + i);
+    truncate_to(v, n);
+    for (size_t i = 0; i < n_after; ++i) chan_delta_list_push(list, &after[i]);
+    free(after);
+}
+
+static void
+chan_delta_list_resize(struct chan_list *list, size_t n, void *value)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    if (n <= size_of(v)) {
+        truncate_to(v, n);
+        return;
+    }
+    while (size_of(v) < n) chan_delta_list_push(list, value);
+}
+
+static struct chan_list_iter
+chan_delta_list_iter_new(const struct chan_list *list)
+{
+    struct chan_list_iter list_iter;
+    list_iter.ind = 0;
+    return list_iter;
+}
+
+static struct chan_list_iter_item*
+chan_delta_list_iter_next(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    if (list_iter->ind >= size_of(v)) return NULL;
+    list_iter->list_iter_item.value = (void*)value_at(v, list_iter->ind);
+    list_iter->ind++;
+    return &list_iter->list_iter_item;
+}
+
+// One decoded block, or the tail.
+static struct chan_list_iter_block*
+chan_delta_list_iter_next_block(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const size_t size = size_of(v);
+    if (list_iter->ind >= size) return NULL;
+    const size_t end = (list_iter->ind / BLOCK + 1) * BLOCK;
+    list_iter->list_iter_block.values = (void*)value_at(v, list_iter->ind);
+    list_iter->list_iter_block.size = (end < size ? end : size) - list_iter->ind;
+    list_iter->ind += list_iter->list_iter_block.size;
+    return &list_iter->list_iter_block;
+}
+
+static struct chan_memory_usage
+chan_delta_list_memory_usage(const struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const size_t block_bytes = sizeof(*v->firsts) + sizeof(*v->meta);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->blocks_capacity * block_bytes + v->packed_capacity * sizeof(*v->packed);
+    usage.used = sizeof(*v) + v->n_blocks * block_bytes + v->packed_size * sizeof(*v->packed);
+    return usage;
+}
+
+static void
+chan_delta_list_shrink_to_fit(struct chan_list *list)
+{
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    if (v->blocks_capacity == v->n_blocks && v->packed_capacity == v->packed_size) return;
+    if (v->n_blocks == 0) {
+        chan_cow_free(v->firsts);
+        chan_cow_free(v->meta);
+        chan_cow_free(v->packed);
+        v->firsts = NULL;
+        v->meta = NULL;
+        v->packed = NULL;
+    }
+    else {
+        v->firsts = CHAN_COW_REALLOC(list, v->firsts,
+            v->blocks_capacity * sizeof(*v->firsts), v->n_blocks * sizeof(*v->firsts));
+        v->meta = CHAN_COW_REALLOC(list, v->meta,
+            v->blocks_capacity * sizeof(*v->meta), v->n_blocks * sizeof(*v->meta));
+        v->packed = CHAN_COW_REALLOC(list, v->packed,
+            v->packed_capacity * sizeof(*v->packed), v->packed_size * sizeof(*v->packed));
+        assert(v->firsts && v->meta && v->packed);
+    }
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->blocks_capacity = v->n_blocks;
+    v->packed_capacity = v->packed_size;
+}
+
+static void
+chan_delta_list_debug_print(
+    const struct chan_list *list,
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_delta_list *v = (struct chan_delta_list*)list;
+    const int bufSize = 256;
+    char buf[bufSize];
+    printf("size %zu, blocks %zu of %zu words [", size_of(v), v->n_blocks, v->packed_size);
+    for (size_t i = 0; i < size_of(v); ++i) {
+        if (i > 0) printf(i % BLOCK ? ", " : " | ");
+        print_value(buf, bufSize, (void*)value_at(v, i));
+        printf("%s", buf);
+    }
+    printf("]\n");
+}
+
+size_t
+chan_delta_list_lower_bound(const struct chan_list *s, uint64_t value)
+{
+    assert(s->vtable->free == chan_delta_list_free && "not a delta list");
+    struct chan_delta_list *v = (struct chan_delta_list*)s;
+    // Blocks starting below `value`. Only the last of them needs decoding.
+    size_t lo = 0;
+    size_t n = v->n_blocks;
+    while (n > 0) {
+        const size_t half = n / 2;
+        if (v->firsts[lo + half] < value) {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else {
+            n = half;
+        }
+    }
+    if (lo == 0 && v->n_blocks > 0) return 0;
+    const uint64_t *values = v->tail;
+    n = v->tail_size;
+    size_t base = v->n_blocks * BLOCK;
+    if (lo > 0 && (lo < v->n_blocks || v->tail_size == 0 || v->tail[0] >= value)) {
+        // In the block before block `lo`, or at the start of block `lo` or
+        // of the tail.
+        values = cached(v, lo - 1);
+        n = BLOCK;
+        base = (lo - 1) * BLOCK;
+    }
+    size_t i = 0;
+    while (n > 0) {
+        const size_t half = n / 2;
+        if (values[i + half] < value) {
+            i += half + 1;
+            n -= half + 1;
+        }
+        else {
+            n = half;
+        }
+    }
+    return base + i;
+}
+
+struct chan_list*
+chan_delta_list_new(void)
+{
+    static const struct chan_list_vtable vtable = {
+        chan_delta_list_free,
+        chan_delta_list_clone,
+        chan_delta_list_clear,
+        chan_delta_list_size,
+        chan_delta_list_insert,
+        chan_delta_list_push,
+        chan_delta_list_pop,
+        chan_delta_list_at,
+        chan_delta_list_remove,
+        chan_delta_list_resize,
+        chan_delta_list_iter_new,
+        chan_delta_list_iter_next,
+        chan_delta_list_iter_next_block,
+        NULL,
+        NULL,
+        chan_delta_list_memory_usage,
+        chan_delta_list_shrink_to_fit,
+        chan_delta_list_debug_print,
+    };
+    static struct chan_list list = { &vtable };
+    struct chan_delta_list *delta_list = malloc(sizeof(*delta_list));
+    memcpy(&delta_list->list, &list, sizeof(list));
+
+    delta_list->n_blocks = 0;
+    delta_list->blocks_capacity = 0;
+    delta_list->firsts = NULL;
+    delta_list->meta = NULL;
+    delta_list->packed_size = 0;
+    delta_list->packed_capacity = 0;
+    delta_list->packed = NULL;
+    delta_list->tail_size = 0;
+    delta_list->cached_block = SIZE_MAX;
+
+    return &delta_list->list;
+}
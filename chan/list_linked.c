@@ -1,4 +1,5 @@
 #include "list.h"
+#include "cow.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -30,11 +31,36 @@ chan_linked_list_free(struct chan_list *list) {
     v->capacity = 0;
     v->size = 0;
     v->value_size = 0;
-    if (v->data) free(v->data);
-    if (v->data) free(v->value_nodes);
+    chan_cow_free(v->data);
+    chan_cow_free(v->value_nodes);
     free(v);
 }
 
+// Copies the part of the arrays that is shared with a clone before the
+// value and node `i` are written.
+static void
+make_unique(struct chan_list *list, size_t i)
+{
+    struct chan_linked_list *v = (struct chan_linked_list*)list;
+    v->data = CHAN_COW_UNSHARE_RANGE(list, v->data, v->size * v->value_size, v->capacity * v->value_size,
+        i * v->value_size, (i + 1) * v->value_size);
+    v->value_nodes = CHAN_COW_UNSHARE_RANGE(list, v->value_nodes, v->size * sizeof(*v->value_nodes),
+        v->capacity * sizeof(*v->value_nodes), i * sizeof(*v->value_nodes), (i + 1) * sizeof(*v->value_nodes));
+}
+
+static struct chan_list*
+chan_linked_list_clone(const struct chan_list *list) {
+    struct chan_linked_list *v = (struct chan_linked_list*)list;
+    struct chan_linked_list *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->list.stats, 0, sizeof(clone->list.stats));
+#endif
+    clone->data = chan_cow_share(v->data);
+    clone->value_nodes = chan_cow_share(v->value_nodes);
+    return &clone->list;
+}
+
 void*
 chan_linked_list_at(const struct chan_list *list, size_t i) {
     assert(false && "not implemented");
@@ -59,8 +85,10 @@ chan_linked_list_reserve(struct chan_list *list, size_t capacity) {
     struct chan_linked_list *v = (struct chan_linked_list*)list;
     if (capacity == 0) return;
     if (v->capacity >= capacity) return;
-    v->data = realloc(v->data, capacity * sizeof(v->value_size));
-    v->value_nodes = realloc(v->value_nodes, capacity * sizeof(*v->value_nodes));
+    v->data = CHAN_COW_REALLOC(list, v->data, v->capacity * v->value_size, capacity * v->value_size);
+    v->value_nodes = CHAN_COW_REALLOC(list, v->value_nodes,
+        v->capacity * sizeof(*v->value_nodes), capacity * sizeof(*v->value_nodes));
+    CHAN_STATS_ADD(list, resizes, 1);
     v->capacity = capacity;
     assert(v->data);
 }
@@ -69,9 +97,10 @@ void
 chan_linked_list_push(struct chan_list *list, void *value) {
     struct chan_linked_list *v = (struct chan_linked_list*)list;
     if (v->size >= v->capacity) {
-        const size_t capacity = v->size == 0 ? 4 : 3 * v->size / 2;
+        const size_t capacity = chan_growth_next_capacity(&list->growth, v->size);
         chan_linked_list_reserve(list, capacity);
     }
+    make_unique(list, v->size);
     CPY(v->data, v->size, value, 0, v->value_size);
     v->size++;
     // TODO Setup value_nodes.
@@ -127,6 +156,38 @@ chan_linked_list_resize(struct chan_list *list, size_t n, void *value) {
     /* } */
 }
 
+static struct chan_memory_usage
+chan_linked_list_memory_usage(const struct chan_list *list)
+{
+    struct chan_linked_list *v = (struct chan_linked_list*)list;
+    const size_t item_size = v->value_size + sizeof(*v->value_nodes);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size;
+    usage.used = sizeof(*v) + v->size * item_size;
+    return usage;
+}
+
+static void
+chan_linked_list_shrink_to_fit(struct chan_list *list)
+{
+    struct chan_linked_list *v = (struct chan_linked_list*)list;
+    if (v->capacity == v->size) return;
+    if (v->size == 0) {
+        chan_cow_free(v->data);
+        chan_cow_free(v->value_nodes);
+        v->data = NULL;
+        v->value_nodes = NULL;
+    }
+    else {
+        v->data = CHAN_COW_REALLOC(list, v->data, v->capacity * v->value_size, v->size * v->value_size);
+        v->value_nodes = CHAN_COW_REALLOC(list, v->value_nodes,
+            v->capacity * sizeof(*v->value_nodes), v->size * sizeof(*v->value_nodes));
+        assert(v->data);
+    }
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->capacity = v->size;
+}
+
 static struct chan_list_iter
 chan_linked_list_iter_new(const struct chan_list *list)
 {
@@ -146,6 +207,17 @@ chan_linked_list_iter_next(const struct chan_list *list, struct chan_list_iter *
     return &list_iter->list_iter_item;
 }
 
+// One value per block.
+static struct chan_list_iter_block*
+chan_linked_list_iter_next_block(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_list_iter_item *item = chan_linked_list_iter_next(list, list_iter);
+    if (!item) return NULL;
+    list_iter->list_iter_block.values = item->value;
+    list_iter->list_iter_block.size = 1;
+    return &list_iter->list_iter_block;
+}
+
 static void
 chan_linked_list_debug_print(
     const struct chan_list *list,
@@ -168,6 +240,7 @@ chan_linked_list_new(size_t value_size)
 {
     static const struct chan_list_vtable vtable = {
         chan_linked_list_free,
+        chan_linked_list_clone,
         chan_linked_list_clear,
         chan_linked_list_size,
         chan_linked_list_insert,
@@ -178,6 +251,11 @@ chan_linked_list_new(size_t value_size)
         chan_linked_list_resize,
         chan_linked_list_iter_new,
         chan_linked_list_iter_next,
+        chan_linked_list_iter_next_block,
+        NULL,
+        NULL,
+        chan_linked_list_memory_usage,
+        chan_linked_list_shrink_to_fit,
         chan_linked_list_debug_print,
     };
     static struct chan_list list = { &vtable };
@@ -188,6 +266,7 @@ chan_linked_list_new(size_t value_size)
     linked_list->size = 0;
     linked_list->capacity = 0;
     linked_list->data = NULL;
+    linked_list->value_nodes = NULL;
 
     return &linked_list->list;
 }
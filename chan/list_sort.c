@@ -0,0 +1,321 @@
+#include "list.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Ranges up to this size are finished with insertion sort.
+#define INSERTION_SORT_MAX 16
+
+// Ranges from this size take the pivot as the median of three medians.
+#define NINTHER_MIN 128
+
+// Largest value size that is moved through a buffer on the stack.
+#define STACK_VALUE_MAX 256
+
+struct sorter {
+    size_t value_size;
+    bool (*less)(void*, void*);
+    // Room for one value.
+    void *tmp;
+};
+
+// The swaps and copies are specialized for the common value sizes, for
+// which they compile to a few register moves instead of `memcpy` calls.
+static inline void
+copy_value(void *dst, const void *src, size_t size)
+{
+    switch (size) {
+    case 4: memcpy(dst, src, 4); return;
+    case 8: memcpy(dst, src, 8); return;
+    case 16: memcpy(dst, src, 16); return;
+    default: memcpy(dst, src, size); return;
+    }
+}
+
+static inline void
+swap_values(void *a, void *b, size_t size)
+{
+    switch (size) {
+    case 4: {
+        uint32_t t;
+        memcpy(&t, a, 4);
+        memcpy(a, b, 4);
+        memcpy(b, &t, 4);
+        return;
+    }
+    case 8: {
+        uint64_t t;
+        memcpy(&t, a, 8);
+        memcpy(a, b, 8);
+        memcpy(b, &t, 8);
+        return;
+    }
+    case 16: {
+        uint64_t t[2];
+        memcpy(t, a, 16);
+        memcpy(a, b, 16);
+        memcpy(b, t, 16);
+        return;
+    }
+    }
+    unsigned char t[64];
+    for (size_t i = 0; i < size; i += sizeof(t)) {
+        const size_t n = size - i < sizeof(t) ? size - i : sizeof(t);
+        memcpy(t, (unsigned char*)a + i, n);
+        memcpy((unsigned char*)a + i, (unsigned char*)b + i, n);
+        memcpy((unsigned char*)b + i, t, n);
+    }
+}
+
+static inline bool
+less_at(const struct sorter *s, void *data, size_t i, size_t j)
+{
+    return s->less(AT(data, i, s->value_size), AT(data, j, s->value_size));
+}
+
+static void
+insertion_sort(const struct sorter *s, void *data, size_t lo, size_t hi)
+{
+    const size_t size = s->value_size;
+    for (size_t i = lo + 1; i < hi; ++i) {
+        if (!less_at(s, data, i, i - 1)) continue;
+        copy_value(s->tmp, AT(data, i, size), size);
+        size_t j = i;
+        do {
+            copy_value(AT(data, j, size), AT(data, j - 1, size), size);
+            --j;
+        } while (j > lo && s->less(s->tmp, AT(data, j - 1, size)));
+        copy_value(AT(data, j, size), s->tmp, size);
+    }
+}
+
+static void
+sift_down(const struct sorter *s, void *base, size_t i, size_t n)
+{
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n) return;
+        if (child + 1 < n && less_at(s, base, child, child + 1)) child++;
+        if (!less_at(s, base, i, child)) return;
+        swap_values(AT(base, i, s->value_size), AT(base, child, s->value_size), s->value_size);
+        i = child;
+    }
+}
+
+// Fallback that bounds the worst case to O(n log n).
+static void
+heap_sort(const struct sorter *s, void *data, size_t lo, size_t hi)
+{
+    void *base = AT(data, lo, s->value_size);
+    const size_t n = hi - lo;
+    for (size_t i = n / 2; i-- > 0;) sift_down(s, base, i, n);
+    for (size_t end = n - 1; end > 0; --end) {
+        swap_values(base, AT(base, end, s->value_size), s->value_size);
+        sift_down(s, base, 0, end);
+    }
+}
+
+static size_t
+median_of_three(const struct sorter *s, void *data, size_t a, size_t b, size_t c)
+{
+    if (less_at(s, data, a, b)) {
+        if (less_at(s, data, b, c)) return b;
+        return less_at(s, data, a, c) ? c : a;
+    }
+    if (less_at(s, data, a, c)) return a;
+    return less_at(s, data, b, c) ? c : b;
+}
+
+// Introsort: quicksort on the median of three (or of three medians for large
+// ranges), insertion sort for small ranges and heapsort once the recursion
+// is deeper than `depth_limit`. Recurses into the smaller part only.
+static void
+intro_sort(const struct sorter *s, void *data, size_t lo, size_t hi, size_t depth_limit)
+{
+    const size_t size = s->value_size;
+    while (hi - lo > INSERTION_SORT_MAX) {
+        if (depth_limit-- == 0) {
+            heap_sort(s, data, lo, hi);
+            return;
+        }
+        const size_t n = hi - lo;
+        const size_t mid = lo + n / 2;
+        size_t pivot;
+        if (n >= NINTHER_MIN) {
+            const size_t step = n / 8;
+            pivot = median_of_three(s, data,
+                median_of_three(s, data, lo, lo + step, lo + 2 * step),
+                median_of_three(s, data, mid - step, mid, mid + step),
+                median_of_three(s, data, hi - 1 - 2 * step, hi - 1 - step, hi - 1));
+        }
+        else {
+            pivot = median_of_three(s, data, lo, mid, hi - 1);
+        }
+        swap_values(AT(data, lo, size), AT(data, pivot, size), size);
+
+        // Hoare partition around the pivot at `lo`. The scans are bounded,
+        // so `less` may also be "less than or equal".
+        size_t i = lo;
+        size_t j = hi;
+        for (;;) {
+            while (less_at(s, data, ++i, lo)) if (i == hi - 1) break;
+            while (less_at(s, data, lo, --j)) if (j == lo) break;
+            if (i >= j) break;
+            swap_values(AT(data, i, size), AT(data, j, size), size);
+        }
+        swap_values(AT(data, lo, size), AT(data, j, size), size);
+
+        if (j - lo < hi - j) {
+            intro_sort(s, data, lo, j, depth_limit);
+            lo = j + 1;
+        }
+        else {
+            intro_sort(s, data, j + 1, hi, depth_limit);
+            hi = j;
+        }
+    }
+    insertion_sort(s, data, lo, hi);
+}
+
+void
+chan_list_sort(struct chan_list *s, size_t value_size, bool (*less)(void*, void*))
+{
+    size_t n;
+    void *data = chan_list_writable_data(s, &n);
+    if (n < 2) return;
+    unsigned char stack_tmp[STACK_VALUE_MAX];
+    struct sorter sorter = { value_size, less, value_size <= STACK_VALUE_MAX ? stack_tmp : malloc(value_size) };
+    size_t depth_limit = 0;
+    for (size_t m = n; m > 1; m /= 2) depth_limit += 2;
+    intro_sort(&sorter, data, 0, n, depth_limit);
+    if (sorter.tmp != stack_tmp) free(sorter.tmp);
+}
+
+// Maps the key bits so that unsigned comparison orders them like the keys.
+static inline uint64_t
+radix_key(const void *value, size_t key_offset, enum chan_radix_key type)
+{
+    const unsigned char *p = (const unsigned char*)value + key_offset;
+    switch (type) {
+    case CHAN_RADIX_U32: { uint32_t k; memcpy(&k, p, 4); return k; }
+    case CHAN_RADIX_I32: { uint32_t k; memcpy(&k, p, 4); return k ^ 0x80000000u; }
+    case CHAN_RADIX_F32: {
+        uint32_t k;
+        memcpy(&k, p, 4);
+        return k & 0x80000000u ? ~k : k ^ 0x80000000u;
+    }
+    case CHAN_RADIX_U64: { uint64_t k; memcpy(&k, p, 8); return k; }
+    case CHAN_RADIX_I64: { uint64_t k; memcpy(&k, p, 8); return k ^ 0x8000000000000000ULL; }
+    case CHAN_RADIX_F64: {
+        uint64_t k;
+        memcpy(&k, p, 8);
+        return k & 0x8000000000000000ULL ? ~k : k ^ 0x8000000000000000ULL;
+    }
+    }
+    return 0;
+}
+
+// One stable pass of the values from `src` to `dst` by byte `digit` of the
+// keys. Inlined with constant `value_size` for the common sizes.
+static inline void
+radix_pass(
+    const void *src,
+    void *dst,
+    size_t n,
+    size_t value_size,
+    size_t key_offset,
+    enum chan_radix_key type,
+    unsigned digit,
+    size_t *offsets
+) {
+    for (size_t i = 0; i < n; ++i) {
+        const void *value = AT(src, i, value_size);
+        const unsigned byte = (radix_key(value, key_offset, type) >> (8 * digit)) & 0xff;
+        copy_value(AT(dst, offsets[byte]++, value_size), value, value_size);
+    }
+}
+
+void
+chan_list_radix_sort(struct chan_list *s, size_t value_size, size_t key_offset, enum chan_radix_key type)
+{
+    const size_t key_size = type <= CHAN_RADIX_F32 ? 4 : 8;
+    assert(key_offset + key_size <= value_size);
+    size_t n;
+    void *data = chan_list_writable_data(s, &n);
+    if (n < 2) return;
+
+    // Histograms of all the key bytes in one pass.
+    size_t (*counts)[256] = calloc(key_size, sizeof(*counts));
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t key = radix_key(AT(data, i, value_size), key_offset, type);
+        for (size_t d = 0; d < key_size; ++d) counts[d][(key >> (8 * d)) & 0xff]++;
+    }
+
+    void *tmp = malloc(n * value_size);
+    void *src = data;
+    void *dst = tmp;
+    for (unsigned d = 0; d < key_size; ++d) {
+        // Skip the bytes that are equal in all keys, eg the high bytes of
+        // small integers.
+        if (counts[d][(radix_key(data, key_offset, type) >> (8 * d)) & 0xff] == n) continue;
+        size_t offsets[256];
+        size_t sum = 0;
+        for (size_t b = 0; b < 256; ++b) {
+            offsets[b] = sum;
+            sum += counts[d][b];
+        }
+        switch (value_size) {
+        case 4: radix_pass(src, dst, n, 4, key_offset, type, d, offsets); break;
+        case 8: radix_pass(src, dst, n, 8, key_offset, type, d, offsets); break;
+        case 16: radix_pass(src, dst, n, 16, key_offset, type, d, offsets); break;
+        default: radix_pass(src, dst, n, value_size, key_offset, type, d, offsets); break;
+        }
+        void *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != data) memcpy(data, src, n * value_size);
+    free(tmp);
+    free(counts);
+}
+
+size_t
+chan_list_lower_bound(const struct chan_list *s, size_t value_size, void *value, bool (*less)(void*, void*))
+{
+    size_t n;
+    void *data = chan_list_data(s, &n);
+    size_t lo = 0;
+    while (n > 0) {
+        const size_t half = n / 2;
+        void *mid = AT(data, lo + half, value_size);
+        // Strict "less than" whether `less` is strict or not.
+        if (less(mid, value) && memcmp(mid, value, value_size) != 0) {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else {
+            n = half;
+        }
+    }
+    return lo;
+}
+
+size_t
+chan_list_unique(struct chan_list *s, size_t value_size)
+{
+    size_t n;
+    void *data = chan_list_writable_data(s, &n);
+    if (n < 2) return n;
+    size_t out = 1;
+    for (size_t i = 1; i < n; ++i) {
+        if (memcmp(AT(data, i, value_size), AT(data, out - 1, value_size), value_size) == 0) continue;
+        if (out != i) copy_value(AT(data, out, value_size), AT(data, i, value_size), value_size);
+        out++;
+    }
+    chan_list_resize(s, out, NULL);
+    return out;
+}
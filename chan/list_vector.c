@@ -1,4 +1,5 @@
 #include "list.h"
+#include "cow.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -25,10 +26,33 @@ chan_vector_list_free(struct chan_list *list) {
     v->capacity = 0;
     v->size = 0;
     v->value_size = 0;
-    if (v->data) free(v->data);
+    chan_cow_free(v->data);
     free(v);
 }
 
+// Copies the values `[from, to)` if they are shared with a clone. Called
+// before writing to them.
+static inline void
+make_unique(struct chan_list *list, size_t from, size_t to)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    v->data = CHAN_COW_UNSHARE_RANGE(list, v->data, v->size * v->value_size, v->capacity * v->value_size,
+        from * v->value_size, to * v->value_size);
+}
+
+static struct chan_list*
+chan_vector_list_clone(const struct chan_list *list)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    struct chan_vector_list *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->list.stats, 0, sizeof(clone->list.stats));
+#endif
+    clone->data = chan_cow_share(v->data);
+    return &clone->list;
+}
+
 void*
 chan_vector_list_at(const struct chan_list *list, size_t i) {
     struct chan_vector_list *v = (struct chan_vector_list*)list;
@@ -52,7 +76,8 @@ chan_vector_list_reserve(struct chan_list *list, size_t n) {
     struct chan_vector_list *v = (struct chan_vector_list*)list;
     if (n == 0) return;
     if (v->capacity >= n) return;
-    v->data = realloc(v->data, n * sizeof(v->value_size));
+    v->data = CHAN_COW_REALLOC(list, v->data, v->capacity * v->value_size, n * v->value_size);
+    CHAN_STATS_ADD(list, resizes, 1);
     v->capacity = n;
     assert(v->data);
 }
@@ -61,9 +86,10 @@ void
 chan_vector_list_push(struct chan_list *list, void *value) {
     struct chan_vector_list *v = (struct chan_vector_list*)list;
     if (v->size >= v->capacity) {
-        const size_t n = v->size == 0 ? 4 : 3 * v->size / 2;
+        const size_t n = chan_growth_next_capacity(&list->growth, v->size);
         chan_vector_list_reserve(list, n);
     }
+    make_unique(list, v->size, v->size + 1);
     CPY(v->data, v->size, value, 0, v->value_size);
     v->size++;
 }
@@ -85,6 +111,7 @@ void
 chan_vector_list_remove(struct chan_list *list, size_t n) {
     struct chan_vector_list *v = (struct chan_vector_list*)list;
     assert(n < v->size);
+    make_unique(list, n, v->size);
     v->size--;
     for (size_t i = n; i < v->size; ++i) {
         CPY(v->data, i, v->data, i + 1, v->value_size);
@@ -97,6 +124,7 @@ chan_vector_list_insert(struct chan_list *list, size_t n, void *value) {
     v->size++;
     assert(n < v->size);
     chan_vector_list_reserve(list, v->size);
+    make_unique(list, n, v->size);
     for (size_t i = v->size - 1; i > n; --i) {
         CPY(v->data, i, v->data, i - 1, v->value_size);
     }
@@ -108,12 +136,40 @@ chan_vector_list_resize(struct chan_list *list, size_t n, void *value) {
     struct chan_vector_list *v = (struct chan_vector_list*)list;
     const size_t n0 = v->size;
     chan_vector_list_reserve(list, n);
+    make_unique(list, n0, n);
     v->size = n;
     for (size_t i = n0; i < n; ++i) {
         CPY(v->data, i, value, 0, v->value_size);
     }
 }
 
+static struct chan_memory_usage
+chan_vector_list_memory_usage(const struct chan_list *list)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * v->value_size;
+    usage.used = sizeof(*v) + v->size * v->value_size;
+    return usage;
+}
+
+static void
+chan_vector_list_shrink_to_fit(struct chan_list *list)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    if (v->capacity == v->size) return;
+    if (v->size == 0) {
+        chan_cow_free(v->data);
+        v->data = NULL;
+    }
+    else {
+        v->data = CHAN_COW_REALLOC(list, v->data, v->capacity * v->value_size, v->size * v->value_size);
+        assert(v->data);
+    }
+    CHAN_STATS_ADD(list, resizes, 1);
+    v->capacity = v->size;
+}
+
 static struct chan_list_iter
 chan_vector_list_iter_new(const struct chan_list *list)
 {
@@ -132,6 +188,32 @@ chan_vector_list_iter_next(const struct chan_list *list, struct chan_list_iter *
     return &list_iter->list_iter_item;
 }
 
+static struct chan_list_iter_block*
+chan_vector_list_iter_next_block(const struct chan_list *list, struct chan_list_iter *list_iter)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    if (list_iter->ind >= v->size) return NULL;
+    list_iter->list_iter_block.values = AT(v->data, list_iter->ind, v->value_size);
+    list_iter->list_iter_block.size = v->size - list_iter->ind;
+    list_iter->ind = v->size;
+    return &list_iter->list_iter_block;
+}
+
+static void*
+chan_vector_list_data(const struct chan_list *list)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    return v->data;
+}
+
+static void*
+chan_vector_list_writable_data(struct chan_list *list)
+{
+    struct chan_vector_list *v = (struct chan_vector_list*)list;
+    make_unique(list, 0, v->size);
+    return v->data;
+}
+
 static void
 chan_vector_list_debug_print(
     const struct chan_list *list,
@@ -154,6 +236,7 @@ chan_vector_list_new(size_t value_size)
 {
     static const struct chan_list_vtable vtable = {
         chan_vector_list_free,
+        chan_vector_list_clone,
         chan_vector_list_clear,
         chan_vector_list_size,
         chan_vector_list_insert,
@@ -164,6 +247,11 @@ chan_vector_list_new(size_t value_size)
         chan_vector_list_resize,
         chan_vector_list_iter_new,
         chan_vector_list_iter_next,
+        chan_vector_list_iter_next_block,
+        chan_vector_list_data,
+        chan_vector_list_writable_data,
+        chan_vector_list_memory_usage,
+        chan_vector_list_shrink_to_fit,
         chan_vector_list_debug_print,
     };
     static struct chan_list list = { &vtable };
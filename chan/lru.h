@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+// Key-value cache that holds at most `capacity` entries and evicts one when
+// a new key is added to a full cache. All the memory is allocated at
+// construction, and lookups, insertions and evictions are `O(1)`.
+struct chan_lru_cache;
+
+enum chan_cache_policy {
+    // Evicts the least recently used entry. Every hit moves the entry to
+    // the front of a list.
+    CHAN_CACHE_LRU,
+    // Approximates LRU: a hit only sets a flag, and eviction sweeps a
+    // "clock hand" over the entries, sparing and clearing the flagged ones.
+    CHAN_CACHE_CLOCK,
+};
+
+struct chan_lru_cache *chan_lru_cache_new(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*),
+    size_t capacity
+);
+struct chan_lru_cache *chan_lru_cache_new_policy(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*),
+    size_t capacity,
+    enum chan_cache_policy policy
+);
+
+void chan_lru_cache_free(struct chan_lru_cache *c);
+void chan_lru_cache_clear(struct chan_lru_cache *c);
+size_t chan_lru_cache_size(const struct chan_lru_cache *c);
+size_t chan_lru_cache_capacity(const struct chan_lru_cache *c);
+// Returns pointer to the value of `key` and marks it used, or NULL if absent.
+void* chan_lru_cache_get(struct chan_lru_cache *c, void *key);
+// Like `get`, but does not mark the key used.
+void* chan_lru_cache_peek(const struct chan_lru_cache *c, void *key);
+// Inserts or replaces the value of `key` and marks it used. Returns true if
+// an entry had to be evicted to make room, in which case its key and value
+// are copied to `evicted_key` and `evicted_value` unless they are NULL.
+bool chan_lru_cache_put(
+    struct chan_lru_cache *c,
+    void *key,
+    void *value,
+    void *evicted_key,
+    void *evicted_value
+);
+// Evicts the entry chosen by the policy, copying it like `put`. Returns
+// false if the cache is empty.
+bool chan_lru_cache_evict(struct chan_lru_cache *c, void *evicted_key, void *evicted_value);
+// Removes `key` if present.
+void chan_lru_cache_remove(struct chan_lru_cache *c, void *key);
+struct chan_memory_usage chan_lru_cache_memory_usage(const struct chan_lru_cache *c);
+// Counters collected when built with `CHAN_STATS`, zeros otherwise.
+struct chan_stats chan_lru_cache_stats(const struct chan_lru_cache *c);
@@ -0,0 +1,332 @@
+#include "lru.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+// Buckets are sized so that a full cache keeps them at most 3/4 in use.
+static const size_t MIN_BUCKETS = 8;
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
+
+#define CPY(dst, dst_ind, src, src_ind, item_size) \
+    memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define CMP(dst, dst_ind, src, src_ind, item_size) \
+    memcmp((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Links of an entry in the recency list, -1 at either end.
+struct entry_node {
+    int neighbors[2]; // First is the more, second the less recently used entry.
+};
+
+struct chan_lru_cache {
+#ifdef CHAN_STATS
+    struct chan_stats stats;
+#endif
+    enum chan_cache_policy policy;
+    size_t key_size;
+    size_t value_size;
+    // Entries are kept in slots `[0, size)` of the arrays below. Removing
+    // one moves the last entry into its slot.
+    size_t size;
+    size_t capacity;
+    void *key_data;
+    void *value_data;
+    // `CHAN_CACHE_LRU`: recency list from `head` (most recent) to `tail`.
+    struct entry_node *entry_nodes;
+    int head;
+    int tail;
+    // `CHAN_CACHE_CLOCK`: referenced flag of each slot, and the slot that
+    // the next eviction looks at first.
+    bool *referenced;
+    size_t hand;
+    // Number of buckets in `hash_to_key_ind`, a power of two.
+    size_t n_buckets;
+    int *hash_to_key_ind;
+    size_t (*hasher)(void*);
+};
+
+// Returns the bucket that holds `key`, or the empty bucket where it should be
+// inserted. The buckets are never full, so the search always ends.
+static size_t
+find_bucket(const struct chan_lru_cache *c, void *key)
+{
+    const size_t mask = c->n_buckets - 1;
+    const size_t hash = c->hasher(key);
+    for (size_t i = 0;; ++i) {
+        const size_t ind = (hash + i) & mask;
+        const int key_ind = c->hash_to_key_ind[ind];
+        if (key_ind != -1) CHAN_STATS_ADD(c, comparisons, 1);
+        if (key_ind == -1 || CMP(c->key_data, key_ind, key, 0, c->key_size) == 0) {
+            CHAN_STATS_PROBE(c, i);
+            return ind;
+        }
+    }
+}
+
+static void
+unlink_entry(struct chan_lru_cache *c, int i)
+{
+    const int prev = c->entry_nodes[i].neighbors[0];
+    const int next = c->entry_nodes[i].neighbors[1];
+    if (prev == -1) c->head = next;
+    else c->entry_nodes[prev].neighbors[1] = next;
+    if (next == -1) c->tail = prev;
+    else c->entry_nodes[next].neighbors[0] = prev;
+}
+
+static void
+push_front(struct chan_lru_cache *c, int i)
+{
+    c->entry_nodes[i].neighbors[0] = -1;
+    c->entry_nodes[i].neighbors[1] = c->head;
+    if (c->head == -1) c->tail = i;
+    else c->entry_nodes[c->head].neighbors[0] = i;
+    c->head = i;
+}
+
+static void
+touch(struct chan_lru_cache *c, int i)
+{
+    if (c->policy == CHAN_CACHE_CLOCK) {
+        c->referenced[i] = true;
+    }
+    else if (c->head != i) {
+        unlink_entry(c, i);
+        push_front(c, i);
+    }
+}
+
+// Empties `bucket`, shifting the following entries of the probe sequence back
+// so that no tombstones are needed.
+static void
+clear_bucket(struct chan_lru_cache *c, size_t bucket)
+{
+    const size_t mask = c->n_buckets - 1;
+    size_t hole = bucket;
+    for (size_t ind = (bucket + 1) & mask; c->hash_to_key_ind[ind] != -1; ind = (ind + 1) & mask) {
+        const int key_ind = c->hash_to_key_ind[ind];
+        const size_t home = c->hasher(AT(c->key_data, key_ind, c->key_size)) & mask;
+        // Move the entry unless its home lies cyclically in `(hole, ind]`.
+        if (((ind - home) & mask) >= ((ind - hole) & mask)) {
+            c->hash_to_key_ind[hole] = key_ind;
+            hole = ind;
+        }
+    }
+    c->hash_to_key_ind[hole] = -1;
+}
+
+// Removes the entry in `bucket` and moves the last entry into its slot.
+static void
+remove_at(struct chan_lru_cache *c, size_t bucket)
+{
+    const int i = c->hash_to_key_ind[bucket];
+    clear_bucket(c, bucket);
+    if (c->policy == CHAN_CACHE_LRU) unlink_entry(c, i);
+    const int last = (int)c->size - 1;
+    if (i != last) {
+        c->hash_to_key_ind[find_bucket(c, AT(c->key_data, last, c->key_size))] = i;
+        CPY(c->key_data, i, c->key_data, last, c->key_size);
+        CPY(c->value_data, i, c->value_data, last, c->value_size);
+        if (c->policy == CHAN_CACHE_LRU) {
+            struct entry_node node = c->entry_nodes[last];
+            c->entry_nodes[i] = node;
+            if (node.neighbors[0] == -1) c->head = i;
+            else c->entry_nodes[node.neighbors[0]].neighbors[1] = i;
+            if (node.neighbors[1] == -1) c->tail = i;
+            else c->entry_nodes[node.neighbors[1]].neighbors[0] = i;
+        }
+        else {
+            c->referenced[i] = c->referenced[last];
+        }
+    }
+    c->size--;
+}
+
+// Returns the slot that the policy evicts next. The cache must not be empty.
+static int
+choose_victim(struct chan_lru_cache *c)
+{
+    if (c->policy == CHAN_CACHE_LRU) return c->tail;
+    for (;;) {
+        if (c->hand >= c->size) c->hand = 0;
+        if (!c->referenced[c->hand]) return (int)c->hand;
+        c->referenced[c->hand++] = false;
+    }
+}
+
+void
+chan_lru_cache_free(struct chan_lru_cache *c)
+{
+    assert(c);
+    free(c->key_data);
+    free(c->value_data);
+    if (c->entry_nodes) free(c->entry_nodes);
+    if (c->referenced) free(c->referenced);
+    free(c->hash_to_key_ind);
+    free(c);
+}
+
+void
+chan_lru_cache_clear(struct chan_lru_cache *c)
+{
+    c->size = 0;
+    c->head = -1;
+    c->tail = -1;
+    c->hand = 0;
+    memset(c->hash_to_key_ind, -1, c->n_buckets * sizeof(*c->hash_to_key_ind));
+}
+
+size_t
+chan_lru_cache_size(const struct chan_lru_cache *c)
+{
+    return c->size;
+}
+
+size_t
+chan_lru_cache_capacity(const struct chan_lru_cache *c)
+{
+    return c->capacity;
+}
+
+void*
+chan_lru_cache_get(struct chan_lru_cache *c, void *key)
+{
+    const int i = c->hash_to_key_ind[find_bucket(c, key)];
+    if (i == -1) return NULL;
+    touch(c, i);
+    return AT(c->value_data, i, c->value_size);
+}
+
+void*
+chan_lru_cache_peek(const struct chan_lru_cache *c, void *key)
+{
+    const int i = c->hash_to_key_ind[find_bucket(c, key)];
+    return i == -1 ? NULL : AT(c->value_data, i, c->value_size);
+}
+
+bool
+chan_lru_cache_evict(struct chan_lru_cache *c, void *evicted_key, void *evicted_value)
+{
+    if (c->size == 0) return false;
+    const int i = choose_victim(c);
+    if (evicted_key) CPY(evicted_key, 0, c->key_data, i, c->key_size);
+    if (evicted_value) CPY(evicted_value, 0, c->value_data, i, c->value_size);
+    remove_at(c, find_bucket(c, AT(c->key_data, i, c->key_size)));
+    return true;
+}
+
+bool
+chan_lru_cache_put(
+    struct chan_lru_cache *c,
+    void *key,
+    void *value,
+    void *evicted_key,
+    void *evicted_value
+) {
+    size_t bucket = find_bucket(c, key);
+    int i = c->hash_to_key_ind[bucket];
+    if (i != -1) {
+        CPY(c->value_data, i, value, 0, c->value_size);
+        touch(c, i);
+        return false;
+    }
+    const bool evict = c->size == c->capacity;
+    if (evict) {
+        // Reuse the slot of the victim so that the other entries stay where
+        // the clock hand expects them.
+        i = choose_victim(c);
+        if (evicted_key) CPY(evicted_key, 0, c->key_data, i, c->key_size);
+        if (evicted_value) CPY(evicted_value, 0, c->value_data, i, c->value_size);
+        clear_bucket(c, find_bucket(c, AT(c->key_data, i, c->key_size)));
+        if (c->policy == CHAN_CACHE_LRU) unlink_entry(c, i);
+        else c->hand = (size_t)i + 1;
+        // Clearing may have shifted the probe sequence of `key`.
+        bucket = find_bucket(c, key);
+    }
+    else {
+        i = (int)c->size++;
+    }
+    c->hash_to_key_ind[bucket] = i;
+    CPY(c->key_data, i, key, 0, c->key_size);
+    CPY(c->value_data, i, value, 0, c->value_size);
+    if (c->policy == CHAN_CACHE_LRU) push_front(c, i);
+    else c->referenced[i] = false;
+    return evict;
+}
+
+void
+chan_lru_cache_remove(struct chan_lru_cache *c, void *key)
+{
+    const size_t bucket = find_bucket(c, key);
+    if (c->hash_to_key_ind[bucket] != -1) remove_at(c, bucket);
+}
+
+struct chan_memory_usage
+chan_lru_cache_memory_usage(const struct chan_lru_cache *c)
+{
+    const size_t policy_size = c->policy == CHAN_CACHE_LRU
+        ? sizeof(*c->entry_nodes) : sizeof(*c->referenced);
+    const size_t item_size = c->key_size + c->value_size + policy_size;
+    const size_t buckets = c->n_buckets * sizeof(*c->hash_to_key_ind);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*c) + c->capacity * item_size + buckets;
+    usage.used = sizeof(*c) + c->size * item_size + buckets;
+    return usage;
+}
+
+struct chan_stats
+chan_lru_cache_stats(const struct chan_lru_cache *c)
+{
+#ifdef CHAN_STATS
+    return c->stats;
+#else
+    struct chan_stats stats = { 0 };
+    return stats;
+#endif
+}
+
+struct chan_lru_cache*
+chan_lru_cache_new_policy(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*),
+    size_t capacity,
+    enum chan_cache_policy policy
+) {
+    assert(capacity > 0 && capacity <= (size_t)INT_MAX);
+    struct chan_lru_cache *c = malloc(sizeof(*c));
+#ifdef CHAN_STATS
+    memset(&c->stats, 0, sizeof(c->stats));
+#endif
+    c->policy = policy;
+    c->key_size = key_size;
+    c->value_size = value_size;
+    c->capacity = capacity;
+    c->key_data = malloc(capacity * key_size);
+    c->value_data = malloc(capacity * value_size);
+    c->entry_nodes = policy == CHAN_CACHE_LRU ? malloc(capacity * sizeof(*c->entry_nodes)) : NULL;
+    c->referenced = policy == CHAN_CACHE_CLOCK ? malloc(capacity * sizeof(*c->referenced)) : NULL;
+    c->n_buckets = MIN_BUCKETS;
+    while (c->n_buckets * MAX_LOAD_NUM < capacity * MAX_LOAD_DEN) c->n_buckets *= 2;
+    c->hash_to_key_ind = malloc(c->n_buckets * sizeof(*c->hash_to_key_ind));
+    c->hasher = hasher;
+    assert(c->key_data && c->value_data && c->hash_to_key_ind);
+    assert(c->entry_nodes || c->referenced);
+    chan_lru_cache_clear(c);
+    return c;
+}
+
+struct chan_lru_cache*
+chan_lru_cache_new(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*),
+    size_t capacity
+) {
+    return chan_lru_cache_new_policy(key_size, value_size, hasher, capacity, CHAN_CACHE_LRU);
+}
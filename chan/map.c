@@ -1,14 +1,49 @@
 #include "map.h"
+#include "bloom.h"
+
+#include <assert.h>
+
+// Refills the filter with the keys of the map, first making room for twice as
+// many if they do not fit. Also drops the bits of removed keys.
+static void
+rebuild_bloom(struct chan_map *s)
+{
+    const size_t size = s->vtable->size(s);
+    if (size > chan_bloom_capacity(s->bloom)) chan_bloom_resize(s->bloom, 2 * size);
+    else chan_bloom_clear(s->bloom);
+    struct chan_map_iter iter = s->vtable->iter_new(s);
+    struct chan_map_iter_item *item;
+    while ((item = s->vtable->iter_next(s, &iter))) chan_bloom_add(s->bloom, item->key);
+}
+
+// Called after `key` has been inserted.
+static void
+bloom_add(struct chan_map *s, void *key)
+{
+    if (!s->bloom) return;
+    if (s->vtable->size(s) > chan_bloom_capacity(s->bloom)) rebuild_bloom(s);
+    else chan_bloom_add(s->bloom, key);
+}
 
 void
 chan_map_free(struct chan_map *s)
 {
+    if (s->bloom) chan_bloom_free(s->bloom);
     s->vtable->free(s);
 }
 
+struct chan_map*
+chan_map_clone(const struct chan_map *s)
+{
+    struct chan_map *clone = s->vtable->clone(s);
+    clone->bloom = s->bloom ? chan_bloom_clone(s->bloom) : NULL;
+    return clone;
+}
+
 void
 chan_map_clear(struct chan_map *s)
 {
+    if (s->bloom) chan_bloom_clear(s->bloom);
     s->vtable->clear(s);
 }
 
@@ -22,14 +57,42 @@ void
 chan_map_insert(struct chan_map *s, void *key, void *value)
 {
     s->vtable->insert(s, key, value);
+    bloom_add(s, key);
+}
+
+void*
+chan_map_get_or_insert(struct chan_map *s, void *key, void *default_value, bool *inserted)
+{
+    bool key_inserted;
+    void *value = s->vtable->get_or_insert(s, key, default_value, &key_inserted);
+    if (key_inserted) bloom_add(s, key);
+    if (inserted) *inserted = key_inserted;
+    return value;
+}
+
+void
+chan_map_upsert(struct chan_map *s, void *key, void *value, void (*combine)(void *existing, void *value))
+{
+    bool inserted;
+    void *existing = chan_map_get_or_insert(s, key, value, &inserted);
+    if (!inserted) combine(existing, value);
 }
 
 void*
 chan_map_at(const struct chan_map *s, void *key)
 {
+    if (s->bloom && !chan_bloom_may_contain(s->bloom, key)) return NULL;
     return s->vtable->at(s, key);
 }
 
+void
+chan_map_set_bloom(struct chan_map *s, struct chan_bloom *bloom)
+{
+    if (s->bloom) chan_bloom_free(s->bloom);
+    s->bloom = bloom;
+    if (bloom) rebuild_bloom(s);
+}
+
 void
 chan_map_remove(struct chan_map *s, void *key)
 {
@@ -48,6 +111,148 @@ chan_map_iter_next(const struct chan_map *s, struct chan_map_iter *iter)
     return s->vtable->iter_next(s, iter);
 }
 
+struct chan_map_iter_block*
+chan_map_iter_next_block(const struct chan_map *s, struct chan_map_iter *iter)
+{
+    return s->vtable->iter_next_block(s, iter);
+}
+
+const void*
+chan_map_keys_data(const struct chan_map *s, size_t *n)
+{
+    assert(s->vtable->keys_data && "keys are not contiguous");
+    *n = s->vtable->size(s);
+    return s->vtable->keys_data(s);
+}
+
+const void*
+chan_map_values_data(const struct chan_map *s, size_t *n)
+{
+    *n = s->vtable->size(s);
+    return s->vtable->values_data(s);
+}
+
+void*
+chan_map_writable_values_data(struct chan_map *s, size_t *n)
+{
+    *n = s->vtable->size(s);
+    return s->vtable->writable_values_data(s);
+}
+
+struct chan_map_iter
+chan_map_lower_bound(const struct chan_map *s, void *key)
+{
+    assert(s->vtable->lower_bound && "map is not ordered");
+    return s->vtable->lower_bound(s, key);
+}
+
+struct chan_map_iter
+chan_map_upper_bound(const struct chan_map *s, void *key)
+{
+    assert(s->vtable->upper_bound && "map is not ordered");
+    return s->vtable->upper_bound(s, key);
+}
+
+struct chan_map_iter
+chan_map_iter_range(const struct chan_map *s, void *lo, void *hi)
+{
+    assert(s->vtable->iter_range && "map is not ordered");
+    return s->vtable->iter_range(s, lo, hi);
+}
+
+struct chan_map_iter
+chan_map_select(const struct chan_map *s, size_t k)
+{
+    assert(s->vtable->select && "map is not ordered");
+    return s->vtable->select(s, k);
+}
+
+size_t
+chan_map_rank(const struct chan_map *s, void *key)
+{
+    assert(s->vtable->rank && "map is not ordered");
+    return s->vtable->rank(s, key);
+}
+
+void
+chan_map_merge(
+    struct chan_map *dst,
+    const struct chan_map *src,
+    void (*combine)(void *dst_value, void *src_value)
+) {
+    if (dst->vtable->merge && dst->vtable == src->vtable) {
+        dst->vtable->merge(dst, src, combine);
+        if (dst->bloom) rebuild_bloom(dst);
+        return;
+    }
+    struct chan_map_iter iter = src->vtable->iter_new(src);
+    struct chan_map_iter_item *item;
+    while ((item = src->vtable->iter_next(src, &iter))) {
+        if (combine) chan_map_upsert(dst, item->key, item->value, combine);
+        else chan_map_insert(dst, item->key, item->value);
+    }
+}
+
+static struct chan_map*
+set_op(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    enum chan_set_op op,
+    void (*combine)(void*, void*)
+) {
+    assert(a->vtable->set_op && "map is not ordered");
+    assert(a->vtable == b->vtable && "maps are of different types");
+    return a->vtable->set_op(a, b, op, combine);
+}
+
+struct chan_map*
+chan_map_union(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    void (*combine)(void *a_value, void *b_value)
+) {
+    return set_op(a, b, CHAN_SET_UNION, combine);
+}
+
+struct chan_map*
+chan_map_intersection(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    void (*combine)(void *a_value, void *b_value)
+) {
+    return set_op(a, b, CHAN_SET_INTERSECTION, combine);
+}
+
+struct chan_map*
+chan_map_difference(const struct chan_map *a, const struct chan_map *b)
+{
+    return set_op(a, b, CHAN_SET_DIFFERENCE, NULL);
+}
+
+struct chan_memory_usage
+chan_map_memory_usage(const struct chan_map *s)
+{
+    struct chan_memory_usage usage = s->vtable->memory_usage(s);
+    if (s->bloom) {
+        const struct chan_memory_usage bloom_usage = chan_bloom_memory_usage(s->bloom);
+        usage.allocated += bloom_usage.allocated;
+        usage.used += bloom_usage.used;
+    }
+    return usage;
+}
+
+void
+chan_map_shrink_to_fit(struct chan_map *s)
+{
+    s->vtable->shrink_to_fit(s);
+}
+
+void
+chan_map_set_growth(struct chan_map *s, struct chan_growth growth)
+{
+    s->growth = growth;
+}
+
 void
 chan_map_debug_print(
     const struct chan_map *s,
@@ -56,3 +261,14 @@ chan_map_debug_print(
 ) {
     s->vtable->debug_print(s, print_key, print_value);
 }
+
+struct chan_stats
+chan_map_stats(const struct chan_map *s)
+{
+#ifdef CHAN_STATS
+    return s->stats;
+#else
+    struct chan_stats stats = { 0 };
+    return stats;
+#endif
+}
@@ -3,8 +3,19 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "growth.h"
+#include "stats.h"
+
+struct chan_bloom;
+
 struct chan_map {
     const struct chan_map_vtable * const vtable;
+    // Optional filter in front of `chan_map_at()`, see `chan_map_set_bloom()`.
+    struct chan_bloom *bloom;
+    struct chan_growth growth;
+#ifdef CHAN_STATS
+    struct chan_stats stats;
+#endif
 };
 
 // Value from the map iterator. Iterator is finished if key == NULL.
@@ -13,23 +24,63 @@ struct chan_map_iter_item {
     void *value;
 };
 
+// Contiguous run of `size` keys and values from the block iterator, in the
+// same order as the item iterator would yield them. Iterator is finished if
+// the returned pointer is NULL.
+struct chan_map_iter_block {
+    void *keys;
+    void *values;
+    size_t size;
+};
+
 // Iterator status.
 struct chan_map_iter {
     size_t ind;
+    // Ordered maps: position where a range iterator stops.
+    size_t end;
     // Storing the yielded value here allows returning it as pointer and
     // making the API for iterating in a loop nicer.
     struct chan_map_iter_item map_iter_item;
+    struct chan_map_iter_block map_iter_block;
+};
+
+enum chan_set_op {
+    CHAN_SET_UNION,
+    CHAN_SET_INTERSECTION,
+    CHAN_SET_DIFFERENCE,
 };
 
 struct chan_map_vtable {
     void (*free)(struct chan_map*);
+    struct chan_map* (*clone)(const struct chan_map*);
     void (*clear)(struct chan_map*);
     size_t (*size)(const struct chan_map*);
     void (*insert)(struct chan_map*, void*, void*);
+    void* (*get_or_insert)(struct chan_map*, void*, void*, bool*);
     void* (*at)(const struct chan_map*, void*);
     void (*remove)(struct chan_map*, void*);
     struct chan_map_iter (*iter_new)(const struct chan_map*);
     struct chan_map_iter_item* (*iter_next)(const struct chan_map*, struct chan_map_iter*);
+    struct chan_map_iter_block* (*iter_next_block)(const struct chan_map*, struct chan_map_iter*);
+    // NULL for maps whose keys are not stored in one array.
+    const void* (*keys_data)(const struct chan_map*);
+    const void* (*values_data)(const struct chan_map*);
+    void* (*writable_values_data)(struct chan_map*);
+    // NULL for maps that are not ordered.
+    struct chan_map_iter (*lower_bound)(const struct chan_map*, void*);
+    struct chan_map_iter (*upper_bound)(const struct chan_map*, void*);
+    struct chan_map_iter (*iter_range)(const struct chan_map*, void*, void*);
+    struct chan_map_iter (*select)(const struct chan_map*, size_t);
+    size_t (*rank)(const struct chan_map*, void*);
+    void (*merge)(struct chan_map*, const struct chan_map*, void (*)(void*, void*));
+    struct chan_map* (*set_op)(
+        const struct chan_map*,
+        const struct chan_map*,
+        enum chan_set_op,
+        void (*)(void*, void*)
+    );
+    struct chan_memory_usage (*memory_usage)(const struct chan_map*);
+    void (*shrink_to_fit)(struct chan_map*);
     void (*debug_print)(
         const struct chan_map*,
         int (*print_key)(char *dest, int n, void *a),
@@ -38,25 +89,103 @@ struct chan_map_vtable {
 };
 
 void chan_map_free(struct chan_map *s);
+// Returns an independent copy of the map in O(1), eg a snapshot for readers
+// while the original keeps changing. The copies share storage until either
+// one is modified, which first copies the arrays it writes to, or only their
+// touched chunks past `chan_growth.chunk_threshold`. While shared,
+// values must not be written through pointers from `chan_map_at()` or the
+// iterators.
+struct chan_map *chan_map_clone(const struct chan_map *s);
 void chan_map_clear(struct chan_map *s);
 size_t chan_map_size(const struct chan_map *s);
 void chan_map_insert(struct chan_map *s, void *key, void *value);
+// Returns pointer to the value of `key`, first inserting `default_value` for
+// it if the key is absent. Sets `inserted` (if not NULL) to whether the key
+// was inserted. Searches for the key only once.
+void* chan_map_get_or_insert(struct chan_map *s, void *key, void *default_value, bool *inserted);
+// Inserts `value` for an absent key, otherwise calls `combine(existing, value)`
+// to update the stored value in place. Searches for the key only once.
+void chan_map_upsert(struct chan_map *s, void *key, void *value, void (*combine)(void *existing, void *value));
 void* chan_map_at(const struct chan_map *s, void *key);
+// Gives the map a Bloom filter (see bloom.h) that `chan_map_at()` consults
+// first, so that most lookups of absent keys return without searching the
+// map. The filter is filled with the current keys and kept up to date, being
+// rebuilt larger when the map outgrows it. The map takes ownership of the
+// filter. Passing NULL frees the current filter.
+void chan_map_set_bloom(struct chan_map *s, struct chan_bloom *bloom);
 void chan_map_remove(struct chan_map *s, void *key);
 struct chan_map_iter chan_map_iter_new(const struct chan_map*);
 struct chan_map_iter_item* chan_map_iter_next(const struct chan_map*, struct chan_map_iter*);
+struct chan_map_iter_block* chan_map_iter_next_block(const struct chan_map*, struct chan_map_iter*);
+// Read-only views of the arrays that hold the keys and the values, for scans
+// without a call per item. Both have `*n = chan_map_size(s)` items, and the
+// i-th value belongs to the i-th key. The order is unspecified, though keys
+// inserted into a map without removals stay in insertion order. Valid until
+// the map is modified.
+// The string hash map does not store its keys in one array and supports
+// only `chan_map_values_data()`.
+const void *chan_map_keys_data(const struct chan_map *s, size_t *n);
+const void *chan_map_values_data(const struct chan_map *s, size_t *n);
+// Same values, first copying the ones shared with clones so that they can be
+// written in place. Valid until the map is modified.
+void *chan_map_writable_values_data(struct chan_map *s, size_t *n);
+// Ordered maps only. Iterator over the keys not less than `key`.
+struct chan_map_iter chan_map_lower_bound(const struct chan_map *s, void *key);
+// Ordered maps only. Iterator over the keys greater than `key`.
+struct chan_map_iter chan_map_upper_bound(const struct chan_map *s, void *key);
+// Ordered maps only. Iterator over the keys in range [lo, hi).
+struct chan_map_iter chan_map_iter_range(const struct chan_map *s, void *lo, void *hi);
+// Ordered maps only. Iterator starting from the `k`th smallest key (from 0).
+struct chan_map_iter chan_map_select(const struct chan_map *s, size_t k);
+// Ordered maps only. Number of keys less than `key`.
+size_t chan_map_rank(const struct chan_map *s, void *key);
+// Inserts the items of `src` to `dst`. For keys in both, calls
+// `combine(dst_value, src_value)` to update the value in `dst`, or if
+// `combine` is NULL, replaces it with the `src` value. When both are ordered
+// maps of the same type this is a linear merge of the sorted sequences,
+// otherwise the items are inserted one at a time.
+void chan_map_merge(
+    struct chan_map *dst,
+    const struct chan_map *src,
+    void (*combine)(void *dst_value, void *src_value)
+);
+// Ordered maps of the same type only. Returns a new map with the keys of `a`
+// or `b`, with the keys of both, or with the keys of `a` that are not in `b`.
+// Values of keys in both are combined like in `chan_map_merge()`. Linear in
+// the sizes, or about `m log(n / m)` for intersection and difference when one
+// map is much smaller.
+struct chan_map *chan_map_union(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    void (*combine)(void *a_value, void *b_value)
+);
+struct chan_map *chan_map_intersection(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    void (*combine)(void *a_value, void *b_value)
+);
+struct chan_map *chan_map_difference(const struct chan_map *a, const struct chan_map *b);
 void chan_map_debug_print(
     const struct chan_map *s,
     int (*print_key)(char *dest, int n, void *a),
     int (*print_value)(char *dest, int n, void *a)
 );
+struct chan_memory_usage chan_map_memory_usage(const struct chan_map *s);
+// Releases unused capacity, eg after `chan_map_clear()`.
+void chan_map_shrink_to_fit(struct chan_map *s);
+// Sets how the arrays of the map grow, effective from their next resize.
+void chan_map_set_growth(struct chan_map *s, struct chan_growth growth);
+// Counters collected when built with `CHAN_STATS`, zeros otherwise.
+struct chan_stats chan_map_stats(const struct chan_map *s);
 
 // The simplest possible implementation.
 // Uses just two arrays and performs searches in O(n).
 struct chan_map *chan_naive_map_new(size_t key_size, size_t value_size);
 
 // Binary Search Tree
-// Improves upon `naive` with `O(log n)` search.
+// Improves upon `naive` with `O(log n)` search. The tree is kept weight
+// balanced by rotations, so inserts, removals, bounds, `chan_map_select()`
+// and `chan_map_rank()` are `O(log n)` also for keys inserted in order.
 struct chan_map *chan_bst_map_new(
     size_t key_size,
     size_t value_size,
@@ -66,8 +195,71 @@ struct chan_map *chan_bst_map_new(
     bool (*less)(void*, void*)
 );
 
+// Adaptive radix tree over the raw key bytes, ordered as by `memcmp()`, so
+// integer keys should be stored big-endian. Inner nodes hold 4, 16, 48 or 256
+// children depending on their fan-out, and chains of single children are
+// collapsed. A lookup follows one key byte per node and compares keys only
+// once, at the leaf. Supports the ordered iterators but not
+// `chan_map_select()`, `chan_map_rank()` or the set operations. The
+// iterators keep no path, so each step searches the successor from the root,
+// visiting as many nodes as a lookup: a full iteration costs `n` lookups,
+// against amortized O(1) per step for the BST. The block iterator yields runs
+// of keys inserted in ascending order, and otherwise single keys.
+struct chan_map *chan_art_map_new(size_t key_size, size_t value_size);
+// ART maps only. Iterator over the keys that start with the `prefix_len`
+// bytes of `prefix`, in order.
+struct chan_map_iter chan_art_map_prefix(const struct chan_map *s, const void *prefix, size_t prefix_len);
+
 struct chan_map *chan_hash_map_new(
     size_t key_size,
     size_t value_size,
     size_t (*hasher)(void*)
 );
+
+// Hash map as above that also stores a copy of each key, of at most 16
+// bytes, in its bucket next to the key index. A probe then compares the keys
+// in the bucket array, so a lookup of an absent key reads no other array and
+// one of a present key reads only its value, at the cost of larger buckets.
+// The dense arrays are still used for the values and for iteration.
+struct chan_map *chan_hash_map_new_inline_keys(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*)
+);
+
+// Read-only map of the `n` distinct keys and their values from the arrays
+// `keys` and `values`, which are copied. Lookups go through a minimal perfect
+// hash function: one hash of the key bytes, one 16-bit pilot from a table of
+// about 4 bits per key, and one key comparison, without empty slots or
+// probing. Building takes up to about a microsecond per key. Returns NULL if
+// the keys are not distinct, or if no hash function was found for them,
+// which is unlikely for distinct keys. Modifying the map asserts.
+struct chan_map *chan_frozen_map_new(
+    size_t key_size,
+    size_t value_size,
+    const void *keys,
+    const void *values,
+    size_t n
+);
+
+// Frozen copy of a hash map from `chan_hash_map_new()` for lookups of a key
+// set that no longer changes. The hash map is left as it is and can be freed.
+// Returns NULL in the unlikely case that no hash function was found.
+struct chan_map *chan_hash_map_freeze(const struct chan_map *map);
+
+// Bucketized cuckoo hash map. Each key has two buckets of 8 slots, one
+// cache line each, so a lookup reads at most two buckets whatever the hasher.
+// Keys that fit in neither go to a stash that is searched linearly, which
+// only grows when many keys have equal hashes. Keys and values are stored
+// densely as in `chan_hash_map_new()`.
+struct chan_map *chan_cuckoo_map_new(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*)
+);
+
+// Hash map with NUL-terminated string keys of any length. The `void*` keys
+// of the map functions are `char*` strings. The key bytes are copied into an
+// internal arena, so the key pointers from the iterators are invalidated by
+// insertions and removals.
+struct chan_map *chan_string_hash_map_new(size_t value_size);
@@ -0,0 +1,1040 @@
+#include "map.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define ART_MAP_X86
+#include <immintrin.h>
+#endif
+
+#define CPY(dst, dst_ind, src, src_ind, item_size) \
+    memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// A child reference is either a leaf, which is the index of its key in the
+// dense arrays with `LEAF` set, or an inner node, which is the node type in
+// the next two bits and the index of the node in the pool of that type.
+#define LEAF 0x80000000u
+#define TYPE_SHIFT 29
+#define INDEX_MASK ((1u << TYPE_SHIFT) - 1)
+#define NONE UINT32_MAX
+
+// Returned by the searches when there is no such key.
+#define NOT_FOUND SIZE_MAX
+
+enum node_type {
+    NODE4,
+    NODE16,
+    NODE48,
+    NODE256,
+};
+
+// Nodes do not store the bytes of their compressed path, only its length.
+// The bytes are read from any key below the node when needed (optimistic
+// path compression), and a lookup checks the whole key at the leaf.
+struct header {
+    uint32_t prefix_len;
+    uint16_t n_children;
+};
+
+// Node4 and Node16 keep their key bytes sorted.
+struct node4 {
+    struct header h;
+    uint8_t keys[4];
+    uint32_t children[4];
+};
+
+struct node16 {
+    struct header h;
+    uint8_t keys[16];
+    uint32_t children[16];
+};
+
+// `child_index[byte]` is one more than the slot of the child, zero if none.
+struct node48 {
+    struct header h;
+    uint8_t child_index[256];
+    uint32_t children[48];
+};
+
+struct node256 {
+    struct header h;
+    uint32_t children[256];
+};
+
+static const size_t NODE_SIZES[4] = {
+    sizeof(struct node4),
+    sizeof(struct node16),
+    sizeof(struct node48),
+    sizeof(struct node256),
+};
+
+// Nodes of one type in a copy-on-write array. Freed nodes are chained
+// through `prefix_len` and reused first.
+struct pool {
+    void *data;
+    size_t size;
+    size_t capacity;
+    size_t n_free;
+    uint32_t free_head;
+};
+
+struct chan_art_map {
+    struct chan_map map;
+    size_t key_size;
+    size_t value_size;
+    // Number of keys.
+    size_t size;
+    // Number of slots in the dense key and value arrays.
+    size_t capacity;
+    void *key_data;
+    void *value_data;
+    uint32_t root;
+    struct pool pools[4];
+};
+
+static inline bool
+is_leaf(uint32_t ref)
+{
+    return ref & LEAF;
+}
+
+static inline size_t
+leaf_ind(uint32_t ref)
+{
+    return ref & ~LEAF;
+}
+
+static inline const unsigned char*
+leaf_key(const struct chan_art_map *v, uint32_t ref)
+{
+    return AT(v->key_data, leaf_ind(ref), v->key_size);
+}
+
+static inline enum node_type
+node_type(uint32_t ref)
+{
+    return (enum node_type)(ref >> TYPE_SHIFT);
+}
+
+static inline struct header*
+node_at(const struct chan_art_map *v, uint32_t ref)
+{
+    const enum node_type type = node_type(ref);
+    return AT(v->pools[type].data, ref & INDEX_MASK, NODE_SIZES[type]);
+}
+
+// Copies the chunk of a chunked pool under bytes `[from, to)` of node
+// `ref` if it is shared with a clone, see `cow.h`. The pool stays in place,
+// so pointers into it remain valid. Other pools are unshared whole by
+// `make_unique()` before any write.
+static void
+make_node_range_unique(struct chan_art_map *v, uint32_t ref, size_t from, size_t to)
+{
+    const enum node_type type = node_type(ref);
+    struct pool *pool = &v->pools[type];
+    const size_t offset = (ref & INDEX_MASK) * NODE_SIZES[type];
+    pool->data = CHAN_COW_UNSHARE_RANGE(&v->map, pool->data, pool->size * NODE_SIZES[type],
+        pool->capacity * NODE_SIZES[type], offset + from, offset + to);
+}
+
+static void
+make_node_unique(struct chan_art_map *v, uint32_t ref)
+{
+    make_node_range_unique(v, ref, 0, NODE_SIZES[node_type(ref)]);
+}
+
+// Same for `*slot`, which is the root or a child in a node.
+static void
+make_slot_unique(struct chan_art_map *v, uint32_t *slot)
+{
+    for (int type = 0; type < 4; ++type) {
+        const struct pool *pool = &v->pools[type];
+        const uintptr_t data = (uintptr_t)pool->data;
+        const uintptr_t p = (uintptr_t)slot;
+        if (p < data || p >= data + pool->capacity * NODE_SIZES[type]) continue;
+        const size_t i = (p - data) / NODE_SIZES[type];
+        const size_t from = p - data - i * NODE_SIZES[type];
+        make_node_range_unique(v, ((uint32_t)type << TYPE_SHIFT) | i, from, from + sizeof(*slot));
+        return;
+    }
+}
+
+// Makes sure that a node of each type can be allocated without moving the
+// pools, so that pointers into them stay valid during one insertion or
+// removal, which allocates at most one node.
+static void
+reserve_nodes(struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    for (int type = 0; type < 4; ++type) {
+        struct pool *pool = &v->pools[type];
+        if (pool->free_head != NONE || pool->size < pool->capacity) continue;
+        const size_t n = chan_growth_next_capacity(&map->growth, pool->size);
+        assert(n <= INDEX_MASK);
+        pool->data = CHAN_COW_REALLOC(map, pool->data, pool->capacity * NODE_SIZES[type], n * NODE_SIZES[type]);
+        pool->capacity = n;
+    }
+}
+
+static uint32_t
+new_node(struct chan_art_map *v, enum node_type type, uint32_t prefix_len)
+{
+    struct pool *pool = &v->pools[type];
+    size_t ind = pool->free_head;
+    if (ind != NONE) {
+        pool->free_head = ((struct header*)AT(pool->data, ind, NODE_SIZES[type]))->prefix_len;
+        pool->n_free--;
+    }
+    else {
+        assert(pool->size < pool->capacity);
+        ind = pool->size++;
+    }
+    const uint32_t ref = ((uint32_t)type << TYPE_SHIFT) | ind;
+    make_node_unique(v, ref);
+    struct header *h = node_at(v, ref);
+    memset(h, 0, NODE_SIZES[type]);
+    h->prefix_len = prefix_len;
+    if (type == NODE48) memset(((struct node48*)h)->children, 0xff, sizeof(((struct node48*)h)->children));
+    if (type == NODE256) memset(((struct node256*)h)->children, 0xff, sizeof(((struct node256*)h)->children));
+    return ref;
+}
+
+static void
+free_node(struct chan_art_map *v, uint32_t ref)
+{
+    struct pool *pool = &v->pools[node_type(ref)];
+    make_node_unique(v, ref);
+    node_at(v, ref)->prefix_len = pool->free_head;
+    pool->free_head = ref & INDEX_MASK;
+    pool->n_free++;
+}
+
+static uint32_t*
+find_child(const struct chan_art_map *v, uint32_t ref, uint8_t byte)
+{
+    struct header *h = node_at(v, ref);
+    switch (node_type(ref)) {
+    case NODE4: {
+        struct node4 *n = (struct node4*)h;
+        for (size_t i = 0; i < h->n_children; ++i) {
+            if (n->keys[i] == byte) return &n->children[i];
+        }
+        return NULL;
+    }
+    case NODE16: {
+        struct node16 *n = (struct node16*)h;
+#ifdef ART_MAP_X86
+        const __m128i eq = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte), _mm_loadu_si128((const __m128i*)n->keys));
+        const unsigned mask = (unsigned)_mm_movemask_epi8(eq) & ((1u << h->n_children) - 1);
+        return mask ? &n->children[__builtin_ctz(mask)] : NULL;
+#else
+        for (size_t i = 0; i < h->n_children; ++i) {
+            if (n->keys[i] == byte) return &n->children[i];
+        }
+        return NULL;
+#endif
+    }
+    case NODE48: {
+        struct node48 *n = (struct node48*)h;
+        return n->child_index[byte] ? &n->children[n->child_index[byte] - 1] : NULL;
+    }
+    case NODE256: {
+        struct node256 *n = (struct node256*)h;
+        return n->children[byte] != NONE ? &n->children[byte] : NULL;
+    }
+    }
+    return NULL;
+}
+
+// First child whose byte is greater than `byte`, or at least `byte` if
+// `inclusive`. NONE if there is none.
+static uint32_t
+child_from(const struct chan_art_map *v, uint32_t ref, unsigned byte, bool inclusive)
+{
+    struct header *h = node_at(v, ref);
+    const unsigned from = inclusive ? byte : byte + 1;
+    switch (node_type(ref)) {
+    case NODE4:
+    case NODE16: {
+        const uint8_t *keys = node_type(ref) == NODE4 ? ((struct node4*)h)->keys : ((struct node16*)h)->keys;
+        const uint32_t *children = node_type(ref) == NODE4
+            ? ((struct node4*)h)->children : ((struct node16*)h)->children;
+        for (size_t i = 0; i < h->n_children; ++i) {
+            if (keys[i] >= from) return children[i];
+        }
+        return NONE;
+    }
+    case NODE48: {
+        struct node48 *n = (struct node48*)h;
+        for (unsigned b = from; b < 256; ++b) {
+            if (n->child_index[b]) return n->children[n->child_index[b] - 1];
+        }
+        return NONE;
+    }
+    case NODE256: {
+        struct node256 *n = (struct node256*)h;
+        for (unsigned b = from; b < 256; ++b) {
+            if (n->children[b] != NONE) return n->children[b];
+        }
+        return NONE;
+    }
+    }
+    return NONE;
+}
+
+// Leaf of the smallest key below `ref`.
+static uint32_t
+min_leaf(const struct chan_art_map *v, uint32_t ref)
+{
+    while (!is_leaf(ref)) ref = child_from(v, ref, 0, true);
+    return ref;
+}
+
+
+// Fills the bytes and the references of the children in byte order and
+// returns their number.
+static size_t
+node_children(const struct chan_art_map *v, uint32_t ref, uint8_t *bytes, uint32_t *children)
+{
+    struct header *h = node_at(v, ref);
+    size_t n = 0;
+    switch (node_type(ref)) {
+    case NODE4:
+        memcpy(bytes, ((struct node4*)h)->keys, h->n_children);
+        memcpy(children, ((struct node4*)h)->children, h->n_children * sizeof(*children));
+        return h->n_children;
+    case NODE16:
+        memcpy(bytes, ((struct node16*)h)->keys, h->n_children);
+        memcpy(children, ((struct node16*)h)->children, h->n_children * sizeof(*children));
+        return h->n_children;
+    case NODE48: {
+        struct node48 *node = (struct node48*)h;
+        for (unsigned b = 0; b < 256; ++b) {
+            if (!node->child_index[b]) continue;
+            bytes[n] = b;
+            children[n++] = node->children[node->child_index[b] - 1];
+        }
+        return n;
+    }
+    case NODE256: {
+        struct node256 *node = (struct node256*)h;
+        for (unsigned b = 0; b < 256; ++b) {
+            if (node->children[b] == NONE) continue;
+            bytes[n] = b;
+            children[n++] = node->children[b];
+        }
+        return n;
+    }
+    }
+    return 0;
+}
+
+static void add_child(struct chan_art_map *v, uint32_t *slot, uint8_t byte, uint32_t child);
+
+// Replaces the node in `slot` by a node of `type` with the same children.
+static void
+change_type(struct chan_art_map *v, uint32_t *slot, enum node_type type)
+{
+    uint8_t bytes[256];
+    uint32_t children[256];
+    const uint32_t old = *slot;
+    const size_t n = node_children(v, old, bytes, children);
+    uint32_t ref = new_node(v, type, node_at(v, old)->prefix_len);
+    for (size_t i = 0; i < n; ++i) add_child(v, &ref, bytes[i], children[i]);
+    free_node(v, old);
+    make_slot_unique(v, slot);
+    *slot = ref;
+}
+
+// Adds a child to the node in `slot`, replacing the node by a bigger one if
+// it is full.
+static void
+add_child(struct chan_art_map *v, uint32_t *slot, uint8_t byte, uint32_t child)
+{
+    const uint32_t ref = *slot;
+    make_node_unique(v, ref);
+    struct header *h = node_at(v, ref);
+    switch (node_type(ref)) {
+    case NODE4:
+    case NODE16: {
+        const bool small = node_type(ref) == NODE4;
+        if (h->n_children == (small ? 4 : 16)) {
+            change_type(v, slot, small ? NODE16 : NODE48);
+            add_child(v, slot, byte, child);
+            return;
+        }
+        uint8_t *keys = small ? ((struct node4*)h)->keys : ((struct node16*)h)->keys;
+        uint32_t *children = small ? ((struct node4*)h)->children : ((struct node16*)h)->children;
+        size_t i = h->n_children;
+        for (; i > 0 && keys[i - 1] > byte; --i) {
+            keys[i] = keys[i - 1];
+            children[i] = children[i - 1];
+        }
+        keys[i] = byte;
+        children[i] = child;
+        break;
+    }
+    case NODE48: {
+        struct node48 *n = (struct node48*)h;
+        if (h->n_children == 48) {
+            change_type(v, slot, NODE256);
+            add_child(v, slot, byte, child);
+            return;
+        }
+        size_t i = 0;
+        while (n->children[i] != NONE) ++i;
+        n->children[i] = child;
+        n->child_index[byte] = i + 1;
+        break;
+    }
+    case NODE256:
+        ((struct node256*)h)->children[byte] = child;
+        break;
+    }
+    h->n_children++;
+}
+
+// Removes a child from the node in `slot`, replacing the node by a smaller
+// one if it becomes sparse, or by its only remaining child.
+static void
+remove_child(struct chan_art_map *v, uint32_t *slot, uint8_t byte)
+{
+    const uint32_t ref = *slot;
+    make_node_unique(v, ref);
+    struct header *h = node_at(v, ref);
+    switch (node_type(ref)) {
+    case NODE4:
+    case NODE16: {
+        const bool small = node_type(ref) == NODE4;
+        uint8_t *keys = small ? ((struct node4*)h)->keys : ((struct node16*)h)->keys;
+        uint32_t *children = small ? ((struct node4*)h)->children : ((struct node16*)h)->children;
+        size_t i = 0;
+        while (keys[i] != byte) ++i;
+        for (; i + 1 < h->n_children; ++i) {
+            keys[i] = keys[i + 1];
+            children[i] = children[i + 1];
+        }
+        break;
+    }
+    case NODE48: {
+        struct node48 *n = (struct node48*)h;
+        n->children[n->child_index[byte] - 1] = NONE;
+        n->child_index[byte] = 0;
+        break;
+    }
+    case NODE256:
+        ((struct node256*)h)->children[byte] = NONE;
+        break;
+    }
+    h->n_children--;
+
+    switch (node_type(ref)) {
+    case NODE4:
+        if (h->n_children == 1) {
+            // The path of the node continues in its child.
+            const uint32_t child = ((struct node4*)h)->children[0];
+            if (!is_leaf(child)) {
+                make_node_unique(v, child);
+                node_at(v, child)->prefix_len += h->prefix_len + 1;
+            }
+            free_node(v, ref);
+            make_slot_unique(v, slot);
+            *slot = child;
+        }
+        break;
+    case NODE16:
+        if (h->n_children == 3) change_type(v, slot, NODE4);
+        break;
+    case NODE48:
+        if (h->n_children == 12) change_type(v, slot, NODE16);
+        break;
+    case NODE256:
+        if (h->n_children == 37) change_type(v, slot, NODE48);
+        break;
+    }
+}
+
+// Slot that holds the leaf whose key has the same bytes as `key` at the
+// branching positions, or NULL if there is none. The caller compares the
+// whole key.
+static uint32_t*
+find_leaf_slot(const struct chan_art_map *v, const unsigned char *key)
+{
+    if (v->root == NONE) return NULL;
+    uint32_t *slot = (uint32_t*)&v->root;
+    size_t depth = 0;
+    while (!is_leaf(*slot)) {
+        depth += node_at(v, *slot)->prefix_len;
+        slot = find_child(v, *slot, key[depth]);
+        if (!slot) return NULL;
+        depth++;
+    }
+    return slot;
+}
+
+// Links `new_leaf` for `key` into the tree and returns NOT_FOUND, or if the
+// key is already in the tree, returns its index and changes nothing.
+static size_t
+insert_leaf(struct chan_map *map, const unsigned char *key, uint32_t new_leaf)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    uint32_t *slot = &v->root;
+    size_t depth = 0;
+    size_t n_nodes = 0;
+    for (;; ++n_nodes) {
+        const uint32_t ref = *slot;
+        if (ref == NONE) {
+            make_slot_unique(v, slot);
+            *slot = new_leaf;
+            return NOT_FOUND;
+        }
+        if (is_leaf(ref)) {
+            // Branch at the first byte where the keys differ.
+            const unsigned char *other = leaf_key(v, ref);
+            CHAN_STATS_ADD(map, comparisons, 1);
+            size_t i = depth;
+            while (i < v->key_size && other[i] == key[i]) ++i;
+            if (i == v->key_size) return leaf_ind(ref);
+            uint32_t node = new_node(v, NODE4, i - depth);
+            add_child(v, &node, other[i], ref);
+            add_child(v, &node, key[i], new_leaf);
+            make_slot_unique(v, slot);
+            *slot = node;
+            CHAN_STATS_MAX(map, max_depth, n_nodes + 1);
+            return NOT_FOUND;
+        }
+        struct header *h = node_at(v, ref);
+        if (h->prefix_len > 0) {
+            // Branch within the compressed path if the key leaves it.
+            const unsigned char *prefix = leaf_key(v, min_leaf(v, ref));
+            size_t i = 0;
+            while (i < h->prefix_len && prefix[depth + i] == key[depth + i]) ++i;
+            if (i < h->prefix_len) {
+                uint32_t node = new_node(v, NODE4, i);
+                make_node_unique(v, ref);
+                h->prefix_len -= i + 1;
+                add_child(v, &node, prefix[depth + i], ref);
+                add_child(v, &node, key[depth + i], new_leaf);
+                make_slot_unique(v, slot);
+                *slot = node;
+                CHAN_STATS_MAX(map, max_depth, n_nodes + 1);
+                return NOT_FOUND;
+            }
+            depth += h->prefix_len;
+        }
+        uint32_t *child = find_child(v, ref, key[depth]);
+        if (!child) {
+            add_child(v, slot, key[depth], new_leaf);
+            CHAN_STATS_MAX(map, max_depth, n_nodes);
+            return NOT_FOUND;
+        }
+        slot = child;
+        depth++;
+    }
+}
+
+// Index of the smallest key greater than `key` if `upper`, otherwise not
+// less than `key`, among the keys below `ref` whose first `depth` bytes
+// equal those of `key`. NOT_FOUND if there is none.
+static size_t
+bound_in(const struct chan_art_map *v, uint32_t ref, const unsigned char *key, size_t depth, bool upper)
+{
+    if (is_leaf(ref)) {
+        const int c = memcmp(leaf_key(v, ref) + depth, key + depth, v->key_size - depth);
+        return c > 0 || (c == 0 && !upper) ? leaf_ind(ref) : NOT_FOUND;
+    }
+    const struct header *h = node_at(v, ref);
+    if (h->prefix_len > 0) {
+        const uint32_t first = min_leaf(v, ref);
+        const int c = memcmp(leaf_key(v, first) + depth, key + depth, h->prefix_len);
+        if (c > 0) return leaf_ind(first);
+        if (c < 0) return NOT_FOUND;
+        depth += h->prefix_len;
+    }
+    const uint32_t *child = find_child(v, ref, key[depth]);
+    if (child) {
+        const size_t ind = bound_in(v, *child, key, depth + 1, upper);
+        if (ind != NOT_FOUND) return ind;
+    }
+    const uint32_t next = child_from(v, ref, key[depth], false);
+    return next == NONE ? NOT_FOUND : leaf_ind(min_leaf(v, next));
+}
+
+static size_t
+bound(const struct chan_art_map *v, const void *key, bool upper)
+{
+    return v->root == NONE ? NOT_FOUND : bound_in(v, v->root, key, 0, upper);
+}
+
+// Reallocates the key and value arrays to hold exactly `n` items.
+static void
+set_capacity(struct chan_map *map, size_t n)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    if (n == v->capacity) return;
+    assert(n >= v->size);
+    assert(n < LEAF - 1);
+    if (n == 0) {
+        chan_cow_free(v->key_data);
+        chan_cow_free(v->value_data);
+        v->key_data = NULL;
+        v->value_data = NULL;
+    }
+    else {
+        v->key_data = CHAN_COW_REALLOC(map, v->key_data, v->capacity * v->key_size, n * v->key_size);
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+        assert(v->key_data && v->value_data);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
+}
+
+// Copies the pools that are shared with a clone, unless they are chunked
+// and copied a node at a time. Called before writing, as the nodes are
+// written through pointers that a moving pool would invalidate.
+static void
+make_unique(struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    for (int type = 0; type < 4; ++type) {
+        struct pool *pool = &v->pools[type];
+        if (chan_cow_is_chunked(pool->data)) continue;
+        pool->data = CHAN_COW_UNSHARE(map, pool->data,
+            pool->size * NODE_SIZES[type], pool->capacity * NODE_SIZES[type]);
+    }
+}
+
+// Copy the part of the key and value arrays, or the value array only, that
+// is shared with a clone before item `i` is written.
+static void
+make_value_unique(struct chan_map *map, size_t i)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, i * v->value_size, (i + 1) * v->value_size);
+}
+
+static void
+make_item_unique(struct chan_map *map, size_t i)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    v->key_data = CHAN_COW_UNSHARE_RANGE(map, v->key_data, v->size * v->key_size, v->capacity * v->key_size,
+        i * v->key_size, (i + 1) * v->key_size);
+    make_value_unique(map, i);
+}
+
+static void
+chan_art_map_clear(struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    v->key_data = CHAN_COW_UNSHARE(map, v->key_data, 0, v->capacity * v->key_size);
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, 0, v->capacity * v->value_size);
+    for (int type = 0; type < 4; ++type) {
+        struct pool *pool = &v->pools[type];
+        pool->data = CHAN_COW_UNSHARE(map, pool->data, 0, pool->capacity * NODE_SIZES[type]);
+        pool->size = 0;
+        pool->n_free = 0;
+        pool->free_head = NONE;
+    }
+    v->root = NONE;
+    v->size = 0;
+}
+
+static size_t
+chan_art_map_size(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return v->size;
+}
+
+// Follows the bytes of the key without comparing keys until the leaf.
+static void*
+chan_art_map_at(const struct chan_map *map, void *key)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    const uint32_t *slot = find_leaf_slot(v, key);
+    if (!slot) return NULL;
+    CHAN_STATS_ADD(map, comparisons, 1);
+    if (memcmp(leaf_key(v, *slot), key, v->key_size) != 0) return NULL;
+    return AT(v->value_data, leaf_ind(*slot), v->value_size);
+}
+
+static void
+chan_art_map_remove(struct chan_map *map, void *key)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    assert(v->size > 0);
+    make_unique(map);
+    reserve_nodes(map);
+    const unsigned char *k = key;
+    size_t key_ind;
+    if (is_leaf(v->root)) {
+        key_ind = leaf_ind(v->root);
+        v->root = NONE;
+    }
+    else {
+        // Find the node above the leaf, which loses the child.
+        uint32_t *slot = &v->root;
+        size_t depth = node_at(v, *slot)->prefix_len;
+        uint32_t *child = find_child(v, *slot, k[depth]);
+        assert(child);
+        while (!is_leaf(*child)) {
+            slot = child;
+            depth += 1 + node_at(v, *slot)->prefix_len;
+            child = find_child(v, *slot, k[depth]);
+            assert(child);
+        }
+        key_ind = leaf_ind(*child);
+        remove_child(v, slot, k[depth]);
+    }
+    CHAN_STATS_ADD(map, comparisons, 1);
+    assert(memcmp(AT(v->key_data, key_ind, v->key_size), key, v->key_size) == 0);
+
+    // Keep the dense arrays dense by moving the last item into the gap.
+    const size_t last = v->size - 1;
+    if (key_ind != last) {
+        uint32_t *slot = find_leaf_slot(v, AT(v->key_data, last, v->key_size));
+        make_slot_unique(v, slot);
+        *slot = LEAF | key_ind;
+        make_item_unique(map, key_ind);
+        CPY(v->key_data, key_ind, v->key_data, last, v->key_size);
+        CPY(v->value_data, key_ind, v->value_data, last, v->value_size);
+    }
+    v->size--;
+}
+
+static void*
+chan_art_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    make_unique(map);
+    reserve_nodes(map);
+    const size_t key_ind = insert_leaf(map, key, LEAF | v->size);
+    if (key_ind != NOT_FOUND) {
+        // The caller may write to the value.
+        make_value_unique(map, key_ind);
+        if (inserted) *inserted = false;
+        return AT(v->value_data, key_ind, v->value_size);
+    }
+
+    // New key, already linked to the slot after the last one.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
+    }
+    make_item_unique(map, v->size);
+    CPY(v->key_data, v->size, key, 0, v->key_size);
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    v->size++;
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
+}
+
+static void
+chan_art_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    bool inserted;
+    void *slot = chan_art_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
+}
+
+// The iterators hold the index of the next key and of the key where they
+// stop. Each step searches the successor from the root, which visits as
+// many nodes as a lookup.
+static struct chan_map_iter
+iter_between(size_t ind, size_t end)
+{
+    struct chan_map_iter map_iter;
+    map_iter.ind = ind;
+    map_iter.end = end;
+    return map_iter;
+}
+
+static struct chan_map_iter
+chan_art_map_iter_new(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return iter_between(v->root == NONE ? NOT_FOUND : leaf_ind(min_leaf(v, v->root)), NOT_FOUND);
+}
+
+static struct chan_map_iter_item*
+chan_art_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    if (map_iter->ind == map_iter->end) return NULL;
+    map_iter->map_iter_item.key = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_item.value = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->ind = bound(v, map_iter->map_iter_item.key, true);
+    return &map_iter->map_iter_item;
+}
+
+// Yields runs of keys that are adjacent both in key order and in the dense
+// arrays, eg keys that were inserted in ascending order. Finding the end of
+// a run still searches the successor of each key.
+static struct chan_map_iter_block*
+chan_art_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    if (map_iter->ind == map_iter->end) return NULL;
+    const size_t first = map_iter->ind;
+    size_t n = 1;
+    size_t next = bound(v, AT(v->key_data, first, v->key_size), true);
+    while (next != map_iter->end && next == first + n) {
+        n++;
+        next = bound(v, AT(v->key_data, next, v->key_size), true);
+    }
+    map_iter->map_iter_block.keys = AT(v->key_data, first, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, first, v->value_size);
+    map_iter->map_iter_block.size = n;
+    map_iter->ind = next;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_art_map_keys_data(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_art_map_values_data(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_art_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    return v->value_data;
+}
+
+static struct chan_map_iter
+chan_art_map_lower_bound(const struct chan_map *map, void *key)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return iter_between(bound(v, key, false), NOT_FOUND);
+}
+
+static struct chan_map_iter
+chan_art_map_upper_bound(const struct chan_map *map, void *key)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    return iter_between(bound(v, key, true), NOT_FOUND);
+}
+
+static struct chan_map_iter
+chan_art_map_iter_range(const struct chan_map *map, void *lo, void *hi)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    if (memcmp(lo, hi, v->key_size) >= 0) return iter_between(NOT_FOUND, NOT_FOUND);
+    return iter_between(bound(v, lo, false), bound(v, hi, false));
+}
+
+static struct chan_memory_usage
+chan_art_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    const size_t item_size = v->key_size + v->value_size;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size;
+    usage.used = sizeof(*v) + v->size * item_size;
+    for (int type = 0; type < 4; ++type) {
+        const struct pool *pool = &v->pools[type];
+        usage.allocated += pool->capacity * NODE_SIZES[type];
+        usage.used += (pool->size - pool->n_free) * NODE_SIZES[type];
+    }
+    return usage;
+}
+
+// Copies the subtree of `ref` from the `old` pools to the pools of the map,
+// which have room for it.
+static uint32_t
+copy_subtree(struct chan_art_map *v, const struct pool *old, uint32_t ref)
+{
+    if (is_leaf(ref)) return ref;
+    const enum node_type type = node_type(ref);
+    const uint32_t copy = ((uint32_t)type << TYPE_SHIFT) | v->pools[type].size++;
+    struct header *h = node_at(v, copy);
+    memcpy(h, AT(old[type].data, ref & INDEX_MASK, NODE_SIZES[type]), NODE_SIZES[type]);
+    uint32_t *children = NULL;
+    size_t n = h->n_children;
+    switch (type) {
+    case NODE4: children = ((struct node4*)h)->children; break;
+    case NODE16: children = ((struct node16*)h)->children; break;
+    case NODE48: children = ((struct node48*)h)->children; n = 48; break;
+    case NODE256: children = ((struct node256*)h)->children; n = 256; break;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (children[i] != NONE) children[i] = copy_subtree(v, old, children[i]);
+    }
+    return copy;
+}
+
+// Copies the nodes to pools of their exact size, dropping the freed ones.
+static void
+chan_art_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    set_capacity(map, v->size);
+    struct pool old[4];
+    memcpy(old, v->pools, sizeof(old));
+    for (int type = 0; type < 4; ++type) {
+        struct pool *pool = &v->pools[type];
+        const size_t n = old[type].size - old[type].n_free;
+        pool->data = n ? CHAN_COW_REALLOC(map, NULL, 0, n * NODE_SIZES[type]) : NULL;
+        pool->size = 0;
+        pool->capacity = n;
+        pool->n_free = 0;
+        pool->free_head = NONE;
+    }
+    if (v->root != NONE) v->root = copy_subtree(v, old, v->root);
+    for (int type = 0; type < 4; ++type) chan_cow_free(old[type].data);
+}
+
+static void
+print_node(
+    const struct chan_art_map *v,
+    uint32_t ref,
+    int indent,
+    int (*print_key)(char *dest, int n, void *a),
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    static const int node_capacities[4] = { 4, 16, 48, 256 };
+    const int bufSize = 256;
+    char buf0[bufSize];
+    char buf1[bufSize];
+    if (is_leaf(ref)) {
+        print_key(buf0, bufSize, AT(v->key_data, leaf_ind(ref), v->key_size));
+        print_value(buf1, bufSize, AT(v->value_data, leaf_ind(ref), v->value_size));
+        printf("%s -> %s\n", buf0, buf1);
+        return;
+    }
+    const struct header *h = node_at(v, ref);
+    printf("node%d, prefix %u\n", node_capacities[node_type(ref)], (unsigned)h->prefix_len);
+    uint8_t bytes[256];
+    uint32_t children[256];
+    const size_t n = node_children(v, ref, bytes, children);
+    for (size_t i = 0; i < n; ++i) {
+        printf("%*s%02x: ", 2 * indent + 2, "", bytes[i]);
+        print_node(v, children[i], indent + 1, print_key, print_value);
+    }
+}
+
+static void
+chan_art_map_debug_print(
+    const struct chan_map *map,
+    int (*print_key)(char *dest, int n, void *a),
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    printf("size %zu, capacity %zu, nodes %zu/%zu/%zu/%zu\n", v->size, v->capacity,
+        v->pools[NODE4].size - v->pools[NODE4].n_free, v->pools[NODE16].size - v->pools[NODE16].n_free,
+        v->pools[NODE48].size - v->pools[NODE48].n_free, v->pools[NODE256].size - v->pools[NODE256].n_free);
+    if (v->root != NONE) print_node(v, v->root, 0, print_key, print_value);
+}
+
+static void
+chan_art_map_free(struct chan_map *map)
+{
+    assert(map);
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    chan_cow_free(v->key_data);
+    chan_cow_free(v->value_data);
+    for (int type = 0; type < 4; ++type) chan_cow_free(v->pools[type].data);
+    free(v);
+}
+
+static struct chan_map*
+chan_art_map_clone(const struct chan_map *map)
+{
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    struct chan_art_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_data = chan_cow_share(v->key_data);
+    clone->value_data = chan_cow_share(v->value_data);
+    for (int type = 0; type < 4; ++type) clone->pools[type].data = chan_cow_share(v->pools[type].data);
+    return &clone->map;
+}
+
+struct chan_map_iter
+chan_art_map_prefix(const struct chan_map *map, const void *prefix, size_t prefix_len)
+{
+    assert(map->vtable->free == chan_art_map_free && "not an ART map");
+    struct chan_art_map *v = (struct chan_art_map*)map;
+    assert(prefix_len <= v->key_size);
+    // The keys with the prefix are those between the prefix padded with
+    // 0x00 bytes and the prefix padded with 0xff bytes.
+    unsigned char lo[v->key_size + 1];
+    unsigned char hi[v->key_size + 1];
+    memcpy(lo, prefix, prefix_len);
+    memcpy(hi, prefix, prefix_len);
+    memset(lo + prefix_len, 0, v->key_size - prefix_len);
+    memset(hi + prefix_len, 0xff, v->key_size - prefix_len);
+    return iter_between(bound(v, lo, false), bound(v, hi, true));
+}
+
+struct chan_map*
+chan_art_map_new(size_t key_size, size_t value_size)
+{
+    static const struct chan_map_vtable vtable = {
+        chan_art_map_free,
+        chan_art_map_clone,
+        chan_art_map_clear,
+        chan_art_map_size,
+        chan_art_map_insert,
+        chan_art_map_get_or_insert,
+        chan_art_map_at,
+        chan_art_map_remove,
+        chan_art_map_iter_new,
+        chan_art_map_iter_next,
+        chan_art_map_iter_next_block,
+        chan_art_map_keys_data,
+        chan_art_map_values_data,
+        chan_art_map_writable_values_data,
+        chan_art_map_lower_bound,
+        chan_art_map_upper_bound,
+        chan_art_map_iter_range,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_art_map_memory_usage,
+        chan_art_map_shrink_to_fit,
+        chan_art_map_debug_print,
+    };
+    static struct chan_map map = { &vtable };
+    assert(key_size > 0);
+    struct chan_art_map *art_map = malloc(sizeof(*art_map));
+    memcpy(&art_map->map, &map, sizeof(map));
+
+    art_map->key_size = key_size;
+    art_map->value_size = value_size;
+    art_map->size = 0;
+    art_map->capacity = 0;
+    art_map->key_data = NULL;
+    art_map->value_data = NULL;
+    art_map->root = NONE;
+    for (int type = 0; type < 4; ++type) {
+        art_map->pools[type].data = NULL;
+        art_map->pools[type].size = 0;
+        art_map->pools[type].capacity = 0;
+        art_map->pools[type].n_free = 0;
+        art_map->pools[type].free_head = NONE;
+    }
+
+    return &art_map->map;
+}
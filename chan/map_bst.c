@@ -1,4 +1,5 @@
 #include "map.h"
+#include "cow.h"
 
 #include <assert.h>
 #include <stdbool.h>
@@ -16,6 +17,8 @@
 
 struct key_node {
     int children[2]; // -1 if none. Index 0 points to the smaller key, 1 == larger.
+    int parent; // -1 for the root.
+    int count; // Number of keys in the subtree, for the order statistics.
 };
 
 struct chan_bst_map {
@@ -24,145 +27,423 @@ struct chan_bst_map {
     size_t value_size;
     size_t size;
     size_t capacity;
+    int root;
     struct key_node *key_nodes;
-    size_t *key_order;
     void *key_data;
     void *value_data;
     bool (*less)(void*, void*);
 };
 
+// Iterators hold the storage index of their next node in `ind`, and of the
+// node to stop at in `end`, or `NO_NODE`.
+#define NO_NODE ((size_t)-1)
+
+#define KEY(v, i) AT((v)->key_data, i, (v)->key_size)
+
+// The tree is weight balanced by the subtree counts: neither subtree of a
+// node holds more than `DELTA` times the keys of the other, counting one
+// more in each. A single rotation restores this unless the inner grandchild
+// has at least `GAMMA` times the keys of the outer one, counted the same
+// way, which needs a double rotation. The depth is then at most about
+// `2.4 log2(n)`.
+#define DELTA 3
+#define GAMMA 2
+
+static inline int
+root_node(const struct chan_bst_map *v)
+{
+    return v->size > 0 ? v->root : -1;
+}
+
+static inline int
+subtree_count(const struct chan_bst_map *v, int i)
+{
+    return i >= 0 ? v->key_nodes[i].count : 0;
+}
+
+static inline int
+leftmost(const struct chan_bst_map *v, int i)
+{
+    while (v->key_nodes[i].children[0] >= 0) i = v->key_nodes[i].children[0];
+    return i;
+}
+
+static inline int
+first_node(const struct chan_bst_map *v)
+{
+    return v->size > 0 ? leftmost(v, v->root) : -1;
+}
+
+// Next node in key order, or -1. Amortized O(1) over a traversal.
+static inline int
+successor(const struct chan_bst_map *v, int i)
+{
+    if (v->key_nodes[i].children[1] >= 0) return leftmost(v, v->key_nodes[i].children[1]);
+    int parent = v->key_nodes[i].parent;
+    while (parent >= 0 && v->key_nodes[parent].children[1] == i) {
+        i = parent;
+        parent = v->key_nodes[i].parent;
+    }
+    return parent;
+}
+
+// Node of the key with `k` smaller keys, or -1.
+static int
+node_of_rank(const struct chan_bst_map *v, size_t k)
+{
+    if (k >= v->size) return -1;
+    int i = v->root;
+    for (;;) {
+        const size_t smaller = subtree_count(v, v->key_nodes[i].children[0]);
+        if (k == smaller) return i;
+        if (k < smaller) {
+            i = v->key_nodes[i].children[0];
+        }
+        else {
+            k -= smaller + 1;
+            i = v->key_nodes[i].children[1];
+        }
+    }
+}
+
+static inline size_t
+node_to_ind(int i)
+{
+    return i >= 0 ? (size_t)i : NO_NODE;
+}
+
+// Reallocates the per-key arrays to hold exactly `n` items.
 static void
-build_key_order(const struct key_node *key_nodes, size_t *order_ind, size_t *key_order, int i)
+set_capacity(struct chan_map *map, size_t n)
 {
-    // Depth-first traversal.
-    if (key_nodes[i].children[0] >= 0) build_key_order(key_nodes, order_ind, key_order, key_nodes[i].children[0]);
-    key_order[(*order_ind)++] = i;
-    if (key_nodes[i].children[1] >= 0) build_key_order(key_nodes, order_ind, key_order, key_nodes[i].children[1]);
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    if (n == v->capacity) return;
+    assert(n >= v->size);
+    if (n == 0) {
+        chan_cow_free(v->key_nodes);
+        chan_cow_free(v->key_data);
+        chan_cow_free(v->value_data);
+        v->key_nodes = NULL;
+        v->key_data = NULL;
+        v->value_data = NULL;
+    }
+    else {
+        v->key_nodes = CHAN_COW_REALLOC(map, v->key_nodes,
+            v->capacity * sizeof(*v->key_nodes), n * sizeof(*v->key_nodes));
+        v->key_data = CHAN_COW_REALLOC(map, v->key_data, v->capacity * v->key_size, n * v->key_size);
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+        assert(v->key_nodes && v->key_data && v->value_data);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
 }
 
+// Copy the part of an array that is shared with a clone before the links,
+// the value, or the key and value of node `i` are written.
 static void
-chan_bst_map_clear(struct chan_map *map)
+make_node_unique(struct chan_map *map, int i)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    v->size = 0;
+    v->key_nodes = CHAN_COW_UNSHARE_RANGE(map, v->key_nodes, v->size * sizeof(*v->key_nodes),
+        v->capacity * sizeof(*v->key_nodes), i * sizeof(*v->key_nodes), (i + 1) * sizeof(*v->key_nodes));
 }
 
-static size_t
-chan_bst_map_size(const struct chan_map *map)
+static void
+make_value_unique(struct chan_map *map, int i)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    return v->size;
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, i * v->value_size, (i + 1) * v->value_size);
 }
 
+static void
+make_item_unique(struct chan_map *map, int i)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    v->key_data = CHAN_COW_UNSHARE_RANGE(map, v->key_data, v->size * v->key_size, v->capacity * v->key_size,
+        i * v->key_size, (i + 1) * v->key_size);
+    make_value_unique(map, i);
+}
+
+// Moves node `c` above its parent, keeping the key order and the counts.
+static void
+rotate_up(struct chan_map *map, int c)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    const int x = v->key_nodes[c].parent;
+    const int grandparent = v->key_nodes[x].parent;
+    const int dir = v->key_nodes[x].children[1] == c;
+    const int inner = v->key_nodes[c].children[!dir];
+    make_node_unique(map, c);
+    make_node_unique(map, x);
+    v->key_nodes[x].children[dir] = inner;
+    if (inner >= 0) {
+        make_node_unique(map, inner);
+        v->key_nodes[inner].parent = x;
+    }
+    v->key_nodes[c].children[!dir] = x;
+    v->key_nodes[c].parent = grandparent;
+    if (grandparent >= 0) {
+        make_node_unique(map, grandparent);
+        v->key_nodes[grandparent].children[v->key_nodes[grandparent].children[1] == x] = c;
+    }
+    else {
+        v->root = c;
+    }
+    v->key_nodes[x].parent = c;
+    v->key_nodes[c].count = v->key_nodes[x].count;
+    v->key_nodes[x].count = subtree_count(v, v->key_nodes[x].children[0])
+        + subtree_count(v, v->key_nodes[x].children[1]) + 1;
+}
+
+// Restores the balance of node `x` after one key was added to or removed
+// from one of its subtrees, which were balanced. Returns the node that took
+// its place.
 static int
-chan_bst_map_index(const struct chan_map *map, void *key)
+rebalance(struct chan_map *map, int x)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    for (size_t i = 0; i < v->size; ++i) {
-        if (CMP(v->key_data, i, key, 0, v->key_size) == 0) {
-            return i;
+    const int weight[2] = {
+        subtree_count(v, v->key_nodes[x].children[0]) + 1,
+        subtree_count(v, v->key_nodes[x].children[1]) + 1,
+    };
+    int heavy;
+    if (weight[1] > DELTA * weight[0]) heavy = 1;
+    else if (weight[0] > DELTA * weight[1]) heavy = 0;
+    else return x;
+    int c = v->key_nodes[x].children[heavy];
+    const int inner = v->key_nodes[c].children[!heavy];
+    const int outer = v->key_nodes[c].children[heavy];
+    if (subtree_count(v, inner) + 1 >= GAMMA * (subtree_count(v, outer) + 1)) {
+        rotate_up(map, inner);
+        c = inner;
+    }
+    rotate_up(map, c);
+    return c;
+}
+
+// Adds `delta` to the counts from node `i` up to the root, rebalancing each
+// node on the way.
+static void
+update_path(struct chan_map *map, int i, int delta)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    while (i >= 0) {
+        make_node_unique(map, i);
+        v->key_nodes[i].count += delta;
+        i = v->key_nodes[rebalance(map, i)].parent;
+    }
+}
+
+// Strict "less than". The `less` function may also be "less than or equal".
+static bool
+key_less(const struct chan_map *map, void *a, void *b)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    CHAN_STATS_ADD(map, comparisons, 1);
+    return v->less(a, b) && memcmp(a, b, v->key_size) != 0;
+}
+
+// Descends to the first node whose key is not less than `key`, or if
+// `upper`, greater than `key`. Returns the node, or -1 if there is none, and
+// sets `rank` (if not NULL) to the number of keys before it.
+static int
+order_bound(const struct chan_map *map, void *key, bool upper, size_t *rank)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    int bound = -1;
+    size_t before_count = 0;
+    int i = root_node(v);
+    while (i >= 0) {
+        void *k = KEY(v, i);
+        const bool before = upper ? !key_less(map, key, k) : key_less(map, k, key);
+        if (before) {
+            before_count += subtree_count(v, v->key_nodes[i].children[0]) + 1;
+            i = v->key_nodes[i].children[1];
+        }
+        else {
+            bound = i;
+            i = v->key_nodes[i].children[0];
         }
     }
-    return -1;
+    if (rank) *rank = before_count;
+    return bound;
+}
+
+static void
+chan_bst_map_clear(struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    v->size = 0;
+}
+
+static size_t
+chan_bst_map_size(const struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    return v->size;
 }
 
 static void*
 chan_bst_map_at(const struct chan_map *map, void *key)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    if (v->size == 0) return NULL;
-    int i = 0;
+    int i = root_node(v);
     while (i >= 0) {
+        CHAN_STATS_ADD(map, comparisons, 1);
         if (CMP(v->key_data, i, key, 0, v->key_size) == 0) {
             return AT(v->value_data, i, v->value_size);
         }
+        CHAN_STATS_ADD(map, comparisons, 1);
         if (v->less(key, AT(v->key_data, i, v->key_size))) i = v->key_nodes[i].children[0];
         else i = v->key_nodes[i].children[1];
     }
     return NULL;
 }
 
+// Copies key, value and links of node `src` to the storage slot `dst`, and
+// points its children to the new slot.
 static void
-chan_bst_map_remove(struct chan_map *map, void *key)
+move_node(struct chan_map *map, int dst, int src)
 {
-    assert(false && "not implemented");
-    // Code from map_naive.
-    /*
-    const int n = chan_bst_map_index(map, key);
-    assert(n >= 0);
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    v->size--;
-    for (size_t i = n; i < v->size; ++i) {
-        CPY(v->key_data, i, v->key_data, i + 1, v->key_size);
-        CPY(v->value_data, i, v->value_data, i + 1, v->value_size);
+    make_item_unique(map, dst);
+    make_node_unique(map, dst);
+    CPY(v->key_data, dst, v->key_data, src, v->key_size);
+    CPY(v->value_data, dst, v->value_data, src, v->value_size);
+    v->key_nodes[dst] = v->key_nodes[src];
+    for (int dir = 0; dir < 2; ++dir) {
+        const int child = v->key_nodes[dst].children[dir];
+        if (child < 0) continue;
+        make_node_unique(map, child);
+        v->key_nodes[child].parent = dst;
     }
-    */
 }
 
 static void
-chan_bst_map_insert(struct chan_map *map, void *key, void *value)
+chan_bst_map_remove(struct chan_map *map, void *key)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    if (chan_bst_map_at(map, key) == NULL) {
-        // New key.
-        if (v->size >= v->capacity) {
-            const size_t n = v->size == 0 ? 4 : 3 * v->size / 2;
-            v->key_nodes = realloc(v->key_nodes, n * sizeof(*v->key_nodes));
-            v->key_order = realloc(v->key_order, n * sizeof(*v->key_order));
-            v->key_data = realloc(v->key_data, n * sizeof(v->key_size));
-            v->value_data = realloc(v->value_data, n * sizeof(v->value_size));
-            v->capacity = n;
+    int i = root_node(v);
+    while (i >= 0) {
+        CHAN_STATS_ADD(map, comparisons, 1);
+        if (CMP(v->key_data, i, key, 0, v->key_size) == 0) break;
+        CHAN_STATS_ADD(map, comparisons, 1);
+        i = v->key_nodes[i].children[!v->less(key, AT(v->key_data, i, v->key_size))];
+    }
+    assert(i >= 0);
+
+    // With two children, take over the successor's key and value, and
+    // remove the successor node instead. It has no smaller child.
+    if (v->key_nodes[i].children[0] >= 0 && v->key_nodes[i].children[1] >= 0) {
+        const int s = leftmost(v, v->key_nodes[i].children[1]);
+        make_item_unique(map, i);
+        CPY(v->key_data, i, v->key_data, s, v->key_size);
+        CPY(v->value_data, i, v->value_data, s, v->value_size);
+        i = s;
+    }
+    // Unlink the node, which has at most one child, and rebalance above it.
+    const int parent = v->key_nodes[i].parent;
+    const int child = v->key_nodes[i].children[v->key_nodes[i].children[0] < 0];
+    if (parent >= 0) {
+        make_node_unique(map, parent);
+        v->key_nodes[parent].children[v->key_nodes[parent].children[1] == i] = child;
+    }
+    else {
+        v->root = child;
+    }
+    if (child >= 0) {
+        make_node_unique(map, child);
+        v->key_nodes[child].parent = parent;
+    }
+    update_path(map, parent, -1);
+
+    // Keep the storage dense by moving the last node to the freed slot.
+    const int last = v->size - 1;
+    if (i != last) {
+        const int last_parent = v->key_nodes[last].parent;
+        if (last_parent >= 0) {
+            make_node_unique(map, last_parent);
+            v->key_nodes[last_parent].children[v->key_nodes[last_parent].children[1] == last] = i;
         }
-        assert(v->value_data);
-        CPY(v->key_data, v->size, key, 0, v->key_size);
-        CPY(v->value_data, v->size, value, 0, v->value_size);
-        v->key_nodes[v->size].children[0] = -1;
-        v->key_nodes[v->size].children[1] = -1;
-        // If existing tree, add as child to some node.
-        if (v->size >= 1) {
-            int i = 0;
-            int valid_i = 0;
-            bool isLess;
-            while (i >= 0) {
-                valid_i = i;
-                isLess = v->less(key, AT(v->key_data, i, v->key_size));
-                if (isLess) i = v->key_nodes[i].children[0];
-                else i = v->key_nodes[i].children[1];
-            }
-            v->key_nodes[valid_i].children[!isLess] = v->size;
+        else {
+            v->root = i;
+        }
+        move_node(map, i, last);
+    }
+    v->size--;
+}
+
+static void*
+chan_bst_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    // Single descent that either finds the key or the node to attach it to.
+    int i = root_node(v);
+    int parent = -1;
+    bool isLess = false;
+    size_t depth = 0;
+    while (i >= 0) {
+        CHAN_STATS_ADD(map, comparisons, 1);
+        if (CMP(v->key_data, i, key, 0, v->key_size) == 0) {
+            // The caller may write to the value.
+            make_value_unique(map, i);
+            if (inserted) *inserted = false;
+            return AT(v->value_data, i, v->value_size);
         }
+        CHAN_STATS_ADD(map, comparisons, 1);
+        parent = i;
+        isLess = v->less(key, AT(v->key_data, i, v->key_size));
+        if (isLess) i = v->key_nodes[i].children[0];
+        else i = v->key_nodes[i].children[1];
+        depth++;
+    }
 
-        // Rebuild key order for iterators.
-        //
-        // Iterators could also maintain their own state to avoid this, but it
-        // seems like either:
-        // * The iterator would need to make an allocation to remember the path it has traversed,
-        //   which is bad because then it requires a function call to free the memory.
-        // * New "parent" field would be added to `key_node` so that some kind of simple state
-        //   with few variables might allow traversing the tree(?).
-        // * The data should be stored in sorted order to begin with, an then simple index would
-        //   suffice as state.
-        // * A fancy state would be need for a solution that "yields" the iterator elements by
-        //   taking steps through the data together with the caller.
-        size_t order_ind = 0;
-        build_key_order(v->key_nodes, &order_ind, v->key_order, 0);
-
-        v->size++;
-        assert(order_ind == v->size);
+    // New key.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
+    }
+    make_item_unique(map, v->size);
+    make_node_unique(map, v->size);
+    CPY(v->key_data, v->size, key, 0, v->key_size);
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    v->key_nodes[v->size].children[0] = -1;
+    v->key_nodes[v->size].children[1] = -1;
+    v->key_nodes[v->size].parent = parent;
+    v->key_nodes[v->size].count = 1;
+    // If existing tree, add as child to the last visited node, and count the
+    // new key in the subtrees on the path.
+    if (parent >= 0) {
+        make_node_unique(map, parent);
+        v->key_nodes[parent].children[!isLess] = v->size;
     }
     else {
-        // Replace existing key.
-        const int i = chan_bst_map_index(map, key);
-        CPY(v->key_data, i, key, 0, v->key_size);
-        CPY(v->value_data, i, value, 0, v->value_size);
+        v->root = v->size;
     }
+    CHAN_STATS_MAX(map, max_depth, depth);
+
+    v->size++;
+    update_path(map, parent, 1);
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
+}
+
+static void
+chan_bst_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    bool inserted;
+    void *slot = chan_bst_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
 }
 
 static struct chan_map_iter
 chan_bst_map_iter_new(const struct chan_map *map)
 {
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
     struct chan_map_iter map_iter;
-    map_iter.ind = 0;
+    map_iter.ind = node_to_ind(first_node(v));
+    map_iter.end = NO_NODE;
     return map_iter;
 }
 
@@ -170,15 +451,262 @@ static struct chan_map_iter_item*
 chan_bst_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
 {
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    if (map_iter->ind >= v->size) return NULL;
+    if (map_iter->ind == NO_NODE || map_iter->ind == map_iter->end) return NULL;
 
-    const size_t ind = v->key_order[map_iter->ind];
-    map_iter->map_iter_item.key = AT(v->key_data, ind, v->key_size);
-    map_iter->map_iter_item.value = AT(v->value_data, ind, v->value_size);
-    map_iter->ind++;
+    const int i = (int)map_iter->ind;
+    map_iter->map_iter_item.key = AT(v->key_data, i, v->key_size);
+    map_iter->map_iter_item.value = AT(v->value_data, i, v->value_size);
+    map_iter->ind = node_to_ind(successor(v, i));
     return &map_iter->map_iter_item;
 }
 
+// Yields runs of keys that are adjacent both in key order and in storage,
+// eg keys that were inserted in ascending order.
+static struct chan_map_iter_block*
+chan_bst_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    if (map_iter->ind == NO_NODE || map_iter->ind == map_iter->end) return NULL;
+
+    const int first = (int)map_iter->ind;
+    size_t n = 1;
+    size_t next = node_to_ind(successor(v, first));
+    while (next != map_iter->end && next == (size_t)first + n) {
+        n++;
+        next = node_to_ind(successor(v, (int)next));
+    }
+    map_iter->map_iter_block.keys = AT(v->key_data, first, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, first, v->value_size);
+    map_iter->map_iter_block.size = n;
+    map_iter->ind = next;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_bst_map_keys_data(const struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_bst_map_values_data(const struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_bst_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    return v->value_data;
+}
+
+// The bounds are found by descending the tree, after which the iterators
+// follow the links to the successors, in amortized O(1) each.
+static struct chan_map_iter
+chan_bst_map_lower_bound(const struct chan_map *map, void *key)
+{
+    struct chan_map_iter map_iter = chan_bst_map_iter_new(map);
+    map_iter.ind = node_to_ind(order_bound(map, key, false, NULL));
+    return map_iter;
+}
+
+static struct chan_map_iter
+chan_bst_map_upper_bound(const struct chan_map *map, void *key)
+{
+    struct chan_map_iter map_iter = chan_bst_map_iter_new(map);
+    map_iter.ind = node_to_ind(order_bound(map, key, true, NULL));
+    return map_iter;
+}
+
+static struct chan_map_iter
+chan_bst_map_iter_range(const struct chan_map *map, void *lo, void *hi)
+{
+    struct chan_map_iter map_iter = chan_bst_map_iter_new(map);
+    size_t lo_rank, hi_rank;
+    map_iter.ind = node_to_ind(order_bound(map, lo, false, &lo_rank));
+    map_iter.end = node_to_ind(order_bound(map, hi, false, &hi_rank));
+    if (hi_rank <= lo_rank) map_iter.ind = NO_NODE;
+    return map_iter;
+}
+
+// Selecting and ranking descend the tree, using the counts of keys in the
+// subtrees.
+static struct chan_map_iter
+chan_bst_map_select(const struct chan_map *map, size_t k)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    struct chan_map_iter map_iter = chan_bst_map_iter_new(map);
+    map_iter.ind = node_to_ind(node_of_rank(v, k));
+    return map_iter;
+}
+
+static size_t
+chan_bst_map_rank(const struct chan_map *map, void *key)
+{
+    size_t rank;
+    order_bound(map, key, false, &rank);
+    return rank;
+}
+
+// Sizes of maps beyond which set operations skip through the larger map by
+// descending it.
+#define GALLOP_RATIO 8
+
+static int
+build_balanced_subtree(struct chan_bst_map *v, size_t lo, size_t hi, int parent, size_t depth)
+{
+    if (lo >= hi) return -1;
+    const size_t mid = lo + (hi - lo) / 2;
+    const int i = mid;
+    CHAN_STATS_MAX(&v->map, max_depth, depth);
+    v->key_nodes[i].children[0] = build_balanced_subtree(v, lo, mid, i, depth + 1);
+    v->key_nodes[i].children[1] = build_balanced_subtree(v, mid + 1, hi, i, depth + 1);
+    v->key_nodes[i].parent = parent;
+    v->key_nodes[i].count = hi - lo;
+    return i;
+}
+
+// Turns keys and values stored in sorted order into a balanced tree.
+static void
+build_balanced(struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    if (v->size == 0) return;
+    v->root = build_balanced_subtree(v, 0, v->size, -1, 0);
+}
+
+// Appends the item of node `i` of `src`.
+static inline void
+append_node(struct chan_bst_map *out, const struct chan_bst_map *src, int i)
+{
+    CPY(out->key_data, out->size, src->key_data, i, out->key_size);
+    CPY(out->value_data, out->size, src->value_data, i, out->value_size);
+    out->size++;
+}
+
+// Writes the result of `op` on `a` and `b` to the empty map `out` in sorted
+// order. Walks the two in-order sequences in step, or if one map is much
+// smaller, walks it and skips through the other with `order_bound()`.
+static void
+merge_sorted(
+    struct chan_map *out,
+    const struct chan_map *a,
+    const struct chan_map *b,
+    enum chan_set_op op,
+    void (*combine)(void*, void*)
+) {
+    struct chan_bst_map *o = (struct chan_bst_map*)out;
+    const struct chan_bst_map *va = (const struct chan_bst_map*)a;
+    const struct chan_bst_map *vb = (const struct chan_bst_map*)b;
+    assert(va->key_size == vb->key_size && va->value_size == vb->value_size);
+    const size_t na = va->size;
+    const size_t nb = vb->size;
+    const size_t n = op == CHAN_SET_UNION ? na + nb
+        : op == CHAN_SET_INTERSECTION ? (na < nb ? na : nb)
+        : na;
+    set_capacity(out, n);
+    const bool gallop_a = na >= GALLOP_RATIO * nb;
+    const bool gallop_b = nb >= GALLOP_RATIO * na;
+    int i = first_node(va);
+    int j = first_node(vb);
+    while (i >= 0 && j >= 0) {
+        void *ka = KEY(va, i);
+        void *kb = KEY(vb, j);
+        if (key_less(a, ka, kb)) {
+            const int end = gallop_a && op == CHAN_SET_INTERSECTION
+                ? order_bound(a, kb, false, NULL) : successor(va, i);
+            if (op != CHAN_SET_INTERSECTION) {
+                for (; i != end; i = successor(va, i)) append_node(o, va, i);
+            }
+            i = end;
+        }
+        else if (key_less(a, kb, ka)) {
+            const int end = gallop_b && op != CHAN_SET_UNION
+                ? order_bound(b, ka, false, NULL) : successor(vb, j);
+            if (op == CHAN_SET_UNION) {
+                for (; j != end; j = successor(vb, j)) append_node(o, vb, j);
+            }
+            j = end;
+        }
+        else {
+            if (op != CHAN_SET_DIFFERENCE) {
+                void *value = AT(vb->value_data, j, vb->value_size);
+                if (combine) {
+                    append_node(o, va, i);
+                    combine(AT(o->value_data, o->size - 1, o->value_size), value);
+                }
+                else {
+                    append_node(o, vb, j);
+                }
+            }
+            i = successor(va, i);
+            j = successor(vb, j);
+        }
+    }
+    if (op != CHAN_SET_INTERSECTION) {
+        for (; i >= 0; i = successor(va, i)) append_node(o, va, i);
+    }
+    if (op == CHAN_SET_UNION) {
+        for (; j >= 0; j = successor(vb, j)) append_node(o, vb, j);
+    }
+    build_balanced(out);
+}
+
+static struct chan_map*
+chan_bst_map_set_op(
+    const struct chan_map *a,
+    const struct chan_map *b,
+    enum chan_set_op op,
+    void (*combine)(void*, void*)
+) {
+    const struct chan_bst_map *v = (const struct chan_bst_map*)a;
+    struct chan_map *out = chan_bst_map_new(v->key_size, v->value_size, v->less);
+    merge_sorted(out, a, b, op, combine);
+    return out;
+}
+
+static void
+chan_bst_map_merge(struct chan_map *dst, const struct chan_map *src, void (*combine)(void*, void*))
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)dst;
+    struct chan_map *out = chan_bst_map_new(v->key_size, v->value_size, v->less);
+    merge_sorted(out, dst, src, CHAN_SET_UNION, combine);
+    // Take over the arrays of the result.
+    struct chan_bst_map *o = (struct chan_bst_map*)out;
+    v->size = 0;
+    set_capacity(dst, 0);
+    v->size = o->size;
+    v->capacity = o->capacity;
+    v->root = o->root;
+    v->key_nodes = o->key_nodes;
+    v->key_data = o->key_data;
+    v->value_data = o->value_data;
+    free(o);
+}
+
+static struct chan_memory_usage
+chan_bst_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    const size_t item_size = v->key_size + v->value_size
+        + sizeof(*v->key_nodes);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size;
+    usage.used = sizeof(*v) + v->size * item_size;
+    return usage;
+}
+
+static void
+chan_bst_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    set_capacity(map, v->size);
+}
+
 static void
 chan_bst_map_debug_print(
     const struct chan_map *map,
@@ -206,12 +734,27 @@ chan_bst_map_free(struct chan_map *map)
     chan_bst_map_clear(map);
 
     struct chan_bst_map *v = (struct chan_bst_map*)map;
-    if (v->key_nodes) free(v->key_nodes);
-    if (v->key_data) free(v->key_data);
-    if (v->value_data) free(v->value_data);
+    chan_cow_free(v->key_nodes);
+    chan_cow_free(v->key_data);
+    chan_cow_free(v->value_data);
     free(v);
 }
 
+static struct chan_map*
+chan_bst_map_clone(const struct chan_map *map)
+{
+    struct chan_bst_map *v = (struct chan_bst_map*)map;
+    struct chan_bst_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_nodes = chan_cow_share(v->key_nodes);
+    clone->key_data = chan_cow_share(v->key_data);
+    clone->value_data = chan_cow_share(v->value_data);
+    return &clone->map;
+}
+
 struct chan_map*
 chan_bst_map_new(
     size_t key_size,
@@ -220,13 +763,28 @@ chan_bst_map_new(
 ) {
     static const struct chan_map_vtable vtable = {
         chan_bst_map_free,
+        chan_bst_map_clone,
         chan_bst_map_clear,
         chan_bst_map_size,
         chan_bst_map_insert,
+        chan_bst_map_get_or_insert,
         chan_bst_map_at,
         chan_bst_map_remove,
         chan_bst_map_iter_new,
         chan_bst_map_iter_next,
+        chan_bst_map_iter_next_block,
+        chan_bst_map_keys_data,
+        chan_bst_map_values_data,
+        chan_bst_map_writable_values_data,
+        chan_bst_map_lower_bound,
+        chan_bst_map_upper_bound,
+        chan_bst_map_iter_range,
+        chan_bst_map_select,
+        chan_bst_map_rank,
+        chan_bst_map_merge,
+        chan_bst_map_set_op,
+        chan_bst_map_memory_usage,
+        chan_bst_map_shrink_to_fit,
         chan_bst_map_debug_print,
     };
     static struct chan_map map = { &vtable };
@@ -237,8 +795,8 @@ chan_bst_map_new(
     bst_map->value_size = value_size;
     bst_map->size = 0;
     bst_map->capacity = 0;
+    bst_map->root = -1;
     bst_map->key_nodes = NULL;
-    bst_map->key_order = NULL;
     bst_map->key_data = NULL;
     bst_map->value_data = NULL;
     bst_map->less = less;
@@ -0,0 +1,662 @@
+#include "map.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Slots per bucket. A bucket is one cache line.
+#define SLOTS 8
+#define BUCKET_BYTES 64
+
+// Smallest non-zero number of buckets. Always a power of two.
+static const size_t MIN_BUCKETS = 2;
+
+// The bucket array is doubled when more than 9/10 of the slots would be in
+// use. Buckets of 8 slots rarely fail an insertion below that.
+#define MAX_LOAD_NUM 9
+#define MAX_LOAD_DEN 10
+
+// Length of the random walk of evictions before an insertion gives up and
+// puts the key in the stash.
+#define MAX_KICKS 128
+
+// The bucket array is doubled when the stash grows past this, unless it is
+// less than half full, in which case the keys are in the stash because
+// their hashes are equal and more buckets would not help.
+#define MAX_STASH 4
+
+#define EMPTY UINT32_MAX
+
+#define CPY(dst, dst_ind, src, src_ind, item_size) \
+    memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define CMP(dst, dst_ind, src, src_ind, item_size) \
+    memcmp((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// The tags are the high hash bits of the keys, compared before the keys. A
+// slot is empty if its key index is `EMPTY`.
+struct bucket {
+    uint32_t tags[SLOTS];
+    uint32_t key_inds[SLOTS];
+};
+
+struct chan_cuckoo_map {
+    struct chan_map map;
+    size_t key_size;
+    size_t value_size;
+    // Number of keys.
+    size_t size;
+    // Number of slots in the dense key and value arrays.
+    size_t capacity;
+    void *key_data;
+    void *value_data;
+    // Number of buckets, zero or a power of two. `buckets` is
+    // `bucket_allocation` aligned to a cache line. The allocation is a
+    // copy-on-write buffer shared with clones.
+    size_t n_buckets;
+    void *bucket_allocation;
+    struct bucket *buckets;
+    // Indices of the keys that did not fit in their buckets.
+    uint32_t *stash;
+    size_t stash_size;
+    size_t stash_capacity;
+    // State of the xorshift that picks the slots to evict.
+    uint64_t random;
+    size_t (*hasher)(void*);
+};
+
+// Finalizer of splitmix64. User hashers may be as weak as the identity, and
+// both the bucket and the tag need well mixed bits.
+static inline uint64_t
+mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static inline uint64_t
+hash_key(const struct chan_cuckoo_map *v, const void *key)
+{
+    return mix((uint64_t)v->hasher((void*)key));
+}
+
+static inline uint32_t
+hash_tag(uint64_t hash)
+{
+    return (uint32_t)(hash >> 32);
+}
+
+// The two buckets of a key are `hash & mask` and the other bucket of that.
+// The other bucket depends only on the bucket and the tag, so evicted keys
+// are moved without hashing them again. It is never the same bucket.
+static inline size_t
+other_bucket(const struct chan_cuckoo_map *v, size_t b, uint32_t tag)
+{
+    return (b ^ (mix(tag) | 1)) & (v->n_buckets - 1);
+}
+
+static inline struct bucket*
+align_buckets(void *allocation)
+{
+    const uintptr_t p = (uintptr_t)allocation;
+    return (struct bucket*)((p + BUCKET_BYTES - 1) & ~(uintptr_t)(BUCKET_BYTES - 1));
+}
+
+static size_t
+bucket_allocation_size(size_t n_buckets)
+{
+    return n_buckets * sizeof(struct bucket) + BUCKET_BYTES - 1;
+}
+
+// Copies the part of the bucket array that is shared with a clone before
+// bytes `[from, to)` of the buckets are written. Other than a chunked
+// array, see `cow.h`, the whole array is copied and may be aligned
+// differently within its new allocation.
+static void
+make_buckets_unique(struct chan_map *map, size_t from, size_t to)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (chan_cow_is_chunked(v->bucket_allocation)) {
+        const size_t offset = (char*)v->buckets - (char*)v->bucket_allocation;
+        const size_t bytes = bucket_allocation_size(v->n_buckets);
+        CHAN_COW_UNSHARE_RANGE(map, v->bucket_allocation, bytes, bytes, offset + from, offset + to);
+    }
+    else if (chan_cow_is_shared(v->bucket_allocation)) {
+        void *allocation = CHAN_COW_REALLOC(map, NULL, 0, bucket_allocation_size(v->n_buckets));
+        struct bucket *buckets = align_buckets(allocation);
+        memcpy(buckets, v->buckets, v->n_buckets * sizeof(*buckets));
+        CHAN_STATS_ADD(map, cow_bytes, v->n_buckets * sizeof(*buckets));
+        chan_cow_free(v->bucket_allocation);
+        v->bucket_allocation = allocation;
+        v->buckets = buckets;
+    }
+}
+
+static void
+make_bucket_unique(struct chan_map *map, size_t b)
+{
+    make_buckets_unique(map, b * sizeof(struct bucket), (b + 1) * sizeof(struct bucket));
+}
+
+// The stash is small and copied whole.
+static void
+make_stash_unique(struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    v->stash = CHAN_COW_UNSHARE(map, v->stash,
+        v->stash_size * sizeof(*v->stash), v->stash_capacity * sizeof(*v->stash));
+}
+
+// Copy the part of the key or value array that is shared with a clone before
+// item `i` of it is written.
+static void
+make_key_unique(struct chan_map *map, size_t i)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    v->key_data = CHAN_COW_UNSHARE_RANGE(map, v->key_data, v->size * v->key_size, v->capacity * v->key_size,
+        i * v->key_size, (i + 1) * v->key_size);
+}
+
+static void
+make_value_unique(struct chan_map *map, size_t i)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, i * v->value_size, (i + 1) * v->value_size);
+}
+
+// Returns the slot that holds the index of the key, in a bucket or in the
+// stash, or NULL if the key is not in the map. At most two buckets are read
+// unless the stash is in use.
+static uint32_t*
+find_slot(const struct chan_map *map, const void *key, uint64_t hash)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    const uint32_t tag = hash_tag(hash);
+    size_t b = hash & (v->n_buckets - 1);
+    for (size_t probe = 0; probe < 2; ++probe) {
+        struct bucket *bucket = &v->buckets[b];
+        for (size_t i = 0; i < SLOTS; ++i) {
+            const uint32_t key_ind = bucket->key_inds[i];
+            if (bucket->tags[i] != tag || key_ind == EMPTY) continue;
+            CHAN_STATS_ADD(map, comparisons, 1);
+            if (CMP(v->key_data, key_ind, key, 0, v->key_size) == 0) {
+                CHAN_STATS_PROBE(map, probe);
+                return &bucket->key_inds[i];
+            }
+        }
+        b = other_bucket(v, b, tag);
+    }
+    for (size_t i = 0; i < v->stash_size; ++i) {
+        CHAN_STATS_ADD(map, comparisons, 1);
+        if (CMP(v->key_data, v->stash[i], key, 0, v->key_size) == 0) {
+            CHAN_STATS_PROBE(map, 2 + i);
+            return &v->stash[i];
+        }
+    }
+    CHAN_STATS_PROBE(map, 2 + v->stash_size);
+    return NULL;
+}
+
+static bool
+put_in_bucket(struct bucket *bucket, uint32_t tag, uint32_t key_ind)
+{
+    for (size_t i = 0; i < SLOTS; ++i) {
+        if (bucket->key_inds[i] != EMPTY) continue;
+        bucket->tags[i] = tag;
+        bucket->key_inds[i] = key_ind;
+        return true;
+    }
+    return false;
+}
+
+static void
+stash_push(struct chan_map *map, uint32_t key_ind)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (v->stash_size == v->stash_capacity) {
+        const size_t n = chan_growth_next_capacity(&map->growth, v->stash_size);
+        v->stash = CHAN_COW_REALLOC(map, v->stash, v->stash_capacity * sizeof(*v->stash), n * sizeof(*v->stash));
+        v->stash_capacity = n;
+    }
+    make_stash_unique(map);
+    v->stash[v->stash_size++] = key_ind;
+}
+
+// Puts the key in a free slot of one of its buckets, or else evicts keys
+// along a random walk until one of them finds a free slot in its other
+// bucket. A key left without a slot goes to the stash.
+static void
+place(struct chan_map *map, uint64_t hash, uint32_t key_ind)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    uint32_t tag = hash_tag(hash);
+    size_t b = hash & (v->n_buckets - 1);
+    make_bucket_unique(map, b);
+    if (put_in_bucket(&v->buckets[b], tag, key_ind)) return;
+    b = other_bucket(v, b, tag);
+    for (size_t kick = 0; kick < MAX_KICKS; ++kick) {
+        make_bucket_unique(map, b);
+        struct bucket *bucket = &v->buckets[b];
+        if (put_in_bucket(bucket, tag, key_ind)) return;
+        // xorshift
+        v->random ^= v->random << 13;
+        v->random ^= v->random >> 7;
+        v->random ^= v->random << 17;
+        const size_t i = v->random % SLOTS;
+        const uint32_t evicted_tag = bucket->tags[i];
+        const uint32_t evicted_ind = bucket->key_inds[i];
+        bucket->tags[i] = tag;
+        bucket->key_inds[i] = key_ind;
+        tag = evicted_tag;
+        key_ind = evicted_ind;
+        b = other_bucket(v, b, tag);
+    }
+    stash_push(map, key_ind);
+}
+
+// Reallocates the key and value arrays to hold exactly `n` items.
+static void
+set_capacity(struct chan_map *map, size_t n)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (n == v->capacity) return;
+    assert(n >= v->size);
+    assert(n <= EMPTY);
+    if (n == 0) {
+        chan_cow_free(v->key_data);
+        chan_cow_free(v->value_data);
+        v->key_data = NULL;
+        v->value_data = NULL;
+    }
+    else {
+        v->key_data = CHAN_COW_REALLOC(map, v->key_data, v->capacity * v->key_size, n * v->key_size);
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+        assert(v->key_data && v->value_data);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
+}
+
+// Smallest number of buckets that can hold `size` keys under the max load.
+static size_t
+buckets_for_size(size_t size)
+{
+    size_t n = MIN_BUCKETS;
+    while (n * SLOTS * MAX_LOAD_NUM < size * MAX_LOAD_DEN) n *= 2;
+    return n;
+}
+
+// Resizes the bucket array to `n_buckets` and places all the keys again,
+// including the stashed ones.
+static void
+rehash(struct chan_map *map, size_t n_buckets)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    chan_cow_free(v->bucket_allocation);
+    v->bucket_allocation = NULL;
+    v->buckets = NULL;
+    v->n_buckets = n_buckets;
+    v->stash_size = 0;
+    if (n_buckets == 0) {
+        assert(v->size == 0);
+        return;
+    }
+    v->bucket_allocation = CHAN_COW_REALLOC(map, NULL, 0, bucket_allocation_size(n_buckets));
+    v->buckets = align_buckets(v->bucket_allocation);
+    CHAN_STATS_ADD(map, resizes, 1);
+    memset(v->buckets, 0xff, n_buckets * sizeof(struct bucket));
+    for (size_t key_ind = 0; key_ind < v->size; ++key_ind) {
+        place(map, hash_key(v, AT(v->key_data, key_ind, v->key_size)), key_ind);
+    }
+}
+
+// Copies the part of the buckets or the stash that is shared with a clone
+// before `*slot` is written, and points it to where the slot is then.
+static void
+make_slot_unique(struct chan_map *map, uint32_t **slot)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (*slot >= v->stash && *slot < v->stash + v->stash_size) {
+        const size_t i = *slot - v->stash;
+        make_stash_unique(map);
+        *slot = &v->stash[i];
+        return;
+    }
+    const size_t offset = (char*)*slot - (char*)v->buckets;
+    make_buckets_unique(map, offset, offset + sizeof(**slot));
+    *slot = (uint32_t*)((char*)v->buckets + offset);
+}
+
+static void
+chan_cuckoo_map_clear(struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    // All buckets are overwritten, so shared ones need not be copied.
+    if (chan_cow_is_shared(v->bucket_allocation)) {
+        chan_cow_free(v->bucket_allocation);
+        v->bucket_allocation = CHAN_COW_REALLOC(map, NULL, 0, bucket_allocation_size(v->n_buckets));
+        v->buckets = align_buckets(v->bucket_allocation);
+    }
+    if (v->n_buckets > 0) memset(v->buckets, 0xff, v->n_buckets * sizeof(struct bucket));
+    v->size = 0;
+    v->stash_size = 0;
+}
+
+static size_t
+chan_cuckoo_map_size(const struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    return v->size;
+}
+
+static void*
+chan_cuckoo_map_at(const struct chan_map *map, void *key)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (v->size == 0) return NULL;
+    const uint32_t *slot = find_slot(map, key, hash_key(v, key));
+    return slot ? AT(v->value_data, *slot, v->value_size) : NULL;
+}
+
+// Returns the slot that holds `key_ind`, which is in the map.
+static uint32_t*
+find_slot_of_ind(struct chan_cuckoo_map *v, uint32_t key_ind)
+{
+    const uint64_t hash = hash_key(v, AT(v->key_data, key_ind, v->key_size));
+    const uint32_t tag = hash_tag(hash);
+    size_t b = hash & (v->n_buckets - 1);
+    for (size_t probe = 0; probe < 2; ++probe) {
+        struct bucket *bucket = &v->buckets[b];
+        for (size_t i = 0; i < SLOTS; ++i) {
+            if (bucket->key_inds[i] == key_ind) return &bucket->key_inds[i];
+        }
+        b = other_bucket(v, b, tag);
+    }
+    for (size_t i = 0; i < v->stash_size; ++i) {
+        if (v->stash[i] == key_ind) return &v->stash[i];
+    }
+    assert(false && "unexpected: key is not in its buckets");
+    return NULL;
+}
+
+static void
+chan_cuckoo_map_remove(struct chan_map *map, void *key)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    assert(v->size > 0);
+    uint32_t *slot = find_slot(map, key, hash_key(v, key));
+    assert(slot);
+    make_slot_unique(map, &slot);
+    const uint32_t key_ind = *slot;
+    const bool stashed = slot >= v->stash && slot < v->stash + v->stash_size;
+    if (stashed) *slot = v->stash[--v->stash_size];
+    else *slot = EMPTY;
+
+    // Keep the dense arrays dense by moving the last item into the gap.
+    const uint32_t last = v->size - 1;
+    if (key_ind != last) {
+        uint32_t *last_slot = find_slot_of_ind(v, last);
+        make_slot_unique(map, &last_slot);
+        *last_slot = key_ind;
+        make_key_unique(map, key_ind);
+        make_value_unique(map, key_ind);
+        CPY(v->key_data, key_ind, v->key_data, last, v->key_size);
+        CPY(v->value_data, key_ind, v->value_data, last, v->value_size);
+    }
+    v->size--;
+}
+
+static void*
+chan_cuckoo_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if ((v->size + 1) * MAX_LOAD_DEN > v->n_buckets * SLOTS * MAX_LOAD_NUM) {
+        rehash(map, v->n_buckets == 0 ? MIN_BUCKETS : 2 * v->n_buckets);
+    }
+
+    const uint64_t hash = hash_key(v, key);
+    const uint32_t *slot = find_slot(map, key, hash);
+    if (slot) {
+        // The caller may write to the value.
+        make_value_unique(map, *slot);
+        if (inserted) *inserted = false;
+        return AT(v->value_data, *slot, v->value_size);
+    }
+
+    // New key.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
+    }
+    make_key_unique(map, v->size);
+    make_value_unique(map, v->size);
+    CPY(v->key_data, v->size, key, 0, v->key_size);
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    place(map, hash, v->size);
+    v->size++;
+    if (v->stash_size > MAX_STASH && 2 * v->size >= v->n_buckets * SLOTS) {
+        rehash(map, 2 * v->n_buckets);
+    }
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
+}
+
+static void
+chan_cuckoo_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    bool inserted;
+    void *slot = chan_cuckoo_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
+}
+
+// The keys and values are dense, so iterating is a linear sweep over them
+// without looking at the buckets. Removals reorder them.
+static struct chan_map_iter
+chan_cuckoo_map_iter_new(const struct chan_map *map)
+{
+    struct chan_map_iter map_iter;
+    map_iter.ind = 0;
+    return map_iter;
+}
+
+static struct chan_map_iter_item*
+chan_cuckoo_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_item.key = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_item.value = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->ind++;
+    return &map_iter->map_iter_item;
+}
+
+static struct chan_map_iter_block*
+chan_cuckoo_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_block.keys = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->map_iter_block.size = v->size - map_iter->ind;
+    map_iter->ind = v->size;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_cuckoo_map_keys_data(const struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_cuckoo_map_values_data(const struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_cuckoo_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    return v->value_data;
+}
+
+static struct chan_memory_usage
+chan_cuckoo_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    const size_t item_size = v->key_size + v->value_size;
+    const size_t slot_size = sizeof(uint32_t) + sizeof(uint32_t);
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size + v->stash_capacity * sizeof(*v->stash)
+        + (v->n_buckets ? bucket_allocation_size(v->n_buckets) : 0);
+    usage.used = sizeof(*v) + v->size * (item_size + slot_size);
+    return usage;
+}
+
+static void
+chan_cuckoo_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    set_capacity(map, v->size);
+    const size_t n_buckets = v->size == 0 ? 0 : buckets_for_size(v->size);
+    if (n_buckets != v->n_buckets) rehash(map, n_buckets);
+    const size_t stash_bytes = v->stash_size * sizeof(*v->stash);
+    if (v->stash_size == 0) {
+        chan_cow_free(v->stash);
+        v->stash = NULL;
+    }
+    else {
+        v->stash = CHAN_COW_REALLOC(map, v->stash, v->stash_capacity * sizeof(*v->stash), stash_bytes);
+    }
+    v->stash_capacity = v->stash_size;
+}
+
+static void
+chan_cuckoo_map_debug_print(
+    const struct chan_map *map,
+    int (*print_key)(char *dest, int n, void *a),
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    const int bufSize = 256;
+    char buf0[bufSize];
+    char buf1[bufSize];
+    printf("size %zu, capacity %zu, buckets %zu, stash %zu\n", v->size, v->capacity, v->n_buckets, v->stash_size);
+    printf("bucket slot -> key ind:\n");
+    for (size_t b = 0; b < v->n_buckets; ++b) {
+        for (size_t i = 0; i < SLOTS; ++i) {
+            const uint32_t key_ind = v->buckets[b].key_inds[i];
+            if (key_ind == EMPTY) continue;
+            printf("* %zu.%zu -> %u\n", b, i, (unsigned)key_ind);
+        }
+    }
+    printf("key -> value:\n");
+    for (size_t i = 0; i < v->size; ++i) {
+        print_key(buf0, bufSize, AT(v->key_data, i, v->key_size));
+        print_value(buf1, bufSize, AT(v->value_data, i, v->value_size));
+        printf("* %s -> %s\n", buf0, buf1);
+    }
+}
+
+static void
+chan_cuckoo_map_free(struct chan_map *map)
+{
+    assert(map);
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    chan_cow_free(v->key_data);
+    chan_cow_free(v->value_data);
+    chan_cow_free(v->bucket_allocation);
+    chan_cow_free(v->stash);
+    free(v);
+}
+
+static struct chan_map*
+chan_cuckoo_map_clone(const struct chan_map *map)
+{
+    struct chan_cuckoo_map *v = (struct chan_cuckoo_map*)map;
+    struct chan_cuckoo_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_data = chan_cow_share(v->key_data);
+    clone->value_data = chan_cow_share(v->value_data);
+    clone->bucket_allocation = chan_cow_share(v->bucket_allocation);
+    clone->buckets = align_buckets(clone->bucket_allocation);
+    // A chunked array that can not be mapped again is copied, and may be
+    // aligned differently in the copy.
+    const size_t offset = (char*)v->buckets - (char*)v->bucket_allocation;
+    if ((char*)clone->buckets != (char*)clone->bucket_allocation + offset) {
+        memmove(clone->buckets, (char*)clone->bucket_allocation + offset, v->n_buckets * sizeof(struct bucket));
+    }
+    clone->stash = chan_cow_share(v->stash);
+    return &clone->map;
+}
+
+struct chan_map*
+chan_cuckoo_map_new(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*)
+) {
+    static const struct chan_map_vtable vtable = {
+        chan_cuckoo_map_free,
+        chan_cuckoo_map_clone,
+        chan_cuckoo_map_clear,
+        chan_cuckoo_map_size,
+        chan_cuckoo_map_insert,
+        chan_cuckoo_map_get_or_insert,
+        chan_cuckoo_map_at,
+        chan_cuckoo_map_remove,
+        chan_cuckoo_map_iter_new,
+        chan_cuckoo_map_iter_next,
+        chan_cuckoo_map_iter_next_block,
+        chan_cuckoo_map_keys_data,
+        chan_cuckoo_map_values_data,
+        chan_cuckoo_map_writable_values_data,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_cuckoo_map_memory_usage,
+        chan_cuckoo_map_shrink_to_fit,
+        chan_cuckoo_map_debug_print,
+    };
+    static struct chan_map map = { &vtable };
+    struct chan_cuckoo_map *cuckoo_map = malloc(sizeof(*cuckoo_map));
+    memcpy(&cuckoo_map->map, &map, sizeof(map));
+
+    cuckoo_map->key_size = key_size;
+    cuckoo_map->value_size = value_size;
+    cuckoo_map->size = 0;
+    cuckoo_map->capacity = 0;
+    cuckoo_map->key_data = NULL;
+    cuckoo_map->value_data = NULL;
+    cuckoo_map->n_buckets = 0;
+    cuckoo_map->bucket_allocation = NULL;
+    cuckoo_map->buckets = NULL;
+    cuckoo_map->stash = NULL;
+    cuckoo_map->stash_size = 0;
+    cuckoo_map->stash_capacity = 0;
+    cuckoo_map->random = 88172645463325252ULL;
+    cuckoo_map->hasher = hasher;
+
+    return &cuckoo_map->map;
+}
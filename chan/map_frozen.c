@@ -0,0 +1,471 @@
+#include "map.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Average number of keys per bucket of the perfect hash function. Each
+// bucket stores a 16-bit pilot, so this is 4 bits per key.
+#define KEYS_PER_BUCKET 4
+
+// The table has `size * ALPHA_DEN / ALPHA_NUM` positions. The few positions
+// past `size` make the pilot search of the last buckets much shorter, and
+// the keys hashed to them are remapped to the free positions below `size`.
+#define ALPHA_NUM 98
+#define ALPHA_DEN 100
+
+// A bucket whose keys collide for every pilot fails the build, which is
+// then started over with another seed, up to `MAX_SEEDS` times.
+#define MAX_PILOT UINT16_MAX
+#define MAX_SEEDS 32
+
+#define CPY(dst, dst_ind, src, src_ind, item_size) \
+    memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define CMP(dst, dst_ind, src, src_ind, item_size) \
+    memcmp((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Read-only map over a minimal perfect hash function (PTHash): each key
+// hashes to a bucket, and the pilot of the bucket was searched for so that
+// the keys of all the buckets get distinct positions. The keys and values
+// are stored at their positions, so there are no empty slots and no probing.
+struct chan_frozen_map {
+    struct chan_map map;
+    size_t key_size;
+    size_t value_size;
+    // Number of keys.
+    size_t size;
+    void *key_data;
+    void *value_data;
+    uint64_t seed;
+    // Number of buckets, of which the first `n_dense_buckets` get 60% of the
+    // keys. Bigger buckets are placed first while the table is still empty,
+    // which keeps the pilots small.
+    size_t n_buckets;
+    size_t n_dense_buckets;
+    // Number of positions, at least `size`.
+    size_t table_size;
+    uint16_t *pilots;
+    // Position of the keys hashed past `size`, indexed by position - size.
+    uint32_t *remap;
+};
+
+// Finalizer of splitmix64.
+static inline uint64_t
+mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Maps `x` to [0, n) by multiplication, which is faster than `x % n`.
+static inline size_t
+fast_range(uint64_t x, size_t n)
+{
+#ifdef __SIZEOF_INT128__
+    return (size_t)(((unsigned __int128)x * n) >> 64);
+#else
+    return (size_t)(x % n);
+#endif
+}
+
+// The keys are hashed by their bytes rather than by a user hasher, because
+// keys with equal hashes could never get distinct positions.
+static inline uint64_t
+hash_key(const void *key, size_t key_size, uint64_t seed)
+{
+    const unsigned char *p = key;
+    uint64_t h = seed ^ key_size;
+    size_t i = 0;
+    for (; i + 8 <= key_size; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        h = mix(h ^ word);
+    }
+    if (i < key_size || key_size == 0) {
+        uint64_t word = 0;
+        memcpy(&word, p + i, key_size - i);
+        h = mix(h ^ word);
+    }
+    return h;
+}
+
+// The high half of the hash picks the bucket and the low half whether it
+// is a dense one.
+static inline size_t
+bucket_of(const struct chan_frozen_map *v, uint64_t hash)
+{
+    const uint64_t high = hash >> 32;
+    if ((hash & UINT32_MAX) * 10 < 6 * (UINT32_MAX + 1ULL)) {
+        return (high * v->n_dense_buckets) >> 32;
+    }
+    return v->n_dense_buckets + ((high * (v->n_buckets - v->n_dense_buckets)) >> 32);
+}
+
+static inline size_t
+position(const struct chan_frozen_map *v, uint64_t hash, uint16_t pilot)
+{
+    return fast_range(mix(hash ^ (pilot * 0x9e3779b97f4a7c15ULL)), v->table_size);
+}
+
+// Searches the pilots for the keys with the given hashes and sets their
+// positions. Returns false if some bucket has no pilot that works, and then
+// sets `duplicate` if that is because the bucket has equal keys.
+static bool
+search_pilots(
+    struct chan_frozen_map *v,
+    const void *keys,
+    const uint64_t *hashes,
+    uint32_t *positions,
+    bool *duplicate
+) {
+    const size_t n = v->size;
+    bool ok = true;
+    // Key indices sorted by bucket, with `offsets[b]` the start of bucket b.
+    uint32_t *offsets = calloc(v->n_buckets + 1, sizeof(*offsets));
+    uint32_t *by_bucket = malloc(n * sizeof(*by_bucket));
+    for (size_t i = 0; i < n; ++i) offsets[bucket_of(v, hashes[i]) + 1]++;
+    size_t max_bucket_size = 0;
+    for (size_t b = 0; b < v->n_buckets; ++b) {
+        if (offsets[b + 1] > max_bucket_size) max_bucket_size = offsets[b + 1];
+        offsets[b + 1] += offsets[b];
+    }
+    uint32_t *fill = malloc(v->n_buckets * sizeof(*fill));
+    memcpy(fill, offsets, v->n_buckets * sizeof(*fill));
+    for (size_t i = 0; i < n; ++i) by_bucket[fill[bucket_of(v, hashes[i])]++] = i;
+
+    // Buckets sorted by size, largest first, reusing `fill`.
+    size_t *size_offsets = calloc(max_bucket_size + 2, sizeof(*size_offsets));
+    for (size_t b = 0; b < v->n_buckets; ++b) {
+        size_offsets[max_bucket_size - (offsets[b + 1] - offsets[b]) + 1]++;
+    }
+    for (size_t s = 0; s <= max_bucket_size; ++s) size_offsets[s + 1] += size_offsets[s];
+    for (size_t b = 0; b < v->n_buckets; ++b) {
+        fill[size_offsets[max_bucket_size - (offsets[b + 1] - offsets[b])]++] = b;
+    }
+
+    uint64_t *taken = calloc((v->table_size + 63) / 64, sizeof(*taken));
+    for (size_t bi = 0; bi < v->n_buckets && ok; ++bi) {
+        const size_t b = fill[bi];
+        const uint32_t *members = by_bucket + offsets[b];
+        const size_t bucket_size = offsets[b + 1] - offsets[b];
+        if (bucket_size == 0) break;
+        size_t pilot = 0;
+        for (; pilot <= MAX_PILOT; ++pilot) {
+            size_t j = 0;
+            for (; j < bucket_size; ++j) {
+                const size_t p = position(v, hashes[members[j]], pilot);
+                if (taken[p / 64] >> (p % 64) & 1) break;
+                size_t k = 0;
+                while (k < j && positions[members[k]] != p) ++k;
+                if (k < j) break;
+                positions[members[j]] = p;
+            }
+            if (j == bucket_size) break;
+        }
+        if (pilot > MAX_PILOT) {
+            for (size_t j = 0; j < bucket_size; ++j) {
+                for (size_t k = 0; k < j; ++k) {
+                    if (hashes[members[j]] != hashes[members[k]]) continue;
+                    if (CMP(keys, members[j], keys, members[k], v->key_size) == 0) *duplicate = true;
+                }
+            }
+            ok = false;
+            break;
+        }
+        v->pilots[b] = pilot;
+        for (size_t j = 0; j < bucket_size; ++j) {
+            const size_t p = positions[members[j]];
+            taken[p / 64] |= 1ULL << (p % 64);
+        }
+    }
+
+    // Pair the taken positions past `size` with the free ones below it.
+    if (ok) {
+        size_t free_p = 0;
+        for (size_t p = n; p < v->table_size; ++p) {
+            v->remap[p - n] = 0;
+            if (!(taken[p / 64] >> (p % 64) & 1)) continue;
+            while (taken[free_p / 64] >> (free_p % 64) & 1) ++free_p;
+            v->remap[p - n] = free_p++;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (positions[i] >= n) positions[i] = v->remap[positions[i] - n];
+        }
+    }
+    free(taken);
+    free(size_offsets);
+    free(fill);
+    free(by_bucket);
+    free(offsets);
+    return ok;
+}
+
+static void
+chan_frozen_map_clear(struct chan_map *map)
+{
+    assert(false && "map is frozen");
+}
+
+static size_t
+chan_frozen_map_size(const struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    return v->size;
+}
+
+// One hash, one pilot and one key comparison, plus a remap for the few keys
+// hashed past the end.
+static void*
+chan_frozen_map_at(const struct chan_map *map, void *key)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    if (v->size == 0) return NULL;
+    const uint64_t hash = hash_key(key, v->key_size, v->seed);
+    size_t p = position(v, hash, v->pilots[bucket_of(v, hash)]);
+    if (p >= v->size) p = v->remap[p - v->size];
+    CHAN_STATS_ADD(map, comparisons, 1);
+    CHAN_STATS_PROBE(map, 0);
+    return CMP(v->key_data, p, key, 0, v->key_size) == 0 ? AT(v->value_data, p, v->value_size) : NULL;
+}
+
+static void
+chan_frozen_map_remove(struct chan_map *map, void *key)
+{
+    assert(false && "map is frozen");
+}
+
+static void*
+chan_frozen_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
+{
+    assert(false && "map is frozen");
+    return NULL;
+}
+
+static void
+chan_frozen_map_insert(struct chan_map *map, void *key, void *value)
+{
+    assert(false && "map is frozen");
+}
+
+// The keys and values are stored in the order of their hash positions.
+static struct chan_map_iter
+chan_frozen_map_iter_new(const struct chan_map *map)
+{
+    struct chan_map_iter map_iter;
+    map_iter.ind = 0;
+    return map_iter;
+}
+
+static struct chan_map_iter_item*
+chan_frozen_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_item.key = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_item.value = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->ind++;
+    return &map_iter->map_iter_item;
+}
+
+static struct chan_map_iter_block*
+chan_frozen_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_block.keys = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->map_iter_block.size = v->size - map_iter->ind;
+    map_iter->ind = v->size;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_frozen_map_keys_data(const struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_frozen_map_values_data(const struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_frozen_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->size * v->value_size);
+    return v->value_data;
+}
+
+static struct chan_memory_usage
+chan_frozen_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->size * (v->key_size + v->value_size)
+        + v->n_buckets * sizeof(*v->pilots) + (v->table_size - v->size) * sizeof(*v->remap);
+    usage.used = usage.allocated;
+    return usage;
+}
+
+// The arrays are allocated at their final sizes.
+static void
+chan_frozen_map_shrink_to_fit(struct chan_map *map)
+{
+}
+
+static void
+chan_frozen_map_debug_print(
+    const struct chan_map *map,
+    int (*print_key)(char *dest, int n, void *a),
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    const int bufSize = 256;
+    char buf0[bufSize];
+    char buf1[bufSize];
+    printf("size %zu, buckets %zu, table %zu, seed %llx\n",
+        v->size, v->n_buckets, v->table_size, (unsigned long long)v->seed);
+    printf("bucket -> pilot:\n");
+    for (size_t b = 0; b < v->n_buckets; ++b) {
+        printf("* %zu -> %u\n", b, (unsigned)v->pilots[b]);
+    }
+    printf("key -> value:\n");
+    for (size_t i = 0; i < v->size; ++i) {
+        print_key(buf0, bufSize, AT(v->key_data, i, v->key_size));
+        print_value(buf1, bufSize, AT(v->value_data, i, v->value_size));
+        printf("* %s -> %s\n", buf0, buf1);
+    }
+}
+
+static void
+chan_frozen_map_free(struct chan_map *map)
+{
+    assert(map);
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    chan_cow_free(v->key_data);
+    chan_cow_free(v->value_data);
+    chan_cow_free(v->pilots);
+    chan_cow_free(v->remap);
+    free(v);
+}
+
+static struct chan_map*
+chan_frozen_map_clone(const struct chan_map *map)
+{
+    struct chan_frozen_map *v = (struct chan_frozen_map*)map;
+    struct chan_frozen_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_data = chan_cow_share(v->key_data);
+    clone->value_data = chan_cow_share(v->value_data);
+    clone->pilots = chan_cow_share(v->pilots);
+    clone->remap = chan_cow_share(v->remap);
+    return &clone->map;
+}
+
+struct chan_map*
+chan_frozen_map_new(
+    size_t key_size,
+    size_t value_size,
+    const void *keys,
+    const void *values,
+    size_t n
+) {
+    static const struct chan_map_vtable vtable = {
+        chan_frozen_map_free,
+        chan_frozen_map_clone,
+        chan_frozen_map_clear,
+        chan_frozen_map_size,
+        chan_frozen_map_insert,
+        chan_frozen_map_get_or_insert,
+        chan_frozen_map_at,
+        chan_frozen_map_remove,
+        chan_frozen_map_iter_new,
+        chan_frozen_map_iter_next,
+        chan_frozen_map_iter_next_block,
+        chan_frozen_map_keys_data,
+        chan_frozen_map_values_data,
+        chan_frozen_map_writable_values_data,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_frozen_map_memory_usage,
+        chan_frozen_map_shrink_to_fit,
+        chan_frozen_map_debug_print,
+    };
+    static struct chan_map map = { &vtable };
+    assert(n < UINT32_MAX);
+    struct chan_frozen_map *frozen_map = malloc(sizeof(*frozen_map));
+    memcpy(&frozen_map->map, &map, sizeof(map));
+
+    frozen_map->key_size = key_size;
+    frozen_map->value_size = value_size;
+    frozen_map->size = n;
+    frozen_map->key_data = NULL;
+    frozen_map->value_data = NULL;
+    frozen_map->seed = 0;
+    frozen_map->n_buckets = 0;
+    frozen_map->n_dense_buckets = 0;
+    frozen_map->table_size = 0;
+    frozen_map->pilots = NULL;
+    frozen_map->remap = NULL;
+    if (n == 0) return &frozen_map->map;
+
+    struct chan_frozen_map *v = frozen_map;
+    v->n_buckets = (n + KEYS_PER_BUCKET - 1) / KEYS_PER_BUCKET + 1;
+    v->n_dense_buckets = v->n_buckets * 3 / 10;
+    if (v->n_dense_buckets == 0) v->n_dense_buckets = 1;
+    v->table_size = n * ALPHA_DEN / ALPHA_NUM;
+    if (v->table_size < n) v->table_size = n;
+    v->pilots = CHAN_COW_REALLOC(&v->map, NULL, 0, v->n_buckets * sizeof(*v->pilots));
+    if (v->table_size > n) {
+        v->remap = CHAN_COW_REALLOC(&v->map, NULL, 0, (v->table_size - n) * sizeof(*v->remap));
+    }
+
+    uint64_t *hashes = malloc(n * sizeof(*hashes));
+    uint32_t *positions = malloc(n * sizeof(*positions));
+    bool found = false;
+    bool duplicate = false;
+    for (size_t attempt = 0; attempt < MAX_SEEDS && !found && !duplicate; ++attempt) {
+        v->seed = mix(0x9e3779b97f4a7c15ULL * (attempt + 1));
+        for (size_t i = 0; i < n; ++i) hashes[i] = hash_key(AT(keys, i, key_size), key_size, v->seed);
+        found = search_pilots(v, keys, hashes, positions, &duplicate);
+    }
+    if (!found) {
+        free(positions);
+        free(hashes);
+        chan_frozen_map_free(&v->map);
+        return NULL;
+    }
+
+    v->key_data = CHAN_COW_REALLOC(&v->map, NULL, 0, n * key_size);
+    v->value_data = CHAN_COW_REALLOC(&v->map, NULL, 0, n * value_size);
+    for (size_t i = 0; i < n; ++i) {
+        CPY(v->key_data, positions[i], keys, i, key_size);
+        CPY(v->value_data, positions[i], values, i, value_size);
+    }
+    free(positions);
+    free(hashes);
+    return &frozen_map->map;
+}
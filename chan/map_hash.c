@@ -1,11 +1,21 @@
 #include "map.h"
+#include "bucket_index.h"
+#include "cow.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
-// Increasing the table size dynamically is not yet supported.
-static const int HASH_TABLE_SIZE = 256;
+// Smallest non-zero number of buckets. Always a power of two.
+static const size_t MIN_BUCKETS = 8;
+
+// Largest key stored in the buckets by `chan_hash_map_new_inline_keys()`.
+#define INLINE_KEY_MAX 16
+
+// The bucket array is grown when more than 3/4 of it would be in use, and
+// `shrink_to_fit` picks the smallest size that stays under the same load.
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
 
 #define CPY(dst, dst_ind, src, src_ind, item_size) \
     memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
@@ -26,39 +36,212 @@ struct chan_hash_map {
     size_t capacity;
     void *key_data;
     void *value_data;
-    int *hash_to_key_ind;
+    // Number of buckets in `hash_to_key_ind`, zero or a power of two.
+    size_t n_buckets;
+    // Bytes per key index, see `bucket_index.h`.
+    size_t bucket_width;
+    // Bytes per bucket. Equal to `bucket_width`, unless the keys are inline:
+    // then each bucket holds the key index followed by a copy of the key,
+    // padded to a multiple of `bucket_width`, and probes compare the keys
+    // there instead of reading the key array.
+    size_t bucket_stride;
+    bool inline_keys;
+    void *hash_to_key_ind;
     size_t (*hasher)(void*);
 };
 
-// Returns position in the hash table where the key was found. In absence of
-// collisions, the return value is same as the `hash` argument. If the key was
-// not found, returns -1 and sets `new_key_ind` to the position where new one
-// should be inserted.
-static int
-find_key_ind(const struct chan_map *map, void *key, size_t hash, int *new_key_ind)
-{
-    struct chan_hash_map *v = (struct chan_hash_map*)map;
-    for (size_t i = 0; i < HASH_TABLE_SIZE; ++i) {
-        size_t ind = (hash + i) % HASH_TABLE_SIZE;
-        int key_ind = v->hash_to_key_ind[ind];
-        if (key_ind == -1) {
-            if (new_key_ind) *new_key_ind = ind;
-            return -1;
-        }
-        if (CMP(v->key_data, key_ind, key, 0, v->key_size) == 0) {
-            return key_ind;
-        }
+// Returns index of the key in the dense arrays, or `CHAN_BUCKET_EMPTY` if
+// the key was not found, in which case `new_key_ind` is set to the bucket
+// where the new one should be inserted.
+#define DEFINE_FIND_KEY_IND(name, type) \
+static size_t \
+name(const struct chan_map *map, void *key, size_t hash, size_t *new_key_ind) \
+{ \
+    struct chan_hash_map *v = (struct chan_hash_map*)map; \
+    const type *buckets = v->hash_to_key_ind; \
+    const size_t mask = v->n_buckets - 1; \
+    for (size_t i = 0; i < v->n_buckets; ++i) { \
+        const size_t ind = (hash + i) & mask; \
+        const type key_ind = buckets[ind]; \
+        if (key_ind == (type)-1) { \
+            CHAN_STATS_PROBE(map, i); \
+            if (new_key_ind) *new_key_ind = ind; \
+            return CHAN_BUCKET_EMPTY; \
+        } \
+        CHAN_STATS_ADD(map, comparisons, 1); \
+        if (CMP(v->key_data, key_ind, key, 0, v->key_size) == 0) { \
+            CHAN_STATS_PROBE(map, i); \
+            return key_ind; \
+        } \
+    } \
+    assert(false && "unexpected: hash map is full"); \
+    return CHAN_BUCKET_EMPTY; \
+}
+
+CHAN_BUCKET_SPECIALIZE(DEFINE_FIND_KEY_IND, find_key_ind)
+
+// Same as above for inline keys.
+#define DEFINE_FIND_INLINE_KEY_IND(name, type) \
+static size_t \
+name(const struct chan_map *map, void *key, size_t hash, size_t *new_key_ind) \
+{ \
+    struct chan_hash_map *v = (struct chan_hash_map*)map; \
+    const char *buckets = v->hash_to_key_ind; \
+    const size_t mask = v->n_buckets - 1; \
+    for (size_t i = 0; i < v->n_buckets; ++i) { \
+        const size_t ind = (hash + i) & mask; \
+        const char *bucket = buckets + ind * v->bucket_stride; \
+        const type key_ind = *(const type*)bucket; \
+        if (key_ind == (type)-1) { \
+            CHAN_STATS_PROBE(map, i); \
+            if (new_key_ind) *new_key_ind = ind; \
+            return CHAN_BUCKET_EMPTY; \
+        } \
+        CHAN_STATS_ADD(map, comparisons, 1); \
+        if (memcmp(bucket + sizeof(type), key, v->key_size) == 0) { \
+            CHAN_STATS_PROBE(map, i); \
+            return key_ind; \
+        } \
+    } \
+    assert(false && "unexpected: hash map is full"); \
+    return CHAN_BUCKET_EMPTY; \
+}
+
+CHAN_BUCKET_SPECIALIZE(DEFINE_FIND_INLINE_KEY_IND, find_inline_key_ind)
+
+static size_t
+find_key_ind(const struct chan_map *map, void *key, size_t hash, size_t *new_key_ind)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    if (v->inline_keys) {
+        return CHAN_BUCKET_DISPATCH(find_inline_key_ind, v->bucket_width, map, key, hash, new_key_ind);
+    }
+    return CHAN_BUCKET_DISPATCH(find_key_ind, v->bucket_width, map, key, hash, new_key_ind);
+}
+
+static inline void*
+bucket_at(const struct chan_hash_map *v, size_t i)
+{
+    return (char*)v->hash_to_key_ind + i * v->bucket_stride;
+}
+
+// Bytes per bucket for key indices of `width` bytes.
+static size_t
+bucket_stride(const struct chan_hash_map *v, size_t width)
+{
+    if (!v->inline_keys) return width;
+    return (width + v->key_size + width - 1) / width * width;
+}
+
+// Points bucket `i` to key `key_ind` and copies the key there if inline.
+static inline void
+set_bucket(struct chan_hash_map *v, size_t i, size_t key_ind)
+{
+    void *bucket = bucket_at(v, i);
+    chan_bucket_set(bucket, v->bucket_width, 0, key_ind);
+    if (v->inline_keys) CPY((char*)bucket + v->bucket_width, 0, v->key_data, key_ind, v->key_size);
+}
+
+// Reallocates the key and value arrays to hold exactly `n` items.
+static void
+set_capacity(struct chan_map *map, size_t n)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    if (n == v->capacity) return;
+    assert(n >= v->size);
+    if (n == 0) {
+        chan_cow_free(v->key_data);
+        chan_cow_free(v->value_data);
+        v->key_data = NULL;
+        v->value_data = NULL;
+    }
+    else {
+        v->key_data = CHAN_COW_REALLOC(map, v->key_data, v->capacity * v->key_size, n * v->key_size);
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+        assert(v->key_data && v->value_data);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
+}
+
+// Smallest number of buckets that can hold `size` keys under the max load.
+static size_t
+buckets_for_size(size_t size)
+{
+    size_t n = MIN_BUCKETS;
+    while (n * MAX_LOAD_NUM < size * MAX_LOAD_DEN) n *= 2;
+    return n;
+}
+
+// Resizes the bucket array to `n_buckets` and reinserts all the keys.
+static void
+rehash(struct chan_map *map, size_t n_buckets)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    if (n_buckets == v->n_buckets) return;
+    if (n_buckets == 0) {
+        assert(v->size == 0);
+        chan_cow_free(v->hash_to_key_ind);
+        v->hash_to_key_ind = NULL;
+        v->n_buckets = 0;
+        v->bucket_width = chan_bucket_width(MIN_BUCKETS);
+        v->bucket_stride = bucket_stride(v, v->bucket_width);
+        return;
+    }
+    // The old buckets are not copied, so there is nothing to move.
+    const size_t width = chan_bucket_width(n_buckets);
+    const size_t stride = bucket_stride(v, width);
+    chan_cow_free(v->hash_to_key_ind);
+    v->hash_to_key_ind = CHAN_COW_REALLOC(map, NULL, 0, n_buckets * stride);
+    assert(v->hash_to_key_ind);
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->n_buckets = n_buckets;
+    v->bucket_width = width;
+    v->bucket_stride = stride;
+    const size_t mask = n_buckets - 1;
+    chan_bucket_fill_empty(v->hash_to_key_ind, stride, n_buckets);
+    for (size_t key_ind = 0; key_ind < v->size; ++key_ind) {
+        size_t ind = v->hasher(AT(v->key_data, key_ind, v->key_size)) & mask;
+        while (chan_bucket_get(bucket_at(v, ind), width, 0) != CHAN_BUCKET_EMPTY) ind = (ind + 1) & mask;
+        set_bucket(v, ind, key_ind);
     }
-    assert(false && "unexpected: hash map is full");
-    *new_key_ind = -1;
-    return -1;
+}
+
+// Copy the part of an array that is shared with a clone before item or
+// bucket `i` of it is written. See `CHAN_COW_UNSHARE_RANGE()`.
+static void
+make_key_unique(struct chan_map *map, size_t i)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    v->key_data = CHAN_COW_UNSHARE_RANGE(map, v->key_data, v->size * v->key_size, v->capacity * v->key_size,
+        i * v->key_size, (i + 1) * v->key_size);
+}
+
+static void
+make_value_unique(struct chan_map *map, size_t i)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, i * v->value_size, (i + 1) * v->value_size);
+}
+
+static void
+make_bucket_unique(struct chan_map *map, size_t i)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    const size_t bucket_bytes = v->n_buckets * v->bucket_stride;
+    v->hash_to_key_ind = CHAN_COW_UNSHARE_RANGE(map, v->hash_to_key_ind, bucket_bytes, bucket_bytes,
+        i * v->bucket_stride, (i + 1) * v->bucket_stride);
 }
 
 static void
 chan_hash_map_clear(struct chan_map *map)
 {
     struct chan_hash_map *v = (struct chan_hash_map*)map;
-    for (size_t i = 0; i < HASH_TABLE_SIZE; ++i) v->hash_to_key_ind[i] = -1;
+    // All buckets are overwritten, so shared ones need not be copied.
+    const size_t bucket_bytes = v->n_buckets * v->bucket_stride;
+    v->hash_to_key_ind = CHAN_COW_UNSHARE(map, v->hash_to_key_ind, 0, bucket_bytes);
+    chan_bucket_fill_empty(v->hash_to_key_ind, v->bucket_stride, v->n_buckets);
     v->size = 0;
 }
 
@@ -74,9 +257,8 @@ chan_hash_map_at(const struct chan_map *map, void *key)
 {
     struct chan_hash_map *v = (struct chan_hash_map*)map;
     if (v->size == 0) return NULL;
-    const size_t hash = v->hasher(key) % HASH_TABLE_SIZE;
-    const int i = find_key_ind(map, key, hash, NULL);
-    return i >= 0 ? AT(v->value_data, i, v->value_size) : NULL;
+    const size_t i = find_key_ind(map, key, v->hasher(key), NULL);
+    return i != CHAN_BUCKET_EMPTY ? AT(v->value_data, i, v->value_size) : NULL;
 }
 
 static void
@@ -85,49 +267,122 @@ chan_hash_map_remove(struct chan_map *map, void *key)
     assert(false && "not implemented");
 }
 
-static void
-chan_hash_map_insert(struct chan_map *map, void *key, void *value)
+static void*
+chan_hash_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
 {
     struct chan_hash_map *v = (struct chan_hash_map*)map;
-    if (v->capacity == 0) {
-        v->hash_to_key_ind = realloc(v->hash_to_key_ind, HASH_TABLE_SIZE * sizeof(v->key_size));
-        for (size_t i = 0; i < HASH_TABLE_SIZE; ++i) v->hash_to_key_ind[i] = -1;
+    // Grow before searching so that `new_key_ind` stays valid.
+    if ((v->size + 1) * MAX_LOAD_DEN > v->n_buckets * MAX_LOAD_NUM) {
+        rehash(map, v->n_buckets == 0 ? MIN_BUCKETS : 2 * v->n_buckets);
     }
 
-    const size_t hash = v->hasher(key) % HASH_TABLE_SIZE;
-    int new_key_ind;
-    const int key_ind = find_key_ind(map, key, hash, &new_key_ind);
-    if (key_ind == -1) {
-        // New key.
-        if (v->size >= v->capacity) {
-            const size_t n = v->size == 0 ? 4 : 3 * v->size / 2;
-            v->key_data = realloc(v->key_data, n * sizeof(v->key_size));
-            v->value_data = realloc(v->value_data, n * sizeof(v->value_size));
-            v->capacity = n;
-        }
-        CPY(v->key_data, v->size, key, 0, v->key_size);
-        CPY(v->value_data, v->size, value, 0, v->value_size);
-        v->hash_to_key_ind[new_key_ind] = v->size;
-        v->size++;
+    size_t new_key_ind;
+    const size_t key_ind = find_key_ind(map, key, v->hasher(key), &new_key_ind);
+    if (key_ind != CHAN_BUCKET_EMPTY) {
+        // The caller may write to the value.
+        make_value_unique(map, key_ind);
+        if (inserted) *inserted = false;
+        return AT(v->value_data, key_ind, v->value_size);
     }
-    else {
-        // Replace existing key.
-        CPY(v->key_data, key_ind, key, 0, v->key_size);
-        CPY(v->value_data, key_ind, value, 0, v->value_size);
+
+    // New key.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
     }
+    make_key_unique(map, v->size);
+    make_value_unique(map, v->size);
+    make_bucket_unique(map, new_key_ind);
+    CPY(v->key_data, v->size, key, 0, v->key_size);
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    set_bucket(v, new_key_ind, v->size);
+    v->size++;
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
 }
 
+static void
+chan_hash_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    bool inserted;
+    void *slot = chan_hash_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
+}
+
+// The keys and values are dense in insertion order, so iterating is a
+// linear sweep over them without looking at the buckets.
 static struct chan_map_iter
 chan_hash_map_iter_new(const struct chan_map *map)
 {
     struct chan_map_iter map_iter;
+    map_iter.ind = 0;
     return map_iter;
 }
 
 static struct chan_map_iter_item*
 chan_hash_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
 {
-    return NULL;
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_item.key = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_item.value = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->ind++;
+    return &map_iter->map_iter_item;
+}
+
+static struct chan_map_iter_block*
+chan_hash_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    // All the remaining items are stored contiguously.
+    map_iter->map_iter_block.keys = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->map_iter_block.size = v->size - map_iter->ind;
+    map_iter->ind = v->size;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_hash_map_keys_data(const struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_hash_map_values_data(const struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_hash_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    return v->value_data;
+}
+
+static struct chan_memory_usage
+chan_hash_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    const size_t item_size = v->key_size + v->value_size;
+    const size_t bucket_size = v->bucket_stride;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size + v->n_buckets * bucket_size;
+    usage.used = sizeof(*v) + v->size * (item_size + bucket_size);
+    return usage;
+}
+
+static void
+chan_hash_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    set_capacity(map, v->size);
+    rehash(map, v->size == 0 ? 0 : buckets_for_size(v->size));
 }
 
 static void
@@ -142,10 +397,10 @@ chan_hash_map_debug_print(
     char buf1[bufSize];
     printf("size %zu, capacity %zu\n", v->size, v->capacity);
     printf("hash table ind -> key ind:\n");
-    for (size_t i = 0; i < HASH_TABLE_SIZE; ++i) {
-        const int key_ind = v->hash_to_key_ind[i];
-        if (key_ind < 0) continue;
-        printf("* %zu -> %d\n", i, key_ind);
+    for (size_t i = 0; i < v->n_buckets; ++i) {
+        const size_t key_ind = chan_bucket_get(bucket_at(v, i), v->bucket_width, 0);
+        if (key_ind == CHAN_BUCKET_EMPTY) continue;
+        printf("* %zu -> %zu\n", i, key_ind);
     }
     printf("key -> value:\n");
     for (size_t i = 0; i < v->size; ++i) {
@@ -159,30 +414,67 @@ static void
 chan_hash_map_free(struct chan_map *map)
 {
     assert(map);
-    chan_hash_map_clear(map);
-
     struct chan_hash_map *v = (struct chan_hash_map*)map;
-    if (v->key_data) free(v->key_data);
-    if (v->value_data) free(v->value_data);
-    if (v->hash_to_key_ind) free(v->hash_to_key_ind);
+    chan_cow_free(v->key_data);
+    chan_cow_free(v->value_data);
+    chan_cow_free(v->hash_to_key_ind);
     free(v);
 }
 
+static struct chan_map*
+chan_hash_map_clone(const struct chan_map *map)
+{
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    struct chan_hash_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_data = chan_cow_share(v->key_data);
+    clone->value_data = chan_cow_share(v->value_data);
+    clone->hash_to_key_ind = chan_cow_share(v->hash_to_key_ind);
+    return &clone->map;
+}
+
 struct chan_map*
-chan_hash_map_new(
+chan_hash_map_freeze(const struct chan_map *map)
+{
+    assert(map->vtable->free == chan_hash_map_free && "not a hash map");
+    struct chan_hash_map *v = (struct chan_hash_map*)map;
+    return chan_frozen_map_new(v->key_size, v->value_size, v->key_data, v->value_data, v->size);
+}
+
+static struct chan_map*
+hash_map_new(
     size_t key_size,
     size_t value_size,
-    size_t (*hasher)(void*)
+    size_t (*hasher)(void*),
+    bool inline_keys
 ) {
     static const struct chan_map_vtable vtable = {
         chan_hash_map_free,
+        chan_hash_map_clone,
         chan_hash_map_clear,
         chan_hash_map_size,
         chan_hash_map_insert,
+        chan_hash_map_get_or_insert,
         chan_hash_map_at,
         chan_hash_map_remove,
         chan_hash_map_iter_new,
         chan_hash_map_iter_next,
+        chan_hash_map_iter_next_block,
+        chan_hash_map_keys_data,
+        chan_hash_map_values_data,
+        chan_hash_map_writable_values_data,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_hash_map_memory_usage,
+        chan_hash_map_shrink_to_fit,
         chan_hash_map_debug_print,
     };
     static struct chan_map map = { &vtable };
@@ -195,8 +487,31 @@ chan_hash_map_new(
     hash_map->capacity = 0;
     hash_map->key_data = NULL;
     hash_map->value_data = NULL;
+    hash_map->n_buckets = 0;
+    hash_map->bucket_width = chan_bucket_width(MIN_BUCKETS);
+    hash_map->inline_keys = inline_keys;
+    hash_map->bucket_stride = bucket_stride(hash_map, hash_map->bucket_width);
     hash_map->hash_to_key_ind = NULL;
     hash_map->hasher = hasher;
 
     return &hash_map->map;
 }
+
+struct chan_map*
+chan_hash_map_new(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*)
+) {
+    return hash_map_new(key_size, value_size, hasher, false);
+}
+
+struct chan_map*
+chan_hash_map_new_inline_keys(
+    size_t key_size,
+    size_t value_size,
+    size_t (*hasher)(void*)
+) {
+    assert(key_size <= INLINE_KEY_MAX && "key too large to store in the buckets");
+    return hash_map_new(key_size, value_size, hasher, true);
+}
@@ -0,0 +1,569 @@
+#include "map.h"
+#include "bucket_index.h"
+#include "cow.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+// Smallest non-zero number of buckets. Always a power of two.
+static const size_t MIN_BUCKETS = 8;
+
+// The bucket array is grown when more than 3/4 of it would be in use.
+#define MAX_LOAD_NUM 3
+#define MAX_LOAD_DEN 4
+
+// The arena is compacted when more than half of it, and at least this many
+// bytes, belong to removed keys.
+static const size_t MIN_COMPACT_BYTES = 4096;
+
+#define CPY(dst, dst_ind, src, src_ind, item_size) \
+    memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Key of the dense arrays. The bytes are in the arena.
+struct key_entry {
+    size_t offset;
+    size_t length;
+    size_t hash;
+};
+
+struct chan_string_hash_map {
+    struct chan_map map;
+    size_t value_size;
+    // Number of keys.
+    size_t size;
+    // Number of slots.
+    size_t capacity;
+    struct key_entry *key_entries;
+    void *value_data;
+    // Number of buckets in `hash_to_key_ind`, zero or a power of two.
+    size_t n_buckets;
+    // Bytes per bucket, see `bucket_index.h`.
+    size_t bucket_width;
+    void *hash_to_key_ind;
+    // Append-only storage of the NUL-terminated key strings.
+    char *arena;
+    size_t arena_size;
+    size_t arena_capacity;
+    // Bytes in the arena that belong to removed keys.
+    size_t arena_dead;
+};
+
+// FNV-1a.
+static size_t
+hash_string(const char *key, size_t length)
+{
+    size_t h = (size_t)14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (unsigned char)key[i];
+        h *= (size_t)1099511628211ULL;
+    }
+    return h;
+}
+
+static const char*
+key_at(const struct chan_string_hash_map *v, size_t key_ind)
+{
+    return v->arena + v->key_entries[key_ind].offset;
+}
+
+// Returns the bucket that holds the key, or the empty bucket where it should
+// be inserted. Lengths and hashes are compared before the key bytes.
+#define DEFINE_FIND_BUCKET(name, type) \
+static size_t \
+name(const struct chan_map *map, const char *key, size_t length, size_t hash) \
+{ \
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map; \
+    const type *buckets = v->hash_to_key_ind; \
+    const size_t mask = v->n_buckets - 1; \
+    for (size_t i = 0; i < v->n_buckets; ++i) { \
+        const size_t ind = (hash + i) & mask; \
+        const type key_ind = buckets[ind]; \
+        if (key_ind == (type)-1) { \
+            CHAN_STATS_PROBE(map, i); \
+            return ind; \
+        } \
+        const struct key_entry *e = &v->key_entries[key_ind]; \
+        if (e->hash != hash || e->length != length) continue; \
+        CHAN_STATS_ADD(map, comparisons, 1); \
+        if (memcmp(v->arena + e->offset, key, length) == 0) { \
+            CHAN_STATS_PROBE(map, i); \
+            return ind; \
+        } \
+    } \
+    assert(false && "unexpected: hash map is full"); \
+    return 0; \
+}
+
+CHAN_BUCKET_SPECIALIZE(DEFINE_FIND_BUCKET, find_bucket)
+
+static size_t
+find_bucket(const struct chan_map *map, const char *key, size_t length, size_t hash)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    return CHAN_BUCKET_DISPATCH(find_bucket, v->bucket_width, map, key, length, hash);
+}
+
+static size_t
+bucket_get(const struct chan_string_hash_map *v, size_t ind)
+{
+    return chan_bucket_get(v->hash_to_key_ind, v->bucket_width, ind);
+}
+
+static void
+bucket_set(struct chan_string_hash_map *v, size_t ind, size_t key_ind)
+{
+    chan_bucket_set(v->hash_to_key_ind, v->bucket_width, ind, key_ind);
+}
+
+// Returns the bucket that points to `key_ind`.
+static size_t
+find_bucket_of_ind(const struct chan_string_hash_map *v, size_t key_ind)
+{
+    const size_t mask = v->n_buckets - 1;
+    size_t ind = v->key_entries[key_ind].hash & mask;
+    while (bucket_get(v, ind) != key_ind) ind = (ind + 1) & mask;
+    return ind;
+}
+
+// Reallocates the key entry and value arrays to hold exactly `n` items.
+static void
+set_capacity(struct chan_map *map, size_t n)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    if (n == v->capacity) return;
+    assert(n >= v->size);
+    if (n == 0) {
+        chan_cow_free(v->key_entries);
+        chan_cow_free(v->value_data);
+        v->key_entries = NULL;
+        v->value_data = NULL;
+    }
+    else {
+        v->key_entries = CHAN_COW_REALLOC(map, v->key_entries,
+            v->capacity * sizeof(*v->key_entries), n * sizeof(*v->key_entries));
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+        assert(v->key_entries && v->value_data);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
+}
+
+// Smallest number of buckets that can hold `size` keys under the max load.
+static size_t
+buckets_for_size(size_t size)
+{
+    size_t n = MIN_BUCKETS;
+    while (n * MAX_LOAD_NUM < size * MAX_LOAD_DEN) n *= 2;
+    return n;
+}
+
+// Resizes the bucket array to `n_buckets` and reinserts all the keys using
+// their cached hashes.
+static void
+rehash(struct chan_map *map, size_t n_buckets)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    if (n_buckets == v->n_buckets) return;
+    chan_cow_free(v->hash_to_key_ind);
+    v->hash_to_key_ind = NULL;
+    v->n_buckets = n_buckets;
+    v->bucket_width = chan_bucket_width(n_buckets == 0 ? MIN_BUCKETS : n_buckets);
+    if (n_buckets == 0) {
+        assert(v->size == 0);
+        return;
+    }
+    v->hash_to_key_ind = CHAN_COW_REALLOC(map, NULL, 0, n_buckets * v->bucket_width);
+    assert(v->hash_to_key_ind);
+    CHAN_STATS_ADD(map, resizes, 1);
+    const size_t mask = n_buckets - 1;
+    chan_bucket_fill_empty(v->hash_to_key_ind, v->bucket_width, n_buckets);
+    for (size_t key_ind = 0; key_ind < v->size; ++key_ind) {
+        size_t ind = v->key_entries[key_ind].hash & mask;
+        while (bucket_get(v, ind) != CHAN_BUCKET_EMPTY) ind = (ind + 1) & mask;
+        bucket_set(v, ind, key_ind);
+    }
+}
+
+// Copies the live keys to a new arena of exactly the needed size.
+static void
+compact_arena(struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    const size_t live = v->arena_size - v->arena_dead;
+    char *arena = NULL;
+    if (live > 0) arena = CHAN_COW_REALLOC(map, NULL, 0, live);
+    v->key_entries = CHAN_COW_UNSHARE(map, v->key_entries,
+        v->size * sizeof(*v->key_entries), v->capacity * sizeof(*v->key_entries));
+    size_t offset = 0;
+    for (size_t i = 0; i < v->size; ++i) {
+        struct key_entry *e = &v->key_entries[i];
+        memcpy(arena + offset, v->arena + e->offset, e->length + 1);
+        e->offset = offset;
+        offset += e->length + 1;
+    }
+    assert(offset == live);
+    chan_cow_free(v->arena);
+    CHAN_STATS_ADD(map, bytes_moved, live);
+    v->arena = arena;
+    v->arena_size = live;
+    v->arena_capacity = live;
+    v->arena_dead = 0;
+}
+
+// Appends the key and its NUL terminator to the arena, returning its offset.
+static size_t
+arena_push(struct chan_map *map, const char *key, size_t length)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    if (v->arena_size + length + 1 > v->arena_capacity) {
+        size_t n = v->arena_capacity < 64 ? 64 : chan_growth_next_capacity(&map->growth, v->arena_capacity);
+        while (n < v->arena_size + length + 1) n = chan_growth_next_capacity(&map->growth, n);
+        v->arena = CHAN_COW_REALLOC(map, v->arena, v->arena_capacity, n);
+        assert(v->arena);
+        v->arena_capacity = n;
+    }
+    v->arena = CHAN_COW_UNSHARE_RANGE(map, v->arena, v->arena_size, v->arena_capacity,
+        v->arena_size, v->arena_size + length + 1);
+    const size_t offset = v->arena_size;
+    memcpy(v->arena + offset, key, length + 1);
+    v->arena_size += length + 1;
+    return offset;
+}
+
+// Copy the part of an array that is shared with a clone before item or
+// bucket `i` of it is written. See `CHAN_COW_UNSHARE_RANGE()`.
+static void
+make_entry_unique(struct chan_map *map, size_t i)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    v->key_entries = CHAN_COW_UNSHARE_RANGE(map, v->key_entries, v->size * sizeof(*v->key_entries),
+        v->capacity * sizeof(*v->key_entries), i * sizeof(*v->key_entries), (i + 1) * sizeof(*v->key_entries));
+}
+
+static void
+make_value_unique(struct chan_map *map, size_t i)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, i * v->value_size, (i + 1) * v->value_size);
+}
+
+static void
+make_bucket_unique(struct chan_map *map, size_t i)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    const size_t bucket_bytes = v->n_buckets * v->bucket_width;
+    v->hash_to_key_ind = CHAN_COW_UNSHARE_RANGE(map, v->hash_to_key_ind, bucket_bytes, bucket_bytes,
+        i * v->bucket_width, (i + 1) * v->bucket_width);
+}
+
+// Copies the arrays that are shared with a clone. Called before rewriting
+// all of them.
+static void
+make_unique(struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    v->key_entries = CHAN_COW_UNSHARE(map, v->key_entries,
+        v->size * sizeof(*v->key_entries), v->capacity * sizeof(*v->key_entries));
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    const size_t bucket_bytes = v->n_buckets * v->bucket_width;
+    v->hash_to_key_ind = CHAN_COW_UNSHARE(map, v->hash_to_key_ind, bucket_bytes, bucket_bytes);
+    v->arena = CHAN_COW_UNSHARE(map, v->arena, v->arena_size, v->arena_capacity);
+}
+
+static void
+chan_string_hash_map_clear(struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    // All buckets are overwritten, so shared ones need not be copied.
+    const size_t bucket_bytes = v->n_buckets * v->bucket_width;
+    v->hash_to_key_ind = CHAN_COW_UNSHARE(map, v->hash_to_key_ind, 0, bucket_bytes);
+    v->arena = CHAN_COW_UNSHARE(map, v->arena, 0, v->arena_capacity);
+    chan_bucket_fill_empty(v->hash_to_key_ind, v->bucket_width, v->n_buckets);
+    v->size = 0;
+    v->arena_size = 0;
+    v->arena_dead = 0;
+}
+
+static size_t
+chan_string_hash_map_size(const struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    return v->size;
+}
+
+static void*
+chan_string_hash_map_at(const struct chan_map *map, void *key)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    if (v->size == 0) return NULL;
+    const size_t length = strlen(key);
+    const size_t b = find_bucket(map, key, length, hash_string(key, length));
+    const size_t i = bucket_get(v, b);
+    return i != CHAN_BUCKET_EMPTY ? AT(v->value_data, i, v->value_size) : NULL;
+}
+
+static void
+chan_string_hash_map_remove(struct chan_map *map, void *key)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    assert(v->size > 0);
+    const size_t length = strlen(key);
+    size_t b = find_bucket(map, key, length, hash_string(key, length));
+    const size_t key_ind = bucket_get(v, b);
+    assert(key_ind != CHAN_BUCKET_EMPTY);
+
+    // Backward shift deletion: move later keys of the probe chain into the
+    // hole unless that would put them before their home bucket.
+    const size_t mask = v->n_buckets - 1;
+    size_t j = b;
+    for (;;) {
+        j = (j + 1) & mask;
+        const size_t k = bucket_get(v, j);
+        if (k == CHAN_BUCKET_EMPTY) break;
+        const size_t home = v->key_entries[k].hash & mask;
+        const bool home_in_hole_to_j = b <= j ? (b < home && home <= j) : (b < home || home <= j);
+        if (home_in_hole_to_j) continue;
+        make_bucket_unique(map, b);
+        bucket_set(v, b, k);
+        b = j;
+    }
+    make_bucket_unique(map, b);
+    bucket_set(v, b, CHAN_BUCKET_EMPTY);
+
+    // Keep the dense arrays dense by moving the last item into the gap.
+    v->arena_dead += v->key_entries[key_ind].length + 1;
+    const size_t last = v->size - 1;
+    if (key_ind != last) {
+        const size_t last_bucket = find_bucket_of_ind(v, last);
+        make_bucket_unique(map, last_bucket);
+        bucket_set(v, last_bucket, key_ind);
+        make_entry_unique(map, key_ind);
+        make_value_unique(map, key_ind);
+        v->key_entries[key_ind] = v->key_entries[last];
+        CPY(v->value_data, key_ind, v->value_data, last, v->value_size);
+    }
+    v->size--;
+
+    if (v->arena_dead >= MIN_COMPACT_BYTES && 2 * v->arena_dead > v->arena_size) {
+        compact_arena(map);
+    }
+}
+
+static void*
+chan_string_hash_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    // Grow before searching so that the found bucket stays valid.
+    if ((v->size + 1) * MAX_LOAD_DEN > v->n_buckets * MAX_LOAD_NUM) {
+        rehash(map, v->n_buckets == 0 ? MIN_BUCKETS : 2 * v->n_buckets);
+    }
+
+    const size_t length = strlen(key);
+    const size_t hash = hash_string(key, length);
+    const size_t b = find_bucket(map, key, length, hash);
+    const size_t key_ind = bucket_get(v, b);
+    if (key_ind != CHAN_BUCKET_EMPTY) {
+        // The caller may write to the value.
+        make_value_unique(map, key_ind);
+        if (inserted) *inserted = false;
+        return AT(v->value_data, key_ind, v->value_size);
+    }
+
+    // New key.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
+    }
+    make_entry_unique(map, v->size);
+    make_value_unique(map, v->size);
+    make_bucket_unique(map, b);
+    struct key_entry *e = &v->key_entries[v->size];
+    e->offset = arena_push(map, key, length);
+    e->length = length;
+    e->hash = hash;
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    bucket_set(v, b, v->size);
+    v->size++;
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
+}
+
+static void
+chan_string_hash_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    bool inserted;
+    void *slot = chan_string_hash_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
+}
+
+static struct chan_map_iter
+chan_string_hash_map_iter_new(const struct chan_map *map)
+{
+    struct chan_map_iter map_iter;
+    map_iter.ind = 0;
+    return map_iter;
+}
+
+static struct chan_map_iter_item*
+chan_string_hash_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    map_iter->map_iter_item.key = (void*)key_at(v, map_iter->ind);
+    map_iter->map_iter_item.value = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->ind++;
+    return &map_iter->map_iter_item;
+}
+
+// The keys have no fixed size, so each block has a single item.
+static struct chan_map_iter_block*
+chan_string_hash_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_map_iter_item *item = chan_string_hash_map_iter_next(map, map_iter);
+    if (!item) return NULL;
+    map_iter->map_iter_block.keys = item->key;
+    map_iter->map_iter_block.values = item->value;
+    map_iter->map_iter_block.size = 1;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_string_hash_map_values_data(const struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_string_hash_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    return v->value_data;
+}
+
+static struct chan_memory_usage
+chan_string_hash_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    const size_t item_size = sizeof(*v->key_entries) + v->value_size;
+    const size_t bucket_size = v->bucket_width;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v) + v->capacity * item_size + v->n_buckets * bucket_size
+        + v->arena_capacity;
+    usage.used = sizeof(*v) + v->size * (item_size + bucket_size)
+        + v->arena_size - v->arena_dead;
+    return usage;
+}
+
+static void
+chan_string_hash_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    make_unique(map);
+    compact_arena(map);
+    set_capacity(map, v->size);
+    rehash(map, v->size == 0 ? 0 : buckets_for_size(v->size));
+}
+
+static void
+chan_string_hash_map_debug_print(
+    const struct chan_map *map,
+    int (*print_key)(char *dest, int n, void *a),
+    int (*print_value)(char *dest, int n, void *a)
+) {
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    const int bufSize = 256;
+    char buf0[bufSize];
+    char buf1[bufSize];
+    printf("size %zu, capacity %zu, arena %zu/%zu (%zu dead)\n",
+        v->size, v->capacity, v->arena_size, v->arena_capacity, v->arena_dead);
+    printf("key -> value:\n");
+    for (size_t i = 0; i < v->size; ++i) {
+        print_key(buf0, bufSize, (void*)key_at(v, i));
+        print_value(buf1, bufSize, AT(v->value_data, i, v->value_size));
+        printf("* %s -> %s\n", buf0, buf1);
+    }
+}
+
+static void
+chan_string_hash_map_free(struct chan_map *map)
+{
+    assert(map);
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    chan_cow_free(v->key_entries);
+    chan_cow_free(v->value_data);
+    chan_cow_free(v->hash_to_key_ind);
+    chan_cow_free(v->arena);
+    free(v);
+}
+
+static struct chan_map*
+chan_string_hash_map_clone(const struct chan_map *map)
+{
+    struct chan_string_hash_map *v = (struct chan_string_hash_map*)map;
+    struct chan_string_hash_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    clone->key_entries = chan_cow_share(v->key_entries);
+    clone->value_data = chan_cow_share(v->value_data);
+    clone->hash_to_key_ind = chan_cow_share(v->hash_to_key_ind);
+    clone->arena = chan_cow_share(v->arena);
+    return &clone->map;
+}
+
+struct chan_map*
+chan_string_hash_map_new(size_t value_size)
+{
+    static const struct chan_map_vtable vtable = {
+        chan_string_hash_map_free,
+        chan_string_hash_map_clone,
+        chan_string_hash_map_clear,
+        chan_string_hash_map_size,
+        chan_string_hash_map_insert,
+        chan_string_hash_map_get_or_insert,
+        chan_string_hash_map_at,
+        chan_string_hash_map_remove,
+        chan_string_hash_map_iter_new,
+        chan_string_hash_map_iter_next,
+        chan_string_hash_map_iter_next_block,
+        NULL,
+        chan_string_hash_map_values_data,
+        chan_string_hash_map_writable_values_data,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_string_hash_map_memory_usage,
+        chan_string_hash_map_shrink_to_fit,
+        chan_string_hash_map_debug_print,
+    };
+    static struct chan_map map = { &vtable };
+    struct chan_string_hash_map *string_map = malloc(sizeof(*string_map));
+    memcpy(&string_map->map, &map, sizeof(map));
+
+    string_map->value_size = value_size;
+    string_map->size = 0;
+    string_map->capacity = 0;
+    string_map->key_entries = NULL;
+    string_map->value_data = NULL;
+    string_map->n_buckets = 0;
+    string_map->bucket_width = chan_bucket_width(MIN_BUCKETS);
+    string_map->hash_to_key_ind = NULL;
+    string_map->arena = NULL;
+    string_map->arena_size = 0;
+    string_map->arena_capacity = 0;
+    string_map->arena_dead = 0;
+
+    return &string_map->map;
+}
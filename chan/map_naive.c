@@ -1,9 +1,16 @@
 #include "map.h"
+#include "cow.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define NAIVE_MAP_X86
+#include <immintrin.h>
+#endif
+
 #define CPY(dst, dst_ind, src, src_ind, item_size) \
     memcpy((void*)(dst) + (item_size) * (dst_ind), (void*)(src) + (item_size) * (src_ind), item_size)
 
@@ -13,16 +20,209 @@
 #define AT(v, ind, item_size) \
     ((void*)(v) + (item_size) * (ind))
 
+// Size of the buffer inside the map struct that holds the first items, so
+// that small maps do not allocate at all.
+#define INLINE_BYTES 256
+#define INLINE_MAX_ITEMS 16
+// Offset of the inline values is rounded up to this for their alignment.
+#define INLINE_ALIGN 16
+
+// Returns index of `key` among the `n` keys, or -1.
+typedef int (*index_fn)(const void *keys, size_t n, size_t key_size, const void *key);
+
 struct chan_naive_map {
     struct chan_map map;
     size_t key_size;
     size_t value_size;
     size_t size;
     size_t capacity;
+    // The data is in `inline_data` iff `capacity == inline_capacity`.
     void *key_data;
     void *value_data;
+    size_t inline_capacity;
+    index_fn index;
+    union {
+        // The other members only force alignment.
+        long double ld;
+        long long ll;
+        void *p;
+        unsigned char bytes[INLINE_BYTES];
+    } inline_data;
 };
 
+static size_t
+inline_value_offset(size_t key_size, size_t n)
+{
+    return (n * key_size + INLINE_ALIGN - 1) / INLINE_ALIGN * INLINE_ALIGN;
+}
+
+static void
+set_inline_pointers(struct chan_naive_map *v)
+{
+    if (v->inline_capacity == 0) {
+        v->key_data = NULL;
+        v->value_data = NULL;
+        return;
+    }
+    v->key_data = v->inline_data.bytes;
+    v->value_data = v->inline_data.bytes + inline_value_offset(v->key_size, v->inline_capacity);
+}
+
+// Reallocates the key and value arrays to hold at least `n` items, moving
+// them into or out of the inline buffer as needed.
+static void
+set_capacity(struct chan_map *map, size_t n)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    assert(n >= v->size);
+    if (n < v->inline_capacity) n = v->inline_capacity;
+    if (n == v->capacity) return;
+
+    const size_t key_bytes = v->size * v->key_size;
+    const size_t value_bytes = v->size * v->value_size;
+    if (n == v->inline_capacity) {
+        // From the heap to the inline buffer.
+        void *key_data = v->key_data;
+        void *value_data = v->value_data;
+        set_inline_pointers(v);
+        if (v->size > 0) {
+            memcpy(v->key_data, key_data, key_bytes);
+            memcpy(v->value_data, value_data, value_bytes);
+        }
+        chan_cow_free(key_data);
+        chan_cow_free(value_data);
+        CHAN_STATS_ADD(map, bytes_moved, key_bytes + value_bytes);
+    }
+    else if (v->capacity == v->inline_capacity) {
+        // From the inline buffer to the heap.
+        void *key_data = CHAN_COW_REALLOC(map, NULL, 0, n * v->key_size);
+        void *value_data = CHAN_COW_REALLOC(map, NULL, 0, n * v->value_size);
+        if (v->size > 0) {
+            memcpy(key_data, v->key_data, key_bytes);
+            memcpy(value_data, v->value_data, value_bytes);
+        }
+        v->key_data = key_data;
+        v->value_data = value_data;
+        CHAN_STATS_ADD(map, bytes_moved, key_bytes + value_bytes);
+    }
+    else {
+        v->key_data = CHAN_COW_REALLOC(map, v->key_data, v->capacity * v->key_size, n * v->key_size);
+        v->value_data = CHAN_COW_REALLOC(map, v->value_data, v->capacity * v->value_size, n * v->value_size);
+    }
+    CHAN_STATS_ADD(map, resizes, 1);
+    v->capacity = n;
+}
+
+// Copies the parts of the heap arrays that are shared with a clone before
+// items `[from, to)` are written. Clones never share the inline buffer.
+static void
+make_unique(struct chan_map *map, size_t from, size_t to)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    if (v->capacity == v->inline_capacity) return;
+    v->key_data = CHAN_COW_UNSHARE_RANGE(map, v->key_data, v->size * v->key_size, v->capacity * v->key_size,
+        from * v->key_size, to * v->key_size);
+    v->value_data = CHAN_COW_UNSHARE_RANGE(map, v->value_data, v->size * v->value_size,
+        v->capacity * v->value_size, from * v->value_size, to * v->value_size);
+}
+
+static int
+index_generic(const void *keys, size_t n, size_t key_size, const void *key)
+{
+    for (size_t i = 0; i < n; ++i) {
+        if (CMP(keys, i, key, 0, key_size) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef NAIVE_MAP_X86
+
+// The vectorized scans compare whole keys as integers, which is the same as
+// the `memcmp` of the generic version. The keys need not be aligned.
+
+static int
+index4_sse2(const void *keys, size_t n, size_t key_size, const void *key)
+{
+    int32_t k;
+    memcpy(&k, key, sizeof(k));
+    const __m128i needle = _mm_set1_epi32(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)AT(keys, i, 4));
+        const int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    const int j = index_generic(AT(keys, i, 4), n - i, 4, key);
+    return j >= 0 ? (int)i + j : -1;
+}
+
+static int
+index8_sse2(const void *keys, size_t n, size_t key_size, const void *key)
+{
+    int64_t k;
+    memcpy(&k, key, sizeof(k));
+    const __m128i needle = _mm_set1_epi64x(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)AT(keys, i, 8));
+        // SSE2 has no 64-bit compare, so require both 32-bit halves to match.
+        const __m128i eq = _mm_cmpeq_epi32(x, needle);
+        const __m128i eq64 = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        const int mask = _mm_movemask_pd(_mm_castsi128_pd(eq64));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    const int j = index_generic(AT(keys, i, 8), n - i, 8, key);
+    return j >= 0 ? (int)i + j : -1;
+}
+
+__attribute__((target("avx2"))) static int
+index4_avx2(const void *keys, size_t n, size_t key_size, const void *key)
+{
+    int32_t k;
+    memcpy(&k, key, sizeof(k));
+    const __m256i needle = _mm256_set1_epi32(k);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)AT(keys, i, 4));
+        const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(x, needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    const int j = index4_sse2(AT(keys, i, 4), n - i, 4, key);
+    return j >= 0 ? (int)i + j : -1;
+}
+
+__attribute__((target("avx2"))) static int
+index8_avx2(const void *keys, size_t n, size_t key_size, const void *key)
+{
+    int64_t k;
+    memcpy(&k, key, sizeof(k));
+    const __m256i needle = _mm256_set1_epi64x(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256i x = _mm256_loadu_si256((const __m256i*)AT(keys, i, 8));
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(x, needle)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    const int j = index8_sse2(AT(keys, i, 8), n - i, 8, key);
+    return j >= 0 ? (int)i + j : -1;
+}
+
+#endif
+
+// Picks the fastest scan for the key size and the CPU we are running on.
+static index_fn
+select_index_fn(size_t key_size)
+{
+#ifdef NAIVE_MAP_X86
+    const bool avx2 = __builtin_cpu_supports("avx2");
+    if (key_size == 4) return avx2 ? index4_avx2 : index4_sse2;
+    if (key_size == 8) return avx2 ? index8_avx2 : index8_sse2;
+#endif
+    return index_generic;
+}
+
 static void
 chan_naive_map_clear(struct chan_map *map)
 {
@@ -41,12 +241,9 @@ static int
 chan_naive_map_index(const struct chan_map *map, void *key)
 {
     struct chan_naive_map *v = (struct chan_naive_map*)map;
-    for (size_t i = 0; i < v->size; ++i) {
-        if (CMP(v->key_data, i, key, 0, v->key_size) == 0) {
-            return i;
-        }
-    }
-    return -1;
+    const int i = v->index(v->key_data, v->size, v->key_size, key);
+    CHAN_STATS_ADD(map, comparisons, i >= 0 ? (size_t)i + 1 : v->size);
+    return i;
 }
 
 static void*
@@ -63,6 +260,7 @@ chan_naive_map_remove(struct chan_map *map, void *key)
     const int n = chan_naive_map_index(map, key);
     assert(n >= 0);
     struct chan_naive_map *v = (struct chan_naive_map*)map;
+    make_unique(map, n, v->size);
     v->size--;
     for (size_t i = n; i < v->size; ++i) {
         CPY(v->key_data, i, v->key_data, i + 1, v->key_size);
@@ -70,28 +268,37 @@ chan_naive_map_remove(struct chan_map *map, void *key)
     }
 }
 
-static void
-chan_naive_map_insert(struct chan_map *map, void *key, void *value)
+static void*
+chan_naive_map_get_or_insert(struct chan_map *map, void *key, void *default_value, bool *inserted)
 {
     struct chan_naive_map *v = (struct chan_naive_map*)map;
-    if (chan_naive_map_at(map, key) == NULL) {
-        // New key.
-        if (v->size >= v->capacity) {
-            const size_t n = v->size == 0 ? 4 : 3 * v->size / 2;
-            v->key_data = realloc(v->key_data, n * sizeof(v->key_size));
-            v->value_data = realloc(v->value_data, n * sizeof(v->value_size));
-            v->capacity = n;
-        }
-        CPY(v->key_data, v->size, key, 0, v->key_size);
-        CPY(v->value_data, v->size, value, 0, v->value_size);
-        v->size++;
+    const int i = chan_naive_map_index(map, key);
+    if (i >= 0) {
+        // The caller may write to the value.
+        make_unique(map, i, i + 1);
+        if (inserted) *inserted = false;
+        return AT(v->value_data, i, v->value_size);
     }
-    else {
-        // Replace existing key.
-        const int i = chan_naive_map_index(map, key);
-        CPY(v->key_data, i, key, 0, v->key_size);
-        CPY(v->value_data, i, value, 0, v->value_size);
+
+    // New key.
+    if (v->size >= v->capacity) {
+        set_capacity(map, chan_growth_next_capacity(&map->growth, v->size));
     }
+    make_unique(map, v->size, v->size + 1);
+    CPY(v->key_data, v->size, key, 0, v->key_size);
+    CPY(v->value_data, v->size, default_value, 0, v->value_size);
+    v->size++;
+    if (inserted) *inserted = true;
+    return AT(v->value_data, v->size - 1, v->value_size);
+}
+
+static void
+chan_naive_map_insert(struct chan_map *map, void *key, void *value)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    bool inserted;
+    void *slot = chan_naive_map_get_or_insert(map, key, value, &inserted);
+    if (!inserted) memcpy(slot, value, v->value_size);
 }
 
 static struct chan_map_iter
@@ -113,6 +320,66 @@ chan_naive_map_iter_next(const struct chan_map *map, struct chan_map_iter *map_i
     return &map_iter->map_iter_item;
 }
 
+static struct chan_map_iter_block*
+chan_naive_map_iter_next_block(const struct chan_map *map, struct chan_map_iter *map_iter)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    if (map_iter->ind >= v->size) return NULL;
+    // All the remaining items are stored contiguously.
+    map_iter->map_iter_block.keys = AT(v->key_data, map_iter->ind, v->key_size);
+    map_iter->map_iter_block.values = AT(v->value_data, map_iter->ind, v->value_size);
+    map_iter->map_iter_block.size = v->size - map_iter->ind;
+    map_iter->ind = v->size;
+    return &map_iter->map_iter_block;
+}
+
+static const void*
+chan_naive_map_keys_data(const struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    return v->key_data;
+}
+
+static const void*
+chan_naive_map_values_data(const struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    return v->value_data;
+}
+
+static void*
+chan_naive_map_writable_values_data(struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    // Clones never share the inline buffer.
+    if (v->capacity != v->inline_capacity) {
+        v->value_data = CHAN_COW_UNSHARE(map, v->value_data, v->size * v->value_size, v->capacity * v->value_size);
+    }
+    return v->value_data;
+}
+
+static struct chan_memory_usage
+chan_naive_map_memory_usage(const struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    struct chan_memory_usage usage;
+    usage.allocated = sizeof(*v);
+    usage.used = sizeof(*v);
+    if (v->capacity != v->inline_capacity) {
+        const size_t item_size = v->key_size + v->value_size;
+        usage.allocated += v->capacity * item_size;
+        usage.used += v->size * item_size;
+    }
+    return usage;
+}
+
+static void
+chan_naive_map_shrink_to_fit(struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    set_capacity(map, v->size);
+}
+
 static void
 chan_naive_map_debug_print(
     const struct chan_map *map,
@@ -138,23 +405,60 @@ chan_naive_map_free(struct chan_map *map)
     chan_naive_map_clear(map);
 
     struct chan_naive_map *v = (struct chan_naive_map*)map;
-    if (v->key_data) free(v->key_data);
-    if (v->value_data) free(v->value_data);
+    if (v->capacity != v->inline_capacity) {
+        chan_cow_free(v->key_data);
+        chan_cow_free(v->value_data);
+    }
     free(v);
 }
 
+static struct chan_map*
+chan_naive_map_clone(const struct chan_map *map)
+{
+    struct chan_naive_map *v = (struct chan_naive_map*)map;
+    struct chan_naive_map *clone = malloc(sizeof(*clone));
+    memcpy(clone, v, sizeof(*clone));
+#ifdef CHAN_STATS
+    memset(&clone->map.stats, 0, sizeof(clone->map.stats));
+#endif
+    if (v->capacity == v->inline_capacity) {
+        // The inline buffer was copied with the struct.
+        set_inline_pointers(clone);
+    }
+    else {
+        clone->key_data = chan_cow_share(v->key_data);
+        clone->value_data = chan_cow_share(v->value_data);
+    }
+    return &clone->map;
+}
+
 struct chan_map*
 chan_naive_map_new(size_t key_size, size_t value_size)
 {
     static const struct chan_map_vtable vtable = {
         chan_naive_map_free,
+        chan_naive_map_clone,
         chan_naive_map_clear,
         chan_naive_map_size,
         chan_naive_map_insert,
+        chan_naive_map_get_or_insert,
         chan_naive_map_at,
         chan_naive_map_remove,
         chan_naive_map_iter_new,
         chan_naive_map_iter_next,
+        chan_naive_map_iter_next_block,
+        chan_naive_map_keys_data,
+        chan_naive_map_values_data,
+        chan_naive_map_writable_values_data,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        chan_naive_map_memory_usage,
+        chan_naive_map_shrink_to_fit,
         chan_naive_map_debug_print,
     };
     static struct chan_map map = { &vtable };
@@ -164,9 +468,14 @@ chan_naive_map_new(size_t key_size, size_t value_size)
     naive_map->key_size = key_size;
     naive_map->value_size = value_size;
     naive_map->size = 0;
-    naive_map->capacity = 0;
-    naive_map->key_data = NULL;
-    naive_map->value_data = NULL;
+    naive_map->index = select_index_fn(key_size);
+
+    // As many items as fit in the inline buffer.
+    size_t n = INLINE_MAX_ITEMS;
+    while (n > 0 && inline_value_offset(key_size, n) + n * value_size > INLINE_BYTES) n--;
+    naive_map->inline_capacity = n;
+    naive_map->capacity = n;
+    set_inline_pointers(naive_map);
 
     return &naive_map->map;
 }
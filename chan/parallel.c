@@ -0,0 +1,402 @@
+#if !defined(_POSIX_C_SOURCE) || _POSIX_C_SOURCE < 200809L
+// For `sysconf`.
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "parallel.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Bytes of values per chunk of the parallel scans. Large enough that the
+// task bookkeeping is negligible, small enough to balance the threads.
+#define CHUNK_BYTES (64 * 1024)
+
+#define CACHE_LINE 64
+
+// Task indices `[begin, end)` left to a thread. The owner takes tasks from
+// the front and thieves take the back half.
+struct worker {
+    pthread_mutex_t lock;
+    size_t begin;
+    size_t end;
+    pthread_t thread;
+    struct chan_pool *pool;
+    size_t index;
+};
+
+struct chan_pool {
+    // Number of threads, including the one that calls `chan_pool_run()`,
+    // which uses `workers[0]`.
+    size_t n_threads;
+    struct worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // Incremented by each run, so that the threads can wait for the next.
+    size_t generation;
+    // Number of threads other than the caller still working on the run.
+    size_t n_busy;
+    bool stop;
+    void (*fn)(void *ctx, size_t task);
+    void *ctx;
+};
+
+static bool
+take_task(struct worker *w, size_t *task)
+{
+    pthread_mutex_lock(&w->lock);
+    const bool found = w->begin < w->end;
+    if (found) *task = w->begin++;
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+// Moves the back half of the tasks of another thread to `w`.
+static bool
+steal_tasks(struct worker *w)
+{
+    struct chan_pool *pool = w->pool;
+    for (size_t i = 1; i < pool->n_threads; ++i) {
+        struct worker *victim = &pool->workers[(w->index + i) % pool->n_threads];
+        pthread_mutex_lock(&victim->lock);
+        const size_t left = victim->end - victim->begin;
+        size_t begin = 0, end = 0;
+        if (left > 0) {
+            end = victim->end;
+            begin = end - (left + 1) / 2;
+            victim->end = begin;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (begin == end) continue;
+        pthread_mutex_lock(&w->lock);
+        w->begin = begin;
+        w->end = end;
+        pthread_mutex_unlock(&w->lock);
+        return true;
+    }
+    return false;
+}
+
+// Returns when no thread has tasks left. Tasks already taken by other threads
+// may still be running.
+static void
+work(struct worker *w)
+{
+    struct chan_pool *pool = w->pool;
+    size_t task;
+    do {
+        while (take_task(w, &task)) pool->fn(pool->ctx, task);
+    } while (steal_tasks(w));
+}
+
+static void*
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct chan_pool *pool = w->pool;
+    size_t generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->stop && pool->generation == generation) pthread_cond_wait(&pool->start, &pool->lock);
+        generation = pool->generation;
+        const bool stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) return NULL;
+
+        work(w);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->n_busy == 0) pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+struct chan_pool*
+chan_pool_new(size_t n_threads)
+{
+    if (n_threads == 0) {
+        const long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cores > 0 ? (size_t)n_cores : 1;
+    }
+    struct chan_pool *pool = malloc(sizeof(*pool));
+    assert(pool);
+    pool->n_threads = n_threads;
+    pool->workers = malloc(n_threads * sizeof(*pool->workers));
+    assert(pool->workers);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->n_busy = 0;
+    pool->stop = false;
+    pool->fn = NULL;
+    pool->ctx = NULL;
+    for (size_t i = 0; i < n_threads; ++i) {
+        struct worker *w = &pool->workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->begin = 0;
+        w->end = 0;
+        w->pool = pool;
+        w->index = i;
+        if (i > 0) {
+            const int err = pthread_create(&w->thread, NULL, worker_main, w);
+            assert(err == 0);
+            (void)err;
+        }
+    }
+    return pool;
+}
+
+void
+chan_pool_free(struct chan_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        struct worker *w = &pool->workers[i];
+        if (i > 0) pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+size_t
+chan_pool_size(const struct chan_pool *pool)
+{
+    return pool->n_threads;
+}
+
+void
+chan_pool_run(struct chan_pool *pool, size_t n_tasks, void (*fn)(void *ctx, size_t task), void *ctx)
+{
+    if (n_tasks == 0) return;
+    if (!pool || pool->n_threads == 1 || n_tasks == 1) {
+        for (size_t i = 0; i < n_tasks; ++i) fn(ctx, i);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    assert(pool->n_busy == 0 && "pool is already running");
+    pool->fn = fn;
+    pool->ctx = ctx;
+    for (size_t i = 0; i < pool->n_threads; ++i) {
+        // The other threads are waiting, so the ranges can be set unlocked.
+        struct worker *w = &pool->workers[i];
+        w->begin = n_tasks * i / pool->n_threads;
+        w->end = n_tasks * (i + 1) / pool->n_threads;
+    }
+    pool->n_busy = pool->n_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_busy > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Number of values per chunk: a whole number of cache lines when the value
+// size divides the line size.
+static size_t
+chunk_items(size_t value_size)
+{
+    const size_t n = CHUNK_BYTES / value_size;
+    if (n == 0) return 1;
+    if (CACHE_LINE % value_size == 0) return n / (CACHE_LINE / value_size) * (CACHE_LINE / value_size);
+    return n;
+}
+
+struct scan {
+    void *values;
+    size_t size;
+    size_t value_size;
+    size_t chunk_items;
+    // The chunks start at multiples of `chunk_items` counted from `skew`
+    // items before `values`.
+    size_t skew;
+    void (*fn)(void *ctx, void *values, size_t n);
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n);
+    void *ctx;
+    // Accumulator of each chunk, `acc_size` bytes each.
+    void *accs;
+    size_t acc_size;
+};
+
+static size_t
+scan_n_chunks(const struct scan *s)
+{
+    return (s->skew + s->size + s->chunk_items - 1) / s->chunk_items;
+}
+
+static void
+scan_chunk(const struct scan *s, size_t chunk, size_t *first, size_t *n)
+{
+    const size_t begin = chunk == 0 ? 0 : chunk * s->chunk_items - s->skew;
+    size_t end = (chunk + 1) * s->chunk_items - s->skew;
+    if (end > s->size) end = s->size;
+    *first = begin;
+    *n = end - begin;
+}
+
+// Skew that puts the chunk boundaries on cache line boundaries, so that the
+// threads do not write to the same lines.
+static size_t
+aligning_skew(const void *values, size_t value_size)
+{
+    const size_t misalignment = (uintptr_t)values % CACHE_LINE;
+    if (CACHE_LINE % value_size != 0 || misalignment % value_size != 0) return 0;
+    return misalignment / value_size;
+}
+
+static void
+for_task(void *ctx, size_t chunk)
+{
+    struct scan *s = ctx;
+    size_t first, n;
+    scan_chunk(s, chunk, &first, &n);
+    s->fn(s->ctx, AT(s->values, first, s->value_size), n);
+}
+
+static void
+reduce_task(void *ctx, size_t chunk)
+{
+    struct scan *s = ctx;
+    size_t first, n;
+    scan_chunk(s, chunk, &first, &n);
+    s->reduce(s->ctx, AT(s->accs, chunk, s->acc_size), AT(s->values, first, s->value_size), n);
+}
+
+static void
+parallel_for(
+    void *values,
+    size_t size,
+    size_t value_size,
+    void (*fn)(void *ctx, void *values, size_t n),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    if (size == 0) return;
+    struct scan s = {
+        values, size, value_size, chunk_items(value_size), aligning_skew(values, value_size),
+        fn, NULL, ctx, NULL, 0
+    };
+    chan_pool_run(pool, scan_n_chunks(&s), for_task, &s);
+}
+
+static void
+parallel_reduce(
+    const void *values,
+    size_t size,
+    size_t value_size,
+    void *acc,
+    size_t acc_size,
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n),
+    void (*combine)(void *ctx, void *acc, const void *other),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    // Only reads, so the chunks need not be aligned, and they stay the same
+    // wherever the values are stored.
+    struct scan s = { (void*)values, size, value_size, chunk_items(value_size), 0, NULL, reduce, ctx, NULL, acc_size };
+    const size_t n_chunks = scan_n_chunks(&s);
+    if (n_chunks == 0) return;
+    s.accs = malloc(n_chunks * acc_size);
+    assert(s.accs);
+    for (size_t i = 0; i < n_chunks; ++i) memcpy(AT(s.accs, i, acc_size), acc, acc_size);
+    chan_pool_run(pool, n_chunks, reduce_task, &s);
+    for (size_t i = 0; i < n_chunks; ++i) combine(ctx, acc, AT(s.accs, i, acc_size));
+    free(s.accs);
+}
+
+void
+chan_list_parallel_for(
+    struct chan_list *list,
+    size_t value_size,
+    void (*fn)(void *ctx, void *values, size_t n),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    size_t size;
+    void *values = chan_list_writable_data(list, &size);
+    assert(size < 2 || (char*)chan_list_at(list, 1) - (char*)values == (ptrdiff_t)value_size);
+    parallel_for(values, size, value_size, fn, ctx, pool);
+}
+
+void
+chan_list_parallel_reduce(
+    const struct chan_list *list,
+    size_t value_size,
+    void *acc,
+    size_t acc_size,
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n),
+    void (*combine)(void *ctx, void *acc, const void *other),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    size_t size;
+    const void *values = chan_list_data(list, &size);
+    assert(size < 2 || (char*)chan_list_at(list, 1) - (char*)values == (ptrdiff_t)value_size);
+    parallel_reduce(values, size, value_size, acc, acc_size, reduce, combine, ctx, pool);
+}
+
+// Checks `value_size` against the first two values from the iterator, which
+// must be at multiples of it in the values array.
+static inline bool
+map_value_size_matches(const struct chan_map *map, const void *values, size_t size, size_t value_size)
+{
+    struct chan_map_iter iter = chan_map_iter_new(map);
+    struct chan_map_iter_item *item;
+    for (int k = 0; k < 2 && (item = chan_map_iter_next(map, &iter)); ++k) {
+        const size_t offset = (const char*)item->value - (const char*)values;
+        if (offset % value_size != 0 || offset >= size * value_size) return false;
+    }
+    return true;
+}
+
+void
+chan_map_parallel_for(
+    struct chan_map *map,
+    size_t value_size,
+    void (*fn)(void *ctx, void *values, size_t n),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    size_t size;
+    void *values = chan_map_writable_values_data(map, &size);
+    assert(map_value_size_matches(map, values, size, value_size));
+    parallel_for(values, size, value_size, fn, ctx, pool);
+}
+
+void
+chan_map_parallel_reduce(
+    const struct chan_map *map,
+    size_t value_size,
+    void *acc,
+    size_t acc_size,
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n),
+    void (*combine)(void *ctx, void *acc, const void *other),
+    void *ctx,
+    struct chan_pool *pool
+) {
+    size_t size;
+    const void *values = chan_map_values_data(map, &size);
+    assert(map_value_size_matches(map, values, size, value_size));
+    parallel_reduce(values, size, value_size, acc, acc_size, reduce, combine, ctx, pool);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include "list.h"
+#include "map.h"
+
+// Pool of worker threads that share the tasks of a run by work stealing:
+// each thread starts on an equal share of the task indices and, when done,
+// takes half of the remaining tasks of another thread.
+struct chan_pool;
+
+// Pool of `n_threads` threads including the calling thread, which works too.
+// Zero picks one thread per online core.
+struct chan_pool *chan_pool_new(size_t n_threads);
+void chan_pool_free(struct chan_pool *pool);
+size_t chan_pool_size(const struct chan_pool *pool);
+// Calls `fn(ctx, i)` for each `i < n_tasks` and returns when all the calls
+// have returned. Runs one call at a time per thread, so a pool must not be
+// used by two runs at once.
+void chan_pool_run(struct chan_pool *pool, size_t n_tasks, void (*fn)(void *ctx, size_t task), void *ctx);
+
+// The parallel scans split the contiguous values, `value_size` bytes each,
+// into chunks of a fixed number of items, a whole number of cache lines where
+// the value size allows, and call `fn(ctx, values, n)` on each chunk of `n`
+// values. `chan_list_parallel_for()` and `chan_map_parallel_for()` first copy
+// the values shared with clones, so `fn` may write them.
+void chan_list_parallel_for(
+    struct chan_list *list,
+    size_t value_size,
+    void (*fn)(void *ctx, void *values, size_t n),
+    void *ctx,
+    struct chan_pool *pool
+);
+
+// Reduces the values to `acc`, which holds `acc_size` bytes. On entry `acc`
+// holds the identity element, which starts the accumulator of each chunk.
+// `reduce(ctx, acc, values, n)` accumulates a chunk, and `combine(ctx, acc,
+// other)` then folds the chunk accumulators into `acc` in the order of the
+// chunks. The chunks do not depend on the number of threads, so for an
+// associative `combine` the result is the same with any pool, including
+// floating point results.
+void chan_list_parallel_reduce(
+    const struct chan_list *list,
+    size_t value_size,
+    void *acc,
+    size_t acc_size,
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n),
+    void (*combine)(void *ctx, void *acc, const void *other),
+    void *ctx,
+    struct chan_pool *pool
+);
+
+// Same over the values of a map, in the order of `chan_map_values_data()`.
+void chan_map_parallel_for(
+    struct chan_map *map,
+    size_t value_size,
+    void (*fn)(void *ctx, void *values, size_t n),
+    void *ctx,
+    struct chan_pool *pool
+);
+
+void chan_map_parallel_reduce(
+    const struct chan_map *map,
+    size_t value_size,
+    void *acc,
+    size_t acc_size,
+    void (*reduce)(void *ctx, void *acc, const void *values, size_t n),
+    void (*combine)(void *ctx, void *acc, const void *other),
+    void *ctx,
+    struct chan_pool *pool
+);
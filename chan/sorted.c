@@ -0,0 +1,251 @@
+#include "sorted.h"
+#include "map.h"
+
+#include <assert.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define SORTED_X86
+#include <immintrin.h>
+#endif
+
+#define AT(v, ind, item_size) \
+    ((void*)(v) + (item_size) * (ind))
+
+// Sizes of arrays beyond which the larger one is searched with `gallop()`.
+#define GALLOP_RATIO 8
+
+struct sorted_array {
+    const void *data;
+    size_t size;
+    size_t item_size;
+    bool (*less)(void*, void*);
+};
+
+// Strict "less than". The `less` function may also be "less than or equal".
+static inline bool
+item_less(const struct sorted_array *s, const void *a, const void *b)
+{
+    return s->less((void*)a, (void*)b) && memcmp(a, b, s->item_size) != 0;
+}
+
+// Position of the first item in `[lo, size)` not less than `item`. Probes
+// `lo`, `lo + 2`, `lo + 6`, ... before a binary search, so that the cost is
+// logarithmic in the distance to the result.
+static size_t
+gallop(const struct sorted_array *s, const void *item, size_t lo)
+{
+    size_t bound = lo;
+    size_t step = 1;
+    while (bound < s->size && item_less(s, AT(s->data, bound, s->item_size), item)) {
+        lo = bound + 1;
+        bound = lo + step;
+        step *= 2;
+    }
+    size_t hi = bound < s->size ? bound : s->size;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (item_less(s, AT(s->data, mid, s->item_size), item)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static size_t
+set_op(
+    const struct sorted_array *a,
+    const struct sorted_array *b,
+    enum chan_set_op op,
+    void *out
+) {
+    const size_t item_size = a->item_size;
+    const bool gallop_a = a->size >= GALLOP_RATIO * b->size;
+    const bool gallop_b = b->size >= GALLOP_RATIO * a->size;
+    size_t n = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a->size && j < b->size) {
+        const void *x = AT(a->data, i, item_size);
+        const void *y = AT(b->data, j, item_size);
+        if (item_less(a, x, y)) {
+            const size_t end = gallop_a ? gallop(a, y, i + 1) : i + 1;
+            if (op != CHAN_SET_INTERSECTION) {
+                memcpy(AT(out, n, item_size), x, (end - i) * item_size);
+                n += end - i;
+            }
+            i = end;
+        }
+        else if (item_less(a, y, x)) {
+            const size_t end = gallop_b ? gallop(b, x, j + 1) : j + 1;
+            if (op == CHAN_SET_UNION) {
+                memcpy(AT(out, n, item_size), y, (end - j) * item_size);
+                n += end - j;
+            }
+            j = end;
+        }
+        else {
+            if (op != CHAN_SET_DIFFERENCE) memcpy(AT(out, n++, item_size), x, item_size);
+            i++;
+            j++;
+        }
+    }
+    if (op != CHAN_SET_INTERSECTION) {
+        memcpy(AT(out, n, item_size), AT(a->data, i, item_size), (a->size - i) * item_size);
+        n += a->size - i;
+    }
+    if (op == CHAN_SET_UNION) {
+        memcpy(AT(out, n, item_size), AT(b->data, j, item_size), (b->size - j) * item_size);
+        n += b->size - j;
+    }
+    return n;
+}
+
+#define SORTED_ARRAYS(a, na, b, nb, item_size, less) \
+    struct sorted_array sa = { a, na, item_size, less }; \
+    struct sorted_array sb = { b, nb, item_size, less }
+
+size_t
+chan_sorted_union(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+) {
+    SORTED_ARRAYS(a, na, b, nb, item_size, less);
+    return set_op(&sa, &sb, CHAN_SET_UNION, out);
+}
+
+size_t
+chan_sorted_intersection(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+) {
+    SORTED_ARRAYS(a, na, b, nb, item_size, less);
+    return set_op(&sa, &sb, CHAN_SET_INTERSECTION, out);
+}
+
+size_t
+chan_sorted_difference(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+) {
+    SORTED_ARRAYS(a, na, b, nb, item_size, less);
+    return set_op(&sa, &sb, CHAN_SET_DIFFERENCE, out);
+}
+
+// The vectorized intersections walk the smaller array `a` and compare each of
+// its items to a whole block of `b` at once, first skipping the blocks that
+// end below the item. The scalar merge finishes the last partial block.
+
+#define SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n) \
+    while (i < na && j < nb) { \
+        if (a[i] < b[j]) i++; \
+        else if (b[j] < a[i]) j++; \
+        else { \
+            out[n++] = a[i]; \
+            i++; \
+            j++; \
+        } \
+    }
+
+#ifdef SORTED_X86
+
+static size_t
+intersection_i32_sse2(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    for (; i < na; ++i) {
+        while (j + 4 <= nb && b[j + 3] < a[i]) j += 4;
+        if (j + 4 > nb) break;
+        const __m128i x = _mm_loadu_si128((const __m128i*)(b + j));
+        const __m128i eq = _mm_cmpeq_epi32(x, _mm_set1_epi32(a[i]));
+        if (_mm_movemask_epi8(eq)) out[n++] = a[i];
+    }
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+}
+
+static size_t
+intersection_i64_sse2(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    for (; i < na; ++i) {
+        while (j + 2 <= nb && b[j + 1] < a[i]) j += 2;
+        if (j + 2 > nb) break;
+        const __m128i x = _mm_loadu_si128((const __m128i*)(b + j));
+        // SSE2 has no 64-bit compare, so require both 32-bit halves to match.
+        const __m128i eq = _mm_cmpeq_epi32(x, _mm_set1_epi64x(a[i]));
+        const __m128i eq64 = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        if (_mm_movemask_epi8(eq64)) out[n++] = a[i];
+    }
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+}
+
+__attribute__((target("avx2"))) static size_t
+intersection_i32_avx2(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    for (; i < na; ++i) {
+        while (j + 8 <= nb && b[j + 7] < a[i]) j += 8;
+        if (j + 8 > nb) break;
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(b + j));
+        const __m256i eq = _mm256_cmpeq_epi32(x, _mm256_set1_epi32(a[i]));
+        if (_mm256_movemask_epi8(eq)) out[n++] = a[i];
+    }
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+}
+
+__attribute__((target("avx2"))) static size_t
+intersection_i64_avx2(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    size_t i = 0, j = 0, n = 0;
+    for (; i < na; ++i) {
+        while (j + 4 <= nb && b[j + 3] < a[i]) j += 4;
+        if (j + 4 > nb) break;
+        const __m256i x = _mm256_loadu_si256((const __m256i*)(b + j));
+        const __m256i eq = _mm256_cmpeq_epi64(x, _mm256_set1_epi64x(a[i]));
+        if (_mm256_movemask_epi8(eq)) out[n++] = a[i];
+    }
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+}
+
+#endif
+
+size_t
+chan_sorted_intersection_i32(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out)
+{
+    // The result is the same either way, walk the smaller array.
+    if (na > nb) return chan_sorted_intersection_i32(b, nb, a, na, out);
+#ifdef SORTED_X86
+    if (__builtin_cpu_supports("avx2")) return intersection_i32_avx2(a, na, b, nb, out);
+    return intersection_i32_sse2(a, na, b, nb, out);
+#else
+    size_t i = 0, j = 0, n = 0;
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+#endif
+}
+
+size_t
+chan_sorted_intersection_i64(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    if (na > nb) return chan_sorted_intersection_i64(b, nb, a, na, out);
+#ifdef SORTED_X86
+    if (__builtin_cpu_supports("avx2")) return intersection_i64_avx2(a, na, b, nb, out);
+    return intersection_i64_sse2(a, na, b, nb, out);
+#else
+    size_t i = 0, j = 0, n = 0;
+    SCALAR_INTERSECTION(a, na, b, nb, out, i, j, n);
+    return n;
+#endif
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Set operations on sorted arrays of unique items, eg the data of a vector
+// list kept in order. The result is written to `out`, which must not overlap
+// the inputs and must have room for `na + nb` items for union, `min(na, nb)`
+// for intersection and `na` for difference. Returns the number of items
+// written. Items in both arrays are taken from `a`.
+//
+// Function `less` returns true iff first argument is less than (or equal to)
+// the second. When one array is much smaller, intersection and difference
+// gallop through the larger one in about `m log(n / m)` comparisons.
+size_t chan_sorted_union(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+);
+size_t chan_sorted_intersection(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+);
+size_t chan_sorted_difference(
+    const void *a, size_t na,
+    const void *b, size_t nb,
+    size_t item_size,
+    bool (*less)(void*, void*),
+    void *out
+);
+
+// Intersections of sorted arrays of unique integers, vectorized on x86.
+size_t chan_sorted_intersection_i32(const int32_t *a, size_t na, const int32_t *b, size_t nb, int32_t *out);
+size_t chan_sorted_intersection_i64(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdlib.h>
+
+// Number of buckets in the probe length histogram. The last bucket counts
+// all lookups that needed at least `CHAN_STATS_PROBE_HIST - 1` probes.
+#define CHAN_STATS_PROBE_HIST 16
+
+// Hot-path counters of a container. Only collected when the library is built
+// with `CHAN_STATS` defined (CMake option of the same name), otherwise all
+// the counters read as zero and the bookkeeping compiles away.
+struct chan_stats {
+    // Number of calls to `realloc` on the container buffers.
+    size_t reallocs;
+    // Bytes copied by `realloc` calls that moved a buffer.
+    size_t bytes_moved;
+    // Bytes copied to stop sharing a buffer with a clone of the container.
+    size_t cow_bytes;
+    // Number of times the capacity of the container was changed.
+    size_t resizes;
+    // Number of key comparisons (`memcmp` or `less`).
+    size_t comparisons;
+    // Hash map: histogram of the number of probes per lookup.
+    size_t probe_hist[CHAN_STATS_PROBE_HIST];
+    // BST map: depth of the deepest node, root having depth 0. ART map: most
+    // inner nodes above a leaf.
+    size_t max_depth;
+};
+
+// Memory held by a container, in bytes. `used` counts the bytes that hold
+// the live elements and their per-element bookkeeping, so `allocated - used`
+// is the most that shrinking the container can give back.
+struct chan_memory_usage {
+    size_t allocated;
+    size_t used;
+};
+
+#ifdef CHAN_STATS
+
+// The containers are passed as (possibly const) pointers to `chan_map` or
+// `chan_list`, both of which have a `stats` field.
+#define CHAN_STATS_OF(c) ((struct chan_stats*)&(c)->stats)
+
+#define CHAN_STATS_ADD(c, field, n) (CHAN_STATS_OF(c)->field += (n))
+
+#define CHAN_STATS_MAX(c, field, n) \
+    do { if ((size_t)(n) > CHAN_STATS_OF(c)->field) CHAN_STATS_OF(c)->field = (n); } while (0)
+
+#define CHAN_STATS_PROBE(c, n) \
+    (CHAN_STATS_OF(c)->probe_hist[(size_t)(n) < CHAN_STATS_PROBE_HIST ? (size_t)(n) : CHAN_STATS_PROBE_HIST - 1]++)
+
+#define CHAN_REALLOC(c, ptr, old_bytes, new_bytes) \
+    chan_stats_realloc(CHAN_STATS_OF(c), ptr, old_bytes, new_bytes)
+
+static inline void*
+chan_stats_realloc(struct chan_stats *stats, void *ptr, size_t old_bytes, size_t new_bytes)
+{
+    void *p = realloc(ptr, new_bytes);
+    stats->reallocs++;
+    if (ptr && p != ptr) stats->bytes_moved += old_bytes < new_bytes ? old_bytes : new_bytes;
+    return p;
+}
+
+#else
+
+#define CHAN_STATS_ADD(c, field, n) ((void)0)
+#define CHAN_STATS_MAX(c, field, n) ((void)0)
+#define CHAN_STATS_PROBE(c, n) ((void)0)
+#define CHAN_REALLOC(c, ptr, old_bytes, new_bytes) realloc(ptr, new_bytes)
+
+#endif
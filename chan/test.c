@@ -1,10 +1,19 @@
+#include <chan/bitvector.h>
+#include <chan/bloom.h>
+#include <chan/cow.h>
+#include <chan/heap.h>
 #include <chan/list.h>
+#include <chan/lru.h>
 #include <chan/map.h>
+#include <chan/parallel.h>
+#include <chan/sorted.h>
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 bool less_int(void *a, void *b) { return *(int*)a <= *(int*)b; }
 int print_int(char *dest, int n, void *a) { return snprintf(dest, n, "%d", *(int*)a); }
@@ -23,10 +32,11 @@ test_vector(int kind, bool print)
     struct chan_list *v;
     if (kind == 0) v = chan_vector_list_new(sizeof(int));
     else if (kind == 1) v = chan_linked_list_new(sizeof(int));
+    else if (kind == 2) v = chan_chunked_list_new(sizeof(int), 4);
     else assert(false);
 
-    const bool supports_resize = kind == 0;
-    const bool supports_remove = kind == 0;
+    const bool supports_resize = kind != 1;
+    const bool supports_remove = kind != 1;
 
     printf("\n=== Testing vector kind %d\n", kind);
 
@@ -54,6 +64,19 @@ test_vector(int kind, bool print)
     chan_list_insert(v, 10, &item);
     if (print) chan_list_debug_print(v, print_int);
 
+    struct chan_memory_usage usage = chan_list_memory_usage(v);
+    assert(usage.allocated >= usage.used);
+    chan_list_clear(v);
+    chan_list_shrink_to_fit(v);
+    usage = chan_list_memory_usage(v);
+    assert(usage.allocated == usage.used);
+
+#ifdef CHAN_STATS
+    struct chan_stats stats = chan_list_stats(v);
+    assert(stats.reallocs > 0);
+    assert(stats.resizes > 0);
+#endif
+
     chan_list_free(v);
     return 0;
 }
@@ -66,6 +89,9 @@ test_map(int kind, bool print)
     if (kind == 0) map = chan_naive_map_new(sizeof(int), sizeof(float));
     else if (kind == 1) map = chan_bst_map_new(sizeof(int), sizeof(float), less_int);
     else if (kind == 2) map = chan_hash_map_new(sizeof(int), sizeof(float), bad_hasher_int);
+    else if (kind == 3) map = chan_cuckoo_map_new(sizeof(int), sizeof(float), bad_hasher_int);
+    else if (kind == 4) map = chan_art_map_new(sizeof(int), sizeof(float));
+    else if (kind == 5) map = chan_hash_map_new_inline_keys(sizeof(int), sizeof(float), bad_hasher_int);
     else assert(false);
     assert(map);
 
@@ -102,34 +128,1741 @@ test_map(int kind, bool print)
 
     if (print) chan_map_debug_print(map, print_int, print_float);
 
+#ifdef CHAN_STATS
+    struct chan_stats stats = chan_map_stats(map);
+    // The naive map has not left its inline buffer yet.
+    if (kind != 0) assert(stats.reallocs > 0);
+    if (kind != 0) assert(stats.resizes > 0);
+    assert(stats.comparisons > 0);
+    if (kind == 1) assert(stats.max_depth > 0);
+#endif
+
     struct chan_map_iter it = chan_map_iter_new(map);
-    struct chan_map_pair *map_pair;
+    struct chan_map_iter_item *item;
     size_t i = 0;
-    /* while ((map_pair = chan_map_iter_next(map, &it))) { */
-    /*     printf("next %d -> %f\n", *(int*)map_pair->key, *(float*)map_pair->value); */
-    /*     i++; */
-    /* } */
-    /* assert(i == 5); */
+    while ((item = chan_map_iter_next(map, &it))) {
+        if (print) printf("next %d -> %f\n", *(int*)item->key, *(float*)item->value);
+        assert(*(float*)chan_map_at(map, item->key) == *(float*)item->value);
+        i++;
+    }
+    assert(i == 5);
+
+    it = chan_map_iter_new(map);
+    struct chan_map_iter_block *block;
+    float value_sum = 0;
+    i = 0;
+    while ((block = chan_map_iter_next_block(map, &it))) {
+        for (size_t j = 0; j < block->size; ++j) value_sum += ((float*)block->values)[j];
+        i += block->size;
+    }
+    assert(i == 5);
+    assert(value_sum == value0 + value1_2 + value2 + value3 + value4);
 
-    if (kind != 1 && kind != 2) {
+    struct chan_memory_usage usage = chan_map_memory_usage(map);
+    assert(usage.allocated >= usage.used);
+    chan_map_shrink_to_fit(map);
+    assert(chan_map_memory_usage(map).allocated <= usage.allocated);
+    assert(chan_map_size(map) == 5);
+    assert(*(float*)chan_map_at(map, &key1) == value1_2);
+    assert(*(float*)chan_map_at(map, &key4) == value4);
+
+    if (kind != 2 && kind != 5) {
         chan_map_remove(map, &key0);
         assert(chan_map_size(map) == 4);
         chan_map_remove(map, &key1);
         assert(chan_map_size(map) == 3);
     }
 
+    chan_map_clear(map);
+    chan_map_shrink_to_fit(map);
+    usage = chan_map_memory_usage(map);
+    assert(usage.allocated == usage.used);
+    assert(chan_map_at(map, &key1) == NULL);
+    chan_map_insert(map, &key1, &value1);
+    assert(*(float*)chan_map_at(map, &key1) == value1);
+
+    chan_map_free(map);
+    return 0;
+}
+
+// Grows a map well past its initial capacity.
+int
+test_map_growth(int kind)
+{
+    printf("\n=== Testing map growth kind %d\n", kind);
+    struct chan_map *map;
+    if (kind == 0) map = chan_naive_map_new(sizeof(int), sizeof(int));
+    else if (kind == 1) map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    else if (kind == 2) map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    else if (kind == 3) map = chan_cuckoo_map_new(sizeof(int), sizeof(int), hasher_int);
+    else if (kind == 4) map = chan_art_map_new(sizeof(int), sizeof(int));
+    else if (kind == 5) map = chan_hash_map_new_inline_keys(sizeof(int), sizeof(int), hasher_int);
+    else assert(false);
+
+    const int n = 1000;
+    for (int i = 0; i < n; ++i) {
+        // Scramble the order so that the BST does not degenerate.
+        int key = (i * 7919) % n;
+        int value = -key;
+        chan_map_insert(map, &key, &value);
+    }
+    assert(chan_map_size(map) == (size_t)n);
+    for (int key = 0; key < n; ++key) {
+        assert(*(int*)chan_map_at(map, &key) == -key);
+    }
+    int key = n;
+    assert(chan_map_at(map, &key) == NULL);
+
+    chan_map_shrink_to_fit(map);
+    for (int key = 0; key < n; ++key) {
+        assert(*(int*)chan_map_at(map, &key) == -key);
+    }
+
+    struct chan_map_iter it = chan_map_iter_new(map);
+    struct chan_map_iter_item *item;
+    int prev_key = -1;
+    size_t i = 0;
+    while ((item = chan_map_iter_next(map, &it))) {
+        assert(*(int*)item->value == -*(int*)item->key);
+        // Ordered map iterates in ascending order.
+        if (kind == 1) assert(*(int*)item->key == prev_key + 1);
+        prev_key = *(int*)item->key;
+        i++;
+    }
+    assert(i == (size_t)n);
+
+    chan_map_free(map);
+    return 0;
+}
+
+// Grows a hash map through all but the widest bucket index type.
+int
+test_hash_map_bucket_width(bool inline_keys)
+{
+    printf("\n=== Testing hash map bucket width, inline keys %d\n", inline_keys);
+    struct chan_map *map = inline_keys
+        ? chan_hash_map_new_inline_keys(sizeof(int), sizeof(int), hasher_int)
+        : chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    // Inline keys are padded to a multiple of the index width.
+    const size_t key_bytes = inline_keys ? sizeof(int) : 0;
+    const int n = 100000;
+    for (int key = 0; key < n; ++key) {
+        // The used memory grows by one key, one value and one bucket index,
+        // whose width depends on the number of buckets.
+        const size_t used = chan_map_memory_usage(map).used;
+        chan_map_insert(map, &key, &key);
+        const size_t bucket_size = chan_map_memory_usage(map).used - used - 2 * sizeof(int);
+        if (key < 192) assert(bucket_size == 1 + key_bytes);
+        else if (key >= 256 && key < 49152) assert(bucket_size == 2 + key_bytes);
+        else if (key >= 65536) assert(bucket_size == 4 + key_bytes);
+    }
+    struct chan_map *clone = chan_map_clone(map);
+    int key = n;
+    chan_map_insert(clone, &key, &key);
+    assert(chan_map_at(map, &key) == NULL);
+    assert(*(int*)chan_map_at(clone, &key) == n);
+    for (int key = 0; key < n; ++key) assert(*(int*)chan_map_at(map, &key) == key);
+    chan_map_free(clone);
+    chan_map_free(map);
+    return 0;
+}
+
+// Grows containers whose arrays are all page mappings.
+int
+test_growth()
+{
+    printf("\n=== Testing growth policy\n");
+    struct chan_growth growth = { 1, 2, 1 };
+    struct chan_list *list = chan_vector_list_new(sizeof(int));
+    chan_list_set_growth(list, growth);
+    const int n = 100000;
+    for (int i = 0; i < n; ++i) chan_list_push(list, &i);
+    // Chunks are opt-in.
+    size_t size;
+    assert(!chan_cow_is_chunked(chan_list_data(list, &size)));
+#ifdef CHAN_STATS
+    // Doubling from 4 to 2^17 items, remapping the pages instead of copying.
+    assert(chan_list_stats(list).resizes == 16);
+    assert(chan_list_stats(list).bytes_moved == 0);
+#endif
+    struct chan_list *clone = chan_list_clone(list);
+    int value = -1;
+    chan_list_push(clone, &value);
+    chan_list_shrink_to_fit(list);
+    for (int i = 0; i < n; ++i) {
+        assert(*(int*)chan_list_at(list, i) == i);
+        assert(*(int*)chan_list_at(clone, i) == i);
+    }
+    assert(chan_list_size(list) == (size_t)n);
+    assert(*(int*)chan_list_at(clone, n) == -1);
+    chan_list_free(clone);
+    chan_list_free(list);
+
+    struct chan_map *map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    chan_map_set_growth(map, growth);
+    for (int key = 0; key < n; key += 2) chan_map_insert(map, &key, &key);
+    struct chan_map *map_clone = chan_map_clone(map);
+    for (int key = 1; key < n; key += 2) chan_map_insert(map_clone, &key, &key);
+    chan_map_shrink_to_fit(map);
+    for (int key = 0; key < n; ++key) {
+        int *v = chan_map_at(map, &key);
+        if (key % 2) assert(v == NULL);
+        else assert(*v == key);
+        assert(*(int*)chan_map_at(map_clone, &key) == key);
+    }
+    chan_map_free(map_clone);
+    chan_map_free(map);
+
+    struct chan_heap *heap = chan_heap_new(sizeof(int), less_int);
+    chan_heap_set_growth(heap, growth);
+    for (int i = n - 1; i >= 0; --i) chan_heap_push(heap, &i);
+#ifdef CHAN_STATS
+    assert(chan_heap_stats(heap).resizes == 16);
+#endif
+    for (int i = 0; i < n; ++i) {
+        int v;
+        chan_heap_pop(heap, &v);
+        assert(v == i);
+    }
+    chan_heap_free(heap);
+    return 0;
+}
+
+// Sums the values through the dense arrays.
+int
+test_map_data(int kind)
+{
+    printf("\n=== Testing map data kind %d\n", kind);
+    struct chan_map *map;
+    if (kind == 0) map = chan_naive_map_new(sizeof(int), sizeof(int));
+    else if (kind == 1) map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    else if (kind == 2) map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    else assert(false);
+
+    size_t n;
+    chan_map_values_data(map, &n);
+    assert(n == 0);
+    const int n_keys = 500;
+    for (int i = 0; i < n_keys; ++i) {
+        int key = (i * 7919) % n_keys;
+        int value = 2 * key;
+        chan_map_insert(map, &key, &value);
+    }
+    const int *keys = chan_map_keys_data(map, &n);
+    assert(n == (size_t)n_keys);
+    const int *values = chan_map_values_data(map, &n);
+    assert(n == (size_t)n_keys);
+    long sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        // Insertion order.
+        assert(keys[i] == (int)((i * 7919) % n_keys));
+        assert(values[i] == 2 * keys[i]);
+        sum += values[i];
+    }
+    assert(sum == (long)n_keys * (n_keys - 1));
+    chan_map_free(map);
+
+    if (kind != 2) return 0;
+    map = chan_string_hash_map_new(sizeof(int));
+    char key[32];
+    for (int i = 0; i < 10; ++i) {
+        snprintf(key, sizeof(key), "%d", i);
+        chan_map_insert(map, key, &i);
+    }
+    values = chan_map_values_data(map, &n);
+    assert(n == 10);
+    for (size_t i = 0; i < n; ++i) assert(values[i] == (int)i);
+    chan_map_free(map);
+    return 0;
+}
+
+void double_values(void *ctx, void *values, size_t n) { for (size_t i = 0; i < n; ++i) ((double*)values)[i] *= 2; }
+void sum_values(void *ctx, void *acc, const void *values, size_t n) { for (size_t i = 0; i < n; ++i) *(double*)acc += ((const double*)values)[i]; }
+void sum_accs(void *ctx, void *acc, const void *other) { *(double*)acc += *(const double*)other; }
+void sum_int_values(void *ctx, void *acc, const void *values, size_t n) { for (size_t i = 0; i < n; ++i) *(long*)acc += ((const int*)values)[i]; }
+void sum_int_accs(void *ctx, void *acc, const void *other) { *(long*)acc += *(const long*)other; }
+void increment_int_values(void *ctx, void *values, size_t n) { for (size_t i = 0; i < n; ++i) ((int*)values)[i]++; }
+
+int
+test_parallel()
+{
+    printf("\n=== Testing parallel scans\n");
+    struct chan_list *list = chan_vector_list_new(sizeof(double));
+    const size_t n = 1000003;
+    for (size_t i = 0; i < n; ++i) {
+        double value = 1.0 / (i + 1);
+        chan_list_push(list, &value);
+    }
+    struct chan_pool *pools[] = { NULL, chan_pool_new(1), chan_pool_new(3), chan_pool_new(0) };
+    double sums[4];
+    for (int i = 0; i < 4; ++i) {
+        chan_list_parallel_for(list, sizeof(double), double_values, NULL, pools[i]);
+        sums[i] = 0;
+        chan_list_parallel_reduce(list, sizeof(double), &sums[i], sizeof(double), sum_values, sum_accs, NULL, pools[i]);
+    }
+    for (size_t i = 0; i < n; ++i) assert(*(double*)chan_list_at(list, i) == 16.0 / (i + 1));
+    // The same chunks are summed in the same order with any pool, so the
+    // sums are equal up to the doubling between the calls.
+    for (int i = 1; i < 4; ++i) assert(sums[i] == 2 * sums[i - 1]);
+    // Writing in parallel leaves a clone as it was.
+    struct chan_list *list_clone = chan_list_clone(list);
+    chan_list_parallel_for(list, sizeof(double), double_values, NULL, pools[2]);
+    assert(*(double*)chan_list_at(list, 1) == 16.0 && *(double*)chan_list_at(list_clone, 1) == 8.0);
+    chan_list_free(list_clone);
+    chan_list_free(list);
+
+    struct chan_map *map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    for (int key = 0; key < 100000; ++key) chan_map_insert(map, &key, &key);
+    long sum = 0;
+    chan_map_parallel_reduce(map, sizeof(int), &sum, sizeof(sum), sum_int_values, sum_int_accs, NULL, pools[3]);
+    assert(sum == 100000L * 99999 / 2);
+    struct chan_map *map_clone = chan_map_clone(map);
+    chan_map_parallel_for(map, sizeof(int), increment_int_values, NULL, pools[2]);
+    for (int key = 0; key < 100000; ++key) {
+        assert(*(int*)chan_map_at(map, &key) == key + 1);
+        assert(*(int*)chan_map_at(map_clone, &key) == key);
+    }
+    chan_map_free(map_clone);
+    chan_map_free(map);
+
+    for (int i = 1; i < 4; ++i) chan_pool_free(pools[i]);
+    return 0;
+}
+
+size_t constant_hasher_int(void *a) { return 7; }
+
+// Fills a cuckoo map with well and badly hashed keys and removes them.
+int
+test_cuckoo_map()
+{
+    printf("\n=== Testing cuckoo map\n");
+    size_t (*hashers[])(void*) = { hasher_int, bad_hasher_int, constant_hasher_int };
+    for (int h = 0; h < 3; ++h) {
+        struct chan_map *map = chan_cuckoo_map_new(sizeof(int), sizeof(int), hashers[h]);
+        const int n = h == 2 ? 100 : 20000;
+        for (int i = 0; i < n; ++i) {
+            int key = (i * 7919) % n;
+            int value = -key;
+            chan_map_insert(map, &key, &value);
+        }
+        assert(chan_map_size(map) == (size_t)n);
+#ifdef CHAN_STATS
+        // A lookup reads two buckets and the stash, which only keys with
+        // equal hashes need.
+        struct chan_stats stats = chan_map_stats(map);
+        size_t in_stash = 0;
+        for (size_t i = 3; i < CHAN_STATS_PROBE_HIST; ++i) in_stash += stats.probe_hist[i];
+        if (h == 0) assert(in_stash == 0);
+        if (h == 2) assert(in_stash > 0);
+#endif
+        struct chan_map *clone = chan_map_clone(map);
+        for (int key = 0; key < n; key += 2) chan_map_remove(map, &key);
+        assert(chan_map_size(map) == (size_t)n / 2);
+        for (int key = 0; key < n; ++key) {
+            int *value = chan_map_at(map, &key);
+            if (key % 2 == 0) assert(value == NULL);
+            else assert(*value == -key);
+            assert(*(int*)chan_map_at(clone, &key) == -key);
+        }
+        chan_map_shrink_to_fit(map);
+        for (int key = 1; key < n; key += 2) assert(*(int*)chan_map_at(map, &key) == -key);
+        struct chan_map_iter it = chan_map_iter_new(map);
+        struct chan_map_iter_item *item;
+        size_t i = 0;
+        while ((item = chan_map_iter_next(map, &it))) {
+            assert(*(int*)item->key % 2 == 1);
+            i++;
+        }
+        assert(i == (size_t)n / 2);
+        chan_map_free(clone);
+        chan_map_free(map);
+    }
+    return 0;
+}
+
+int
+test_map_range()
+{
+    printf("\n=== Testing ordered map range queries\n");
+    struct chan_map *map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    // Even keys 0, 2, ..., 198, in scrambled order.
+    for (int i = 0; i < 100; ++i) {
+        int key = 2 * ((i * 37) % 100);
+        chan_map_insert(map, &key, &i);
+    }
+
+    int key = 51;
+    struct chan_map_iter it = chan_map_lower_bound(map, &key);
+    struct chan_map_iter_item *item = chan_map_iter_next(map, &it);
+    assert(*(int*)item->key == 52);
+    assert(*(int*)chan_map_iter_next(map, &it)->key == 54);
+    key = 52;
+    it = chan_map_lower_bound(map, &key);
+    assert(*(int*)chan_map_iter_next(map, &it)->key == 52);
+    it = chan_map_upper_bound(map, &key);
+    assert(*(int*)chan_map_iter_next(map, &it)->key == 54);
+    key = 198;
+    it = chan_map_upper_bound(map, &key);
+    assert(chan_map_iter_next(map, &it) == NULL);
+    key = -5;
+    it = chan_map_lower_bound(map, &key);
+    assert(*(int*)chan_map_iter_next(map, &it)->key == 0);
+
+    int lo = 10, hi = 21;
+    it = chan_map_iter_range(map, &lo, &hi);
+    int expected = 10;
+    while ((item = chan_map_iter_next(map, &it))) {
+        assert(*(int*)item->key == expected);
+        expected += 2;
+    }
+    assert(expected == 22);
+
+    it = chan_map_iter_range(map, &lo, &hi);
+    size_t n = 0;
+    struct chan_map_iter_block *block;
+    while ((block = chan_map_iter_next_block(map, &it))) n += block->size;
+    assert(n == 6);
+
+    // Order statistics.
+    key = 52;
+    assert(chan_map_rank(map, &key) == 26);
+    key = 53;
+    assert(chan_map_rank(map, &key) == 27);
+    key = -1;
+    assert(chan_map_rank(map, &key) == 0);
+    it = chan_map_select(map, 26);
+    assert(*(int*)chan_map_iter_next(map, &it)->key == 52);
+    it = chan_map_select(map, 100);
+    assert(chan_map_iter_next(map, &it) == NULL);
+
+    // Empty ranges.
+    it = chan_map_iter_range(map, &hi, &lo);
+    assert(chan_map_iter_next(map, &it) == NULL);
+    lo = 11; hi = 12;
+    it = chan_map_iter_range(map, &lo, &hi);
+    assert(chan_map_iter_next(map, &it) == NULL);
+
+    // Remove keys, including the root and nodes with two children, and check
+    // that the order statistics follow.
+    for (int i = 0; i < 100; i += 2) {
+        key = 2 * ((i * 37) % 100);
+        chan_map_remove(map, &key);
+        assert(chan_map_at(map, &key) == NULL);
+    }
+    assert(chan_map_size(map) == 50);
+    it = chan_map_iter_new(map);
+    size_t k = 0;
+    int prev_key = -1;
+    while ((item = chan_map_iter_next(map, &it))) {
+        assert(*(int*)item->key > prev_key);
+        assert(chan_map_rank(map, item->key) == k);
+        struct chan_map_iter sel = chan_map_select(map, k);
+        assert(chan_map_iter_next(map, &sel)->key == item->key);
+        assert(*(int*)chan_map_at(map, item->key) == *(int*)item->value);
+        prev_key = *(int*)item->key;
+        k++;
+    }
+    assert(k == 50);
+    for (int i = 1; i < 100; i += 2) {
+        key = 2 * ((i * 37) % 100);
+        chan_map_remove(map, &key);
+    }
+    assert(chan_map_size(map) == 0);
+    key = 4;
+    chan_map_insert(map, &key, &key);
+    assert(*(int*)chan_map_at(map, &key) == 4);
+    chan_map_remove(map, &key);
+
+    // Random inserts and removals interleaved with rank and select, checked
+    // against a table of the present keys.
+    bool present[500] = { false };
+    size_t n_present = 0;
+    unsigned long long state = 88172645463325252ULL;
+    for (int op = 0; op < 20000; ++op) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        key = state % 500;
+        if (present[key]) chan_map_remove(map, &key);
+        else chan_map_insert(map, &key, &key);
+        n_present += present[key] ? -1 : 1;
+        present[key] = !present[key];
+        if (op % 97 != 0) continue;
+        size_t rank = 0;
+        for (int k = 0; k < 500; ++k) {
+            assert(chan_map_rank(map, &k) == rank);
+            if (!present[k]) continue;
+            it = chan_map_select(map, rank);
+            assert(*(int*)chan_map_iter_next(map, &it)->key == k);
+            rank++;
+        }
+        assert(rank == n_present && chan_map_size(map) == n_present);
+    }
+    chan_map_free(map);
+
+    // Sorted inserts and removals keep the tree balanced.
+    map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    const int n_sorted = 1 << 14;
+    for (int i = 0; i < n_sorted; ++i) chan_map_insert(map, &i, &i);
+    for (int i = 0; i < n_sorted / 2; ++i) chan_map_remove(map, &i);
+    for (int i = n_sorted; i < 2 * n_sorted; ++i) chan_map_insert(map, &i, &i);
+#ifdef CHAN_STATS
+    // The depth of a weight balanced tree is below 2.5 log2(n).
+    assert(chan_map_stats(map).max_depth < 5 * 15 / 2);
+#endif
+    for (int r = 0; r < n_sorted + n_sorted / 2; r += 101) {
+        it = chan_map_select(map, r);
+        assert(*(int*)chan_map_iter_next(map, &it)->key == n_sorted / 2 + r);
+    }
     chan_map_free(map);
     return 0;
 }
 
+void add_int(void *existing, void *value) { *(int*)existing += *(int*)value; }
+
+// Counts occurrences with the read-modify-write functions.
+int
+test_map_upsert(int kind)
+{
+    printf("\n=== Testing map upsert kind %d\n", kind);
+    struct chan_map *map;
+    if (kind == 0) map = chan_naive_map_new(sizeof(int), sizeof(int));
+    else if (kind == 1) map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    else if (kind == 2) map = chan_hash_map_new(sizeof(int), sizeof(int), bad_hasher_int);
+    else assert(false);
+
+    const int n = 100;
+    const int one = 1;
+    for (int i = 0; i < n; ++i) {
+        int key = (i * 37) % 10;
+        chan_map_upsert(map, &key, (void*)&one, add_int);
+    }
+    assert(chan_map_size(map) == 10);
+    for (int key = 0; key < 10; ++key) assert(*(int*)chan_map_at(map, &key) == n / 10);
+
+    bool inserted;
+    int key = 3;
+    const int zero = 0;
+    int *count = chan_map_get_or_insert(map, &key, (void*)&zero, &inserted);
+    assert(!inserted && *count == n / 10);
+    (*count)++;
+    assert(*(int*)chan_map_at(map, &key) == n / 10 + 1);
+    key = 11;
+    count = chan_map_get_or_insert(map, &key, (void*)&zero, &inserted);
+    assert(inserted && *count == 0);
+    assert(chan_map_size(map) == 11);
+    chan_map_free(map);
+    if (kind != 2) return 0;
+
+    map = chan_string_hash_map_new(sizeof(int));
+    chan_map_upsert(map, "a", (void*)&one, add_int);
+    chan_map_upsert(map, "b", (void*)&one, add_int);
+    chan_map_upsert(map, "a", (void*)&one, add_int);
+    assert(*(int*)chan_map_at(map, "a") == 2);
+    assert(*(int*)chan_map_at(map, "b") == 1);
+    chan_map_free(map);
+    return 0;
+}
+
+// Exercises the inline buffer and the key size specific scans of the naive map.
+int
+test_naive_map_small()
+{
+    printf("\n=== Testing small naive map\n");
+    struct chan_map *map = chan_naive_map_new(sizeof(long long), sizeof(int));
+    const int n = 40;
+    for (int i = 0; i < n; ++i) {
+        long long key = (long long)i << 33 | i;
+        chan_map_insert(map, &key, &i);
+        if (i == 7) assert(chan_map_memory_usage(map).allocated == chan_map_memory_usage(map).used);
+    }
+    for (int i = 0; i < n; ++i) {
+        long long key = (long long)i << 33 | i;
+        assert(*(int*)chan_map_at(map, &key) == i);
+        // Matches only in one of the 32-bit halves.
+        key = (long long)i << 33 | (i + 1);
+        assert(chan_map_at(map, &key) == NULL);
+    }
+    for (int i = 10; i < n; ++i) {
+        long long key = (long long)i << 33 | i;
+        chan_map_remove(map, &key);
+    }
+    chan_map_shrink_to_fit(map);
+    struct chan_memory_usage usage = chan_map_memory_usage(map);
+    assert(usage.allocated == usage.used);
+    for (int i = 0; i < 10; ++i) {
+        long long key = (long long)i << 33 | i;
+        assert(*(int*)chan_map_at(map, &key) == i);
+    }
+    chan_map_free(map);
+
+    // Key size without a specialized scan.
+    map = chan_naive_map_new(3, sizeof(int));
+    for (int i = 0; i < n; ++i) {
+        char key[3] = { (char)i, 1, 2 };
+        chan_map_insert(map, key, &i);
+    }
+    for (int i = 0; i < n; ++i) {
+        char key[3] = { (char)i, 1, 2 };
+        assert(*(int*)chan_map_at(map, key) == i);
+    }
+    chan_map_free(map);
+    return 0;
+}
+
+int print_string(char *dest, int n, void *a) { return snprintf(dest, n, "%s", (char*)a); }
+
+int
+test_string_hash_map(bool print)
+{
+    printf("\n=== Testing string hash map\n");
+    struct chan_map *map = chan_string_hash_map_new(sizeof(int));
+    char key[32];
+    const int n = 2000;
+    for (int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        chan_map_insert(map, key, &i);
+    }
+    assert(chan_map_size(map) == (size_t)n);
+    int value = -1;
+    chan_map_insert(map, "key-5", &value);
+    assert(chan_map_size(map) == (size_t)n);
+    assert(*(int*)chan_map_at(map, "key-5") == -1);
+    assert(chan_map_at(map, "key-") == NULL);
+    assert(chan_map_at(map, "") == NULL);
+    chan_map_insert(map, "", &value);
+    assert(*(int*)chan_map_at(map, "") == -1);
+    chan_map_remove(map, "");
+
+    // Remove enough keys to trigger arena compaction.
+    for (int i = 0; i < n; ++i) {
+        if (i % 3 == 0) continue;
+        snprintf(key, sizeof(key), "key-%d", i);
+        chan_map_remove(map, key);
+        assert(chan_map_at(map, key) == NULL);
+    }
+    for (int i = 0; i < n; ++i) {
+        snprintf(key, sizeof(key), "key-%d", i);
+        int *v = chan_map_at(map, key);
+        if (i % 3 != 0) assert(v == NULL);
+        else assert(*v == i);
+    }
+
+    struct chan_map_iter it = chan_map_iter_new(map);
+    struct chan_map_iter_item *item;
+    size_t i = 0;
+    while ((item = chan_map_iter_next(map, &it))) {
+        assert(chan_map_at(map, item->key) == item->value);
+        i++;
+    }
+    assert(i == chan_map_size(map));
+
+    chan_map_shrink_to_fit(map);
+    struct chan_memory_usage usage = chan_map_memory_usage(map);
+    assert(usage.allocated >= usage.used);
+    assert(*(int*)chan_map_at(map, "key-3") == 3);
+    if (print) printf("string map %zu keys, %zu bytes\n", chan_map_size(map), usage.allocated);
+
+    chan_map_free(map);
+    return 0;
+}
+
+bool strict_less_int(void *a, void *b) { return *(int*)a < *(int*)b; }
+
+int
+test_heap(size_t arity)
+{
+    printf("\n=== Testing heap arity %zu\n", arity);
+    struct chan_heap *h = chan_heap_new_arity(sizeof(int), strict_less_int, arity);
+    assert(chan_heap_peek(h) == NULL);
+
+    const int n = 500;
+    chan_heap_handle handles[500];
+    for (int i = 0; i < n; ++i) {
+        int value = (i * 7919) % n;
+        handles[i] = chan_heap_push(h, &value);
+    }
+    assert(chan_heap_size(h) == (size_t)n);
+    assert(*(int*)chan_heap_peek(h) == 0);
+
+    // Decrease the largest value to the new minimum.
+    int i_max = 0;
+    for (int i = 0; i < n; ++i) if (*(int*)chan_heap_get(h, handles[i]) == n - 1) i_max = i;
+    int value = -1;
+    chan_heap_decrease_key(h, handles[i_max], &value);
+    assert(*(int*)chan_heap_peek(h) == -1);
+
+    int prev = -2;
+    for (int i = 0; i < n; ++i) {
+        chan_heap_pop(h, &value);
+        assert(value > prev);
+        prev = value;
+    }
+    assert(prev == n - 2);
+    assert(chan_heap_size(h) == 0);
+
+    int values[100];
+    for (int i = 0; i < 100; ++i) values[i] = 100 - i;
+    chan_heap_heapify(h, values, 100);
+    assert(*(int*)chan_heap_get(h, 99) == 1);
+    value = 0;
+    chan_heap_decrease_key(h, 50, &value);
+    for (int i = 0; i < 100; ++i) {
+        chan_heap_pop(h, &value);
+        assert(value == (i == 0 ? 0 : i < 50 ? i : i + 1));
+    }
+    chan_heap_shrink_to_fit(h);
+    chan_heap_free(h);
+    return 0;
+}
+
+int
+test_lru_cache(enum chan_cache_policy policy)
+{
+    printf("\n=== Testing LRU cache policy %d\n", (int)policy);
+    struct chan_lru_cache *c = chan_lru_cache_new_policy(sizeof(int), sizeof(int), bad_hasher_int, 3, policy);
+    int key, value, evicted_key, evicted_value;
+    for (key = 0; key < 3; ++key) {
+        value = 10 * key;
+        assert(!chan_lru_cache_put(c, &key, &value, NULL, NULL));
+    }
+    assert(chan_lru_cache_size(c) == 3);
+    // Use key 0 so that key 1 is the one evicted by both policies.
+    key = 0;
+    assert(*(int*)chan_lru_cache_get(c, &key) == 0);
+    key = 3;
+    value = 30;
+    assert(chan_lru_cache_put(c, &key, &value, &evicted_key, &evicted_value));
+    assert(evicted_key == 1 && evicted_value == 10);
+    key = 1;
+    assert(chan_lru_cache_get(c, &key) == NULL);
+    key = 2;
+    assert(*(int*)chan_lru_cache_peek(c, &key) == 20);
+    chan_lru_cache_remove(c, &key);
+    assert(chan_lru_cache_peek(c, &key) == NULL);
+    assert(chan_lru_cache_size(c) == 2);
+
+    // Replacing a value does not evict.
+    key = 3;
+    value = 31;
+    assert(!chan_lru_cache_put(c, &key, &value, NULL, NULL));
+    assert(*(int*)chan_lru_cache_get(c, &key) == 31);
+    chan_lru_cache_clear(c);
+    assert(!chan_lru_cache_evict(c, NULL, NULL));
+    chan_lru_cache_free(c);
+
+    // Keys are inserted in order and the most recent ones are read back, so
+    // the cache must end up holding exactly the last `capacity` keys.
+    const int capacity = 100;
+    c = chan_lru_cache_new_policy(sizeof(int), sizeof(int), hasher_int, capacity, policy);
+    for (key = 0; key < 1000; ++key) {
+        value = -key;
+        const bool evicted = chan_lru_cache_put(c, &key, &value, &evicted_key, NULL);
+        assert(evicted == (key >= capacity));
+        if (evicted) assert(evicted_key == key - capacity);
+    }
+    assert(chan_lru_cache_size(c) == (size_t)capacity);
+    for (key = 1000 - capacity; key < 1000; ++key) {
+        assert(*(int*)chan_lru_cache_get(c, &key) == -key);
+    }
+    struct chan_memory_usage usage = chan_lru_cache_memory_usage(c);
+    assert(usage.used == usage.allocated);
+    chan_lru_cache_free(c);
+    return 0;
+}
+
+int
+test_bloom()
+{
+    printf("\n=== Testing Bloom filter\n");
+    const int n = 1000;
+    struct chan_bloom *b = chan_bloom_new(sizeof(int), NULL, n, 10);
+    for (int key = 0; key < 2 * n; key += 2) chan_bloom_add(b, &key);
+    int false_positives = 0;
+    for (int key = 0; key < 2 * n; ++key) {
+        const bool may_contain = chan_bloom_may_contain(b, &key);
+        if (key % 2 == 0) assert(may_contain);
+        else false_positives += may_contain;
+    }
+    printf("false positives: %d / %d\n", false_positives, n);
+    assert(false_positives < n / 20);
+    chan_bloom_clear(b);
+    int key = 0;
+    assert(!chan_bloom_may_contain(b, &key));
+    chan_bloom_free(b);
+
+    // Attached to a map, the filter has to follow insertions past its
+    // initial size, removals and clearing.
+    for (int kind = 0; kind < 3; ++kind) {
+        struct chan_map *map = kind == 0 ? chan_naive_map_new(sizeof(int), sizeof(int))
+            : kind == 1 ? chan_bst_map_new(sizeof(int), sizeof(int), less_int)
+            : chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+        for (key = 0; key < 10; ++key) chan_map_insert(map, &key, &key);
+        chan_map_set_bloom(map, chan_bloom_new(sizeof(int), hasher_int, 16, 10));
+        for (key = 10; key < 200; ++key) chan_map_get_or_insert(map, &key, &key, NULL);
+        if (kind != 2) {
+            key = 5;
+            chan_map_remove(map, &key);
+        }
+        for (key = 0; key < 400; ++key) {
+            int *value = chan_map_at(map, &key);
+            const bool present = key < 200 && (kind == 2 || key != 5);
+            assert(present ? value && *value == key : value == NULL);
+        }
+        chan_map_clear(map);
+        key = 0;
+        assert(chan_map_at(map, &key) == NULL);
+        chan_map_free(map);
+    }
+    return 0;
+}
+
+int
+test_clone()
+{
+    printf("\n=== Testing clones\n");
+    for (int kind = 0; kind < 3; ++kind) {
+        // Small maps keep the naive map in its inline buffer, large ones not.
+        for (int n = 8; n <= 100; n += 92) {
+            struct chan_map *map = kind == 0 ? chan_naive_map_new(sizeof(int), sizeof(int))
+                : kind == 1 ? chan_bst_map_new(sizeof(int), sizeof(int), less_int)
+                : chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+            for (int key = 0; key < n; ++key) chan_map_insert(map, &key, &key);
+            if (n > 8) chan_map_set_bloom(map, chan_bloom_new(sizeof(int), hasher_int, n, 10));
+            struct chan_map *clone = chan_map_clone(map);
+            struct chan_map *clone2 = chan_map_clone(clone);
+
+            int key = n;
+            int value = -1;
+            chan_map_insert(map, &key, &value);
+            key = 0;
+            chan_map_insert(map, &key, &value);
+            if (kind != 2) {
+                key = 1;
+                chan_map_remove(map, &key);
+            }
+            assert(chan_map_size(clone) == (size_t)n);
+            for (key = 0; key <= n; ++key) {
+                int *v = chan_map_at(clone, &key);
+                assert(key < n ? v && *v == key : v == NULL);
+            }
+            key = 0;
+            assert(*(int*)chan_map_at(map, &key) == -1);
+            key = n;
+            assert(*(int*)chan_map_at(map, &key) == -1);
+#ifdef CHAN_STATS
+            if (kind != 0 || n > 8) assert(chan_map_stats(map).cow_bytes > 0);
+#endif
+
+            // Writing to the clone leaves its own clone intact.
+            chan_map_clear(clone);
+            chan_map_free(map);
+            key = n - 1;
+            assert(chan_map_at(clone, &key) == NULL);
+            assert(*(int*)chan_map_at(clone2, &key) == n - 1);
+            chan_map_free(clone);
+            chan_map_free(clone2);
+        }
+    }
+
+    struct chan_map *map = chan_string_hash_map_new(sizeof(int));
+    int value = 1;
+    chan_map_insert(map, "a", &value);
+    struct chan_map *clone = chan_map_clone(map);
+    chan_map_remove(map, "a");
+    chan_map_insert(map, "b", &value);
+    assert(chan_map_at(clone, "b") == NULL);
+    assert(*(int*)chan_map_at(clone, "a") == 1);
+    chan_map_free(map);
+    chan_map_free(clone);
+
+    struct chan_list *list = chan_vector_list_new(sizeof(int));
+    for (int i = 0; i < 10; ++i) chan_list_push(list, &i);
+    struct chan_list *list_clone = chan_list_clone(list);
+    value = -1;
+    chan_list_insert(list, 0, &value);
+    chan_list_pop(list_clone);
+    assert(chan_list_size(list) == 11 && chan_list_size(list_clone) == 9);
+    for (int i = 0; i < 9; ++i) assert(*(int*)chan_list_at(list_clone, i) == i);
+    assert(*(int*)chan_list_at(list, 0) == -1);
+    chan_list_free(list_clone);
+    chan_list_free(list);
+    return 0;
+}
+
+// Clones containers whose arrays are all chunk mappings, which a write copies
+// only in part.
+int
+test_chunked_clone(int kind)
+{
+    printf("\n=== Testing chunked clones kind %d\n", kind);
+    struct chan_map *map;
+    if (kind == 0) map = chan_naive_map_new(sizeof(int), sizeof(int));
+    else if (kind == 1) map = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    else if (kind == 2) map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    else if (kind == 3) map = chan_cuckoo_map_new(sizeof(int), sizeof(int), hasher_int);
+    else if (kind == 4) map = chan_art_map_new(sizeof(int), sizeof(int));
+    else if (kind == 5) map = chan_hash_map_new_inline_keys(sizeof(int), sizeof(int), hasher_int);
+    else assert(false);
+    // Chunked from the first byte.
+    struct chan_growth growth = { 1, 2, 1, 1 };
+    chan_map_set_growth(map, growth);
+
+    // The naive map searches linearly.
+    const int n = kind == 0 ? 4000 : 1 << 18;
+    for (int i = 0; i < n; ++i) {
+        int key = (i * 7919) % n;
+        chan_map_insert(map, &key, &key);
+    }
+    struct chan_map *clone = chan_map_clone(map);
+#ifdef CHAN_STATS
+    const size_t cow_bytes = chan_map_stats(map).cow_bytes;
+#endif
+    int key = n / 2;
+    int value = -1;
+    chan_map_insert(map, &key, &value);
+#ifdef CHAN_STATS
+    // The chunk of the value, and of the key in the naive map. Without a
+    // memory file for the chunks the arrays are copied whole.
+    size_t size;
+    if (chan_cow_is_chunked(chan_map_values_data(map, &size))) {
+        assert(chan_map_stats(map).cow_bytes - cow_bytes <= 2 * CHAN_COW_CHUNK);
+    }
+#endif
+    key = n;
+    chan_map_insert(map, &key, &value);
+    // The hash map can not remove.
+    const int removed = kind == 2 || kind == 5 ? 0 : 100;
+    for (key = 0; key < removed; ++key) chan_map_remove(map, &key);
+
+    assert(chan_map_size(clone) == (size_t)n && chan_map_size(map) == (size_t)(n + 1 - removed));
+    for (key = 0; key <= n; ++key) {
+        int *v = chan_map_at(clone, &key);
+        assert(key < n ? v && *v == key : v == NULL);
+        v = chan_map_at(map, &key);
+        if (key < removed) assert(v == NULL);
+        else assert(*v == (key == n / 2 || key == n ? -1 : key));
+    }
+
+    // The clone writes to its chunks in turn.
+    chan_map_free(map);
+    chan_map_clear(clone);
+    key = 0;
+    chan_map_insert(clone, &key, &value);
+    assert(chan_map_size(clone) == 1 && *(int*)chan_map_at(clone, &key) == -1);
+    chan_map_free(clone);
+    return 0;
+}
+
+int
+test_chunked_list_clone()
+{
+    printf("\n=== Testing chunked list clones\n");
+    struct chan_growth growth = { 1, 2, 1, 1 };
+    struct chan_list *list = chan_vector_list_new(sizeof(int));
+    chan_list_set_growth(list, growth);
+    const int n = 1 << 18;
+    for (int i = 0; i < n; ++i) chan_list_push(list, &i);
+    struct chan_list *clone = chan_list_clone(list);
+#ifdef CHAN_STATS
+    const size_t cow_bytes = chan_list_stats(list).cow_bytes;
+#endif
+    int value = -1;
+    chan_list_push(list, &value);
+#ifdef CHAN_STATS
+    size_t size;
+    if (chan_cow_is_chunked(chan_list_data(list, &size))) {
+        assert(chan_list_stats(list).cow_bytes - cow_bytes <= CHAN_COW_CHUNK);
+    }
+#endif
+    chan_list_remove(list, n - 10);
+    chan_list_insert(list, 0, &value);
+    chan_list_pop(clone);
+    for (int i = 0; i < n - 1; ++i) assert(*(int*)chan_list_at(clone, i) == i);
+    assert(chan_list_size(list) == (size_t)n + 1);
+    assert(*(int*)chan_list_at(list, 0) == -1 && *(int*)chan_list_at(list, n) == -1);
+    assert(*(int*)chan_list_at(list, n - 10) == n - 11 && *(int*)chan_list_at(list, n - 9) == n - 9);
+    chan_list_free(list);
+    chan_list_free(clone);
+
+    list = chan_bitvector_new(3);
+    chan_list_set_growth(list, growth);
+    for (int i = 0; i < 8 * n; ++i) chan_bitvector_push(list, i % 7);
+    clone = chan_list_clone(list);
+    chan_bitvector_set(list, n, 7);
+    chan_bitvector_push(list, 7);
+    chan_bitvector_push(clone, 0);
+    for (int i = 0; i < 8 * n; ++i) {
+        assert(chan_bitvector_get(clone, i) == (unsigned)(i % 7));
+        assert(chan_bitvector_get(list, i) == (i == n ? 7u : (unsigned)(i % 7)));
+    }
+    assert(chan_bitvector_get(list, 8 * n) == 7 && chan_bitvector_get(clone, 8 * n) == 0);
+    chan_list_free(list);
+    chan_list_free(clone);
+
+    list = chan_delta_list_new();
+    chan_list_set_growth(list, growth);
+    for (uint64_t i = 0; i < (uint64_t)n; ++i) {
+        uint64_t x = 3 * i;
+        chan_list_push(list, &x);
+    }
+    clone = chan_list_clone(list);
+    chan_list_remove(list, 0);
+    for (int i = 0; i < n; ++i) {
+        assert(*(uint64_t*)chan_list_at(clone, i) == 3 * (uint64_t)i);
+        if (i < n - 1) assert(*(uint64_t*)chan_list_at(list, i) == 3 * (uint64_t)i + 3);
+    }
+    chan_list_free(list);
+    chan_list_free(clone);
+
+    // The linked list can not read its values yet, only push them.
+    list = chan_linked_list_new(sizeof(int));
+    chan_list_set_growth(list, growth);
+    for (int i = 0; i < n; ++i) chan_list_push(list, &i);
+    clone = chan_list_clone(list);
+    chan_list_push(list, &value);
+    assert(chan_list_size(list) == (size_t)n + 1 && chan_list_size(clone) == (size_t)n);
+    chan_list_free(list);
+    chan_list_free(clone);
+    return 0;
+}
+
+// Checks that `map` holds exactly the keys in [0, n) for which `expected`
+// gives a value other than -1, with those values, in order. If `balanced`,
+// also checks the depth of the tree.
+static void
+check_set_op(const struct chan_map *map, int n, int (*expected)(int), bool balanced)
+{
+    struct chan_map_iter iter = chan_map_iter_new(map);
+    struct chan_map_iter_item *item;
+    int key = 0;
+    size_t size = 0;
+    while ((item = chan_map_iter_next(map, &iter))) {
+        while (expected(key) == -1) key++;
+        assert(*(int*)item->key == key);
+        assert(*(int*)item->value == expected(key));
+        key++;
+        size++;
+    }
+    for (; key < n; ++key) assert(expected(key) == -1);
+    assert(chan_map_size(map) == size);
+#ifdef CHAN_STATS
+    size_t depth = 0;
+    while (((size_t)1 << depth) <= size) depth++;
+    if (balanced) assert(chan_map_stats(map).max_depth < depth);
+#else
+    (void)balanced;
+#endif
+}
+
+// Keys of `a` are the even numbers below 200 and keys of `b` the multiples of
+// 3 below 300, the values being the keys.
+static int union_value(int k) { return k % 6 == 0 && k < 200 ? 2 * k : (k % 2 == 0 && k < 200) || k % 3 == 0 ? k : -1; }
+static int intersection_value(int k) { return k % 6 == 0 && k < 200 ? 2 * k : -1; }
+static int difference_value(int k) { return k % 2 == 0 && k % 3 != 0 && k < 200 ? k : -1; }
+static int merge_value(int k) { return k % 6 == 0 && k < 200 ? k : (k % 2 == 0 && k < 200) || k % 3 == 0 ? k : -1; }
+
+int
+test_map_set_ops()
+{
+    printf("\n=== Testing map set operations\n");
+    struct chan_map *a = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    struct chan_map *b = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    for (int i = 0; i < 300; ++i) {
+        // Insert in a scrambled order.
+        const int key = (i * 7) % 300;
+        if (key % 2 == 0 && key < 200) chan_map_insert(a, (void*)&key, (void*)&key);
+        if (key % 3 == 0) chan_map_insert(b, (void*)&key, (void*)&key);
+    }
+    struct chan_map *c = chan_map_union(a, b, add_int);
+    check_set_op(c, 300, union_value, true);
+    chan_map_free(c);
+    c = chan_map_intersection(a, b, add_int);
+    check_set_op(c, 300, intersection_value, true);
+    chan_map_free(c);
+    c = chan_map_difference(a, b);
+    check_set_op(c, 300, difference_value, true);
+    // The results are ordinary maps.
+    int key = 1;
+    chan_map_insert(c, &key, &key);
+    assert(*(int*)chan_map_at(c, &key) == 1);
+    chan_map_free(c);
+
+    // Very different sizes, which gallops through the larger map.
+    struct chan_map *small = chan_bst_map_new(sizeof(int), sizeof(int), less_int);
+    for (key = 0; key < 300; key += 60) chan_map_insert(small, &key, &key);
+    c = chan_map_intersection(b, small, NULL);
+    assert(chan_map_size(c) == 5);
+    chan_map_free(c);
+    c = chan_map_difference(b, small);
+    assert(chan_map_size(c) == 95);
+    key = 60;
+    assert(chan_map_at(c, &key) == NULL);
+    chan_map_free(c);
+    c = chan_map_difference(small, b);
+    assert(chan_map_size(c) == 0);
+    chan_map_free(c);
+    chan_map_free(small);
+
+    // In place, both with an ordered map and with a hash map.
+    struct chan_map *h = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+    chan_map_merge(h, a, NULL);
+    chan_map_merge(h, b, NULL);
+    chan_map_merge(a, b, NULL);
+    check_set_op(a, 300, merge_value, false);
+    assert(chan_map_size(h) == chan_map_size(a));
+    for (key = 0; key < 300; ++key) {
+        int *value = chan_map_at(h, &key);
+        assert(merge_value(key) == -1 ? value == NULL : *value == key);
+    }
+    chan_map_free(h);
+    chan_map_free(a);
+    chan_map_free(b);
+
+    // Sorted arrays.
+    int32_t x[100], y[1000], out[1100], expected[1100];
+    int64_t x64[100], y64[1000], out64[1000];
+    for (int i = 0; i < 100; ++i) x64[i] = x[i] = 17 * i;
+    for (int i = 0; i < 1000; ++i) y64[i] = y[i] = 3 * i - 100;
+    size_t n = chan_sorted_intersection(x, 100, y, 1000, sizeof(int), less_int, expected);
+    assert(n == 33);
+    for (size_t i = 0; i < n; ++i) assert(expected[i] % 17 == 0 && expected[i] % 3 == 2);
+    assert(chan_sorted_intersection_i32(x, 100, y, 1000, out) == n);
+    assert(memcmp(out, expected, n * sizeof(*out)) == 0);
+    assert(chan_sorted_intersection_i32(y, 1000, x, 100, out) == n);
+    assert(memcmp(out, expected, n * sizeof(*out)) == 0);
+    assert(chan_sorted_intersection_i64(x64, 100, y64, 1000, out64) == n);
+    for (size_t i = 0; i < n; ++i) assert(out64[i] == expected[i]);
+    n = chan_sorted_union(x, 100, y, 1000, sizeof(int), less_int, out);
+    assert(n == 1100 - 33);
+    for (size_t i = 1; i < n; ++i) assert(out[i - 1] < out[i]);
+    n = chan_sorted_difference(x, 100, y, 1000, sizeof(int), less_int, out);
+    assert(n == 100 - 33);
+    for (size_t i = 0; i < n; ++i) assert(out[i] % 17 == 0 && out[i] % 3 != 2);
+    return 0;
+}
+
+int
+test_frozen_map()
+{
+    printf("\n=== Testing frozen map\n");
+    for (int n = 0; n <= 30000; n = n < 10 ? n + 1 : n * 3) {
+        struct chan_map *map = chan_hash_map_new(sizeof(int), sizeof(int), hasher_int);
+        for (int i = 0; i < n; ++i) {
+            int key = i * 7919;
+            int value = -i;
+            chan_map_insert(map, &key, &value);
+        }
+        struct chan_map *frozen = chan_hash_map_freeze(map);
+        chan_map_free(map);
+        assert(chan_map_size(frozen) == (size_t)n);
+        for (int i = 0; i < n; ++i) {
+            int key = i * 7919;
+            assert(*(int*)chan_map_at(frozen, &key) == -i);
+            key++;
+            assert(chan_map_at(frozen, &key) == NULL);
+        }
+        // No empty slots: the keys fill the whole key array.
+        size_t n_keys;
+        const int *keys = chan_map_keys_data(frozen, &n_keys);
+        const int *values = chan_map_values_data(frozen, &n_keys);
+        assert(n_keys == (size_t)n);
+        for (size_t i = 0; i < n_keys; ++i) assert(keys[i] == -values[i] * 7919);
+        struct chan_memory_usage usage = chan_map_memory_usage(frozen);
+        assert(usage.allocated <= 512 + n * (2 * sizeof(int) + 1));
+#ifdef CHAN_STATS
+        struct chan_stats stats = chan_map_stats(frozen);
+        assert(stats.comparisons == 2 * (size_t)n);
+        assert(stats.probe_hist[0] == 2 * (size_t)n);
+#endif
+        struct chan_map *clone = chan_map_clone(frozen);
+        chan_map_free(frozen);
+        struct chan_map_iter it = chan_map_iter_new(clone);
+        struct chan_map_iter_item *item;
+        size_t i = 0;
+        while ((item = chan_map_iter_next(clone, &it))) {
+            assert(*(int*)chan_map_at(clone, item->key) == *(int*)item->value);
+            i++;
+        }
+        assert(i == (size_t)n);
+        chan_map_free(clone);
+    }
+    // Duplicate keys fail the build.
+    int keys[] = { 1, 2, 3, 2 };
+    int values[] = { 1, 2, 3, 4 };
+    assert(chan_frozen_map_new(sizeof(int), sizeof(int), keys, values, 4) == NULL);
+    return 0;
+}
+
+// Big-endian bytes of `x`, which the ART map orders like the integers.
+static void
+to_big_endian(unsigned char *key, unsigned long long x)
+{
+    for (int i = 7; i >= 0; --i, x >>= 8) key[i] = x & 0xff;
+}
+
+static unsigned long long
+from_big_endian(const unsigned char *key)
+{
+    unsigned long long x = 0;
+    for (int i = 0; i < 8; ++i) x = x << 8 | key[i];
+    return x;
+}
+
+int
+test_art_map()
+{
+    printf("\n=== Testing ART map\n");
+    struct chan_map *map = chan_art_map_new(8, sizeof(unsigned long long));
+    // Keys i * i in [0, 4 n) plus a dense run of keys sharing their first
+    // six bytes, so that all node types and compressed paths occur.
+    const size_t n = 20000;
+    unsigned long long *sorted = malloc(2 * n * sizeof(*sorted));
+    size_t n_sorted = 0;
+    unsigned char key[8];
+    for (size_t i = 0; i < n; ++i) {
+        const unsigned long long x = (i * 7919) % n;
+        const unsigned long long keys[2] = { x * x * 4, 0xabcdef0000000000ULL + x };
+        for (int j = 0; j < 2; ++j) {
+            to_big_endian(key, keys[j]);
+            unsigned long long value = ~keys[j];
+            chan_map_insert(map, key, &value);
+        }
+    }
+    for (size_t i = 0; i < n; ++i) sorted[n_sorted++] = i * i * 4;
+    for (size_t i = 0; i < n; ++i) sorted[n_sorted++] = 0xabcdef0000000000ULL + i;
+    assert(chan_map_size(map) == n_sorted);
+    for (size_t i = 0; i < n_sorted; ++i) {
+        to_big_endian(key, sorted[i]);
+        assert(*(unsigned long long*)chan_map_at(map, key) == ~sorted[i]);
+        to_big_endian(key, sorted[i] + 1);
+        if (i + 1 < n_sorted && sorted[i + 1] != sorted[i] + 1) assert(chan_map_at(map, key) == NULL);
+    }
+
+    // Ordered iteration, bounds and ranges.
+    struct chan_map_iter it = chan_map_iter_new(map);
+    struct chan_map_iter_item *item;
+    size_t i = 0;
+    while ((item = chan_map_iter_next(map, &it))) assert(from_big_endian(item->key) == sorted[i++]);
+    assert(i == n_sorted);
+    for (size_t k = 1; k < n; k += 97) {
+        to_big_endian(key, k * k * 4 - 1);
+        it = chan_map_lower_bound(map, key);
+        assert(from_big_endian(chan_map_iter_next(map, &it)->key) == k * k * 4);
+        to_big_endian(key, k * k * 4);
+        it = chan_map_upper_bound(map, key);
+        assert(from_big_endian(chan_map_iter_next(map, &it)->key) == sorted[k + 1]);
+        unsigned char hi[8];
+        to_big_endian(hi, (k + 3) * (k + 3) * 4);
+        it = chan_map_iter_range(map, key, hi);
+        for (i = 0; (item = chan_map_iter_next(map, &it)); ++i) assert(from_big_endian(item->key) == sorted[k + i]);
+        assert(i == 3);
+    }
+
+    // Prefix scans.
+    const unsigned char prefix[7] = { 0xab, 0xcd, 0xef, 0, 0, 0, 1 };
+    it = chan_art_map_prefix(map, prefix, 7);
+    for (i = 0; (item = chan_map_iter_next(map, &it)); ++i) {
+        assert(from_big_endian(item->key) == 0xabcdef0000000100ULL + i);
+    }
+    assert(i == 256);
+    it = chan_art_map_prefix(map, prefix, 3);
+    for (i = 0; chan_map_iter_next(map, &it); ++i) {}
+    assert(i == n);
+    it = chan_art_map_prefix(map, prefix + 1, 2);
+    assert(chan_map_iter_next(map, &it) == NULL);
+
+    // Removing every other key shrinks the nodes.
+    struct chan_map *clone = chan_map_clone(map);
+    for (size_t k = 0; k < n_sorted; k += 2) {
+        to_big_endian(key, sorted[k]);
+        chan_map_remove(map, key);
+    }
+    assert(chan_map_size(map) == n_sorted / 2);
+    it = chan_map_iter_new(map);
+    for (i = 1; (item = chan_map_iter_next(map, &it)); i += 2) {
+        assert(from_big_endian(item->key) == sorted[i]);
+        assert(*(unsigned long long*)item->value == ~sorted[i]);
+    }
+    assert(i == n_sorted + 1);
+    for (size_t k = 0; k < n_sorted; ++k) {
+        to_big_endian(key, sorted[k]);
+        if (k % 2 == 0) assert(chan_map_at(map, key) == NULL);
+        else assert(*(unsigned long long*)chan_map_at(map, key) == ~sorted[k]);
+        assert(*(unsigned long long*)chan_map_at(clone, key) == ~sorted[k]);
+    }
+    for (size_t k = 1; k < n_sorted; k += 2) {
+        to_big_endian(key, sorted[k]);
+        chan_map_remove(map, key);
+    }
+    assert(chan_map_size(map) == 0);
+    it = chan_map_iter_new(map);
+    assert(chan_map_iter_next(map, &it) == NULL);
+    chan_map_shrink_to_fit(map);
+    const struct chan_memory_usage usage = chan_map_memory_usage(map);
+    assert(usage.allocated == usage.used);
+
+    // Keys inserted in ascending order come in one block, up to the end of
+    // a range.
+    for (size_t k = 0; k < 1000; ++k) {
+        to_big_endian(key, k);
+        chan_map_insert(map, key, &k);
+    }
+    struct chan_map_iter_block *block;
+    it = chan_map_iter_new(map);
+    block = chan_map_iter_next_block(map, &it);
+    assert(block->size == 1000 && from_big_endian(block->keys) == 0);
+    assert(chan_map_iter_next_block(map, &it) == NULL);
+    unsigned char hi[8];
+    to_big_endian(key, 10);
+    to_big_endian(hi, 20);
+    it = chan_map_iter_range(map, key, hi);
+    block = chan_map_iter_next_block(map, &it);
+    assert(block->size == 10 && from_big_endian(block->keys) == 10);
+    assert(chan_map_iter_next_block(map, &it) == NULL);
+
+    free(sorted);
+    chan_map_free(clone);
+    chan_map_free(map);
+    return 0;
+}
+
+static int compare_int(const void *a, const void *b) { return (*(int*)a > *(int*)b) - (*(int*)a < *(int*)b); }
+
+// Record larger than the specialized swaps, ordered by `key`.
+struct record {
+    int key;
+    int payload[5];
+};
+
+static bool less_record(void *a, void *b) { return ((struct record*)a)->key < ((struct record*)b)->key; }
+
+// Record for the radix sort with the key after a payload.
+struct radix_record {
+    unsigned index;
+    union { unsigned u32; int i32; float f32; unsigned long long u64; long long i64; double f64; } key;
+};
+
+static bool
+radix_key_less(const struct radix_record *a, const struct radix_record *b, enum chan_radix_key type)
+{
+    switch (type) {
+    case CHAN_RADIX_U32: return a->key.u32 < b->key.u32;
+    case CHAN_RADIX_I32: return a->key.i32 < b->key.i32;
+    case CHAN_RADIX_F32: return a->key.f32 < b->key.f32;
+    case CHAN_RADIX_U64: return a->key.u64 < b->key.u64;
+    case CHAN_RADIX_I64: return a->key.i64 < b->key.i64;
+    case CHAN_RADIX_F64: return a->key.f64 < b->key.f64;
+    }
+    return false;
+}
+
+int
+test_list_sort()
+{
+    printf("\n=== Testing list sort\n");
+    unsigned long long state = 88172645463325252ULL;
+    const size_t sizes[] = { 0, 1, 2, 17, 1000, 100000 };
+    for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+        const size_t n = sizes[k];
+        // Random, few distinct, all equal and descending values, with a
+        // strict and a non-strict `less`.
+        for (int pattern = 0; pattern < 4; ++pattern) {
+            for (int strict = 0; strict < 2; ++strict) {
+                struct chan_list *list = chan_vector_list_new(sizeof(int));
+                int *expected = malloc((n + 1) * sizeof(int));
+                for (size_t i = 0; i < n; ++i) {
+                    state ^= state << 13;
+                    state ^= state >> 7;
+                    state ^= state << 17;
+                    int value = pattern == 0 ? (int)state : pattern == 1 ? (int)(state % 5) : pattern == 2 ? 7 : -(int)i;
+                    expected[i] = value;
+                    chan_list_push(list, &value);
+                }
+                struct chan_list *clone = chan_list_clone(list);
+                chan_list_sort(list, sizeof(int), strict ? strict_less_int : less_int);
+                qsort(expected, n, sizeof(int), compare_int);
+                size_t m;
+                const int *data = chan_list_data(list, &m);
+                assert(m == n);
+                assert(n == 0 || memcmp(data, expected, n * sizeof(int)) == 0);
+                if (n > 2 && pattern == 3) assert(*(int*)chan_list_at(clone, 0) == 0);
+
+                if (n > 0) {
+                    const size_t i = chan_list_lower_bound(list, sizeof(int), &expected[n / 2], less_int);
+                    assert(data[i] == expected[n / 2]);
+                    assert(i == 0 || data[i - 1] < expected[n / 2]);
+                    int above = expected[n - 1] + 1;
+                    if (above > expected[n - 1]) assert(chan_list_lower_bound(list, sizeof(int), &above, less_int) == n);
+                }
+                const size_t n_unique = chan_list_unique(list, sizeof(int));
+                assert(n_unique == chan_list_size(list));
+                data = chan_list_data(list, &m);
+                for (size_t i = 1; i < m; ++i) assert(data[i - 1] < data[i]);
+                if (pattern == 2 && n > 0) assert(n_unique == 1);
+                free(expected);
+                chan_list_free(clone);
+                chan_list_free(list);
+            }
+        }
+    }
+
+    // Values moved through the generic swap.
+    struct chan_list *records = chan_vector_list_new(sizeof(struct record));
+    for (int i = 0; i < 5000; ++i) {
+        struct record r = { (i * 7919) % 5000, { i, i, i, i, -i } };
+        chan_list_push(records, &r);
+    }
+    chan_list_sort(records, sizeof(struct record), less_record);
+    for (int i = 0; i < 5000; ++i) {
+        const struct record *r = chan_list_at(records, i);
+        assert(r->key == i && r->payload[4] == -r->payload[0]);
+    }
+    chan_list_free(records);
+
+    for (int type = CHAN_RADIX_U32; type <= CHAN_RADIX_F64; ++type) {
+        struct chan_list *list = chan_vector_list_new(sizeof(struct radix_record));
+        const unsigned n = 50000;
+        for (unsigned i = 0; i < n; ++i) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            struct radix_record r;
+            memset(&r, 0, sizeof(r));
+            r.index = i;
+            // Few distinct keys, to check that the sort is stable.
+            const long long x = (long long)(state % 2000) - 1000;
+            switch (type) {
+            case CHAN_RADIX_U32: r.key.u32 = (unsigned)x; break;
+            case CHAN_RADIX_I32: r.key.i32 = (int)x; break;
+            case CHAN_RADIX_F32: r.key.f32 = x / 8.f; break;
+            case CHAN_RADIX_U64: r.key.u64 = (unsigned long long)x; break;
+            case CHAN_RADIX_I64: r.key.i64 = x * 1000000000LL; break;
+            case CHAN_RADIX_F64: r.key.f64 = x * 1e100; break;
+            }
+            chan_list_push(list, &r);
+        }
+        chan_list_radix_sort(list, sizeof(struct radix_record), offsetof(struct radix_record, key), type);
+        assert(chan_list_size(list) == n);
+        for (unsigned i = 1; i < n; ++i) {
+            const struct radix_record *a = chan_list_at(list, i - 1);
+            const struct radix_record *b = chan_list_at(list, i);
+            assert(!radix_key_less(b, a, type));
+            if (!radix_key_less(a, b, type)) assert(a->index < b->index);
+        }
+        chan_list_free(list);
+    }
+    return 0;
+}
+
+int
+test_chunked_list()
+{
+    printf("\n=== Testing chunked list\n");
+    struct chan_list *list = chan_chunked_list_new(sizeof(int), 100);
+    int value = 0;
+    chan_list_push(list, &value);
+    int *first = chan_list_at(list, 0);
+    const int n = 10000;
+    for (value = 1; value < n; ++value) chan_list_push(list, &value);
+    // Growing did not move the values.
+    assert(first == chan_list_at(list, 0));
+    for (int i = 0; i < n; ++i) assert(*(int*)chan_list_at(list, i) == i);
+#ifdef CHAN_STATS
+    // Only the directory of chunk pointers was copied.
+    assert(chan_list_stats(list).bytes_moved < n * sizeof(int) / 4);
+#endif
+
+    // The blocks are the chunks of 128 values.
+    struct chan_list_iter iter = chan_list_iter_new(list);
+    struct chan_list_iter_block *block;
+    int expected = 0;
+    while ((block = chan_list_iter_next_block(list, &iter))) {
+        assert(block->size == 128 || expected + (int)block->size == n);
+        for (size_t i = 0; i < block->size; ++i) assert(((int*)block->values)[i] == expected++);
+    }
+    assert(expected == n);
+
+    struct chan_list *clone = chan_list_clone(list);
+    value = -1;
+    chan_list_insert(list, 9000, &value);
+    chan_list_remove(list, 9500);
+    chan_list_push(clone, &value);
+    assert(chan_list_size(list) == (size_t)n && chan_list_size(clone) == (size_t)n + 1);
+    for (int i = 0; i < n; ++i) {
+        const int e = i < 9000 ? i : i == 9000 ? -1 : i < 9500 ? i - 1 : i;
+        assert(*(int*)chan_list_at(list, i) == e);
+        assert(*(int*)chan_list_at(clone, i) == i);
+    }
+    // Chunks before the insertion are still shared.
+    assert(chan_list_at(clone, 0) == first);
+    assert(chan_list_at(list, 0) == first);
+    chan_list_free(clone);
+
+    chan_list_resize(list, 1000, NULL);
+    chan_list_shrink_to_fit(list);
+    struct chan_memory_usage usage = chan_list_memory_usage(list);
+    assert(usage.allocated == usage.used + 24 * sizeof(int));
+    chan_list_free(list);
+    return 0;
+}
+
+int
+test_bitvector()
+{
+    printf("\n=== Testing bitvector\n");
+    unsigned long long state = 88172645463325252ULL;
+    const unsigned widths[] = { 1, 3, 7, 8, 11, 16 };
+    for (size_t k = 0; k < sizeof(widths) / sizeof(widths[0]); ++k) {
+        const unsigned bits = widths[k];
+        const unsigned mask = (1u << bits) - 1;
+        const size_t n = 1000;
+        struct chan_list *list = chan_bitvector_new(bits);
+        unsigned *expected = malloc((n + 1) * sizeof(unsigned));
+        for (size_t i = 0; i < n; ++i) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            expected[i] = (unsigned)state & mask;
+            chan_bitvector_push(list, expected[i]);
+        }
+        struct chan_list *clone = chan_list_clone(list);
+        const unsigned original = expected[10];
+        chan_bitvector_set(list, 10, mask);
+        expected[10] = mask;
+        for (size_t i = 0; i < n; ++i) {
+            assert(chan_bitvector_get(list, i) == expected[i]);
+            const unsigned value = bits <= 8 ? *(uint8_t*)chan_list_at(list, i) : *(uint16_t*)chan_list_at(list, i);
+            assert(value == expected[i]);
+        }
+        assert(chan_bitvector_get(clone, 10) == original);
+
+        // Values straddling words move through the list API too.
+        uint16_t value = 1;
+        chan_list_insert(list, 100, &value);
+        chan_list_remove(list, 0);
+        memmove(expected, expected + 1, 99 * sizeof(unsigned));
+        expected[99] = 1;
+        size_t i = 0;
+        struct chan_list_iter iter = chan_list_iter_new(list);
+        struct chan_list_iter_block *block;
+        while ((block = chan_list_iter_next_block(list, &iter))) {
+            for (size_t j = 0; j < block->size; ++j, ++i) {
+                const unsigned x = bits <= 8 ? ((uint8_t*)block->values)[j] : ((uint16_t*)block->values)[j];
+                assert(x == expected[i]);
+            }
+        }
+        assert(i == n);
+        chan_list_pop(list);
+        assert(chan_list_size(list) == n - 1);
+
+        // The words are dense and zero past the last value.
+        size_t n_words;
+        const uint64_t *words = chan_bitvector_words(list, &n_words);
+        assert(n_words == ((n - 1) * bits + 63) / 64);
+        if (((n - 1) * bits) % 64) assert(words[n_words - 1] >> (((n - 1) * bits) % 64) == 0);
+        chan_list_shrink_to_fit(list);
+        struct chan_memory_usage usage = chan_list_memory_usage(list);
+        assert(usage.allocated == usage.used);
+
+        free(expected);
+        chan_list_free(clone);
+        chan_list_free(list);
+    }
+
+    // A write after a clone copies only the words in use, and the spare
+    // words of the copy stay zero.
+    {
+        struct chan_list *list = chan_bitvector_new(1);
+        for (int i = 0; i < 64; ++i) chan_bitvector_push(list, 0);
+        struct chan_list *clone = chan_list_clone(list);
+        chan_bitvector_push(list, 0);
+        for (int i = 0; i < 100; ++i) chan_bitvector_push(list, i % 2);
+        assert(chan_bitvector_count(list) == 50);
+        assert(chan_bitvector_rank(list, 65) == 0);
+        assert(chan_bitvector_rank(list, 165) == 50);
+        assert(chan_bitvector_select(list, 50) == 165);
+        assert(chan_bitvector_count(clone) == 0 && chan_list_size(clone) == 64);
+        chan_list_free(clone);
+        chan_list_free(list);
+    }
+
+    // Rank, select and the word operations against plain arrays.
+    const size_t n = 5000;
+    struct chan_list *a = chan_bitvector_new(1);
+    struct chan_list *b = chan_bitvector_new(1);
+    bool *bits_a = malloc(n * sizeof(bool));
+    bool *bits_b = malloc(n * sizeof(bool));
+    for (size_t i = 0; i < n; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        // Sparse in the first half and dense in the second.
+        bits_a[i] = i < n / 2 ? state % 50 == 0 : state % 3 != 0;
+        bits_b[i] = state % 4 == 0;
+        chan_list_push(a, &bits_a[i]);
+        chan_list_push(b, &bits_b[i]);
+    }
+    size_t ones = 0;
+    for (size_t i = 0; i <= n; ++i) {
+        assert(chan_bitvector_rank(a, i) == ones);
+        if (i < n && bits_a[i]) {
+            assert(chan_bitvector_select(a, ones) == i);
+            ones++;
+        }
+    }
+    assert(chan_bitvector_count(a) == ones);
+    assert(chan_bitvector_select(a, ones) == n);
+
+    struct chan_list *c = chan_list_clone(a);
+    chan_bitvector_and(a, b);
+    chan_bitvector_or(c, b);
+    size_t n_and = 0;
+    for (size_t i = 0; i < n; ++i) {
+        assert(chan_bitvector_get(a, i) == (bits_a[i] && bits_b[i]));
+        assert(chan_bitvector_get(c, i) == (bits_a[i] || bits_b[i]));
+        n_and += bits_a[i] && bits_b[i];
+    }
+    // The directory is rebuilt after a modification.
+    assert(chan_bitvector_rank(a, n) == n_and);
+    chan_bitvector_xor(c, c);
+    assert(chan_bitvector_count(c) == 0 && chan_list_size(c) == n);
+    chan_list_free(c);
+    chan_list_free(b);
+    chan_list_free(a);
+    free(bits_b);
+    free(bits_a);
+    return 0;
+}
+
+int
+test_delta_list()
+{
+    printf("\n=== Testing delta list\n");
+    unsigned long long state = 88172645463325252ULL;
+    const size_t n = 100000;
+    struct chan_list *list = chan_delta_list_new();
+    uint64_t *expected = malloc(n * sizeof(uint64_t));
+    uint64_t value = 1000;
+    for (size_t i = 0; i < n; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        // Small gaps and repeats, a few gaps too large for any width, and a
+        // run of equal values for blocks of zero bits.
+        if (i < 20000 || i >= 21000) value += state % 100 == 0 ? state >> 24 : state % 1000;
+        expected[i] = value;
+        chan_list_push(list, &value);
+    }
+    assert(chan_list_size(list) == n);
+    for (size_t i = 0; i < n; ++i) assert(*(uint64_t*)chan_list_at(list, i) == expected[i]);
+    size_t i = 0;
+    struct chan_list_iter iter = chan_list_iter_new(list);
+    struct chan_list_iter_block *block;
+    while ((block = chan_list_iter_next_block(list, &iter))) {
+        assert(block->size == 128 || i + block->size == n);
+        for (size_t j = 0; j < block->size; ++j, ++i) assert(((uint64_t*)block->values)[j] == expected[i]);
+    }
+    assert(i == n);
+    struct chan_memory_usage usage = chan_list_memory_usage(list);
+    assert(usage.used < n * sizeof(uint64_t) / 3);
+
+    for (size_t k = 0; k < 10000; ++k) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        const uint64_t query = k < 5000 ? expected[state % n] + k % 3 - 1 : state % (value + 10);
+        // Check against a binary search of a plain array.
+        size_t a = 0, b = n;
+        while (a < b) {
+            const size_t mid = a + (b - a) / 2;
+            if (expected[mid] < query) a = mid + 1;
+            else b = mid;
+        }
+        assert(chan_delta_list_lower_bound(list, query) == a);
+    }
+    assert(chan_delta_list_lower_bound(list, 0) == 0);
+    assert(chan_delta_list_lower_bound(list, value + 1) == n);
+
+    struct chan_list *clone = chan_list_clone(list);
+    uint64_t x = expected[500];
+    chan_list_insert(list, 500, &x);
+    chan_list_remove(list, 70000);
+    chan_list_pop(list);
+    chan_list_resize(list, n - 50, NULL);
+    assert(chan_list_size(list) == n - 50);
+    for (size_t i = 0; i < n - 50; ++i) {
+        const uint64_t e = i <= 500 ? expected[i] : i < 70000 ? expected[i - 1] : expected[i];
+        assert(*(uint64_t*)chan_list_at(list, i) == e);
+    }
+    for (size_t i = 0; i < n; ++i) assert(*(uint64_t*)chan_list_at(clone, i) == expected[i]);
+    x = expected[n - 1];
+    chan_list_push(clone, &x);
+    assert(chan_list_size(clone) == n + 1);
+    chan_list_free(clone);
+
+    chan_list_clear(list);
+    chan_list_shrink_to_fit(list);
+    usage = chan_list_memory_usage(list);
+    assert(usage.allocated == usage.used);
+    assert(chan_delta_list_lower_bound(list, 5) == 0);
+    free(expected);
+    chan_list_free(list);
+    return 0;
+}
+
 int
 main()
 {
     const bool print = true;
     if (test_vector(0, print)) return 1;
     /* if (test_vector(1, print)) return 1; */
+    if (test_vector(2, print)) return 1;
     if (test_map(0, print)) return 1;
     if (test_map(1, print)) return 1;
     if (test_map(2, print)) return 1;
+    if (test_map(3, print)) return 1;
+    if (test_map(4, print)) return 1;
+    if (test_map(5, print)) return 1;
+    if (test_naive_map_small()) return 1;
+    if (test_string_hash_map(print)) return 1;
+    if (test_map_upsert(0)) return 1;
+    if (test_map_upsert(1)) return 1;
+    if (test_map_upsert(2)) return 1;
+    if (test_map_data(0)) return 1;
+    if (test_map_data(1)) return 1;
+    if (test_map_data(2)) return 1;
+    if (test_map_range()) return 1;
+    if (test_map_set_ops()) return 1;
+    if (test_heap(2)) return 1;
+    if (test_heap(4)) return 1;
+    if (test_lru_cache(CHAN_CACHE_LRU)) return 1;
+    if (test_lru_cache(CHAN_CACHE_CLOCK)) return 1;
+    if (test_bloom()) return 1;
+    if (test_clone()) return 1;
+    if (test_chunked_clone(0)) return 1;
+    if (test_chunked_clone(1)) return 1;
+    if (test_chunked_clone(2)) return 1;
+    if (test_chunked_clone(3)) return 1;
+    if (test_chunked_clone(4)) return 1;
+    if (test_chunked_clone(5)) return 1;
+    if (test_chunked_list_clone()) return 1;
+    if (test_map_growth(0)) return 1;
+    if (test_map_growth(1)) return 1;
+    if (test_map_growth(2)) return 1;
+    if (test_map_growth(3)) return 1;
+    if (test_map_growth(4)) return 1;
+    if (test_map_growth(5)) return 1;
+    if (test_hash_map_bucket_width(false)) return 1;
+    if (test_hash_map_bucket_width(true)) return 1;
+    if (test_growth()) return 1;
+    if (test_parallel()) return 1;
+    if (test_cuckoo_map()) return 1;
+    if (test_frozen_map()) return 1;
+    if (test_art_map()) return 1;
+    if (test_list_sort()) return 1;
+    if (test_chunked_list()) return 1;
+    if (test_bitvector()) return 1;
+    if (test_delta_list()) return 1;
     return 0;
 }